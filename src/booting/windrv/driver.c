@@ -168,6 +168,44 @@ NTSTATUS NoirVisorDispatchIoControl(IN PDEVICE_OBJECT DeviceObject,IN PIRP Irp)
 			*(PBOOLEAN)OutputBuffer=NoirIsVirtualizationEnabled();
 			break;
 		}
+		case IOCTL_ExitTrace:
+		{
+			// Input: Processor Number, Buffer Size and address of the user buffer. Output: NoirVisor status.
+			if(InputSize<8+sizeof(PVOID) || OutputSize<sizeof(ULONG32))
+				st=STATUS_BUFFER_TOO_SMALL;
+			else
+			{
+				ULONG32 ProcessorNumber=*(PULONG32)InputBuffer;
+				ULONG32 BufferSize=*(PULONG32)((ULONG_PTR)InputBuffer+4);
+				PVOID TraceBuffer=*(PVOID*)((ULONG_PTR)InputBuffer+8);
+				// The trace buffer is a user-mode address. It must be probed and accessed under exception handler.
+				__try
+				{
+					ProbeForWrite(TraceBuffer,BufferSize,sizeof(ULONG64));
+					*(PULONG32)OutputBuffer=NoirQueryExitTrace(ProcessorNumber,TraceBuffer,BufferSize);
+					st=STATUS_SUCCESS;
+				}
+				__except(EXCEPTION_EXECUTE_HANDLER)
+				{
+					st=GetExceptionCode();
+				}
+			}
+			break;
+		}
+		case IOCTL_ExitStats:
+		{
+			// Input: Processor Number. Output: NoirVisor status, followed by the statistics of the processor.
+			if(InputSize<sizeof(ULONG32) || OutputSize<sizeof(ULONG64))
+				st=STATUS_BUFFER_TOO_SMALL;
+			else
+			{
+				ULONG32 ProcessorNumber=*(PULONG32)InputBuffer;
+				// The statistics are aligned to 8 bytes in the output buffer.
+				*(PULONG32)OutputBuffer=NoirQueryExitStatistics(ProcessorNumber,(PVOID)((ULONG_PTR)OutputBuffer+sizeof(ULONG64)),OutputSize-sizeof(ULONG64));
+				st=STATUS_SUCCESS;
+			}
+			break;
+		}
 		case IOCTL_CvmCreateVm:
 		{
 			PCVM_HANDLE VmHandle=(PCVM_HANDLE)((ULONG_PTR)OutputBuffer+sizeof(CVM_HANDLE));
@@ -239,22 +277,17 @@ NTSTATUS NoirVisorDispatchIoControl(IN PDEVICE_OBJECT DeviceObject,IN PIRP Irp)
 		case IOCTL_CvmRunVcpu:
 		{
 			st=STATUS_SUCCESS;
-			if(OutputSize<noir_cvm_exit_context_size)
-			{
-				if(OutputSize<sizeof(ULONG64))
-					st=STATUS_INSUFFICIENT_RESOURCES;
-				else
-				{
-					*(PULONG32)OutputBuffer=NOIR_INSUFFICIENT_RESOURCES;
-					*(PULONG32)((ULONG_PTR)OutputBuffer+4)=noir_cvm_exit_context_size;
-				}
-			}
+			if(OutputSize<sizeof(ULONG64))
+				st=STATUS_INSUFFICIENT_RESOURCES;
 			else
 			{
 				CVM_HANDLE VmHandle=*(PCVM_HANDLE)InputBuffer;
 				ULONG32 VpIndex=*(PULONG32)((ULONG_PTR)InputBuffer+sizeof(CVM_HANDLE));
-				PVOID ExitContext=(PVOID)((ULONG_PTR)OutputBuffer+sizeof(ULONG64));
+				// If the vCPU has a VPCB, the Exit-Context is delivered through it and only the status is returned.
+				PVOID ExitContext=OutputSize<noir_cvm_exit_context_size?NULL:(PVOID)((ULONG_PTR)OutputBuffer+sizeof(ULONG64));
 				*(PULONG32)OutputBuffer=NoirRunVirtualProcessor(VmHandle,VpIndex,ExitContext);
+				if(*(PULONG32)OutputBuffer==NOIR_BUFFER_TOO_SMALL)
+					*(PULONG32)((ULONG_PTR)OutputBuffer+4)=noir_cvm_exit_context_size;
 			}
 			break;
 		}
@@ -325,6 +358,21 @@ NTSTATUS NoirVisorDispatchIoControl(IN PDEVICE_OBJECT DeviceObject,IN PIRP Irp)
 			st=STATUS_SUCCESS;
 			break;
 		}
+		case IOCTL_CvmSetVcpuVpcb:
+		{
+			// Input: VM Handle, vCPU Index (padded to 8 bytes) and VPCB address. Output: NoirVisor status.
+			if(InputSize<16+sizeof(PVOID) || OutputSize<sizeof(ULONG32))
+				st=STATUS_BUFFER_TOO_SMALL;
+			else
+			{
+				CVM_HANDLE VmHandle=*(PCVM_HANDLE)InputBuffer;
+				ULONG32 VpIndex=*(PULONG32)((ULONG_PTR)InputBuffer+sizeof(CVM_HANDLE));
+				PVOID ControlBlock=*(PVOID*)((ULONG_PTR)InputBuffer+16);
+				*(PULONG32)OutputBuffer=NoirSetVirtualProcessorControlBlock(VmHandle,VpIndex,ControlBlock);
+				st=STATUS_SUCCESS;
+			}
+			break;
+		}
 		default:
 		{
 			break;
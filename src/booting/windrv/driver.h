@@ -53,6 +53,8 @@ typedef ULONG32 NOIR_STATUS;
 #define IOCTL_OsVer			CTL_CODE_GEN(0x813)
 #define IOCTL_VirtCap		CTL_CODE_GEN(0x814)
 #define IOCTL_VirtEn		CTL_CODE_GEN(0x815)
+#define IOCTL_ExitTrace		CTL_CODE_GEN(0x816)
+#define IOCTL_ExitStats		CTL_CODE_GEN(0x817)
 
 // Following definitions are intended for CVM use.
 #define IOCTL_CvmCreateVm		CTL_CODE_GEN(0x880)
@@ -73,6 +75,7 @@ typedef ULONG32 NOIR_STATUS;
 #define IOCTL_CvmQueryVcpuStats	CTL_CODE_GEN(0x898)
 #define IOCTL_CvmViewVcpuReg2	CTL_CODE_GEN(0x899)
 #define IOCTL_CvmEditVcpuReg2	CTL_CODE_GEN(0x89A)
+#define IOCTL_CvmSetVcpuVpcb	CTL_CODE_GEN(0x89B)
 
 // Layered Hypervisor Functions
 typedef ULONG64 CVM_HANDLE;
@@ -164,6 +167,7 @@ NOIR_STATUS NoirEditVirtualProcessorRegisters2(IN CVM_HANDLE VirtualMachine,IN U
 NOIR_STATUS NoirQueryVirtualProcessorStatistics(IN CVM_HANDLE VirtualMachine,IN ULONG32 VpIndex,OUT PVOID Buffer,IN ULONG32 BufferSize);
 NOIR_STATUS NoirSetEventInjection(IN CVM_HANDLE VirtualMachine,IN ULONG32 VpIndex,IN ULONG64 InjectedEvent);
 NOIR_STATUS NoirSetVirtualProcessorOptions(IN CVM_HANDLE VirtualMachine,IN ULONG32 VpIndex,IN ULONG32 OptionType,IN ULONG32 Options);
+NOIR_STATUS NoirSetVirtualProcessorControlBlock(IN CVM_HANDLE VirtualMachine,IN ULONG32 VpIndex,IN PVOID ControlBlock);
 NOIR_STATUS NoirRunVirtualProcessor(IN CVM_HANDLE VirtualMachine,IN ULONG32 VpIndex,OUT PVOID ExitContext);
 NOIR_STATUS NoirRescindVirtualProcessor(IN CVM_HANDLE VirtualMachine,IN ULONG32 VpIndex);
 
@@ -184,6 +188,8 @@ void NoirAcpiFinalize();
 ULONG NoirVisorVersion();
 ULONG NoirQueryVirtualizationSupportability();
 BOOLEAN NoirIsVirtualizationEnabled();
+NOIR_STATUS NoirQueryExitTrace(IN ULONG32 ProcessorNumber,OUT PVOID Buffer,IN ULONG32 BufferSize);
+NOIR_STATUS NoirQueryExitStatistics(IN ULONG32 ProcessorNumber,OUT PVOID Buffer,IN ULONG32 BufferSize);
 void NoirLocatePsLoadedModule(IN PDRIVER_OBJECT DriverObject);
 BOOLEAN NoirInitializeCodeIntegrity(IN PVOID ImageBase);
 void NoirFinalizeCodeIntegrity();
@@ -175,6 +175,7 @@
 #define amd64_pl2_ssp					0x6A6
 #define amd64_pl3_ssp					0x6A7
 #define amd64_isst_addr					0x6A8
+#define amd64_tsc_deadline				0x6E0
 #define amd64_x2apic_msr_start			0x800
 #define amd64_x2apic_id					0x802
 #define amd64_x2apic_version			0x803
@@ -214,6 +215,7 @@
 #define amd64_fs_base					0xC0000100
 #define amd64_gs_base					0xC0000101
 #define amd64_kernel_gs_base			0xC0000102
+#define amd64_tsc_aux					0xC0000103
 #define amd64_hwcr						0xC0010015
 
 // SVM/SMM Related MSRs
@@ -18,10 +18,22 @@
 #define ci_enforcement_delay 50000
 #endif
 
+// If pages are write-protected by Hardware-Enforced CI, software scanning
+// is only a background audit. Verification is triggered by write faults.
+#if !defined(ci_audit_delay)
+#define ci_audit_delay 600000
+#endif
+
+#define noir_ci_fault_not_protected		0
+#define noir_ci_fault_discarded			1
+#define noir_ci_fault_corrupted			2		// The page is corrupted, and so is its snapshot.
+#define noir_ci_fault_restored			3		// The page was corrupted, and is restored from its snapshot.
+
 typedef struct _noir_ci_page
 {
 	void* virt;
 	u64 phys;
+	void* snapshot;		// Copy of immutable pages, taken when the page is added to CI.
 	u32 crc;
 	union
 	{
@@ -29,10 +41,12 @@ typedef struct _noir_ci_page
 		{
 			u32 soft_ci:1;
 			u32 hard_ci:1;
-			u32 reserved:30;
+			u32 immutable:1;	// Mutable pages (e.g.: data sections) are write-protected, but not verified.
+			u32 reserved:29;
 		};
 		u32 value;
 	}options;
+	u32v write_faults;
 }noir_ci_page,*noir_ci_page_p;
 
 typedef struct _noir_ci_context
@@ -53,19 +67,25 @@ typedef struct _noir_ci_context
 		};
 		u32 value;
 	}options;
+	u32v write_faults;
+	u32v corruptions;
+	u32v restorations;
 	noir_ci_page page_ci[0];
 }noir_ci_context,*noir_ci_context_p;
 
 u8 nvc_confirm_cpu_manufacturer(char* vendor_string);
 bool nvc_is_vt_supported();
 u32 stdcall noir_crc32_page_sse(void* page);
+u32 stdcall noir_crc32_page_sse_x3(void* page);
 bool fastcall noir_check_sse42();
+bool fastcall noir_check_pclmulqdq();
 
 #if defined(_code_integrity)
 u32 noir_ci_selected_page=0;
 u32v noir_ci_stop_signal=0;
 noir_hvdata noir_ci_context_p noir_ci=null;
 noir_hvdata noir_crc32_page_func noir_crc32_page=null;
+noir_hvdata u32 crc32c_slice_table[8][256];
 
 noir_hvdata const u32 crc32c_table[256]=
 {
@@ -136,5 +156,6 @@ noir_hvdata const u32 crc32c_table[256]=
 };
 #else
 bool fastcall noir_ci_is_ci_phys_page(u64 phys,void** virt);
+u32 fastcall noir_ci_verify_on_write_fault(u64 phys,void** virt);
 extern noir_ci_context_p noir_ci;
 #endif
\ No newline at end of file
@@ -25,6 +25,9 @@
 #define noir_cvm_vcpu_priority_user				0
 #define noir_cvm_vcpu_priority_kernel			8
 
+// The VMM has no preference of processor to run the vCPU.
+#define noir_cvm_no_affinity_hint				0xffffffff
+
 // CPUID Leaves for NoirVisor Customizable VM.
 #define ncvm_cpuid_leaf_range_and_vendor_string			0x40000000
 #define ncvm_cpuid_vendor_neutral_interface_id			0x40000001
@@ -55,13 +58,17 @@ typedef enum _noir_cvm_intercept_code
 	cv_task_switch=15,
 	cv_single_step=16,
 	cv_apic_msr=17,
+	cv_apic_access=18,
+	cv_apic_ipi=19,
 	// The rest are scheduler-relevant.
 	cv_scheduler_exit=0x80000000,
 	cv_scheduler_pause=0x80000001,
 	cv_scheduler_bug=0x80000002,
 	cv_scheduler_npt_misconfig=0x80000003,
 	cv_scheduler_nsv_activate=0x80000004,
-	cv_scheduler_nsv_claim_security=0x80000005
+	cv_scheduler_nsv_claim_security=0x80000005,
+	// The host timer must be re-armed. This is handled by NoirVisor and never delivered to the VMM.
+	cv_scheduler_timer_rearm=0x80000006
 }noir_cvm_intercept_code,*noir_cvm_intercept_code_p;
 
 typedef enum _noir_cvm_register_type
@@ -157,6 +164,7 @@ typedef enum _noir_cvm_register_name
 	noir_cvm_register_cstar=0x100A,
 	noir_cvm_register_sfmask=0x100B,
 	noir_cvm_register_ststar=0x100C,
+	noir_cvm_register_tsc_aux=0x100D,
 	// No MSRs goes beyond this definitions.
 	noir_cvm_register_msr_max
 	// FIXME: Implement more register names.
@@ -167,7 +175,10 @@ typedef enum _noir_cvm_vcpu_option_type
 	noir_cvm_guest_vcpu_options,
 	noir_cvm_exception_bitmap,
 	noir_cvm_vcpu_priority,
-	noir_cvm_msr_interception
+	noir_cvm_msr_interception,
+	noir_cvm_vcpu_affinity_hint,
+	noir_cvm_lapic_timer_ratio,
+	noir_cvm_halt_poll_window
 }noir_cvm_vcpu_option_type,*noir_cvm_vcpu_option_type_p;
 
 #define noir_cvm_cpuid_quickpath_limit_per_vm		64
@@ -358,6 +369,38 @@ typedef struct _noir_cvm_interrupt_window_context
 	};
 }noir_cvm_interrupt_window_context;
 
+// For accelerated virtual APIC, accesses unhandled by hardware are delivered to the VMM.
+typedef struct _noir_cvm_apic_access_context
+{
+	struct
+	{
+		u32 offset:12;
+		u32 write:1;
+		u32 trap:1;		// The write is completed and the instruction is retired.
+		u32 reserved:18;
+	};
+	// The value written. Valid only if the write is trap-like.
+	// For reads of the timer current count, it is the count computed by the LAPIC timer of NoirVisor.
+	u32 value;
+}noir_cvm_apic_access_context,*noir_cvm_apic_access_context_p;
+
+#define noir_cvm_apic_ipi_unsupported_type		0
+#define noir_cvm_apic_ipi_target_not_running	1
+#define noir_cvm_apic_ipi_invalid_target		2
+#define noir_cvm_apic_ipi_invalid_backing_page	3
+#define noir_cvm_apic_ipi_unaccelerated			4
+
+// The IPI is already written to ICR in the virtual APIC page when the VMM sees it.
+typedef struct _noir_cvm_apic_ipi_context
+{
+	u32 icr_lo;
+	u32 icr_hi;
+	u32 reason;
+	u32 target_count;
+	// Bitmap of vCPUs not running. The interrupt is pending in their virtual APIC pages.
+	u64 targets[4];
+}noir_cvm_apic_ipi_context,*noir_cvm_apic_ipi_context_p;
+
 typedef struct _noir_cvm_cpuid_context
 {
 	struct
@@ -382,6 +425,8 @@ typedef struct _noir_cvm_exit_context
 		noir_cvm_cpuid_context cpuid;
 		noir_cvm_task_switch_context task_switch;
 		noir_cvm_interrupt_window_context interrupt_window;
+		noir_cvm_apic_access_context apic_access;
+		noir_cvm_apic_ipi_context apic_ipi;
 		noir_nsv_activation_context nsv_activation;
 		noir_nsv_claim_pages_context claim_pages;
 	};
@@ -450,6 +495,7 @@ typedef struct _noir_msr_state
 	u64 sfmask;
 	u64 ststar;
 	u64 gsswap;
+	u64 tsc_aux;
 	struct
 	{
 		memory_descriptor host_page;
@@ -556,7 +602,8 @@ typedef union _noir_cvm_vcpu_state_cache
 		u32 ap_valid:1;		// Includes apic-base.
 		u32 ss_valid:1;		// Includes ssp,pln_ssp,u/s_cet,isst
 		u32 ts_valid:1;		// Includes TSC
-		u32 reserved:15;
+		u32 ta_valid:1;		// Includes TSC_AUX
+		u32 reserved:14;
 		u32 tl_valid:1;		// Includes TLB of EPT/NPT.
 		// This field indicates whether the state in VMCS/VMCB is
 		// updated to the state save area in the vCPU structure.
@@ -565,6 +612,29 @@ typedef union _noir_cvm_vcpu_state_cache
 	u32 value;
 }noir_cvm_vcpu_state_cache,*noir_cvm_vcpu_state_cache_p;
 
+#define noir_cvm_state_cache_gprvalid		0x00000001
+#define noir_cvm_state_cache_cr_valid		0x00000002
+#define noir_cvm_state_cache_cr2valid		0x00000004
+#define noir_cvm_state_cache_dr_valid		0x00000008
+#define noir_cvm_state_cache_sr_valid		0x00000010
+#define noir_cvm_state_cache_fg_valid		0x00000020
+#define noir_cvm_state_cache_dt_valid		0x00000040
+#define noir_cvm_state_cache_lt_valid		0x00000080
+#define noir_cvm_state_cache_sc_valid		0x00000100
+#define noir_cvm_state_cache_se_valid		0x00000200
+#define noir_cvm_state_cache_tp_valid		0x00000400
+#define noir_cvm_state_cache_ef_valid		0x00000800
+#define noir_cvm_state_cache_pa_valid		0x00001000
+#define noir_cvm_state_cache_lb_valid		0x00002000
+#define noir_cvm_state_cache_ap_valid		0x00004000
+#define noir_cvm_state_cache_ss_valid		0x00008000
+#define noir_cvm_state_cache_ts_valid		0x00010000
+#define noir_cvm_state_cache_ta_valid		0x00020000
+#define noir_cvm_state_cache_all_groups		0x0003FFFF
+
+// Groups to be dumped from VMCB/VMCS. Groups invalid in the state cache are edited by the VMM and up-to-date in the vCPU structure.
+#define noir_cvm_stale_state_groups(v,g)	((g)&(v)->state_cache.value&~(v)->synchronized_groups)
+
 typedef struct _noir_cvm_event_injection
 {
 	union
@@ -608,17 +678,109 @@ typedef struct _noir_cvm_vcpu_statistics
 		noir_cvm_interception_counter rsm;
 	}interceptions;
 	u64 runtime;
+	struct
+	{
+		u64 attempts;		// Halts polled by NoirVisor.
+		u64 successes;		// Halts woken up within the polling window.
+		u64 time;			// TSC ticks spent on polling.
+	}halt_poll;
+	u64 queue_completions;	// VPCB submission queue entries consumed by NoirVisor.
 }noir_cvm_vcpu_statistics,*noir_cvm_vcpu_statistics_p;
 
+// Latency of VM-Exits is sampled once every 64 exits in order to bound the overhead of profiler.
+#define noir_exit_profiler_sample_mask		0x3F
+
+typedef struct _noir_exit_statistics
+{
+	u64 count;
+	u64 sampled_count;
+	u64 sampled_time;		// In TSC ticks.
+	u64 max_time;			// In TSC ticks.
+}noir_exit_statistics,*noir_exit_statistics_p;
+
+// Register groups in the VPCB are laid out by register type.
+// Bit n of the dirty/request/valid masks stands for the register type n.
+typedef struct _noir_cvm_vpcb_register_file
+{
+	noir_gpr_state gpr;
+	u64 rflags;
+	u64 rip;
+	u64 cr[3];
+	u64 cr2;
+	u64 dr[4];
+	u64 dr67[2];
+	segment_register sr[4];
+	segment_register fgseg[2];
+	u64 gsswap;
+	segment_register dt[2];
+	segment_register lt[2];
+	u64 syscall_msr[4];
+	u64 sysenter_msr[3];
+	u64 cr8;
+	noir_fx_state fxstate;
+	u64 xcr0;
+	u64 efer;
+	u64 pat;
+	u64 lbr[5];
+	u64 tsc;
+	u64 ghcb;
+	u64 apic_bar;
+}noir_cvm_vpcb_register_file,*noir_cvm_vpcb_register_file_p;
+
+#define noir_cvm_vpcb_group(t)			((u64)1<<(t))
+// GPRs, rflags and rip are published on every exit.
+#define noir_cvm_vpcb_default_groups	(noir_cvm_vpcb_group(noir_cvm_general_purpose_register)|noir_cvm_vpcb_group(noir_cvm_flags_register)|noir_cvm_vpcb_group(noir_cvm_instruction_pointer))
+// Extended State is variable-sized and cannot be exchanged through VPCB.
+#define noir_cvm_vpcb_invalid_groups	(noir_cvm_vpcb_group(noir_cvm_xsave_area)|~(noir_cvm_vpcb_group(noir_cvm_maximum_register_type)-1))
+
+// Entry Types of the VPCB Submission Queue
+#define noir_cvm_vpcb_entry_interrupt	1
+#define noir_cvm_vpcb_entry_io_in		2
+#define noir_cvm_vpcb_entry_io_out		3
+
+// The length of the queue must be a power of two.
+#define noir_cvm_vpcb_queue_length		64
+
+typedef struct _noir_cvm_vpcb_queue_entry
+{
+	u32 type;
+	union
+	{
+		struct
+		{
+			u16 port;
+			u16 size;		// In bytes: 1, 2 or 4.
+			u32 value;		// For in, the value to be read by the guest. For out, NoirVisor stores the value written by the guest.
+		}io;
+		struct
+		{
+			u32 vector;		// External interrupt to be posted to the virtual APIC.
+			u32 reserved;
+		}interrupt;
+	};
+	u32 reserved;
+}noir_cvm_vpcb_queue_entry,*noir_cvm_vpcb_queue_entry_p;
+
+// Submission Queue: User Hypervisor posts events and canned responses to the tail.
+// NoirVisor consumes them from the head in order, before deciding to switch to the User Hypervisor.
+// An entry that does not match the current VM-Exit stays at the head and stalls the queue.
+typedef struct _noir_cvm_vpcb_queue
+{
+	u32v head;		// Written by NoirVisor only.
+	u32v tail;		// Written by User Hypervisor only.
+	u64 reserved;
+	noir_cvm_vpcb_queue_entry entries[noir_cvm_vpcb_queue_length];
+}noir_cvm_vpcb_queue,*noir_cvm_vpcb_queue_p;
+
 // Virtual-Processor Control Block (VPCB) is one or more shared page(s) between the NoirVisor
 // and the User Hypervisors to accelerate VM-Exit handlings, especially I/O emulations.
-// When VPCB is active, Exit-Context is not used.
+// When VPCB is active, Exit-Context is not used. One exit-handle-resume cycle takes
+// only the run-vCPU call: the User Hypervisor marks edited register groups as dirty,
+// and NoirVisor loads them before the entry, then publishes the requested groups
+// along with the Exit-Context after the exit.
 typedef struct _noir_cvm_vcpu_control_block
 {
 	u64 size;
-	// This code is used for User Hypervisors to know what to do.
-	// NoirVisor will reuse this field to emulate inputs.
-	noir_cvm_intercept_code intercept_code;
 	union
 	{
 		struct
@@ -630,31 +792,60 @@ typedef struct _noir_cvm_vcpu_control_block
 		};
 		u64 value;
 	}flags;
-	union
-	{
-		struct
-		{
-			u16 port;
-			u8 size;
-			u8 direction;
-			u64 count;
-		}pio;
-		struct
-		{
-			u64 gpa;
-			u16 size;
-			u8 direction;
-			u64 count;
-		}mmio;
-	}io;
-	u64 rflags;
-	u64 rip;
-	u64 next_rip;
+	// Groups written by User Hypervisor. NoirVisor clears this mask on loading.
+	u64 dirty;
+	// Groups User Hypervisor wishes to receive on exit, in addition to the defaults.
+	u64 request;
+	// Groups published by NoirVisor for the latest exit.
+	u64 valid;
+	noir_cvm_exit_context exit_context;
+	noir_cvm_vpcb_register_file registers;
 	// Align the I/O buffer at 1024 bytes.
 	// Note that the biggest registers in x86 have 1024 bytes (AMX registers).
 	align_at(1024) u8 io_buff[1024];
+	noir_cvm_vpcb_queue queue;
 }noir_cvm_vcpu_control_block,*noir_cvm_vcpu_control_block_p;
 
+// Timer Modes in LVT Timer Register
+#define noir_cvm_lapic_timer_one_shot		0
+#define noir_cvm_lapic_timer_periodic		1
+#define noir_cvm_lapic_timer_tsc_deadline	2
+
+#define noir_cvm_lapic_timer_mode(lvt)		(((lvt)>>17)&3)
+#define noir_cvm_lapic_timer_masked(lvt)	(((lvt)>>16)&1)
+
+// Local APIC Timer emulated by NoirVisor. Time is measured in guest TSC ticks.
+// The timer is emulated only if the VM has the virtual APIC accelerated.
+typedef struct _noir_cvm_lapic_timer
+{
+	u64 deadline;			// Zero if the timer is disarmed.
+	u64 period;				// Zero unless the timer is periodic.
+	u64 wakeup;				// Host TSC when the halted vCPU is to be woken up. Zero if it is not halted.
+	u64 armed;				// Host TSC when the host timer armed for the vCPU expires. Zero if it is not armed.
+	u32 lvt;
+	u32 initial_count;
+	u32 divide_config;
+	u32 tsc_ratio;			// Guest TSC ticks per APIC timer tick. Zero if the VMM emulates the timer.
+	u64 expirations;
+	u64 latency;			// Accumulated guest TSC ticks from expirations to injections.
+}noir_cvm_lapic_timer,*noir_cvm_lapic_timer_p;
+
+#define noir_cvm_lapic_timer_enabled(t)		((t)->tsc_ratio!=0)
+
+// The initial polling window is 1/16 of the maximum window.
+#define noir_cvm_halt_poll_initial_shift	4
+
+// Halt-Polling: NoirVisor polls for wakeup requests before delivering the halt to the VMM.
+typedef struct _noir_cvm_halt_poll
+{
+	u64 window;				// Current polling window in TSC ticks.
+	u64 window_max;			// Maximum polling window in TSC ticks. Zero disables polling.
+	u64 halt_start;			// TSC when the halt was delivered to the VMM. Zero if it was not.
+	u32v requests;			// Incremented by every request that wakes up the vCPU.
+	u32v interrupts;		// Incremented by every request that posts an interrupt. Rescissions do not count.
+	bool halted;			// Set by the core if the halt can be completed by NoirVisor.
+}noir_cvm_halt_poll,*noir_cvm_halt_poll_p;
+
 typedef struct _noir_cvm_virtual_cpu
 {
 	noir_gpr_state gpr;
@@ -671,14 +862,18 @@ typedef struct _noir_cvm_virtual_cpu
 	u64 tsc_offset;
 	void* tunnel;
 	void* iobuff;
+	void** tunnel_locker;
 	u64 swapped_pte;
 	noir_pushlock vcpu_lock;
 	u32v ref_count;
+	u32v scheduled;		// Claimed by the thread running or reconfiguring this vCPU.
 	noir_cvm_event_injection injected_event;
 	noir_cvm_exit_context exit_context;
 	noir_cvm_vcpu_options vcpu_options;
 	noir_cvm_vcpu_msr_interceptions msr_interceptions;
 	noir_cvm_vcpu_state_cache state_cache;
+	u32 synchronized_groups;		// State cache groups dumped from VMCB/VMCS since the last VM-Exit.
+	u32 synchronizing_groups;		// State cache groups requested to be dumped. Zero stands for all groups.
 	noir_cvm_vcpu_statistics statistics;
 	struct
 	{
@@ -687,6 +882,11 @@ typedef struct _noir_cvm_virtual_cpu
 	}statistics_internal;
 	u32 exception_bitmap;
 	u32 scheduling_priority;
+	u32 affinity_hint;		// Processor where the VMM prefers to run this vCPU.
+	noir_cvm_lapic_timer lapic_timer;
+	noir_event halt_event;	// Signaled to wake up the vCPU halted in NoirVisor.
+	noir_timer host_timer;	// Interrupts the processor at the expiration of the LAPIC timer if there is no preemption timer.
+	noir_cvm_halt_poll halt_poll;
 	noir_cvm_cpuid_quickpath_info cpuid_quickpath[8];
 }noir_cvm_virtual_cpu,*noir_cvm_virtual_cpu_p;
 
@@ -766,6 +966,26 @@ typedef struct _noir_cvm_virtual_machine
 	noir_reslock vcpu_list_lock;
 }noir_cvm_virtual_machine,*noir_cvm_virtual_machine_p;
 
+// MSR Accessor Table is shared by the register-edit path and compatible interfaces.
+#define noir_cvm_msr_tsc_relative		0x1		// The field holds the offset to host TSC.
+// Maximum number of MSRs to be transferred in one pass.
+#define noir_cvm_msr_transfer_limit		64
+
+typedef struct _noir_cvm_msr_accessor
+{
+	u32 index;
+	u32 offset;			// Offset of the field in vCPU structure.
+	u32 cache_mask;		// State-cache groups to be invalidated on edit.
+	u32 flags;
+}noir_cvm_msr_accessor,*noir_cvm_msr_accessor_p;
+
+// Layout of this structure is compatible with MSR entries of Intel HAXM.
+typedef struct _noir_cvm_msr_entry
+{
+	u64 index;
+	u64 value;
+}noir_cvm_msr_entry,*noir_cvm_msr_entry_p;
+
 typedef struct _noir_cvm_gmem_op_context
 {
 	noir_cvm_virtual_cpu_p vcpu;
@@ -820,6 +1040,8 @@ noir_status nvc_svmc_set_unmapping(noir_cvm_virtual_machine_p virtual_machine,u6
 noir_status nvc_svmc_query_gpa_accessing_bitmap(noir_cvm_virtual_machine_p virtual_machine,u64 gpa_start,u32 page_count,void* bitmap,u32 bitmap_size);
 noir_status nvc_svmc_clear_gpa_accessing_bits(noir_cvm_virtual_machine_p virtual_machine,u64 gpa_start,u32 page_count);
 u32 nvc_svmc_get_vm_asid(noir_cvm_virtual_machine_p vm);
+u32 nvc_svmc_get_supported_vm_properties();
+bool nvc_svmc_post_interrupt(noir_cvm_virtual_cpu_p vcpu,u8 vector);
 // CVM Functions from VT-Core
 noir_status nvc_vtc_create_vm(noir_cvm_virtual_machine_p *virtual_machine);
 void nvc_vtc_release_vm(noir_cvm_virtual_machine_p virtual_machine);
@@ -830,6 +1052,8 @@ noir_status nvc_vtc_rescind_vcpu(noir_cvm_virtual_cpu_p vcpu);
 noir_cvm_virtual_cpu_p nvc_vtc_reference_vcpu(noir_cvm_virtual_machine_p vm,u32 vcpu_id);
 noir_status nvc_vtc_set_mapping(noir_cvm_virtual_machine_p virtual_machine,noir_cvm_address_mapping_p mapping_info);
 u32 nvc_vtc_get_vm_asid(noir_cvm_virtual_machine_p vm);
+u32 nvc_vtc_get_supported_vm_properties();
+bool nvc_vtc_post_interrupt(noir_cvm_virtual_cpu_p vcpu,u8 vector);
 
 // Idle VM is to be considered as the List Head.
 noir_cvm_virtual_machine noir_idle_vm={0};
@@ -875,5 +1099,8 @@ noir_status nvc_view_vcpu_registers(noir_cvm_virtual_cpu_p vcpu,noir_cvm_registe
 noir_status nvc_set_guest_vcpu_options(noir_cvm_virtual_cpu_p vcpu,noir_cvm_vcpu_option_type option_type,u32 data);
 noir_status nvc_set_mapping(noir_cvm_virtual_machine_p virtual_machine,noir_cvm_address_mapping_p mapping_info);
 void nvc_synchronize_vcpu_state(noir_cvm_virtual_cpu_p vcpu);
+u32 nvc_edit_vcpu_msr_list(noir_cvm_virtual_cpu_p vcpu,noir_cvm_msr_entry_p entries,u32 count);
+u32 nvc_view_vcpu_msr_list(noir_cvm_virtual_cpu_p vcpu,noir_cvm_msr_entry_p entries,u32 count);
+noir_status nvc_operate_guest_memory(noir_cvm_virtual_cpu_p vcpu,u64 guest_address,void* buffer,u32 size,bool write,bool use_va);
 noir_status nvc_run_vcpu(noir_cvm_virtual_cpu_p vcpu,void* exit_context);
 #endif
\ No newline at end of file
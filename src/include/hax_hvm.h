@@ -244,7 +244,7 @@ typedef struct _noir_hax_vcpu_state
 #define hax_msr_fmask			0xC0000084
 #define hax_msr_kernel_gs_base	0xC0000102
 
-#define hax_max_msr_array		20
+#define hax_max_msr_array		0x20
 
 typedef struct _noir_hax_vmx_msr
 {
@@ -99,6 +99,7 @@
 #define ia32_efer_nxe_bit	0x800
 
 // This is used for defining MSRs.
+#define ia32_apic_base					0x1B
 #define ia32_feature_control			0x3A
 #define ia32_bios_updt_trig				0x79
 #define ia32_bios_sign_id				0x8B
@@ -163,6 +164,13 @@
 #define ia32_vmx_vmfunc					0x491
 #define ia32_vmx_3rdproc_ctrl			0x492
 #define ia32_rtit_ctrl					0x570
+#define ia32_tsc_deadline				0x6E0
+#define ia32_x2apic_id					0x802
+#define ia32_x2apic_icr					0x830
+#define ia32_x2apic_timer_lvt			0x832
+#define ia32_x2apic_timer_init_count	0x838
+#define ia32_x2apic_timer_cur_count		0x839
+#define ia32_x2apic_timer_div_conf		0x83E
 #define ia32_efer						0xC0000080
 #define ia32_star						0xC0000081
 #define ia32_lstar						0xC0000082
@@ -171,6 +179,30 @@
 #define ia32_fs_base					0xC0000100
 #define ia32_gs_base					0xC0000101
 #define ia32_kernel_gs_base				0xC0000102
+#define ia32_tsc_aux					0xC0000103
+
+// Local APIC Registers (Offsets in xAPIC Page)
+#define ia32_apic_id					0x020
+#define ia32_apic_version				0x030
+#define ia32_apic_tpr					0x080
+#define ia32_apic_ppr					0x0A0
+#define ia32_apic_dfr					0x0E0
+#define ia32_apic_spurious_int_vector	0x0F0
+#define ia32_apic_isr					0x100
+#define ia32_apic_irr					0x200
+#define ia32_apic_icr_lo				0x300
+#define ia32_apic_icr_hi				0x310
+#define ia32_apic_timer_lvt				0x320
+#define ia32_apic_error_lvt				0x370
+#define ia32_apic_timer_init_count		0x380
+#define ia32_apic_timer_cur_count		0x390
+#define ia32_apic_timer_div_conf		0x3E0
+
+// Local APIC Base MSR Bit Fields
+#define ia32_apic_default_base	0xFEE00000
+#define ia32_apic_bsp			8
+#define ia32_apic_extd			10
+#define ia32_apic_enable		11
 
 // This is used for defining IA-32 architectural interrupt vectors.
 #define ia32_divide_error				0
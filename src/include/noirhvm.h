@@ -17,6 +17,7 @@
 #include "mshv_hvm.h"
 #include "cvm_hvm.h"
 #include "hax_hvm.h"
+#include "nvtrace.h"
 #if defined(_vt_core)
 #include "vt_hvm.h"
 #elif defined(_svm_core)
@@ -83,6 +84,7 @@
 #define noir_cvm_run_vcpu					0x10001
 #define noir_cvm_dump_vcpu_vmcb				0x10002
 #define noir_cvm_set_vcpu_options			0x10003
+#define noir_cvm_guest_memory_operation		0x10004
 
 // Define the ownership purposes on Reverse Mapping Table.
 #define noir_nsv_rmt_subverted_host			0x00
@@ -213,6 +215,14 @@ typedef struct _noir_hypervisor
 	// Only Type-II (Layered) HyperVisor can schedule CVM.
 	struct _noir_cvm_virtual_machine *idle_vm;
 #endif
+	// Per-processor VM-Exit trace buffers. Null if tracing is not built.
+	noir_exit_trace_buffer_p *exit_trace;
+	// Interrupt time and TSC sampled on building the hypervisor. They calibrate the TSC frequency.
+	struct
+	{
+		u64 time;
+		u64 tsc;
+	}tsc_calibration;
 	struct
 	{
 		union
@@ -263,7 +273,8 @@ typedef struct _noir_hypervisor
 			u64 hide_from_pt:1;					// Bit 7
 			u64 enable_nsv:1;					// Bit 8
 			u64 enable_iommu:1;					// Bit 9
-			u64 reserved:53;					// Bits 10-62
+			u64 stealth_hook_dual_view:1;		// Bit 10
+			u64 reserved:52;					// Bits 11-62
 			u64 software_decoder:1;				// Bit 63
 		};
 		u64 value;
@@ -331,6 +342,7 @@ typedef struct _noir_hypervisor
 		noir_pushlock lock;
 	}rmd;
 	u32 cpu_count;
+	u32 nested_cache_capacity;		// Number of cached nested VMCBs per vCPU.
 	char vendor_string[13];
 	u8 cpu_manuf;
 	u8 selected_core;
@@ -365,6 +377,7 @@ bool nvc_is_vt_enabled();
 u32 nvc_vt_get_avail_vpid();
 bool nvc_vt_subvert_system(noir_hypervisor_p hvm);
 void nvc_vt_restore_system(noir_hypervisor_p hvm);
+noir_status nvc_vt_query_exit_statistics(u32 processor,void* buffer,u32 buffer_size);
 // Functions from SVM Core.
 bool nvc_is_svm_supported();
 bool nvc_is_npt_supported();
@@ -388,6 +401,7 @@ bool nvc_build_reverse_mapping_table();
 void nvc_configure_reverse_mapping(u64 hpa,u64 gpa,u32 asid,bool shared,u8 ownership);
 bool nvc_validate_rmt_reassignment(u64p hpa,u64p gpa,u32 pages,u32 asid,bool shared,u8 ownership);
 noir_rmt_entry_p nvc_get_rmt_entry(u64 hpa);
+u32 nvc_setup_per_processor(noir_broadcast_worker worker);
 extern noir_hypervisor_p hvm_p;
 extern ulong_ptr system_cr3;
 extern ulong_ptr orig_system_call;
@@ -427,6 +441,44 @@ u8 nvc_emu_try_vmexit_write_memory(noir_gpr_state_p gpr_state,noir_seg_state_p s
 bool nvc_translate_host_virtual_address_routine64(u64 pt,u64 va,u32 level,u64p pa,u32p error_code,bool r,bool w,bool x,bool u);
 size_t nvc_copy_host_virtual_memory64(u64 pt,u64 va,void* buffer,size_t length,bool write,bool la57,u32p error_code);
 size_t nvc_copy_guest_virtual_memory(noir_cvm_virtual_cpu_p vcpu,u64 gva,void* buffer,size_t length,bool write,u32p error_code);
+void nvc_operate_guest_memory_hvrt(noir_cvm_gmem_op_context_p context);
+
+// Functions from NoirVisor Profiler.
+void nvc_cvm_profiler_enter(noir_cvm_virtual_cpu_p vcpu,u64 exit_time);
+void nvc_cvm_profiler_leave(noir_cvm_virtual_cpu_p vcpu,u64 exit_time);
+void nvc_cvm_profiler_classify(noir_cvm_virtual_cpu_p vcpu,bool world_switched);
+void nvc_record_exit_statistics(noir_exit_statistics_p stats,bool sampled,u64 ticks);
+noir_exit_trace_record_p nvc_begin_exit_trace(u32 processor);
+void nvc_trace_exit_memory(noir_exit_trace_record_p record,u64 address,void* buffer,u32 size);
+
+// Functions from NoirVisor LAPIC Timer.
+u64 nvc_tsc_ticks_per_100ns();
+void nvc_cvm_lapic_timer_write_lvt(noir_cvm_lapic_timer_p timer,u32 value);
+void nvc_cvm_lapic_timer_write_initial_count(noir_cvm_lapic_timer_p timer,u32 value,u64 now);
+void nvc_cvm_lapic_timer_write_divide_config(noir_cvm_lapic_timer_p timer,u32 value);
+void nvc_cvm_lapic_timer_write_deadline(noir_cvm_lapic_timer_p timer,u64 value);
+u64 nvc_cvm_lapic_timer_read_deadline(noir_cvm_lapic_timer_p timer);
+u32 nvc_cvm_lapic_timer_read_current_count(noir_cvm_lapic_timer_p timer,u64 now);
+u64 nvc_cvm_lapic_timer_remaining(noir_cvm_lapic_timer_p timer,u64 now);
+u64 nvc_cvm_lapic_timer_arm(noir_cvm_lapic_timer_p timer,u64 now,u64 tsc_offset);
+bool nvc_cvm_lapic_timer_unarmed(noir_cvm_lapic_timer_p timer,u64 now,u64 tsc_offset);
+bool nvc_cvm_lapic_timer_expire(noir_cvm_lapic_timer_p timer,u64 now,u8p vector);
+bool nvc_cvm_lapic_timer_write_register(noir_cvm_lapic_timer_p timer,u32 offset,u32 value,u64 now);
+bool nvc_cvm_lapic_timer_rdmsr(noir_cvm_lapic_timer_p timer,u32 index,u64 now,u64p value);
+bool nvc_cvm_lapic_timer_wrmsr(noir_cvm_lapic_timer_p timer,u32 index,u64 value,u64 now);
+
+// Functions from NoirVisor Halt-Polling.
+void nvc_cvm_halt_poll_set_max_window(noir_cvm_halt_poll_p poll,u64 window_max);
+void nvc_cvm_halt_poll_grow(noir_cvm_halt_poll_p poll);
+void nvc_cvm_halt_poll_shrink(noir_cvm_halt_poll_p poll);
+void nvc_cvm_halt_poll_update(noir_cvm_halt_poll_p poll,u64 halted_ticks);
+
+// Functions from NoirVisor VPCB Submission Queue.
+noir_cvm_vpcb_queue_p nvc_cvm_get_vpcb_queue(noir_cvm_virtual_cpu_p vcpu);
+bool nvc_cvm_vpcb_queue_peek(noir_cvm_vpcb_queue_p queue,noir_cvm_vpcb_queue_entry_p entry);
+void nvc_cvm_vpcb_queue_pop(noir_cvm_vpcb_queue_p queue);
+bool nvc_cvm_vpcb_queue_peek_interrupt(noir_cvm_vpcb_queue_p queue,u8p vector);
+bool nvc_cvm_vpcb_queue_complete_io(noir_cvm_vpcb_queue_p queue,u16 port,u32 size,bool in,u64p rax);
 
 // Exception Handlers in Assembly
 void noir_divide_error_fault_handler_a(void);
@@ -450,6 +502,7 @@ void noir_control_protection_fault_handler_a(void);
 
 // Miscellaneous
 u64 noir_query_enabled_features_in_system();
+u32 noir_query_nested_cache_capacity();
 void noir_system_call(void);
 
 u64 nvc_translate_address_l5(u64 cr3,u64 gva,bool write,bool *fault);
@@ -457,6 +510,10 @@ u64 nvc_translate_address_l4(u64 cr3,u64 gva,bool write,bool *fault);
 u64 nvc_translate_address_l3(u64 cr3,u32 gva,bool write,bool *fault);
 u64 nvc_translate_address_l2(u64 cr3,u32 gva,bool write,bool *fault);
 
+#define noir_nested_cache_capacity_default	16
+#define noir_nested_cache_capacity_minimum	2
+#define noir_nested_cache_capacity_maximum	1024
+
 #if defined(_central_hvm)
 #define known_vendor_strings	16
 // This list is sorted for acceleration through binary search.
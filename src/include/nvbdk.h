@@ -594,9 +594,14 @@ typedef void (*noir_broadcast_worker)(void* context,u32 processor_id);
 void noir_save_processor_state(noir_processor_state_p state);
 u16 noir_get_segment_attributes(ulong_ptr gdt_base,u16 selector);
 void noir_generic_call(noir_broadcast_worker worker,void* context);
+void noir_targeted_call(noir_broadcast_worker worker,void* context,u32 processor_id);
 void* noir_get_host_idt_base(u32 processor_number);
 u32 noir_get_processor_count();
 u32 noir_get_current_processor();
+// Raising the IRQL to dispatch level keeps the thread on the current processor.
+u8 noir_raise_irql_to_dispatch();
+void noir_lower_irql(u8 irql);
+u32 noir_get_current_numa_node();
 u32 noir_get_instruction_length(void* code,bool long_mode);
 u32 noir_get_instruction_length_ex(void* code,u8 bits);
 u32 noir_disasm_instruction(void* code,char* mnemonic,size_t mnemonic_length,u8 bits,u64 virtual_address);
@@ -621,6 +626,7 @@ typedef i32(cdecl *noir_sorting_comparator)(const void* a,const void*b);
 typedef i32(cdecl *noir_bst_search_comparator)(avl_node_p node,const void* item);
 
 avl_node_p noir_insert_avl_node(avl_node_p parent,avl_node_p node,noir_sorting_comparator compare_fn);
+avl_node_p noir_remove_avl_node(avl_node_p parent,avl_node_p node,noir_sorting_comparator compare_fn);
 avl_node_p noir_search_avl_node(avl_node_p root,const void* item,noir_bst_search_comparator compare_fn);
 
 // Bitmap Facility
@@ -653,6 +659,18 @@ void noir_xsaves(void* state,u64 bv_mask);
 void noir_xrestores(void* state,u64 bv_mask);
 
 // Memory Facility
+#define noir_numa_node_any		0xFFFFFFFF
+
+// Allocation policy on NUMA systems.
+typedef enum _noir_memory_locality
+{
+	// Structures accessed by all processors, e.g.: MSR bitmaps, nested paging tables of CVMs.
+	noir_memory_shared,
+	// Structures accessed by the processor that allocates them, e.g.: VMCS, VMCB, host stacks.
+	// For CVM vCPUs, this is the processor running the VMM thread that creates the vCPU.
+	noir_memory_local
+}noir_memory_locality,*noir_memory_locality_p;
+
 typedef void (*noir_physical_range_callback)
 (
 	u64 start,
@@ -661,6 +679,9 @@ typedef void (*noir_physical_range_callback)
 );
 
 void* noir_alloc_contd_memory(size_t length);
+void* noir_alloc_contd_memory_for_numa(u32 numa_node,size_t length);
+u32 noir_select_numa_node(noir_memory_locality locality);
+void* noir_alloc_contd_memory_with_locality(noir_memory_locality locality,size_t length);
 void* noir_alloc_nonpg_memory(size_t length);
 void* noir_alloc_paged_memory(size_t length);
 void* noir_alloc_2mb_page();
@@ -674,6 +695,7 @@ u64 noir_get_current_process_cr3();
 void* noir_lock_pages(void* virt,size_t bytes,u64p phys);
 void noir_unlock_pages(void* locker);
 void noir_get_locked_range(void* locker,void** virt,u32p bytes);
+void* noir_get_locked_system_address(void* locker);
 void* noir_map_physical_memory(u64 physical_address,size_t length);
 void* noir_map_uncached_memory(u64 physical_address,size_t length);
 void noir_unmap_physical_memory(void* virtual_address,size_t length);
@@ -708,6 +730,9 @@ typedef u32 (stdcall *noir_thread_procedure)(void* context);
 typedef void* noir_thread;
 typedef void* noir_reslock;
 typedef ulong_ptr noir_pushlock;
+typedef void* noir_event;
+typedef void* noir_timer;
+typedef void* noir_interrupt;
 
 noir_thread noir_create_thread(noir_thread_procedure procedure,void* context);
 void noir_exit_thread(u32 status);
@@ -724,6 +749,17 @@ void noir_acquire_pushlock_shared(noir_pushlock *lock);
 void noir_acquire_pushlock_exclusive(noir_pushlock *lock);
 void noir_release_pushlock_shared(noir_pushlock *lock);
 void noir_release_pushlock_exclusive(noir_pushlock *lock);
+noir_event noir_initialize_event();
+void noir_finalize_event(noir_event event);
+void noir_set_event(noir_event event);
+void noir_reset_event(noir_event event);
+bool noir_wait_event(noir_event event,u64 timeout);
+noir_timer noir_initialize_timer();
+void noir_finalize_timer(noir_timer timer);
+void noir_set_timer(noir_timer timer,u64 due_time);
+void noir_cancel_timer(noir_timer timer);
+noir_interrupt noir_connect_noop_interrupt(u8 vector);
+void noir_disconnect_interrupt(noir_interrupt interrupt);
 
 // Crypto Facility
 typedef u32 (stdcall *noir_crc32_page_func)(void* page);
@@ -736,4 +772,5 @@ void noir_aes128_decrypt_pages(void* page_base,u8p expanded_keys,u64 pages,u8p k
 
 // Miscellaneous
 void noir_qsort(void* base,u32 num,u32 width,noir_sorting_comparator comparator);
-u64 noir_get_system_time();
\ No newline at end of file
+u64 noir_get_system_time();
+u64 noir_get_interrupt_time();
\ No newline at end of file
@@ -252,6 +252,17 @@ typedef u32 noir_status;
 
 #define noir_acpi_no_such_table			0xC000000F
 
+/*
+  Status Indicator: noir_vcpu_busy
+  If a vCPU is being run or reconfigured by
+  another thread, then this value is
+  supposed to be returned.
+
+  Value: 0xC0000010
+*/
+
+#define noir_vcpu_busy					0xC0000010
+
 /*
   Status Indicator: noir_not_intel
   If a procedure is specific for Intel Processor,
@@ -0,0 +1,83 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file defines the binary format of VM-Exit traces of NoirVisor.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /include/nvtrace.h
+*/
+
+#include <nvdef.h>
+
+/*
+  VM-Exit traces are captured only if NoirVisor is built with _hv_exit_trace defined.
+
+  Each processor owns a ring of fixed-size records. A trace buffer is laid out as:
+  +-----------------------+
+  | Header (64 bytes)     |
+  +-----------------------+
+  | Record 0 (256 bytes)  |
+  | Record 1              |
+  | ...                   |
+  +-----------------------+
+  The record of sequence n is located at index (n & (capacity-1)).
+  If the sequence exceeds the capacity, the oldest records are overwritten.
+*/
+#define noir_exit_trace_signature		0x5445764E		// "NvET"
+#define noir_exit_trace_version			1
+#define noir_exit_trace_capacity		1024			// Must be power of 2.
+
+// Vendors of the traced VM-Exit.
+#define noir_exit_trace_vendor_vmx		0
+#define noir_exit_trace_vendor_svm		1
+
+// Flags of the traced VM-Exit.
+#define noir_exit_trace_cvm_exit		0x1		// The VM-Exit is from a CVM vCPU.
+#define noir_exit_trace_memory_valid	0x2		// The memory field is valid.
+
+// Semantics of the information fields.
+// For Intel VT-x:
+//   info[0]: Exit Qualification
+//   info[1]: Guest-Physical Address
+//   info[2]: VM-Exit Instruction Length
+//   info[3]: VM-Exit Interruption Information
+// For AMD-V:
+//   info[0]: EXITINFO1
+//   info[1]: EXITINFO2
+//   info[2]: Next RIP
+//   info[3]: EXITINTINFO
+typedef struct _noir_exit_trace_record
+{
+	u64 tsc;
+	u32 exit_code;
+	u8 vendor;
+	u8 flags;
+	u8 memory_size;			// Number of valid bytes in memory field.
+	u8 reserved;
+	u64 info[4];
+	u64 rip;
+	u64 rflags;
+	u64 gpr[16];			// In the order of noir_gpr_state.
+	u64 memory_address;		// Guest address where the memory is read from.
+	u8 memory[16];
+	u64 reserved2[5];
+}noir_exit_trace_record,*noir_exit_trace_record_p;
+
+typedef struct _noir_exit_trace_buffer
+{
+	u32 signature;
+	u16 version;
+	u16 record_size;
+	u32 capacity;
+	u32 processor;
+	u64 sequence;		// Number of records ever written.
+	u64 reserved[5];
+	noir_exit_trace_record records[1];
+}noir_exit_trace_buffer,*noir_exit_trace_buffer_p;
+
+#define noir_exit_trace_buffer_size		(sizeof(noir_exit_trace_buffer)+sizeof(noir_exit_trace_record)*(noir_exit_trace_capacity-1))
@@ -23,6 +23,7 @@
 #define noir_svm_run_custom_vcpu			0x10001
 #define noir_svm_dump_vcpu_vmcb				0x10002
 #define noir_svm_set_vcpu_options			0x10003
+#define noir_svm_guest_memory_operation		0x10004
 #define noir_svm_nsv_reassign_rmt			0x10005
 #define noir_svm_nsv_remap_by_rmt			0x10006
 #define noir_svm_nsv_crypto_for_rmt			0x10007
@@ -41,7 +42,8 @@
 #define noir_svm_sipi_sent					0
 
 // Number of nested VMCBs to be cached.
-#define noir_svm_cached_nested_vmcb			16
+// Intercept vectors of VMCB cover intercept codes 0x00-0xBF.
+#define noir_svm_nested_intercept_words		6
 
 // Definitions of CVM CPUID maskings
 #define noir_svm_cpuid_cvmask0_ecx_fn0000_0001	0xE2D83209
@@ -109,6 +111,8 @@ typedef struct _noir_svm_virtual_msr
 
 typedef struct _noir_svm_nested_vcpu_node
 {
+	avl_node avl;			// AVL-Node must be at the top of the structure.
+	list_entry cache_list;
 	memory_descriptor vmcb_t;
 	memory_descriptor vmcb_c;
 	union
@@ -116,17 +120,40 @@ typedef struct _noir_svm_nested_vcpu_node
 		struct
 		{
 			u64 clean:1;
-			u64 reserved:63;
+			u64 l1_npt:1;
+			u64 cached:1;
+			u64 reserved:61;
 		};
 		u64 value;
 	}flags;
+	// Snapshot of intercept vectors specified by the nested hypervisor.
+	// Bit n indicates the nested hypervisor intercepts the intercept code n.
+	u32 l1_intercepts[noir_svm_nested_intercept_words];
+	// Permission maps of the nested guest: union of NoirVisor's maps and the nested hypervisor's maps.
+	memory_descriptor iopm_t;
+	memory_descriptor msrpm_t;
+	// Permission maps of the nested hypervisor. Null if the nested hypervisor does not protect I/O or MSRs.
+	void* l1_iopm;
+	void* l1_msrpm;
 }noir_svm_nested_vcpu_node,*noir_svm_nested_vcpu_node_p;
 
 typedef struct _noir_svm_nested_vcpu
 {
 	u64 hsave_gpa;
 	void* hsave_hva;
-	noir_svm_nested_vcpu_node node_pool[noir_svm_cached_nested_vmcb];
+	noir_svm_nested_vcpu_node_p node_pool;
+	// Nodes are indexed by the GPA of L1 VMCB in an AVL tree.
+	// Nodes are ordered by time of reference in the cache list. The head is the most recently used.
+	struct
+	{
+		noir_svm_nested_vcpu_node_p root;
+		list_entry head;
+		u32 capacity;
+		u32 reserved;
+		u64 hits;
+		u64 misses;
+		u64 evictions;
+	}cache;
 	struct
 	{
 		u64 svme:1;
@@ -274,6 +301,9 @@ typedef struct _noir_svm_custom_vcpu
 		u64 value;
 	}special_state;
 	u64 lasted_tsc;
+	// The LDR and DFR that the AVIC Logical APIC ID Table currently reflects.
+	u32 avic_ldr;
+	u32 avic_dfr;
 	u32 proc_id;	// The physical processor id this vCPU was scheduled to
 	u32 vcpu_id;	// The virtual processor id of this vCPU
 }noir_svm_custom_vcpu,*noir_svm_custom_vcpu_p;
@@ -350,15 +380,20 @@ void nvc_svm_dump_guest_segments(noir_cvm_virtual_cpu_p vcpu,void* vmcb);
 void nvc_svm_dump_guest_fs_gs(noir_cvm_virtual_cpu_p vcpu,void* vmcb);
 void nvc_svm_set_guest_vcpu_options(noir_svm_custom_vcpu_p vcpu);
 void nvc_svm_switch_to_guest_vcpu(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu);
+bool nvc_svm_update_cvm_timer(noir_svm_custom_vcpu_p cvcpu);
+bool nvc_svm_cvm_timer_unarmed(noir_svm_custom_vcpu_p cvcpu);
+void nvc_svm_deliver_queued_interrupts(noir_svm_custom_vcpu_p cvcpu);
 void nvc_svm_switch_to_host_vcpu(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu);
 void nvc_svm_inject_cvm_exception(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu,u8 vector,bool ev,u32 error_code,u64 pf_addr,u8 fetch_length,u8p fetched_instruction);
 bool nvc_svm_nsv_save_guest_vcpu(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu);
 bool nvc_svm_nsv_load_guest_vcpu(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu);
 void nvc_svm_load_basic_exit_context(noir_svm_custom_vcpu_p vcpu);
 void nvc_svm_emulate_init_signal(noir_gpr_state_p gpr_state,void* vmcb,u32 cpuid_fms);
+void nvc_svm_initialize_nested_vcpu_cache(noir_svm_nested_vcpu_p nvcpu);
 noir_svm_nested_vcpu_node_p nvc_svm_get_nested_vcpu_node(noir_svm_nested_vcpu_p nvcpu,u64 vmcb);
 void noir_hvcode nvc_svm_switch_to_nested_vcpu(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu_node);
 void noir_hvcode nvc_svm_switch_from_nested_vcpu(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu);
+bool noir_hvcode nvc_svm_nested_exit_reflected(noir_svm_nested_vcpu_node_p nvcpu,i32 intercept_code,u64 exit_info1,u32 msr_index);
 void noir_hvcode nvc_svm_clear_nested_gif(noir_svm_vcpu_p vcpu);
 void noir_hvcode nvc_svm_set_nested_gif(noir_svm_vcpu_p vcpu);
 bool nvc_svmc_get_physical_mapping(noir_svm_custom_npt_manager_p npt_manager,u64 gpa,u64p hpa,bool r,bool w,bool x);
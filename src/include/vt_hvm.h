@@ -21,6 +21,14 @@
 #define noir_vt_run_custom_vcpu			0x10001
 #define noir_vt_dump_vcpu_vmcs			0x10002
 #define noir_vt_set_vcpu_options		0x10003
+#define noir_vt_clear_custom_vmcs		0x10005
+
+// The VMCS of CVM vCPU is clear and not active on any processor.
+#define noir_vt_vmcs_not_resident		0xffffffff
+
+// Notification vector of posted interrupts for CVM vCPUs. The host never sends this vector.
+// Its priority class is the highest so that the TPR of the host does not hold the notification.
+#define noir_vt_posted_interrupt_vector	0xF2
 
 #define noir_nvt_vmxe			0
 #define noir_nvt_vmxon			1
@@ -42,13 +50,14 @@
 #define noir_vt_cvm_msr_auto_cstar		2
 #define noir_vt_cvm_msr_auto_sfmask		3
 #define noir_vt_cvm_msr_auto_gsswap		4
-#define noir_vt_cvm_msr_auto_br_from	5
-#define noir_vt_cvm_msr_auto_br_to		6
-#define noir_vt_cvm_msr_auto_ex_from	7
-#define noir_vt_cvm_msr_auto_ex_to		8
+#define noir_vt_cvm_msr_auto_tsc_aux	5
+#define noir_vt_cvm_msr_auto_br_from	6
+#define noir_vt_cvm_msr_auto_br_to		7
+#define noir_vt_cvm_msr_auto_ex_from	8
+#define noir_vt_cvm_msr_auto_ex_to		9
 
 // FIXME: When LBR Virtualization is ready, change this value.
-#define noir_vt_cvm_msr_auto_max		5
+#define noir_vt_cvm_msr_auto_max		6
 
 typedef enum _noir_vt_consistency_check_failure_id
 {
@@ -94,8 +103,24 @@ typedef struct _noir_vt_hvm
 	memory_descriptor msr_bitmap;
 	memory_descriptor io_bitmap_a;
 	memory_descriptor io_bitmap_b;
+	struct
+	{
+		memory_descriptor vmread_bitmap;
+		memory_descriptor vmwrite_bitmap;
+		bool readonly_fields;
+	}shadow_vmcs;
+	struct
+	{
+		u32p table;		// Each entry is the index of the hook page plus one. Zero indicates an empty slot.
+		u32 mask;
+	}hook_lookup;
 	u32 hvm_cpuid_leaf_max;
 	struct _noir_dmar_manager *dmar_manager;
+	u32 cvm_properties;		// Properties of CVM supported by the processor.
+	void* host_apic;		// Mapped xAPIC page of the host. It is null if the host is in x2APIC mode.
+	void* notification_interrupt;	// Host handler of stray posted-interrupt notifications.
+	bool preemption_timer;	// The VMX-preemption timer counts down by one every 2^preemption_timer_rate TSC ticks.
+	u8 preemption_timer_rate;
 }noir_vt_hvm,*noir_vt_hvm_p;
 
 typedef struct _noir_vt_msr_entry
@@ -119,11 +144,35 @@ typedef struct _noir_vt_nested_vcpu
 	memory_descriptor vmcs_c;
 	// Abstracted-to-CPU VMCS.
 	memory_descriptor vmcs_t;
+	// Shadow VMCS for the Abstracted-to-user VMCS.
+	memory_descriptor vmcs_s;
 	u32 status;
 }noir_vt_nested_vcpu,*noir_vt_nested_vcpu_p;
 
 struct _noir_ept_manager;
 
+// Slots of cached VM-Exit information fields.
+#define noir_vt_exit_cache_qualification			0
+#define noir_vt_exit_cache_gpa						1
+#define noir_vt_exit_cache_gla						2
+#define noir_vt_exit_cache_instruction_length		3
+#define noir_vt_exit_cache_instruction_information	4
+#define noir_vt_exit_cache_interruption_information	5
+#define noir_vt_exit_cache_interruption_error_code	6
+#define noir_vt_exit_cache_idt_vectoring_information	7
+#define noir_vt_exit_cache_slots					8
+
+// Number of VM-Exit reasons handled by NoirVisor.
+#define vmx_maximum_exit_reason		70
+
+// Statistics of VM-Exits on a processor, indexed by the exit reason.
+typedef struct _noir_vt_exit_statistics
+{
+	u64 sequence;
+	noir_exit_statistics reason[vmx_maximum_exit_reason];		// Exits from the subverted host.
+	noir_exit_statistics cvm_reason[vmx_maximum_exit_reason];	// Exits from CVM guests.
+}noir_vt_exit_statistics,*noir_vt_exit_statistics_p;
+
 typedef struct _noir_vt_vcpu
 {
 	memory_descriptor vmxon;
@@ -142,11 +191,22 @@ typedef struct _noir_vt_vcpu
 		u32 error_code;
 	}fallback;
 	struct _noir_ept_manager *ept_manager;
+	// Data view of EPT, present only if stealth hook uses dual views.
+	struct _noir_ept_manager *ept_data_view;
+	// VM-Exit information fields read during this VM-Exit.
+	struct
+	{
+		u32 valid;
+		u32 reason;
+		u64 value[noir_vt_exit_cache_slots];
+	}exit_cache;
+	noir_vt_exit_statistics exit_statistics;
 	noir_vt_virtual_msr virtual_msr;
 	noir_vt_nested_vcpu nested_vcpu;
 	noir_cvm_virtual_cpu cvm_state;
 	noir_mshv_vcpu mshvcpu;
 	u32 family_ext;		// Cached info of Extended Family.
+	u32 pi_destination;	// Host APIC ID in the format of Notification Destination.
 	u8 status;
 	u8 enabled_feature;
 	u8 mtrr_dirty;
@@ -195,6 +255,8 @@ typedef struct _noir_vt_custom_vcpu
 	struct _noir_vt_custom_vm *vm;
 	memory_descriptor vmcs;
 	memory_descriptor msr_auto;
+	memory_descriptor virtual_apic;
+	memory_descriptor pi_desc;
 	union
 	{
 		struct
@@ -205,8 +267,10 @@ typedef struct _noir_vt_custom_vcpu
 		u64 value;
 	}special_state;
 	u64 lasted_tsc;
-	u32 proc_id;
+	u32 proc_id;		// Processor where the VMCS is active.
 	u32 vcpu_id;
+	bool launched;
+	bool options_pending;
 }noir_vt_custom_vcpu,*noir_vt_custom_vcpu_p;
 
 typedef struct _noir_vt_custom_vm
@@ -217,11 +281,14 @@ typedef struct _noir_vt_custom_vm
 	u32 vcpu_count;
 	u16 vpid;
 	struct _noir_vt_custom_ept_manager eptm;
+	memory_descriptor apic_access;
+	u64 apic_access_gpa;		// Guest-physical address where the APIC-Access Page is mapped.
 }noir_vt_custom_vm,*noir_vt_custom_vm_p;
 
 typedef struct _noir_vt_initial_stack
 {
 	noir_vt_vcpu_p vcpu;
+	// The idle vCPU indicates the subverted host. This is maintained on VMPTRLD of world switches.
 	noir_vt_custom_vcpu_p custom_vcpu;
 	u32 proc_id;
 	union
@@ -244,11 +311,16 @@ extern noir_vt_custom_vcpu nvc_vt_idle_cvcpu;
 u8 fastcall nvc_vt_subvert_processor_a(noir_vt_vcpu_p vcpu);
 noir_status nvc_vtc_initialize_cvm_module();
 void nvc_vtc_finalize_cvm_module();
+noir_status nvc_vtc_relocate_apic_access(noir_vt_custom_vm_p vm,u64 gpa);
 void nvc_vt_initialize_cvm_vmcs(noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu);
 void nvc_vt_switch_to_guest_vcpu(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu);
+bool nvc_vt_update_cvm_timer(noir_vt_custom_vcpu_p cvcpu);
+void nvc_vt_deliver_queued_interrupts(noir_vt_custom_vcpu_p cvcpu);
 void nvc_vt_switch_to_host_vcpu(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu);
 void nvc_vt_dump_vcpu_state(noir_vt_custom_vcpu_p vcpu);
 void nvc_vt_set_guest_vcpu_options(noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu);
+void nvc_vt_apply_guest_vcpu_options(noir_vt_custom_vcpu_p cvcpu);
+void nvc_vt_clear_cvm_vmcs(noir_vt_custom_vcpu_p cvcpu);
 void nvc_vt_dump_vmcs_guest_state();
 void nvc_vt_host_nmi_handler(void);
 void nvc_vt_resume_without_entry(noir_gpr_state_p state);
@@ -260,4 +332,9 @@ void noir_vt_vmfail_invalid();
 void noir_vt_vmfail_valid();
 void noir_vt_vmfail(noir_vt_nested_vcpu_p nested_vcpu,u32 message);
 bool noir_vt_nested_vmread(void* vmcs,u32 encoding,ulong_ptr* data);
-bool noir_vt_nested_vmwrite(void* vmcs,u32 encoding,ulong_ptr data);
\ No newline at end of file
+bool noir_vt_nested_vmwrite(void* vmcs,u32 encoding,ulong_ptr data);
+void nvc_vt_build_nested_vmcs_field_table();
+void nvc_vt_build_shadow_vmcs_bitmaps(noir_vt_hvm_p rhvm);
+void nvc_vt_load_shadow_vmcs(noir_vt_vcpu_p vcpu);
+void nvc_vt_sync_shadow_vmcs(noir_vt_vcpu_p vcpu);
+void nvc_vt_unload_shadow_vmcs(noir_vt_vcpu_p vcpu);
\ No newline at end of file
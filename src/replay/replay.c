@@ -0,0 +1,460 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file is the main module of the user-mode VM-Exit replay engine.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/replay.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <setjmp.h>
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvtrace.h>
+#include "replay.h"
+#include "replay_test.h"
+
+/*
+  The replay engine feeds the records of VM-Exit traces into the exit
+  handlers of the cores, which are compiled as user-mode code. The
+  processor, the VMCB and the VMCS are simulated by the engine.
+  For each record, the engine reports how long the handler runs and
+  hashes the vCPU state after the handler returns. If the digests of
+  two builds differ on the same trace, the handlers behave differently.
+*/
+#define noir_replay_fnv_offset		0xCBF29CE484222325
+#define noir_replay_fnv_prime		0x100000001B3
+#define noir_replay_stat_slots		1024
+
+typedef struct _noir_replay_statistics
+{
+	u64 count;
+	u64 faulted;
+	u64 aborted;
+	u64 total_time;		// In TSC ticks.
+	u64 min_time;
+	u64 max_time;
+	u32 exit_code;
+	u8 vendor;
+	bool valid;
+}noir_replay_statistics,*noir_replay_statistics_p;
+
+noir_exit_trace_record_p noir_replay_record=null;
+bool noir_replay_verbose=false;
+
+noir_replay_statistics noir_replay_stats[noir_replay_stat_slots]={0};
+noir_replay_vendor_p noir_replay_vendors[2]={&noir_replay_vt,&noir_replay_svm};
+sigjmp_buf noir_replay_jump;
+const char* noir_replay_reason=null;
+volatile sig_atomic_t noir_replay_active=0;
+
+u64 noir_replay_hash(u64 hash,const void* buffer,size_t length)
+{
+	for(size_t i=0;i<length;i++)
+	{
+		hash^=((const u8*)buffer)[i];
+		hash*=noir_replay_fnv_prime;
+	}
+	return hash;
+}
+
+// Return to the engine from the middle of the exit handler.
+void noir_replay_leave(int outcome,const char* reason)
+{
+	noir_replay_reason=reason;
+	siglongjmp(noir_replay_jump,outcome);
+}
+
+void static noir_replay_signal_handler(int signum)
+{
+	if(noir_replay_active)
+	{
+		noir_replay_reason="The handler accessed memory that is not simulated.";
+		siglongjmp(noir_replay_jump,noir_replay_faulted);
+	}
+	signal(signum,SIG_DFL);
+	raise(signum);
+}
+
+// Serve the memory from the record. Bytes outside the recorded memory read as zero.
+size_t noir_replay_read_memory(u64 address,void* buffer,size_t length)
+{
+	size_t copied=0;
+	memset(buffer,0,length);
+	if(noir_replay_record && (noir_replay_record->flags & noir_exit_trace_memory_valid))
+	{
+		const u64 start=noir_replay_record->memory_address;
+		const u64 end=start+noir_replay_record->memory_size;
+		if(address>=start && address<end)
+		{
+			copied=(size_t)(end-address)<length?(size_t)(end-address):length;
+			memcpy(buffer,&noir_replay_record->memory[address-start],copied);
+		}
+	}
+	return copied;
+}
+
+u32 noir_replay_instruction_length()
+{
+	if(noir_replay_record)
+	{
+		u64 length=0;
+		if(noir_replay_record->vendor==noir_exit_trace_vendor_svm)
+			length=noir_replay_record->info[2]-noir_replay_record->rip;
+		else
+			length=noir_replay_record->info[2];
+		if(length<=15)return (u32)length;
+	}
+	return 0;
+}
+
+noir_replay_statistics_p static noir_replay_get_statistics(u8 vendor,u32 exit_code)
+{
+	u32 i=(exit_code*31+vendor)&(noir_replay_stat_slots-1);
+	for(u32 j=0;j<noir_replay_stat_slots;j++)
+	{
+		noir_replay_statistics_p stats=&noir_replay_stats[(i+j)&(noir_replay_stat_slots-1)];
+		if(!stats->valid)
+		{
+			stats->valid=true;
+			stats->vendor=vendor;
+			stats->exit_code=exit_code;
+			stats->min_time=0xFFFFFFFFFFFFFFFF;
+			return stats;
+		}
+		if(stats->vendor==vendor && stats->exit_code==exit_code)return stats;
+	}
+	return null;
+}
+
+int static noir_replay_compare_statistics(const void* a,const void* b)
+{
+	const noir_replay_statistics_p x=(const noir_replay_statistics_p)a,y=(const noir_replay_statistics_p)b;
+	if(x->valid!=y->valid)return x->valid?-1:1;
+	if(x->vendor!=y->vendor)return x->vendor<y->vendor?-1:1;
+	if(x->exit_code!=y->exit_code)return x->exit_code<y->exit_code?-1:1;
+	return 0;
+}
+
+// Replay one record. Returns the outcome of the replay.
+int static noir_replay_one(noir_exit_trace_record_p record,u64* ticks)
+{
+	noir_replay_vendor_p vendor=noir_replay_vendors[record->vendor];
+	volatile u64 start=0;
+	int outcome;
+	noir_replay_record=record;
+	noir_replay_reset_processor();
+	vendor->load(record);
+	noir_replay_active=1;
+	outcome=sigsetjmp(noir_replay_jump,1);
+	if(outcome==noir_replay_completed)
+	{
+		start=__rdtsc();
+		vendor->invoke();
+		*ticks=__rdtsc()-start;
+	}
+	noir_replay_active=0;
+	noir_replay_record=null;
+	return outcome;
+}
+
+// Records are replayed from the oldest to the newest.
+bool static noir_replay_buffer(noir_exit_trace_buffer_p buffer,bool first_pass,u64* digest,u64* replayed,u64* skipped)
+{
+	const u64 count=buffer->sequence<buffer->capacity?buffer->sequence:buffer->capacity;
+	for(u64 i=buffer->sequence-count;i<buffer->sequence;i++)
+	{
+		noir_exit_trace_record_p record=&buffer->records[i&(buffer->capacity-1)];
+		noir_replay_statistics_p stats;
+		u64 ticks=0;
+		int outcome;
+		if(record->vendor>noir_exit_trace_vendor_svm)
+		{
+			fprintf(stderr,"Record %llu of processor %u has unknown vendor %u!\n",i,buffer->processor,record->vendor);
+			return false;
+		}
+		// CVM exits depend on the state of the CVM, which is not traced.
+		if(record->flags & noir_exit_trace_cvm_exit)
+		{
+			if(first_pass)(*skipped)++;
+			continue;
+		}
+		outcome=noir_replay_one(record,&ticks);
+		stats=noir_replay_get_statistics(record->vendor,record->exit_code);
+		if(stats==null)
+		{
+			fprintf(stderr,"Too many kinds of VM-Exits!\n");
+			return false;
+		}
+		if(outcome==noir_replay_completed)
+		{
+			stats->count++;
+			stats->total_time+=ticks;
+			if(ticks<stats->min_time)stats->min_time=ticks;
+			if(ticks>stats->max_time)stats->max_time=ticks;
+		}
+		else if(first_pass)
+		{
+			if(outcome==noir_replay_faulted)
+				stats->faulted++;
+			else
+				stats->aborted++;
+			if(noir_replay_verbose)fprintf(stderr,"Record %llu of processor %u (Exit Code 0x%X) is not completed: %s\n",i,buffer->processor,record->exit_code,noir_replay_reason);
+		}
+		if(first_pass)
+		{
+			// The outcome is hashed as well, so that a handler starting to fault changes the digest.
+			*digest=noir_replay_hash(*digest,&outcome,sizeof(outcome));
+			if(outcome==noir_replay_completed)*digest=noir_replay_vendors[record->vendor]->digest(*digest);
+			(*replayed)++;
+		}
+	}
+	return true;
+}
+
+noir_exit_trace_buffer_p static noir_replay_validate_buffer(u8p data,size_t size,size_t* buffer_size)
+{
+	noir_exit_trace_buffer_p buffer=(noir_exit_trace_buffer_p)data;
+	if(size<offsetof(noir_exit_trace_buffer,records))return null;
+	if(buffer->signature!=noir_exit_trace_signature || buffer->version!=noir_exit_trace_version)return null;
+	if(buffer->record_size!=sizeof(noir_exit_trace_record))return null;
+	if(buffer->capacity==0 || (buffer->capacity&(buffer->capacity-1)))return null;
+	*buffer_size=offsetof(noir_exit_trace_buffer,records)+(size_t)buffer->capacity*sizeof(noir_exit_trace_record);
+	return *buffer_size<=size?buffer:null;
+}
+
+u8p static noir_replay_load_file(const char* file_name,size_t* size)
+{
+	u8p data=null;
+	FILE* fp=fopen(file_name,"rb");
+	if(fp)
+	{
+		long length;
+		fseek(fp,0,SEEK_END);
+		length=ftell(fp);
+		fseek(fp,0,SEEK_SET);
+		if(length>0)
+		{
+			data=malloc((size_t)length);
+			if(data)
+			{
+				if(fread(data,1,(size_t)length,fp)==(size_t)length)
+					*size=(size_t)length;
+				else
+				{
+					free(data);
+					data=null;
+				}
+			}
+		}
+		fclose(fp);
+	}
+	return data;
+}
+
+void static noir_replay_print_statistics()
+{
+	qsort(noir_replay_stats,noir_replay_stat_slots,sizeof(noir_replay_statistics),noir_replay_compare_statistics);
+	printf("%-10s  %-10s  %10s  %8s  %8s  %12s  %12s  %12s\n","Vendor","Exit Code","Count","Faulted","Aborted","Avg Ticks","Min Ticks","Max Ticks");
+	for(u32 i=0;i<noir_replay_stat_slots && noir_replay_stats[i].valid;i++)
+	{
+		noir_replay_statistics_p stats=&noir_replay_stats[i];
+		const u64 avg=stats->count?stats->total_time/stats->count:0;
+		const u64 min=stats->count?stats->min_time:0;
+		printf("%-10s  0x%08X  %10llu  %8llu  %8llu  %12llu  %12llu  %12llu\n",stats->vendor==noir_exit_trace_vendor_svm?"AMD-V":"VT-x",stats->exit_code,stats->count,stats->faulted,stats->aborted,avg,min,stats->max_time);
+	}
+}
+
+// Run the tests whose names begin with the prefix. Returns the number of failed tests.
+u32 static noir_replay_run_tests(const char* prefix)
+{
+	u32 passed=0,failed=0;
+	for(u32 i=0;i<noir_replay_test_count;i++)
+	{
+		noir_replay_test_p test=&noir_replay_tests[i];
+		volatile bool result=false;
+		if(prefix && strncmp(test->name,prefix,strlen(prefix)))continue;
+		noir_replay_reason="An assertion failed.";
+		if(test->vendor==null || test->vendor->initialize())
+		{
+			// Faults in the handlers fail the test instead of crashing the engine.
+			noir_replay_active=1;
+			if(sigsetjmp(noir_replay_jump,1)==noir_replay_completed)result=test->routine();
+			noir_replay_active=0;
+			noir_replay_identity_memory=false;
+			noir_replay_rmt_entry=null;
+			noir_replay_record=null;
+			noir_replay_numa_node=0;
+			noir_replay_allocation_budget=maxu32;
+		}
+		else
+			noir_replay_reason="The simulated vCPU cannot be initialized.";
+		if(test->vendor)test->vendor->finalize();
+		if(result)
+		{
+			printf("[PASS] %s\n",test->name);
+			passed++;
+		}
+		else
+		{
+			printf("[FAIL] %s: %s\n",test->name,noir_replay_reason);
+			failed++;
+		}
+	}
+	printf("%u test(s) passed, %u test(s) failed.\n",passed,failed);
+	return failed;
+}
+
+// Run the benchmarks whose names begin with the prefix. Returns the number of failed benchmarks.
+u32 static noir_replay_run_benchmarks(const char* prefix,u32 iterations)
+{
+	u32 failed=0;
+	for(u32 i=0;i<noir_replay_benchmark_count;i++)
+	{
+		noir_replay_benchmark_p benchmark=&noir_replay_benchmarks[i];
+		volatile bool completed=false;
+		if(prefix && strncmp(benchmark->name,prefix,strlen(prefix)))continue;
+		printf("[BENCHMARK] %s\n",benchmark->name);
+		if(benchmark->vendor==null || benchmark->vendor->initialize())
+		{
+			noir_replay_active=1;
+			if(sigsetjmp(noir_replay_jump,1)==noir_replay_completed)
+			{
+				benchmark->routine(noir_replay_benchmark_rounds*iterations);
+				completed=true;
+			}
+			noir_replay_active=0;
+			noir_replay_identity_memory=false;
+			noir_replay_rmt_entry=null;
+			noir_replay_record=null;
+			noir_replay_numa_node=0;
+			noir_replay_allocation_budget=maxu32;
+		}
+		else
+			noir_replay_reason="The simulated vCPU cannot be initialized.";
+		if(benchmark->vendor)benchmark->vendor->finalize();
+		if(!completed)
+		{
+			printf("[FAIL] %s: %s\n",benchmark->name,noir_replay_reason);
+			failed++;
+		}
+	}
+	return failed;
+}
+
+void static noir_replay_usage(const char* program)
+{
+	printf("Usage: %s [-n iterations] [-v] <trace file>...\n",program);
+	printf("       %s -t [test name prefix]\n",program);
+	printf("       %s [-n iterations] -b [benchmark name prefix]\n",program);
+	printf("  -n  Replay the traces for the specified times. Default is 1.\n");
+	printf("  -v  Print the debug messages of the hypervisor and the records not completed.\n");
+	printf("  -t  Run the tests of the handlers instead of replaying traces.\n");
+	printf("  -b  Run the benchmarks instead of replaying traces. Each iteration runs %u rounds.\n",noir_replay_benchmark_rounds);
+}
+
+int main(int argc,char* argv[])
+{
+	u64 digest=noir_replay_fnv_offset,replayed=0,skipped=0;
+	u32 iterations=1;
+	int first_file=argc;
+	bool initialized[2]={false,false},run_tests=false,run_benchmarks=false;
+	const char* test_prefix=null;
+	for(int i=1;i<argc;i++)
+	{
+		if(strcmp(argv[i],"-n")==0 && i+1<argc)
+			iterations=(u32)strtoul(argv[++i],null,0);
+		else if(strcmp(argv[i],"-v")==0)
+			noir_replay_verbose=true;
+		else if(strcmp(argv[i],"-t")==0)
+		{
+			run_tests=true;
+			if(i+1<argc && argv[i+1][0]!='-')test_prefix=argv[++i];
+		}
+		else if(strcmp(argv[i],"-b")==0)
+		{
+			run_benchmarks=true;
+			if(i+1<argc && argv[i+1][0]!='-')test_prefix=argv[++i];
+		}
+		else if(argv[i][0]=='-')
+		{
+			noir_replay_usage(argv[0]);
+			return 1;
+		}
+		else
+		{
+			first_file=i;
+			break;
+		}
+	}
+	signal(SIGSEGV,noir_replay_signal_handler);
+	signal(SIGBUS,noir_replay_signal_handler);
+	signal(SIGFPE,noir_replay_signal_handler);
+	signal(SIGILL,noir_replay_signal_handler);
+	if(run_tests)return noir_replay_run_tests(test_prefix)?1:0;
+	if(run_benchmarks)return noir_replay_run_benchmarks(test_prefix,iterations?iterations:1)?1:0;
+	if(first_file==argc || iterations==0)
+	{
+		noir_replay_usage(argv[0]);
+		return 1;
+	}
+	for(int i=first_file;i<argc;i++)
+	{
+		size_t size=0,offset=0;
+		u8p data=noir_replay_load_file(argv[i],&size);
+		if(data==null)
+		{
+			fprintf(stderr,"Failed to load trace file %s!\n",argv[i]);
+			return 1;
+		}
+		// A trace file might consist of the buffers of several processors.
+		while(offset<size)
+		{
+			size_t buffer_size;
+			noir_exit_trace_buffer_p buffer=noir_replay_validate_buffer(&data[offset],size-offset,&buffer_size);
+			if(buffer==null)
+			{
+				fprintf(stderr,"Trace file %s is malformed at offset 0x%zX!\n",argv[i],offset);
+				return 1;
+			}
+			for(u32 j=0;j<iterations;j++)
+			{
+				// The simulated vCPU of the vendor is built once. Only one vendor is active at a time.
+				const u32 k=buffer->records[0].vendor==noir_exit_trace_vendor_svm;
+				if(!initialized[k])
+				{
+					if(initialized[k^1])
+					{
+						noir_replay_vendors[k^1]->finalize();
+						initialized[k^1]=false;
+					}
+					if(!noir_replay_vendors[k]->initialize())
+					{
+						fprintf(stderr,"Failed to initialize the simulated %s vCPU!\n",noir_replay_vendors[k]->name);
+						return 1;
+					}
+					initialized[k]=true;
+				}
+				if(!noir_replay_buffer(buffer,j==0,&digest,&replayed,&skipped))return 1;
+			}
+			offset+=buffer_size;
+		}
+		free(data);
+	}
+	for(u32 k=0;k<2;k++)
+		if(initialized[k])
+			noir_replay_vendors[k]->finalize();
+	noir_replay_print_statistics();
+	printf("Replayed %llu records for %u iteration(s). %llu CVM records are skipped.\n",replayed,iterations,skipped);
+	printf("Digest: 0x%016llX\n",digest);
+	return 0;
+}
@@ -0,0 +1,51 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file is the header of the user-mode VM-Exit replay engine.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/replay.h
+*/
+
+// Outcomes of replaying a record.
+#define noir_replay_completed		0
+#define noir_replay_faulted			1		// The handler accessed memory that is not simulated.
+#define noir_replay_aborted			2		// The handler left the hypervisor or reached what is not simulated.
+
+// Each vendor core linked into the engine is described by this structure.
+typedef struct _noir_replay_vendor
+{
+	const char* name;
+	bool (*initialize)(void);
+	void (*finalize)(void);
+	// Load the record into the simulated vCPU.
+	void (*load)(noir_exit_trace_record_p record);
+	// Invoke the VM-Exit handler of the core. This is the only part being timed.
+	void (*invoke)(void);
+	// Hash the simulated vCPU state after the handler returns.
+	u64 (*digest)(u64 hash);
+}noir_replay_vendor,*noir_replay_vendor_p;
+
+extern noir_replay_vendor noir_replay_svm;
+extern noir_replay_vendor noir_replay_vt;
+
+// Record being replayed.
+extern noir_exit_trace_record_p noir_replay_record;
+extern bool noir_replay_verbose;
+extern bool noir_replay_identity_memory;
+extern void* noir_replay_rmt_entry;
+extern u32 noir_replay_numa_node;
+extern u32 noir_replay_allocation_budget;
+
+// Functions from the engine.
+void noir_replay_leave(int outcome,const char* reason);
+size_t noir_replay_read_memory(u64 address,void* buffer,size_t length);
+u32 noir_replay_instruction_length();
+u64 noir_replay_hash(u64 hash,const void* buffer,size_t length);
+void noir_replay_reset_processor();
+u32 noir_replay_query_numa_node(void* virtual_address);
@@ -0,0 +1,145 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file allows the exit handlers to be compiled into user-mode replay engine.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/replay_compat.h
+*/
+
+/*
+  The core is written for MSVC. This header is force-included into every
+  source compiled by GCC or Clang for the replay engine.
+  MSVC keywords are erased, and MSVC intrinsics are declared as functions.
+  The replay engine implements these functions with simulated processor state.
+*/
+
+#include <stddef.h>
+#include <stdarg.h>
+
+#define __int8		char
+#define __int16		short
+#define __int32		int
+#define __int64		long long
+
+#define __cdecl
+#define __stdcall
+#define __fastcall
+#define __declspec(x)
+// Inline functions defined in headers must not be exported from each object.
+#define __inline		static __inline__
+#define __forceinline	static __inline__
+
+#define _In_
+#define _Out_
+#define _Inout_
+
+// Bit-Test Intrinsics
+unsigned char _bittest(const void* base,long offset);
+unsigned char _bittestandset(void* base,long offset);
+unsigned char _bittestandreset(void* base,long offset);
+unsigned char _bittestandcomplement(void* base,long offset);
+unsigned char _bittest64(const void* base,long long offset);
+unsigned char _bittestandset64(void* base,long long offset);
+unsigned char _bittestandreset64(void* base,long long offset);
+unsigned char _bittestandcomplement64(void* base,long long offset);
+unsigned char _interlockedbittestandset(volatile void* base,long offset);
+unsigned char _interlockedbittestandreset(volatile void* base,long offset);
+unsigned char _interlockedbittestandset64(volatile void* base,long long offset);
+unsigned char _interlockedbittestandreset64(volatile void* base,long long offset);
+unsigned char _BitScanForward(void* index,unsigned long mask);
+unsigned char _BitScanReverse(void* index,unsigned long mask);
+unsigned char _BitScanForward64(void* index,unsigned long long mask);
+unsigned char _BitScanReverse64(void* index,unsigned long long mask);
+
+// Atomic Intrinsics
+long _InterlockedIncrement(volatile void* addend);
+long _InterlockedDecrement(volatile void* addend);
+long _InterlockedExchange(volatile void* target,long value);
+long _InterlockedCompareExchange(volatile void* destination,long exchange,long comparand);
+long _InterlockedAnd(volatile void* destination,long value);
+long _InterlockedOr(volatile void* destination,long value);
+long long _InterlockedIncrement64(volatile void* addend);
+long long _InterlockedDecrement64(volatile void* addend);
+long long _InterlockedExchange64(volatile void* target,long long value);
+long long _InterlockedCompareExchange64(volatile void* destination,long long exchange,long long comparand);
+long long _InterlockedAnd64(volatile void* destination,long long value);
+long long _InterlockedOr64(volatile void* destination,long long value);
+
+// String Intrinsics
+void __stosb(void* dest,unsigned char data,size_t count);
+void __stosw(void* dest,unsigned short data,size_t count);
+void __stosd(void* dest,unsigned long data,size_t count);
+void __stosq(void* dest,unsigned long long data,size_t count);
+void __movsb(void* dest,const void* src,size_t count);
+void __movsw(void* dest,const void* src,size_t count);
+void __movsd(void* dest,const void* src,size_t count);
+void __movsq(void* dest,const void* src,size_t count);
+
+// Processor Intrinsics
+void __cpuidex(int* info,int leaf,int subleaf);
+unsigned long long __readmsr(unsigned long index);
+void __writemsr(unsigned long index,unsigned long long value);
+unsigned long long __readcr0(void);
+unsigned long long __readcr2(void);
+unsigned long long __readcr3(void);
+unsigned long long __readcr4(void);
+unsigned long long __readcr8(void);
+void __writecr0(unsigned long long value);
+void __writecr3(unsigned long long value);
+void __writecr4(unsigned long long value);
+void __writecr8(unsigned long long value);
+unsigned long long __readdr(unsigned int index);
+void __writedr(unsigned int index,unsigned long long value);
+unsigned long long _xgetbv(unsigned int index);
+void _xsetbv(unsigned int index,unsigned long long value);
+void __sidt(void* dest);
+void __lidt(void* src);
+unsigned long long __rdtsc(void);
+unsigned long long __rdtscp(void* aux);
+void __invlpg(void* address);
+void __wbinvd(void);
+void __nop(void);
+void __debugbreak(void);
+void __int2c(void);
+void __ud2(void);
+void _disable(void);
+void _enable(void);
+void _mm_pause(void);
+void _mm_lfence(void);
+void _mm_sfence(void);
+void _mm_mfence(void);
+unsigned char __inbyte(unsigned short port);
+unsigned short __inword(unsigned short port);
+unsigned long __indword(unsigned short port);
+void __outbyte(unsigned short port,unsigned char data);
+void __outword(unsigned short port,unsigned short data);
+void __outdword(unsigned short port,unsigned long data);
+unsigned char __readgsbyte(unsigned long offset);
+unsigned short __readgsword(unsigned long offset);
+unsigned long __readgsdword(unsigned long offset);
+unsigned long long __readgsqword(unsigned long offset);
+
+// SVM Intrinsics
+void __svm_vmrun(size_t vmcb);
+void __svm_vmload(size_t vmcb);
+void __svm_vmsave(size_t vmcb);
+void __svm_stgi(void);
+void __svm_clgi(void);
+void __svm_invlpga(void* address,int asid);
+
+// VMX Intrinsics
+unsigned char __vmx_on(unsigned long long* vmxon);
+void __vmx_off(void);
+unsigned char __vmx_vmptrld(unsigned long long* vmcs);
+void __vmx_vmptrst(unsigned long long* vmcs);
+unsigned char __vmx_vmclear(unsigned long long* vmcs);
+unsigned char __vmx_vmread(size_t field,void* value);
+unsigned char __vmx_vmwrite(size_t field,size_t value);
+unsigned char __vmx_vmlaunch(void);
+unsigned char __vmx_vmresume(void);
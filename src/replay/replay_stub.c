@@ -0,0 +1,684 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file simulates the processor and the platform for the replay engine.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/replay_stub.c
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvbdk.h>
+#include <nvstatus.h>
+#include <noirhvm.h>
+#include <nv_intrin.h>
+#include <ci.h>
+#include <acpi.h>
+#include "replay.h"
+
+/*
+  The simulated processor is deterministic so that digests of replays
+  are comparable across the machines running the replay engine:
+  - CPUID reports zero for every leaf.
+  - MSRs, control registers and debug registers read zero until written.
+  - Port I/O reads all ones, as if nothing is decoding the port.
+  Only the Time-Stamp Counter is real. It is not hashed into digests.
+*/
+#define noir_replay_msr_slots		256
+
+typedef struct _noir_replay_processor
+{
+	struct
+	{
+		u32 index;
+		bool valid;
+		u64 value;
+	}msr[noir_replay_msr_slots];
+	u64 cr[16];
+	u64 dr[8];
+	u64 xcr0;
+}noir_replay_processor,*noir_replay_processor_p;
+
+noir_replay_processor noir_replay_cpu={0};
+
+// Global variables of the hypervisor.
+noir_hypervisor hvm_t={0};
+noir_hypervisor_p hvm_p=&hvm_t;
+ulong_ptr orig_system_call=0;
+noir_mshv_cpuid_handler* hvm_cpuid_handlers=null;
+
+void noir_replay_reset_processor()
+{
+	memset(&noir_replay_cpu,0,sizeof(noir_replay_cpu));
+}
+
+// Bit-Test Intrinsics
+unsigned char _bittest(const void* base,long offset)
+{
+	return (((const u8*)base)[offset>>3]>>(offset&7))&1;
+}
+
+unsigned char _bittestandset(void* base,long offset)
+{
+	const unsigned char r=_bittest(base,offset);
+	((u8*)base)[offset>>3]|=(u8)(1<<(offset&7));
+	return r;
+}
+
+unsigned char _bittestandreset(void* base,long offset)
+{
+	const unsigned char r=_bittest(base,offset);
+	((u8*)base)[offset>>3]&=(u8)~(1<<(offset&7));
+	return r;
+}
+
+unsigned char _bittestandcomplement(void* base,long offset)
+{
+	const unsigned char r=_bittest(base,offset);
+	((u8*)base)[offset>>3]^=(u8)(1<<(offset&7));
+	return r;
+}
+
+unsigned char _bittest64(const void* base,long long offset)
+{
+	return _bittest(base,(long)offset);
+}
+
+unsigned char _bittestandset64(void* base,long long offset)
+{
+	return _bittestandset(base,(long)offset);
+}
+
+unsigned char _bittestandreset64(void* base,long long offset)
+{
+	return _bittestandreset(base,(long)offset);
+}
+
+unsigned char _bittestandcomplement64(void* base,long long offset)
+{
+	return _bittestandcomplement(base,(long)offset);
+}
+
+unsigned char _interlockedbittestandset(volatile void* base,long offset)
+{
+	const u8 mask=(u8)(1<<(offset&7));
+	return (__atomic_fetch_or(&((volatile u8*)base)[offset>>3],mask,__ATOMIC_SEQ_CST)&mask)!=0;
+}
+
+unsigned char _interlockedbittestandreset(volatile void* base,long offset)
+{
+	const u8 mask=(u8)(1<<(offset&7));
+	return (__atomic_fetch_and(&((volatile u8*)base)[offset>>3],(u8)~mask,__ATOMIC_SEQ_CST)&mask)!=0;
+}
+
+unsigned char _interlockedbittestandset64(volatile void* base,long long offset)
+{
+	return _interlockedbittestandset(base,(long)offset);
+}
+
+unsigned char _interlockedbittestandreset64(volatile void* base,long long offset)
+{
+	return _interlockedbittestandreset(base,(long)offset);
+}
+
+// The index operand is 32-bit as is in MSVC.
+unsigned char _BitScanForward(void* index,unsigned long mask)
+{
+	if((u32)mask==0)return 0;
+	*(u32*)index=(u32)__builtin_ctz((u32)mask);
+	return 1;
+}
+
+unsigned char _BitScanReverse(void* index,unsigned long mask)
+{
+	if((u32)mask==0)return 0;
+	*(u32*)index=31-(u32)__builtin_clz((u32)mask);
+	return 1;
+}
+
+unsigned char _BitScanForward64(void* index,unsigned long long mask)
+{
+	if(mask==0)return 0;
+	*(u32*)index=(u32)__builtin_ctzll(mask);
+	return 1;
+}
+
+unsigned char _BitScanReverse64(void* index,unsigned long long mask)
+{
+	if(mask==0)return 0;
+	*(u32*)index=63-(u32)__builtin_clzll(mask);
+	return 1;
+}
+
+// Atomic Intrinsics. The long type is 32-bit as is in MSVC.
+long _InterlockedIncrement(volatile void* addend)
+{
+	return __atomic_add_fetch((volatile i32*)addend,1,__ATOMIC_SEQ_CST);
+}
+
+long _InterlockedDecrement(volatile void* addend)
+{
+	return __atomic_sub_fetch((volatile i32*)addend,1,__ATOMIC_SEQ_CST);
+}
+
+long _InterlockedExchange(volatile void* target,long value)
+{
+	return __atomic_exchange_n((volatile i32*)target,(i32)value,__ATOMIC_SEQ_CST);
+}
+
+long _InterlockedCompareExchange(volatile void* destination,long exchange,long comparand)
+{
+	i32 expected=(i32)comparand;
+	__atomic_compare_exchange_n((volatile i32*)destination,&expected,(i32)exchange,false,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST);
+	return expected;
+}
+
+long _InterlockedAnd(volatile void* destination,long value)
+{
+	return __atomic_fetch_and((volatile i32*)destination,(i32)value,__ATOMIC_SEQ_CST);
+}
+
+long _InterlockedOr(volatile void* destination,long value)
+{
+	return __atomic_fetch_or((volatile i32*)destination,(i32)value,__ATOMIC_SEQ_CST);
+}
+
+long long _InterlockedIncrement64(volatile void* addend)
+{
+	return __atomic_add_fetch((volatile i64*)addend,1,__ATOMIC_SEQ_CST);
+}
+
+long long _InterlockedDecrement64(volatile void* addend)
+{
+	return __atomic_sub_fetch((volatile i64*)addend,1,__ATOMIC_SEQ_CST);
+}
+
+long long _InterlockedExchange64(volatile void* target,long long value)
+{
+	return __atomic_exchange_n((volatile i64*)target,value,__ATOMIC_SEQ_CST);
+}
+
+long long _InterlockedCompareExchange64(volatile void* destination,long long exchange,long long comparand)
+{
+	i64 expected=comparand;
+	__atomic_compare_exchange_n((volatile i64*)destination,&expected,exchange,false,__ATOMIC_SEQ_CST,__ATOMIC_SEQ_CST);
+	return expected;
+}
+
+long long _InterlockedAnd64(volatile void* destination,long long value)
+{
+	return __atomic_fetch_and((volatile i64*)destination,value,__ATOMIC_SEQ_CST);
+}
+
+long long _InterlockedOr64(volatile void* destination,long long value)
+{
+	return __atomic_fetch_or((volatile i64*)destination,value,__ATOMIC_SEQ_CST);
+}
+
+// String Intrinsics
+void __stosb(void* dest,unsigned char data,size_t count)
+{
+	memset(dest,data,count);
+}
+
+void __stosw(void* dest,unsigned short data,size_t count)
+{
+	for(size_t i=0;i<count;i++)((u16*)dest)[i]=data;
+}
+
+void __stosd(void* dest,unsigned long data,size_t count)
+{
+	for(size_t i=0;i<count;i++)((u32*)dest)[i]=(u32)data;
+}
+
+void __stosq(void* dest,unsigned long long data,size_t count)
+{
+	for(size_t i=0;i<count;i++)((u64*)dest)[i]=data;
+}
+
+void __movsb(void* dest,const void* src,size_t count)
+{
+	memmove(dest,src,count);
+}
+
+void __movsw(void* dest,const void* src,size_t count)
+{
+	memmove(dest,src,count*sizeof(u16));
+}
+
+void __movsd(void* dest,const void* src,size_t count)
+{
+	memmove(dest,src,count*sizeof(u32));
+}
+
+void __movsq(void* dest,const void* src,size_t count)
+{
+	memmove(dest,src,count*sizeof(u64));
+}
+
+// Processor Intrinsics
+void __cpuidex(int* info,int leaf,int subleaf)
+{
+	memset(info,0,sizeof(int)*4);
+}
+
+unsigned long long __readmsr(unsigned long index)
+{
+	for(u32 i=0;i<noir_replay_msr_slots;i++)
+	{
+		if(!noir_replay_cpu.msr[i].valid)break;
+		if(noir_replay_cpu.msr[i].index==(u32)index)return noir_replay_cpu.msr[i].value;
+	}
+	return 0;
+}
+
+void __writemsr(unsigned long index,unsigned long long value)
+{
+	for(u32 i=0;i<noir_replay_msr_slots;i++)
+	{
+		if(!noir_replay_cpu.msr[i].valid)
+		{
+			noir_replay_cpu.msr[i].index=(u32)index;
+			noir_replay_cpu.msr[i].valid=true;
+		}
+		if(noir_replay_cpu.msr[i].index==(u32)index)
+		{
+			noir_replay_cpu.msr[i].value=value;
+			return;
+		}
+	}
+	noir_replay_leave(noir_replay_aborted,"The simulated MSR file is exhausted.");
+}
+
+unsigned long long __readcr0(void){return noir_replay_cpu.cr[0];}
+unsigned long long __readcr2(void){return noir_replay_cpu.cr[2];}
+unsigned long long __readcr3(void){return noir_replay_cpu.cr[3];}
+unsigned long long __readcr4(void){return noir_replay_cpu.cr[4];}
+unsigned long long __readcr8(void){return noir_replay_cpu.cr[8];}
+void __writecr0(unsigned long long value){noir_replay_cpu.cr[0]=value;}
+void __writecr3(unsigned long long value){noir_replay_cpu.cr[3]=value;}
+void __writecr4(unsigned long long value){noir_replay_cpu.cr[4]=value;}
+void __writecr8(unsigned long long value){noir_replay_cpu.cr[8]=value;}
+void noir_writecr2(ulong_ptr value){noir_replay_cpu.cr[2]=value;}
+
+unsigned long long __readdr(unsigned int index)
+{
+	return noir_replay_cpu.dr[index&7];
+}
+
+void __writedr(unsigned int index,unsigned long long value)
+{
+	noir_replay_cpu.dr[index&7]=value;
+}
+
+unsigned long long _xgetbv(unsigned int index)
+{
+	return index==0?noir_replay_cpu.xcr0:0;
+}
+
+void _xsetbv(unsigned int index,unsigned long long value)
+{
+	if(index==0)noir_replay_cpu.xcr0=value;
+}
+
+// The extended states of the simulated processor are not saved.
+void noir_xsave(void* state,u64 bv_mask){}
+void noir_xrestore(void* state,u64 bv_mask){}
+
+void __sidt(void* dest)
+{
+	memset(dest,0,10);
+}
+
+void __lidt(void* src){}
+void noir_lgdt(descriptor_register_p src){}
+
+unsigned long long __rdtsc(void)
+{
+	return __builtin_ia32_rdtsc();
+}
+
+unsigned long long __rdtscp(void* aux)
+{
+	*(u32*)aux=0;
+	return __builtin_ia32_rdtsc();
+}
+
+void __invlpg(void* address){}
+void __wbinvd(void){}
+void __nop(void){}
+void _disable(void){}
+void _enable(void){}
+
+void __debugbreak(void)
+{
+	if(noir_replay_verbose)fprintf(stderr,"Breakpoint is hit during replay!\n");
+}
+
+void __int2c(void)
+{
+	noir_replay_leave(noir_replay_aborted,"Assertion failure is raised.");
+}
+
+void __ud2(void)
+{
+	noir_replay_leave(noir_replay_aborted,"Undefined opcode is executed.");
+}
+
+void _mm_pause(void){__builtin_ia32_pause();}
+void _mm_lfence(void){__builtin_ia32_lfence();}
+void _mm_sfence(void){__builtin_ia32_sfence();}
+void _mm_mfence(void){__builtin_ia32_mfence();}
+
+unsigned char __inbyte(unsigned short port){return 0xFF;}
+unsigned short __inword(unsigned short port){return 0xFFFF;}
+unsigned long __indword(unsigned short port){return 0xFFFFFFFF;}
+void __outbyte(unsigned short port,unsigned char data){}
+void __outword(unsigned short port,unsigned short data){}
+void __outdword(unsigned short port,unsigned long data){}
+
+// The GS segment of the simulated processor is not set up. Reading it is treated as a fault.
+unsigned long long __readgsqword(unsigned long offset)
+{
+	noir_replay_leave(noir_replay_faulted,"GS segment is not simulated.");
+	return 0;
+}
+
+// Platform Functions
+/*
+  The NUMA topology is mocked. Tests select the node of the current processor,
+  and allocations remember the node they are requested from.
+  Contiguous memory is page-aligned. Its virtual address is its physical address.
+  Tests may limit the number of allocations that succeed, so as to inject allocation failures.
+*/
+#define noir_replay_allocation_slots	256
+
+typedef struct _noir_replay_allocation
+{
+	void* address;
+	u32 numa_node;
+}noir_replay_allocation,*noir_replay_allocation_p;
+
+noir_replay_allocation static noir_replay_allocations[noir_replay_allocation_slots];
+u32 noir_replay_numa_node=0;
+u32 noir_replay_allocation_budget=maxu32;
+
+bool static noir_replay_consume_allocation()
+{
+	if(noir_replay_allocation_budget==0)return false;
+	if(noir_replay_allocation_budget!=maxu32)noir_replay_allocation_budget--;
+	return true;
+}
+
+void* noir_alloc_contd_memory_for_numa(u32 numa_node,size_t length)
+{
+	const size_t aligned_length=page_4kb_mult(page_4kb_count(length+page_4kb_size-1));
+	void* p=noir_replay_consume_allocation()?aligned_alloc(page_4kb_size,aligned_length):null;
+	if(p)
+	{
+		memset(p,0,aligned_length);
+		for(u32 i=0;i<noir_replay_allocation_slots;i++)
+		{
+			if(noir_replay_allocations[i].address==null)
+			{
+				noir_replay_allocations[i].address=p;
+				noir_replay_allocations[i].numa_node=numa_node;
+				break;
+			}
+		}
+	}
+	return p;
+}
+
+void* noir_alloc_contd_memory(size_t length)
+{
+	return noir_alloc_contd_memory_for_numa(noir_numa_node_any,length);
+}
+
+void noir_free_contd_memory(void* virtual_address,size_t length)
+{
+	for(u32 i=0;i<noir_replay_allocation_slots;i++)
+		if(noir_replay_allocations[i].address==virtual_address)
+			noir_replay_allocations[i].address=null;
+	free(virtual_address);
+}
+
+// Returns the node that the contiguous memory is allocated from.
+u32 noir_replay_query_numa_node(void* virtual_address)
+{
+	for(u32 i=0;i<noir_replay_allocation_slots;i++)
+		if(noir_replay_allocations[i].address==virtual_address)
+			return noir_replay_allocations[i].numa_node;
+	return noir_numa_node_any;
+}
+
+void* noir_alloc_2mb_page()
+{
+	void* p=noir_replay_consume_allocation()?aligned_alloc(page_2mb_size,page_2mb_size):null;
+	if(p)memset(p,0,page_2mb_size);
+	return p;
+}
+
+void noir_free_2mb_page(void* virtual_address)
+{
+	free(virtual_address);
+}
+
+void* noir_alloc_nonpg_memory(size_t length)
+{
+	return noir_replay_consume_allocation()?calloc(1,length):null;
+}
+
+void noir_free_nonpg_memory(void* virtual_address)
+{
+	free(virtual_address);
+}
+
+u64 noir_get_physical_address(void* virtual_address)
+{
+	return (u64)virtual_address;
+}
+
+u32 noir_get_current_numa_node()
+{
+	return noir_replay_numa_node;
+}
+
+// Tests may allocate the structures referenced by physical addresses and use their virtual addresses as physical addresses.
+bool noir_replay_identity_memory=false;
+
+void* noir_find_virt_by_phys(u64 physical_address)
+{
+	// Physical memory is not simulated. Handlers dereferencing the result would fault.
+	return noir_replay_identity_memory?(void*)physical_address:null;
+}
+
+// Device registers are not mapped unless tests use identity memory.
+void* noir_map_uncached_memory(u64 physical_address,size_t length)
+{
+	return noir_replay_identity_memory?(void*)physical_address:null;
+}
+
+void noir_unmap_physical_memory(void* virtual_address,size_t length){}
+
+// The simulated platform has no memory ranges and no ACPI tables. Tests build the structures by themselves.
+void noir_enum_physical_memory_ranges(noir_physical_range_callback callback_routine,void* context){}
+
+noir_status nvc_acpi_search_table(u32 signature,acpi_common_description_header_p prev,acpi_common_description_header_p *table)
+{
+	return noir_acpi_no_such_table;
+}
+
+noir_status nvc_register_mmio_region(noir_mmio_region_p mr)
+{
+	return noir_not_implemented;
+}
+
+void noir_qsort(void* base,u32 num,u32 width,noir_sorting_comparator comparator)
+{
+	qsort(base,num,width,comparator);
+}
+
+void noir_copy_memory(void* dest,void* src,u32 cch)
+{
+	memcpy(dest,src,cch);
+}
+
+// Code integrity uses the slicing-by-8 kernel only. The engine does not link the assembly kernels,
+// and the simulated processor supports no SLAT. Tests enable Hardware-Enforced CI by themselves.
+bool fastcall noir_check_sse42()
+{
+	return false;
+}
+
+bool fastcall noir_check_pclmulqdq()
+{
+	return false;
+}
+
+u32 stdcall noir_crc32_page_sse(void* page)
+{
+	return 0;
+}
+
+u32 stdcall noir_crc32_page_sse_x3(void* page)
+{
+	return 0;
+}
+
+u8 nvc_confirm_cpu_manufacturer(char* vendor_string)
+{
+	return unknown_processor;
+}
+
+bool nvc_is_vt_supported()
+{
+	return false;
+}
+
+u64 noir_get_system_time()
+{
+	// Convert TSC into 100ns units as if the TSC ticks at 1GHz.
+	return __builtin_ia32_rdtsc()/100;
+}
+
+
+// Instruction decoder requires Zydis, which is not built by the replay engine.
+// Instruction lengths are taken from the records instead.
+u32 noir_get_instruction_length(void* code,bool long_mode)
+{
+	return noir_replay_instruction_length();
+}
+
+u32 noir_get_instruction_length_ex(void* code,u8 bits)
+{
+	return noir_replay_instruction_length();
+}
+
+noir_status nvc_emu_decode_memory_access(noir_cvm_virtual_cpu_p vcpu)
+{
+	return noir_not_implemented;
+}
+
+u8 nvc_emu_try_vmexit_write_memory(noir_gpr_state_p gpr_state,noir_seg_state_p seg_state,u8p instruction,void* operand,size_t *size)
+{
+	return 0;
+}
+
+// Memory accesses are served from the memory recorded in the trace.
+size_t nvc_copy_host_virtual_memory64(u64 pt,u64 va,void* buffer,size_t length,bool write,bool la57,u32p error_code)
+{
+	return write?length:noir_replay_read_memory(va,buffer,length);
+}
+
+size_t nvc_copy_guest_virtual_memory(noir_cvm_virtual_cpu_p vcpu,u64 gva,void* buffer,size_t length,bool write,u32p error_code)
+{
+	return write?length:noir_replay_read_memory(gva,buffer,length);
+}
+
+void nvc_call_rw_mmio_region(bool direction,u64 address,u64 size,u64p value)
+{
+	if(!direction)*value=0xFFFFFFFFFFFFFFFF;
+}
+
+// Tests may classify every page with the same reverse-mapping entry. Null means no page is reverse-mapped.
+void* noir_replay_rmt_entry=null;
+
+noir_rmt_entry_p nvc_get_rmt_entry(u64 hpa)
+{
+	return (noir_rmt_entry_p)noir_replay_rmt_entry;
+}
+
+void nvc_record_exit_statistics(noir_exit_statistics_p stats,bool sampled,u64 ticks)
+{
+	stats->count++;
+	if(sampled)
+	{
+		stats->sampled_count++;
+		stats->sampled_time+=ticks;
+		if(ticks>stats->max_time)stats->max_time=ticks;
+	}
+}
+
+// CVM exits are not replayed. The profiler is never entered.
+void nvc_cvm_profiler_enter(noir_cvm_virtual_cpu_p vcpu,u64 exit_time){}
+void nvc_cvm_profiler_leave(noir_cvm_virtual_cpu_p vcpu,u64 exit_time){}
+void nvc_cvm_profiler_classify(noir_cvm_virtual_cpu_p vcpu,bool world_switched){}
+
+u64 fastcall nvc_mshv_rdmsr_handler(noir_mshv_vcpu_p vcpu,u32 index)
+{
+	return 0;
+}
+
+void fastcall nvc_mshv_wrmsr_handler(noir_mshv_vcpu_p vcpu,u32 index,u64 val){}
+
+// Debug prints are silent unless the replay is verbose.
+int rpl_vsnprintf(char *str,size_t size,const char *format,va_list args)
+{
+	return vsnprintf(str,size,format,args);
+}
+
+void cdecl nv_dprintf(const char* format,...)
+{
+	if(noir_replay_verbose)
+	{
+		va_list arg_list;
+		va_start(arg_list,format);
+		fputs("[NoirVisor] ",stderr);
+		vfprintf(stderr,format,arg_list);
+		va_end(arg_list);
+	}
+}
+
+void cdecl nvd_printf_fn(const char* src_file,const u32 src_ln,const char* format,...)
+{
+	if(noir_replay_verbose)
+	{
+		va_list arg_list;
+		va_start(arg_list,format);
+		fprintf(stderr,"[NoirVisor - %s:%u] ",src_file,src_ln);
+		vfprintf(stderr,format,arg_list);
+		va_end(arg_list);
+	}
+}
+
+void cdecl nv_panicf(const char* format,...)
+{
+	if(noir_replay_verbose)
+	{
+		va_list arg_list;
+		va_start(arg_list,format);
+		fputs("[NoirVisor - Panic] ",stderr);
+		vfprintf(stderr,format,arg_list);
+		va_end(arg_list);
+	}
+}
@@ -0,0 +1,197 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file replays AMD-V VM-Exits with the SVM core.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/replay_svm.c
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvbdk.h>
+#include <nvstatus.h>
+#include <noirhvm.h>
+#include <svm_intrin.h>
+#include <nv_intrin.h>
+#include <amd64.h>
+#include "../svm_core/svm_vmcb.h"
+#include "../svm_core/svm_npt.h"
+#include "../svm_core/svm_def.h"
+#include "replay.h"
+
+void fastcall nvc_svm_exit_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu);
+
+// Hidden processor states loaded by vmload and vmsave instructions are not simulated.
+void __svm_vmload(size_t vmcb){}
+void __svm_vmsave(size_t vmcb){}
+void __svm_stgi(void){}
+void __svm_clgi(void){}
+void __svm_invlpga(void* address,int asid){}
+
+void __svm_vmrun(size_t vmcb)
+{
+	noir_replay_leave(noir_replay_aborted,"Nested guest is not simulated.");
+}
+
+noir_svm_vcpu_p noir_replay_svm_vcpu=null;
+noir_gpr_state noir_replay_svm_gpr={0};
+
+bool noir_replay_svm_initialize()
+{
+	noir_svm_initial_stack_p loader_stack;
+	hvm_p->relative_hvm=calloc(1,sizeof(noir_svm_hvm));
+	noir_replay_svm_vcpu=aligned_alloc(page_size,sizeof(noir_svm_vcpu));
+	if(hvm_p->relative_hvm==null || noir_replay_svm_vcpu==null)return false;
+	memset(noir_replay_svm_vcpu,0,sizeof(noir_svm_vcpu));
+	noir_replay_svm_vcpu->vmcb.virt=aligned_alloc(page_size,page_size);
+	noir_replay_svm_vcpu->hv_stack=aligned_alloc(page_size,nvc_stack_size);
+	if(noir_replay_svm_vcpu->vmcb.virt==null || noir_replay_svm_vcpu->hv_stack==null)return false;
+	// Physical memory is not simulated. Use the virtual address as the physical address.
+	noir_replay_svm_vcpu->vmcb.phys=(u64)noir_replay_svm_vcpu->vmcb.virt;
+	noir_replay_svm_vcpu->self=noir_replay_svm_vcpu;
+	noir_replay_svm_vcpu->relative_hvm=hvm_p->relative_hvm;
+	hvm_p->virtual_cpu=noir_replay_svm_vcpu;
+	hvm_p->cpu_count=1;
+	memset(noir_replay_svm_vcpu->hv_stack,0,nvc_stack_size);
+	loader_stack=noir_svm_get_loader_stack(noir_replay_svm_vcpu->hv_stack);
+	loader_stack->vcpu=noir_replay_svm_vcpu;
+	loader_stack->custom_vcpu=&nvc_svm_idle_cvcpu;
+	loader_stack->proc_id=0;
+	nvc_svm_set_mshv_handler(false);
+	return true;
+}
+
+void noir_replay_svm_finalize()
+{
+	if(noir_replay_svm_vcpu)
+	{
+		free(noir_replay_svm_vcpu->vmcb.virt);
+		free(noir_replay_svm_vcpu->hv_stack);
+		free(noir_replay_svm_vcpu);
+		noir_replay_svm_vcpu=null;
+	}
+	free(hvm_p->relative_hvm);
+	hvm_p->relative_hvm=null;
+	hvm_p->virtual_cpu=null;
+}
+
+void noir_replay_svm_load(noir_exit_trace_record_p record)
+{
+	void* vmcb=noir_replay_svm_vcpu->vmcb.virt;
+	noir_svm_initial_stack_p loader_stack=noir_svm_get_loader_stack(noir_replay_svm_vcpu->hv_stack);
+	u64 efer=0,cr0=0,cr4=0;
+	// The subverted host is always in 64-bit mode.
+	noir_bts64(&efer,amd64_efer_sce);
+	noir_bts64(&efer,amd64_efer_lme);
+	noir_bts64(&efer,amd64_efer_lma);
+	noir_bts64(&efer,amd64_efer_nxe);
+	noir_bts64(&efer,amd64_efer_svme);
+	noir_bts64(&cr0,amd64_cr0_pe);
+	noir_bts64(&cr0,amd64_cr0_pg);
+	noir_bts64(&cr4,amd64_cr4_pae);
+	noir_stosb(vmcb,0,page_size);
+	noir_svm_vmwrite64(vmcb,exit_code,(u64)(i64)(i32)record->exit_code);
+	noir_svm_vmwrite64(vmcb,exit_info1,record->info[0]);
+	noir_svm_vmwrite64(vmcb,exit_info2,record->info[1]);
+	noir_svm_vmwrite64(vmcb,next_rip,record->info[2]);
+	noir_svm_vmwrite64(vmcb,exit_interrupt_info,record->info[3]);
+	noir_svm_vmwrite64(vmcb,guest_rip,record->rip);
+	noir_svm_vmwrite64(vmcb,guest_rflags,record->rflags);
+	noir_svm_vmwrite64(vmcb,guest_rsp,record->gpr[4]);
+	noir_svm_vmwrite64(vmcb,guest_rax,record->gpr[0]);
+	noir_svm_vmwrite64(vmcb,guest_efer,efer);
+	noir_svm_vmwrite64(vmcb,guest_cr0,cr0);
+	noir_svm_vmwrite64(vmcb,guest_cr4,cr4);
+	noir_svm_vmwrite16(vmcb,guest_cs_attrib,0x29B);		// 64-bit code segment with DPL=0.
+	// Instruction bytes are placed as if Decode Assists fetched them.
+	if((record->flags & noir_exit_trace_memory_valid) && record->memory_address==record->rip)
+	{
+		const u8 fetched=record->memory_size<15?record->memory_size:15;
+		noir_svm_vmwrite8(vmcb,number_of_bytes_fetched,fetched);
+		noir_movsb((void*)((ulong_ptr)vmcb+guest_instruction_bytes),record->memory,fetched);
+	}
+	// The world is not switched prior to the VM-Exit.
+	loader_stack->guest_vmcb_pa=noir_replay_svm_vcpu->vmcb.phys;
+	loader_stack->custom_vcpu=&nvc_svm_idle_cvcpu;
+	noir_movsb(&noir_replay_svm_gpr,record->gpr,sizeof(noir_gpr_state));
+	// The exit handler identifies the exiting vCPU by the VMCB address in rax.
+	noir_replay_svm_gpr.rax=noir_replay_svm_vcpu->vmcb.phys;
+}
+
+void noir_replay_svm_invoke()
+{
+	nvc_svm_exit_handler(&noir_replay_svm_gpr,noir_replay_svm_vcpu);
+}
+
+u64 noir_replay_svm_digest(u64 hash)
+{
+	void* vmcb=noir_replay_svm_vcpu->vmcb.virt;
+	u64 state[5];
+	state[0]=noir_svm_vmread64(vmcb,guest_rax);
+	state[1]=noir_svm_vmread64(vmcb,guest_rip);
+	state[2]=noir_svm_vmread64(vmcb,guest_rflags);
+	state[3]=noir_svm_vmread64(vmcb,guest_rsp);
+	state[4]=noir_svm_vmread64(vmcb,event_injection);
+	hash=noir_replay_hash(hash,state,sizeof(state));
+	// The rax field of GPR state is the VMCB address, which is irrelevant to the guest.
+	return noir_replay_hash(hash,&noir_replay_svm_gpr.rcx,sizeof(noir_gpr_state)-sizeof(u64));
+}
+
+noir_replay_vendor noir_replay_svm=
+{
+	"AMD-V",
+	noir_replay_svm_initialize,
+	noir_replay_svm_finalize,
+	noir_replay_svm_load,
+	noir_replay_svm_invoke,
+	noir_replay_svm_digest
+};
+
+// Leaving the hypervisor cannot be simulated.
+void nvc_svm_return(noir_gpr_state_p stack)
+{
+	noir_replay_leave(noir_replay_aborted,"The hypervisor is leaving.");
+}
+
+void nvc_svm_host_ready_nmi(void){}
+
+void nvc_npt_reassign_page_ownership_hvrt(noir_svm_vcpu_p vcpu,noir_rmt_remap_context_p context)
+{
+	noir_replay_leave(noir_replay_aborted,"Nested paging is not simulated.");
+}
+
+// CVM exits are not replayed. Functions for NSV guests are never reached.
+void nvc_svm_nsv_load_nae_synthetic_msr_state(noir_svm_custom_vcpu_p cvcpu){}
+
+bool nvc_svm_nsv_load_guest_vcpu(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu)
+{
+	return false;
+}
+
+bool nvc_svm_nsv_save_guest_vcpu(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu)
+{
+	return false;
+}
+
+bool nvc_svm_rdmsr_nsvexit_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu)
+{
+	return false;
+}
+
+bool nvc_svm_wrmsr_nsvexit_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu)
+{
+	return false;
+}
+
+u8 nvc_emu_decode_npiep_instruction(noir_cvm_virtual_cpu_p vcpu,u8p buffer,size_t buffer_limit,noir_npiep_operand_p operand)
+{
+	return 0;
+}
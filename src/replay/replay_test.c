@@ -0,0 +1,65 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file registers the tests and benchmarks of the user-mode replay engine.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/replay_test.c
+*/
+
+#include <stdio.h>
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvtrace.h>
+#include "replay.h"
+#include "replay_test.h"
+
+noir_replay_test noir_replay_tests[]=
+{
+	{"vt_shadow_vmcs",&noir_replay_vt,noir_replay_test_vt_shadow_vmcs},
+	{"ci_restoration",null,noir_replay_test_ci_restoration},
+	{"cvm_timer_rearm",null,noir_replay_test_cvm_timer_rearm},
+	{"cvm_halt_window",null,noir_replay_test_cvm_halt_window},
+	{"cvm_halt_trace",null,noir_replay_test_cvm_halt_trace},
+	{"cvm_queue_order",null,noir_replay_test_cvm_queue_order},
+	{"cvm_queue_validation",null,noir_replay_test_cvm_queue_validation},
+	{"cvm_queue_io",null,noir_replay_test_cvm_queue_io},
+	{"svm_nested_fast_path",&noir_replay_svm,noir_replay_test_svm_nested_fast_path},
+	{"vt_apicv_pir_merge",null,noir_replay_test_vt_apicv_pir_merge},
+	{"vt_apicv_notification",null,noir_replay_test_vt_apicv_notification},
+	{"vt_apicv_priority",null,noir_replay_test_vt_apicv_priority},
+	{"vt_exit_statistics",&noir_replay_vt,noir_replay_test_vt_exit_statistics},
+	{"numa_policy",null,noir_replay_test_numa_policy},
+	{"numa_ept_placement",&noir_replay_vt,noir_replay_test_numa_ept_placement},
+	{"vt_ept_split_failure",null,noir_replay_test_vt_ept_split_failure},
+	{"vt_iommu_register_polls",null,noir_replay_test_vt_iommu_register_polls},
+	{"vt_iommu_queue_polls",null,noir_replay_test_vt_iommu_queue_polls},
+	{"vt_iommu_identity_map",&noir_replay_vt,noir_replay_test_vt_iommu_identity_map},
+	{"svm_vmcb_cache",null,noir_replay_test_svm_vmcb_cache},
+	{"svm_state_synchronization",null,noir_replay_test_svm_state_synchronization},
+	{"svm_clean_bits",&noir_replay_svm,noir_replay_test_svm_clean_bits},
+	{"svm_avic_logical_id",null,noir_replay_test_svm_avic_logical_id},
+	{"svm_avic_ipi_routing",null,noir_replay_test_svm_avic_ipi_routing},
+	{"svm_avic_running_filter",null,noir_replay_test_svm_avic_running_filter}
+};
+
+const u32 noir_replay_test_count=sizeof(noir_replay_tests)/sizeof(noir_replay_test);
+
+noir_replay_benchmark noir_replay_benchmarks[]=
+{
+	{"vt_exit_profiler",&noir_replay_vt,noir_replay_benchmark_vt_exit_profiler},
+	{"svm_vmcb_cache",null,noir_replay_benchmark_svm_vmcb_cache},
+	{"cvm_vpcb_queue",null,noir_replay_benchmark_cvm_vpcb_queue}
+};
+
+const u32 noir_replay_benchmark_count=sizeof(noir_replay_benchmarks)/sizeof(noir_replay_benchmark);
+
+void noir_replay_test_failure(const char* file,u32 line,const char* expression)
+{
+	fprintf(stderr,"%s:%u: Assertion failed: %s\n",file,line,expression);
+}
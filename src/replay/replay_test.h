@@ -0,0 +1,78 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file is the header of the tests of the user-mode replay engine.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/replay_test.h
+*/
+
+// Each test drives the handlers of the core with synthesized state.
+typedef struct _noir_replay_test
+{
+	const char* name;
+	// The simulated vCPU of the vendor is built before the test runs. This can be null.
+	noir_replay_vendor_p vendor;
+	// Returns true if the test passes.
+	bool (*routine)(void);
+}noir_replay_test,*noir_replay_test_p;
+
+extern noir_replay_test noir_replay_tests[];
+extern const u32 noir_replay_test_count;
+
+// Each benchmark times a path of the core and prints the results.
+typedef struct _noir_replay_benchmark
+{
+	const char* name;
+	noir_replay_vendor_p vendor;
+	// The number of rounds is a multiple of noir_replay_benchmark_rounds.
+	void (*routine)(u32 rounds);
+}noir_replay_benchmark,*noir_replay_benchmark_p;
+
+#define noir_replay_benchmark_rounds	0x10000
+
+extern noir_replay_benchmark noir_replay_benchmarks[];
+extern const u32 noir_replay_benchmark_count;
+
+void noir_replay_test_failure(const char* file,u32 line,const char* expression);
+
+// Fail the test if the condition does not hold.
+#define noir_replay_assert(condition)	\
+	do{if(!(condition)){noir_replay_test_failure(__FILE__,__LINE__,#condition);return false;}}while(0)
+
+// Test Routines
+bool noir_replay_test_vt_shadow_vmcs(void);
+bool noir_replay_test_ci_restoration(void);
+bool noir_replay_test_cvm_timer_rearm(void);
+bool noir_replay_test_cvm_halt_window(void);
+bool noir_replay_test_cvm_halt_trace(void);
+bool noir_replay_test_cvm_queue_order(void);
+bool noir_replay_test_cvm_queue_validation(void);
+bool noir_replay_test_cvm_queue_io(void);
+bool noir_replay_test_svm_nested_fast_path(void);
+bool noir_replay_test_vt_apicv_pir_merge(void);
+bool noir_replay_test_vt_apicv_notification(void);
+bool noir_replay_test_vt_apicv_priority(void);
+bool noir_replay_test_vt_exit_statistics(void);
+bool noir_replay_test_numa_policy(void);
+bool noir_replay_test_numa_ept_placement(void);
+bool noir_replay_test_vt_ept_split_failure(void);
+bool noir_replay_test_vt_iommu_register_polls(void);
+bool noir_replay_test_vt_iommu_queue_polls(void);
+bool noir_replay_test_vt_iommu_identity_map(void);
+bool noir_replay_test_svm_vmcb_cache(void);
+bool noir_replay_test_svm_state_synchronization(void);
+bool noir_replay_test_svm_clean_bits(void);
+bool noir_replay_test_svm_avic_logical_id(void);
+bool noir_replay_test_svm_avic_ipi_routing(void);
+bool noir_replay_test_svm_avic_running_filter(void);
+
+// Benchmark Routines
+void noir_replay_benchmark_vt_exit_profiler(u32 rounds);
+void noir_replay_benchmark_svm_vmcb_cache(u32 rounds);
+void noir_replay_benchmark_cvm_vpcb_queue(u32 rounds);
@@ -0,0 +1,268 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file replays Intel VT-x VM-Exits with the VT core.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/replay_vt.c
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvstatus.h>
+#include <nvbdk.h>
+#include <vt_intrin.h>
+#include <noirhvm.h>
+#include <nv_intrin.h>
+#include <ia32.h>
+#include "../vt_core/vt_def.h"
+#include "../vt_core/vt_vmcs.h"
+#include "../vt_core/vt_ept.h"
+#include "replay.h"
+
+/*
+  The VMCS is simulated by an array indexed by the field encoding.
+  Bits 13-14 of the encoding specify the width of the field. Bit 0 of
+  a 64-bit field selects the high 32 bits of the field.
+  The address of the array is the physical address of the VMCS, so
+  vmread and vmwrite operate on whichever array is current.
+*/
+#define noir_replay_vmcs_limit		0x8000
+
+#define noir_replay_vmcs_width_16		0
+#define noir_replay_vmcs_width_64		1
+#define noir_replay_vmcs_width_32		2
+#define noir_replay_vmcs_width_natural	3
+
+void fastcall nvc_vt_exit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu);
+
+noir_vt_vcpu_p noir_replay_vt_vcpu=null;
+noir_gpr_state noir_replay_vt_gpr={0};
+u64p noir_replay_vmcs=null;
+u64 noir_replay_current_vmcs=0xFFFFFFFFFFFFFFFF;
+
+u8 __vmx_vmread(size_t field,void* value)
+{
+	u64p vmcs=(u64p)noir_replay_current_vmcs;
+	if(noir_replay_current_vmcs==0xFFFFFFFFFFFFFFFF)return vmx_fail_invalid;
+	if(field>=noir_replay_vmcs_limit)return vmx_fail_valid;
+	switch((field>>13)&3)
+	{
+		case noir_replay_vmcs_width_16:
+		{
+			*(u16*)value=(u16)vmcs[field];
+			break;
+		}
+		case noir_replay_vmcs_width_64:
+		{
+			if(field&1)
+				*(u32*)value=(u32)(vmcs[field&~1]>>32);
+			else
+				*(u64*)value=vmcs[field];
+			break;
+		}
+		case noir_replay_vmcs_width_32:
+		{
+			*(u32*)value=(u32)vmcs[field];
+			break;
+		}
+		case noir_replay_vmcs_width_natural:
+		{
+			*(u64*)value=vmcs[field];
+			break;
+		}
+	}
+	return vmx_success;
+}
+
+u8 __vmx_vmwrite(size_t field,size_t value)
+{
+	u64p vmcs=(u64p)noir_replay_current_vmcs;
+	if(noir_replay_current_vmcs==0xFFFFFFFFFFFFFFFF)return vmx_fail_invalid;
+	if(field>=noir_replay_vmcs_limit)return vmx_fail_valid;
+	switch((field>>13)&3)
+	{
+		case noir_replay_vmcs_width_16:
+		{
+			vmcs[field]=(u16)value;
+			break;
+		}
+		case noir_replay_vmcs_width_64:
+		{
+			if(field&1)
+				vmcs[field&~1]=(vmcs[field&~1]&0xFFFFFFFF)|((u64)(u32)value<<32);
+			else
+				vmcs[field]=value;
+			break;
+		}
+		case noir_replay_vmcs_width_32:
+		{
+			vmcs[field]=(u32)value;
+			break;
+		}
+		case noir_replay_vmcs_width_natural:
+		{
+			vmcs[field]=value;
+			break;
+		}
+	}
+	return vmx_success;
+}
+
+u8 __vmx_vmptrld(u64* vmcs)
+{
+	noir_replay_current_vmcs=*vmcs;
+	return vmx_success;
+}
+
+void __vmx_vmptrst(u64* vmcs)
+{
+	*vmcs=noir_replay_current_vmcs;
+}
+
+u8 __vmx_vmclear(u64* vmcs)
+{
+	if(noir_replay_current_vmcs==*vmcs)noir_replay_current_vmcs=0xFFFFFFFFFFFFFFFF;
+	return vmx_success;
+}
+
+u8 noir_vt_invept(size_t type,invept_descriptor_p descriptor)
+{
+	return vmx_success;
+}
+
+u8 noir_vt_invvpid(size_t type,invvpid_descriptor_p descriptor)
+{
+	return vmx_success;
+}
+
+
+bool noir_replay_vt_initialize()
+{
+	noir_vt_initial_stack_p loader_stack;
+	hvm_p->relative_hvm=calloc(1,sizeof(noir_vt_hvm));
+	noir_replay_vt_vcpu=aligned_alloc(page_size,sizeof(noir_vt_vcpu));
+	noir_replay_vmcs=calloc(noir_replay_vmcs_limit,sizeof(u64));
+	if(hvm_p->relative_hvm==null || noir_replay_vt_vcpu==null || noir_replay_vmcs==null)return false;
+	memset(noir_replay_vt_vcpu,0,sizeof(noir_vt_vcpu));
+	noir_replay_vt_vcpu->hv_stack=aligned_alloc(page_size,nvc_stack_size);
+	if(noir_replay_vt_vcpu->hv_stack==null)return false;
+	// Physical memory is not simulated. Use the virtual address as the physical address.
+	noir_replay_vt_vcpu->vmcs.virt=noir_replay_vmcs;
+	noir_replay_vt_vcpu->vmcs.phys=(u64)noir_replay_vmcs;
+	noir_replay_vt_vcpu->self=noir_replay_vt_vcpu;
+	noir_replay_vt_vcpu->relative_hvm=hvm_p->relative_hvm;
+	noir_replay_current_vmcs=noir_replay_vt_vcpu->vmcs.phys;
+	hvm_p->virtual_cpu=noir_replay_vt_vcpu;
+	hvm_p->cpu_count=1;
+	memset(noir_replay_vt_vcpu->hv_stack,0,nvc_stack_size);
+	loader_stack=(noir_vt_initial_stack_p)((ulong_ptr)noir_replay_vt_vcpu->hv_stack+nvc_stack_size-sizeof(noir_vt_initial_stack));
+	loader_stack->vcpu=noir_replay_vt_vcpu;
+	loader_stack->custom_vcpu=&nvc_vt_idle_cvcpu;
+	loader_stack->proc_id=0;
+	nvc_vt_set_mshv_handler(false);
+	return true;
+}
+
+void noir_replay_vt_finalize()
+{
+	if(noir_replay_vt_vcpu)
+	{
+		free(noir_replay_vt_vcpu->hv_stack);
+		free(noir_replay_vt_vcpu);
+		noir_replay_vt_vcpu=null;
+	}
+	free(noir_replay_vmcs);
+	noir_replay_vmcs=null;
+	free(hvm_p->relative_hvm);
+	hvm_p->relative_hvm=null;
+	hvm_p->virtual_cpu=null;
+}
+
+void noir_replay_vt_load(noir_exit_trace_record_p record)
+{
+	noir_vt_initial_stack_p loader_stack=(noir_vt_initial_stack_p)((ulong_ptr)noir_replay_vt_vcpu->hv_stack+nvc_stack_size-sizeof(noir_vt_initial_stack));
+	u64 efer=0,cr0=0,cr4=0;
+	// The subverted host is always in 64-bit mode.
+	noir_bts64(&efer,ia32_efer_sce);
+	noir_bts64(&efer,ia32_efer_lme);
+	noir_bts64(&efer,ia32_efer_lma);
+	noir_bts64(&efer,ia32_efer_nxe);
+	noir_bts64(&cr0,ia32_cr0_pe);
+	noir_bts64(&cr0,ia32_cr0_pg);
+	noir_bts64(&cr4,ia32_cr4_pae);
+	// A handler leaving in the middle might not have restored the current VMCS.
+	noir_replay_current_vmcs=noir_replay_vt_vcpu->vmcs.phys;
+	noir_stosq(noir_replay_vmcs,0,noir_replay_vmcs_limit);
+	noir_vt_vmwrite(vmexit_reason,record->exit_code);
+	noir_vt_vmwrite(vmexit_qualification,record->info[0]);
+	noir_vt_vmwrite(guest_physical_address,record->info[1]);
+	noir_vt_vmwrite(vmexit_instruction_length,record->info[2]);
+	noir_vt_vmwrite(vmexit_interruption_information,record->info[3]);
+	noir_vt_vmwrite(guest_rip,record->rip);
+	noir_vt_vmwrite(guest_rflags,record->rflags);
+	noir_vt_vmwrite(guest_rsp,record->gpr[4]);
+	noir_vt_vmwrite(guest_msr_ia32_efer,efer);
+	noir_vt_vmwrite(guest_cr0,cr0);
+	noir_vt_vmwrite(guest_cr4,cr4);
+	noir_vt_vmwrite(guest_cs_access_rights,0xA09B);		// 64-bit code segment with DPL=0.
+	loader_stack->custom_vcpu=&nvc_vt_idle_cvcpu;
+	noir_movsb(&noir_replay_vt_gpr,record->gpr,sizeof(noir_gpr_state));
+}
+
+void noir_replay_vt_invoke()
+{
+	nvc_vt_exit_handler(&noir_replay_vt_gpr,noir_replay_vt_vcpu);
+}
+
+u64 noir_replay_vt_digest(u64 hash)
+{
+	u64 state[5]={0};
+	noir_vt_vmread(guest_rip,&state[0]);
+	noir_vt_vmread(guest_rflags,&state[1]);
+	noir_vt_vmread(guest_rsp,&state[2]);
+	noir_vt_vmread(vmentry_interruption_information_field,&state[3]);
+	noir_vt_vmread(vmentry_exception_error_code,&state[4]);
+	hash=noir_replay_hash(hash,state,sizeof(state));
+	return noir_replay_hash(hash,&noir_replay_vt_gpr,sizeof(noir_gpr_state));
+}
+
+noir_replay_vendor noir_replay_vt=
+{
+	"Intel VT-x",
+	noir_replay_vt_initialize,
+	noir_replay_vt_finalize,
+	noir_replay_vt_load,
+	noir_replay_vt_invoke,
+	noir_replay_vt_digest
+};
+
+// Leaving the hypervisor or switching worlds cannot be simulated.
+void nvc_vt_resume_without_entry(noir_gpr_state_p state)
+{
+	noir_replay_leave(noir_replay_aborted,"The hypervisor is leaving.");
+}
+
+void nvc_vt_switch_to_host_vcpu(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu)
+{
+	noir_replay_leave(noir_replay_aborted,"The world is switched.");
+}
+
+// CVM exits are not replayed. Functions for CVM are never reached.
+void nvc_vt_initialize_cvm_vmcs(noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu){}
+void nvc_vt_clear_cvm_vmcs(noir_vt_custom_vcpu_p cvcpu){}
+void nvc_vt_set_guest_vcpu_options(noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu){}
+void nvc_vt_deliver_queued_interrupts(noir_vt_custom_vcpu_p cvcpu){}
+void nvc_vt_dump_vcpu_state(noir_vt_custom_vcpu_p vcpu){}
+
+bool nvc_vt_update_cvm_timer(noir_vt_custom_vcpu_p cvcpu)
+{
+	return false;
+}
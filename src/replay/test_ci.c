@@ -0,0 +1,89 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file tests the write-fault verification and the restoration of Code Integrity.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_ci.c
+*/
+
+#include <sys/mman.h>
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvbdk.h>
+#include <nvstatus.h>
+#include <noirhvm.h>
+#include <nv_intrin.h>
+#include <ci.h>
+#include "replay.h"
+#include "replay_test.h"
+
+// Each OS layer declares the CI routines by itself.
+bool noir_initialize_ci(bool soft_ci,bool hard_ci);
+bool noir_add_section_to_ci(void* base,u32 size,bool enable_scan);
+bool noir_activate_ci(void);
+void noir_finalize_ci(void);
+
+// Physical addresses are identical to virtual addresses in the replay engine.
+// The write-fault handler restores the pages through the identity map of the lowest 512GiB,
+// so that the code section is mapped there.
+#define noir_replay_test_ci_code_base	0x7E00000000
+
+u8p static noir_replay_test_ci_code=null;
+u8 static _Alignas(page_size) noir_replay_test_ci_data[page_size];
+
+bool static noir_replay_test_ci_verify()
+{
+	void* gva=null;
+	noir_replay_assert(noir_replay_test_ci_code!=MAP_FAILED);
+	for(u32 i=0;i<page_size*2;i++)noir_replay_test_ci_code[i]=(u8)(i*7+3);
+	noir_stosb(noir_replay_test_ci_data,0,page_size);
+	// The simulated processor supports no SLAT. Enforce it anyway, as the write faults are simulated.
+	noir_replay_assert(noir_initialize_ci(true,true));
+	noir_ci->options.hard_ci=true;
+	noir_replay_assert(noir_add_section_to_ci(noir_replay_test_ci_code,page_size*2,true));
+	noir_replay_assert(noir_add_section_to_ci(noir_replay_test_ci_data,page_size,false));
+	noir_replay_assert(noir_activate_ci());
+	noir_replay_assert(noir_ci->pages==4);
+	// An intact page: the write is discarded.
+	noir_replay_assert(noir_ci_verify_on_write_fault((u64)&noir_replay_test_ci_code[page_size+0x10],&gva)==noir_ci_fault_discarded);
+	noir_replay_assert(gva==&noir_replay_test_ci_code[page_size+0x10]);
+	// A corrupted page is restored from its snapshot.
+	noir_replay_test_ci_code[page_size+0x123]^=0xFF;
+	noir_replay_assert(noir_ci_verify_on_write_fault((u64)&noir_replay_test_ci_code[page_size],&gva)==noir_ci_fault_restored);
+	noir_replay_assert(noir_replay_test_ci_code[page_size+0x123]==(u8)((page_size+0x123)*7+3));
+	noir_replay_assert(noir_ci->corruptions==1 && noir_ci->restorations==1);
+	noir_replay_assert(noir_ci_verify_on_write_fault((u64)&noir_replay_test_ci_code[page_size],&gva)==noir_ci_fault_discarded);
+	// The snapshot is corrupted as well. The page cannot be restored.
+	for(u32 i=0;i<noir_ci->pages;i++)
+		if(noir_ci->page_ci[i].virt==noir_replay_test_ci_code)
+			((u8p)noir_ci->page_ci[i].snapshot)[0x40]^=0xFF;
+	noir_replay_test_ci_code[0x40]^=0xFF;
+	noir_replay_assert(noir_ci_verify_on_write_fault((u64)noir_replay_test_ci_code,&gva)==noir_ci_fault_corrupted);
+	noir_replay_assert(noir_replay_test_ci_code[0x40]==(u8)((0x40*7+3)^0xFF));
+	noir_replay_assert(noir_ci->corruptions==2 && noir_ci->restorations==1);
+	// Mutable pages are never verified. Neither are pages outside of CI.
+	noir_replay_test_ci_data[0]=1;
+	noir_replay_assert(noir_ci_verify_on_write_fault((u64)noir_replay_test_ci_data,&gva)==noir_ci_fault_discarded);
+	noir_replay_assert(noir_ci_verify_on_write_fault((u64)noir_ci,&gva)==noir_ci_fault_discarded);
+	noir_replay_assert(noir_ci_verify_on_write_fault((u64)&gva,&gva)==noir_ci_fault_not_protected);
+	noir_replay_assert(noir_ci_is_ci_phys_page((u64)noir_replay_test_ci_data,null));
+	noir_replay_assert(noir_ci->write_faults==6);
+	return true;
+}
+
+bool noir_replay_test_ci_restoration()
+{
+	bool result;
+	noir_replay_test_ci_code=mmap((void*)noir_replay_test_ci_code_base,page_size*2,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE,-1,0);
+	result=noir_replay_test_ci_verify();
+	// The SLAT builders of other tests must not see the protected pages.
+	noir_finalize_ci();
+	if(noir_replay_test_ci_code!=MAP_FAILED)munmap(noir_replay_test_ci_code,page_size*2);
+	return result && noir_ci==null;
+}
@@ -0,0 +1,134 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file simulates the halt-polling policy of CVM with synthetic wakeup traces.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_cvhalt.c
+*/
+
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvbdk.h>
+#include <nvstatus.h>
+#include <noirhvm.h>
+#include "replay.h"
+#include "replay_test.h"
+
+// The maximum window is 16 times the initial window.
+#define noir_replay_test_halt_window_max	1600
+#define noir_replay_test_halt_window_init	(noir_replay_test_halt_window_max>>noir_cvm_halt_poll_initial_shift)
+#define noir_replay_test_halt_count			0x1000
+
+/*
+  The vCPU halts repeatedly. Each halt lasts for the ticks drawn from the trace.
+  If the wakeup arrives within the window, the poll succeeds and the VMM is not involved.
+  Otherwise, the whole window is wasted and the halt is delivered to the VMM.
+  In both cases, the window is adapted to the duration of the halt, as the run loop does.
+*/
+typedef struct _noir_replay_test_halt_sim
+{
+	noir_cvm_halt_poll poll;
+	u32 seed;
+	u64 attempts;
+	u64 successes;
+	u64 wasted;			// Ticks spent polling without a wakeup.
+}noir_replay_test_halt_sim,*noir_replay_test_halt_sim_p;
+
+// Draw the duration of a halt uniformly from the range.
+u64 static noir_replay_test_halt_draw(noir_replay_test_halt_sim_p sim,u64 low,u64 high)
+{
+	sim->seed=sim->seed*1103515245+12345;
+	return low+(sim->seed>>8)%(high-low+1);
+}
+
+void static noir_replay_test_halt_run(noir_replay_test_halt_sim_p sim,u32 halts,u64 low,u64 high)
+{
+	sim->attempts=sim->successes=sim->wasted=0;
+	for(u32 i=0;i<halts;i++)
+	{
+		const u64 halted_ticks=noir_replay_test_halt_draw(sim,low,high);
+		if(sim->poll.window)
+		{
+			sim->attempts++;
+			if(halted_ticks<=sim->poll.window)
+				sim->successes++;
+			else
+				sim->wasted+=sim->poll.window;
+		}
+		nvc_cvm_halt_poll_update(&sim->poll,halted_ticks);
+	}
+}
+
+bool noir_replay_test_cvm_halt_window()
+{
+	noir_cvm_halt_poll poll={0};
+	nvc_cvm_halt_poll_set_max_window(&poll,noir_replay_test_halt_window_max);
+	noir_replay_assert(poll.window==0);
+	// Growing starts from the initial window and doubles up to the maximum.
+	nvc_cvm_halt_poll_grow(&poll);
+	noir_replay_assert(poll.window==noir_replay_test_halt_window_init);
+	for(u32 i=0;i<noir_cvm_halt_poll_initial_shift;i++)nvc_cvm_halt_poll_grow(&poll);
+	noir_replay_assert(poll.window==noir_replay_test_halt_window_max);
+	nvc_cvm_halt_poll_grow(&poll);
+	noir_replay_assert(poll.window==noir_replay_test_halt_window_max);
+	// Shrinking halves the window. Below the initial window, polling stops.
+	nvc_cvm_halt_poll_shrink(&poll);
+	noir_replay_assert(poll.window==noir_replay_test_halt_window_max>>1);
+	for(u32 i=1;i<noir_cvm_halt_poll_initial_shift;i++)nvc_cvm_halt_poll_shrink(&poll);
+	noir_replay_assert(poll.window==noir_replay_test_halt_window_init);
+	nvc_cvm_halt_poll_shrink(&poll);
+	noir_replay_assert(poll.window==0);
+	// A wakeup within the window keeps it. A late wakeup within the maximum grows it. A halt beyond the maximum shrinks it.
+	poll.window=400;
+	nvc_cvm_halt_poll_update(&poll,400);
+	noir_replay_assert(poll.window==400);
+	nvc_cvm_halt_poll_update(&poll,401);
+	noir_replay_assert(poll.window==800);
+	nvc_cvm_halt_poll_update(&poll,noir_replay_test_halt_window_max+1);
+	noir_replay_assert(poll.window==400);
+	// Lowering the maximum clamps the window. Zero disables polling.
+	nvc_cvm_halt_poll_set_max_window(&poll,200);
+	noir_replay_assert(poll.window==200);
+	nvc_cvm_halt_poll_set_max_window(&poll,0);
+	noir_replay_assert(poll.window==0);
+	nvc_cvm_halt_poll_update(&poll,10);
+	noir_replay_assert(poll.window==0);
+	return true;
+}
+
+bool noir_replay_test_cvm_halt_trace()
+{
+	noir_replay_test_halt_sim sim={0};
+	sim.seed=1;
+	nvc_cvm_halt_poll_set_max_window(&sim.poll,noir_replay_test_halt_window_max);
+	// Short halts: the window grows to cover them and most polls succeed.
+	noir_replay_test_halt_run(&sim,noir_replay_test_halt_count,10,1000);
+	noir_replay_assert(sim.poll.window>=1000);
+	noir_replay_assert(sim.successes*100>=sim.attempts*99);
+	noir_replay_assert(sim.attempts>=noir_replay_test_halt_count-noir_cvm_halt_poll_initial_shift);
+	// Idle vCPU: every halt outlasts the maximum. Polling stops after a few halts, so little time is wasted.
+	noir_replay_test_halt_run(&sim,noir_replay_test_halt_count,noir_replay_test_halt_window_max*10,noir_replay_test_halt_window_max*100);
+	noir_replay_assert(sim.poll.window==0);
+	noir_replay_assert(sim.successes==0 && sim.attempts<=noir_cvm_halt_poll_initial_shift+1);
+	noir_replay_assert(sim.wasted<noir_replay_test_halt_window_max*2);
+	// The vCPU becomes busy again. The window regrows from zero within a few halts.
+	noir_replay_test_halt_run(&sim,noir_cvm_halt_poll_initial_shift+2,noir_replay_test_halt_window_max-100,noir_replay_test_halt_window_max);
+	noir_replay_assert(sim.poll.window==noir_replay_test_halt_window_max);
+	// Mixed halts: the window stays useful as long as most halts are short. It never exceeds the maximum.
+	for(u32 i=0;i<noir_replay_test_halt_count;i++)
+	{
+		if(i&7)
+			noir_replay_test_halt_run(&sim,1,10,noir_replay_test_halt_window_max);
+		else
+			noir_replay_test_halt_run(&sim,1,noir_replay_test_halt_window_max*10,noir_replay_test_halt_window_max*10);
+		noir_replay_assert(sim.poll.window<=noir_replay_test_halt_window_max);
+	}
+	noir_replay_assert(sim.poll.window!=0);
+	return true;
+}
@@ -0,0 +1,186 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file tests and benchmarks the VPCB submission queue of CVM.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_cvqueue.c
+*/
+
+#include <stdio.h>
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvbdk.h>
+#include <nvstatus.h>
+#include <noirhvm.h>
+#include <nv_intrin.h>
+#include "replay.h"
+#include "replay_test.h"
+
+#define noir_replay_test_queue_port		0x3F8
+#define noir_replay_test_queue_items	0x1000
+
+noir_cvm_vpcb_queue static noir_replay_test_queue;
+
+// The producer is the User Hypervisor: write the entry, then publish it by incrementing the tail.
+bool static noir_replay_test_queue_push(noir_cvm_vpcb_queue_p queue,u32 type,u32 data,u16 size)
+{
+	noir_cvm_vpcb_queue_entry_p entry=&queue->entries[queue->tail&(noir_cvm_vpcb_queue_length-1)];
+	if(queue->tail-queue->head>=noir_cvm_vpcb_queue_length)return false;
+	entry->type=type;
+	if(type==noir_cvm_vpcb_entry_interrupt)
+	{
+		entry->interrupt.vector=data;
+		entry->interrupt.reserved=0;
+	}
+	else
+	{
+		entry->io.port=noir_replay_test_queue_port;
+		entry->io.size=size;
+		entry->io.value=data;
+	}
+	queue->tail++;
+	return true;
+}
+
+// Both indices start right below the wrap-around point of 32-bit integers.
+noir_cvm_vpcb_queue_p static noir_replay_test_queue_reset(u32 start)
+{
+	noir_cvm_vpcb_queue_p queue=&noir_replay_test_queue;
+	noir_stosb(queue,0,sizeof(noir_cvm_vpcb_queue));
+	queue->head=queue->tail=start;
+	return queue;
+}
+
+bool noir_replay_test_cvm_queue_order()
+{
+	noir_cvm_vpcb_queue_p queue=noir_replay_test_queue_reset(0xFFFFFFF0);
+	u32 produced=0,consumed=0,seed=1;
+	u8 vector;
+	// The producer and the consumer take turns with random batch sizes. Vectors must be consumed in order.
+	while(consumed<noir_replay_test_queue_items)
+	{
+		u32 batch;
+		seed=seed*1103515245+12345;
+		batch=(seed>>8)%(noir_cvm_vpcb_queue_length+8);
+		for(u32 i=0;i<batch && produced<noir_replay_test_queue_items;i++)
+		{
+			if(!noir_replay_test_queue_push(queue,noir_cvm_vpcb_entry_interrupt,16+produced%240,0))break;
+			produced++;
+		}
+		noir_replay_assert(queue->tail-queue->head<=noir_cvm_vpcb_queue_length);
+		seed=seed*1103515245+12345;
+		batch=(seed>>8)%(noir_cvm_vpcb_queue_length+8);
+		for(u32 i=0;i<batch;i++)
+		{
+			if(!nvc_cvm_vpcb_queue_peek_interrupt(queue,&vector))
+			{
+				noir_replay_assert(consumed==produced);
+				break;
+			}
+			noir_replay_assert(vector==16+consumed%240);
+			nvc_cvm_vpcb_queue_pop(queue);
+			consumed++;
+		}
+	}
+	// Both indices have wrapped around.
+	noir_replay_assert(queue->head==queue->tail && queue->head==0xFFFFFFF0+noir_replay_test_queue_items);
+	noir_replay_assert(!nvc_cvm_vpcb_queue_peek_interrupt(queue,&vector));
+	return true;
+}
+
+bool noir_replay_test_cvm_queue_validation()
+{
+	noir_cvm_vpcb_queue_p queue=noir_replay_test_queue_reset(0xFFFFFFC0);
+	noir_cvm_vpcb_queue_entry entry;
+	u64 rax=0;
+	u8 vector;
+	for(u32 i=0;i<noir_cvm_vpcb_queue_length;i++)noir_replay_test_queue_push(queue,noir_cvm_vpcb_entry_interrupt,0x30+i,0);
+	noir_replay_assert(!noir_replay_test_queue_push(queue,noir_cvm_vpcb_entry_interrupt,0x30,0));
+	// A full queue is consistent.
+	noir_replay_assert(nvc_cvm_vpcb_queue_peek_interrupt(queue,&vector) && vector==0x30);
+	// The tail is written by user mode. More than 64 pending entries, or a tail behind the head, means an empty queue.
+	queue->tail=queue->head+noir_cvm_vpcb_queue_length+1;
+	noir_replay_assert(!nvc_cvm_vpcb_queue_peek(queue,&entry));
+	noir_replay_assert(!nvc_cvm_vpcb_queue_peek_interrupt(queue,&vector));
+	noir_replay_assert(!nvc_cvm_vpcb_queue_complete_io(queue,noir_replay_test_queue_port,1,true,&rax));
+	queue->tail=queue->head-1;
+	noir_replay_assert(!nvc_cvm_vpcb_queue_peek(queue,&entry));
+	noir_replay_assert(queue->head==0xFFFFFFC0);
+	// Reserved vectors are rejected and stall the queue at the head.
+	queue=noir_replay_test_queue_reset(0);
+	noir_replay_test_queue_push(queue,noir_cvm_vpcb_entry_interrupt,0x0E,0);
+	noir_replay_test_queue_push(queue,noir_cvm_vpcb_entry_interrupt,0x40,0);
+	noir_replay_assert(!nvc_cvm_vpcb_queue_peek_interrupt(queue,&vector));
+	noir_replay_assert(queue->head==0);
+	// An interrupt entry does not complete an I/O access, and vice versa.
+	queue=noir_replay_test_queue_reset(0);
+	noir_replay_test_queue_push(queue,noir_cvm_vpcb_entry_interrupt,0x40,0);
+	noir_replay_assert(!nvc_cvm_vpcb_queue_complete_io(queue,noir_replay_test_queue_port,1,true,&rax));
+	queue=noir_replay_test_queue_reset(0);
+	noir_replay_test_queue_push(queue,noir_cvm_vpcb_entry_io_in,0x55,1);
+	noir_replay_assert(!nvc_cvm_vpcb_queue_peek_interrupt(queue,&vector));
+	noir_replay_assert(queue->head==0 && rax==0);
+	return true;
+}
+
+bool noir_replay_test_cvm_queue_io()
+{
+	noir_cvm_vpcb_queue_p queue=noir_replay_test_queue_reset(0);
+	u64 rax=0xFFFFFFFFFFFFFFFF;
+	// A mismatched port, size or direction leaves the entry at the head and rax untouched.
+	noir_replay_test_queue_push(queue,noir_cvm_vpcb_entry_io_in,0x12345678,1);
+	noir_replay_assert(!nvc_cvm_vpcb_queue_complete_io(queue,noir_replay_test_queue_port+1,1,true,&rax));
+	noir_replay_assert(!nvc_cvm_vpcb_queue_complete_io(queue,noir_replay_test_queue_port,2,true,&rax));
+	noir_replay_assert(!nvc_cvm_vpcb_queue_complete_io(queue,noir_replay_test_queue_port,1,false,&rax));
+	noir_replay_assert(queue->head==0 && rax==0xFFFFFFFFFFFFFFFF);
+	// An invalid size is never completed, even if the entry matches.
+	queue->entries[0].io.size=8;
+	noir_replay_assert(!nvc_cvm_vpcb_queue_complete_io(queue,noir_replay_test_queue_port,8,true,&rax));
+	queue->entries[0].io.size=1;
+	// Reads of 1 and 2 bytes merge into rax. A read of 4 bytes clears the upper half.
+	noir_replay_assert(nvc_cvm_vpcb_queue_complete_io(queue,noir_replay_test_queue_port,1,true,&rax));
+	noir_replay_assert(rax==0xFFFFFFFFFFFFFF78 && queue->head==1);
+	rax=0xFFFFFFFFFFFFFFFF;
+	noir_replay_test_queue_push(queue,noir_cvm_vpcb_entry_io_in,0x12345678,2);
+	noir_replay_assert(nvc_cvm_vpcb_queue_complete_io(queue,noir_replay_test_queue_port,2,true,&rax));
+	noir_replay_assert(rax==0xFFFFFFFFFFFF5678);
+	noir_replay_test_queue_push(queue,noir_cvm_vpcb_entry_io_in,0x12345678,4);
+	noir_replay_assert(nvc_cvm_vpcb_queue_complete_io(queue,noir_replay_test_queue_port,4,true,&rax));
+	noir_replay_assert(rax==0x12345678);
+	// Writes store only the bytes of the access into the entry.
+	rax=0xAABBCCDD11223344;
+	for(u32 size=1;size<=4;size<<=1)
+	{
+		const u32 slot=queue->head&(noir_cvm_vpcb_queue_length-1);
+		noir_replay_test_queue_push(queue,noir_cvm_vpcb_entry_io_out,0xFFFFFFFF,(u16)size);
+		noir_replay_assert(nvc_cvm_vpcb_queue_complete_io(queue,noir_replay_test_queue_port,size,false,&rax));
+		noir_replay_assert(queue->entries[slot].io.value==(u32)(rax&(size==4?0xFFFFFFFF:((1<<(size<<3))-1))));
+	}
+	noir_replay_assert(rax==0xAABBCCDD11223344 && queue->head==queue->tail && queue->head==6);
+	return true;
+}
+
+// TSC ticks per entry of a round trip: the producer posts a canned port-in response and the consumer completes the access with it.
+void noir_replay_benchmark_cvm_vpcb_queue(u32 rounds)
+{
+	const u32 batches[]={1,8,noir_cvm_vpcb_queue_length};
+	for(u32 i=0;i<sizeof(batches)/sizeof(u32);i++)
+	{
+		noir_cvm_vpcb_queue_p queue=noir_replay_test_queue_reset(0);
+		u64 start,total,rax=0;
+		start=__rdtsc();
+		for(u32 j=0;j<rounds;j+=batches[i])
+		{
+			for(u32 k=0;k<batches[i];k++)noir_replay_test_queue_push(queue,noir_cvm_vpcb_entry_io_in,j+k,4);
+			for(u32 k=0;k<batches[i];k++)nvc_cvm_vpcb_queue_complete_io(queue,noir_replay_test_queue_port,4,true,&rax);
+		}
+		total=__rdtsc()-start;
+		printf("  Batch of %2u: %llu ticks per round trip\n",batches[i],total/rounds);
+	}
+}
@@ -0,0 +1,103 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file tests the LAPIC timer emulation for CVM with virtual time.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_cvtimer.c
+*/
+
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvbdk.h>
+#include <nvstatus.h>
+#include <noirhvm.h>
+#include "replay.h"
+#include "replay_test.h"
+
+// The guest TSC is ahead of the host TSC by this offset.
+#define noir_replay_test_tsc_offset		0x100000
+#define noir_replay_test_timer_vector	0x30
+
+/*
+  The AMD-V core arms a host timer before running the guest. The guest runs
+  until the host timer interrupts the processor. Whenever the guest is about
+  to be resumed, expirations are injected, and the host timer is re-armed if
+  it would miss the next expiration. Time is simulated by the host TSC.
+*/
+typedef struct _noir_replay_test_timer_sim
+{
+	noir_cvm_lapic_timer timer;
+	u64 now;			// Host TSC.
+	u64 injections;
+	u64 rearms;
+}noir_replay_test_timer_sim,*noir_replay_test_timer_sim_p;
+
+// The guest exits at the host TSC. Returns true if the host timer is re-armed before the guest is resumed.
+bool static noir_replay_test_timer_resume(noir_replay_test_timer_sim_p sim,u64 now)
+{
+	u8 vector;
+	sim->now=now;
+	if(nvc_cvm_lapic_timer_expire(&sim->timer,now+noir_replay_test_tsc_offset,&vector))
+		if(vector==noir_replay_test_timer_vector)sim->injections++;
+	if(nvc_cvm_lapic_timer_unarmed(&sim->timer,now,noir_replay_test_tsc_offset))
+	{
+		nvc_cvm_lapic_timer_arm(&sim->timer,now,noir_replay_test_tsc_offset);
+		sim->rearms++;
+		return true;
+	}
+	return false;
+}
+
+bool noir_replay_test_cvm_timer_rearm()
+{
+	noir_replay_test_timer_sim sim={0};
+	noir_cvm_lapic_timer_p timer=&sim.timer;
+	sim.now=1000;
+	timer->tsc_ratio=1;
+	// Periodic timer with 500 ticks per period. Divide by 1.
+	nvc_cvm_lapic_timer_write_divide_config(timer,0xB);
+	nvc_cvm_lapic_timer_write_lvt(timer,(noir_cvm_lapic_timer_periodic<<17)|noir_replay_test_timer_vector);
+	nvc_cvm_lapic_timer_write_initial_count(timer,500,sim.now+noir_replay_test_tsc_offset);
+	noir_replay_assert(nvc_cvm_lapic_timer_arm(timer,sim.now,noir_replay_test_tsc_offset)==500);
+	noir_replay_assert(timer->armed==sim.now+500);
+	// Each expiration of the host timer injects one interrupt and re-arms for the next period.
+	for(u32 i=0;i<10;i++)
+	{
+		noir_replay_assert(noir_replay_test_timer_resume(&sim,timer->armed));
+		noir_replay_assert(timer->armed==sim.now+500);
+	}
+	noir_replay_assert(sim.injections==10 && sim.rearms==10);
+	noir_replay_assert(timer->latency==0);
+	// Other VM-Exits before the expiration do not re-arm the host timer.
+	noir_replay_assert(!noir_replay_test_timer_resume(&sim,sim.now+100));
+	noir_replay_assert(!noir_replay_test_timer_resume(&sim,sim.now+300));
+	noir_replay_assert(sim.injections==10 && sim.rearms==10);
+	// The guest moves the deadline earlier. The host timer armed for the old deadline would miss it.
+	nvc_cvm_lapic_timer_write_initial_count(timer,50,sim.now+noir_replay_test_tsc_offset);
+	noir_replay_assert(noir_replay_test_timer_resume(&sim,sim.now));
+	noir_replay_assert(timer->armed==sim.now+50);
+	noir_replay_assert(noir_replay_test_timer_resume(&sim,timer->armed));
+	noir_replay_assert(sim.injections==11 && timer->latency==0);
+	// The guest moves the deadline later. The host timer fires early and is re-armed without injection.
+	nvc_cvm_lapic_timer_write_initial_count(timer,2000,sim.now+noir_replay_test_tsc_offset);
+	noir_replay_assert(!noir_replay_test_timer_resume(&sim,sim.now));
+	noir_replay_assert(noir_replay_test_timer_resume(&sim,timer->armed));
+	noir_replay_assert(sim.injections==11 && timer->armed==timer->deadline-noir_replay_test_tsc_offset);
+	// TSC-deadline mode disarms the timer. The host timer is canceled.
+	nvc_cvm_lapic_timer_write_lvt(timer,(noir_cvm_lapic_timer_tsc_deadline<<17)|noir_replay_test_timer_vector);
+	noir_replay_assert(!noir_replay_test_timer_resume(&sim,sim.now));
+	noir_replay_assert(nvc_cvm_lapic_timer_arm(timer,sim.now,noir_replay_test_tsc_offset)==maxu64 && timer->armed==0);
+	// The deadline is in guest TSC.
+	nvc_cvm_lapic_timer_write_deadline(timer,sim.now+noir_replay_test_tsc_offset+800);
+	noir_replay_assert(noir_replay_test_timer_resume(&sim,sim.now));
+	noir_replay_assert(timer->armed==sim.now+800);
+	noir_replay_assert(!noir_replay_test_timer_resume(&sim,timer->armed));
+	noir_replay_assert(sim.injections==12 && timer->latency==0 && timer->deadline==0);
+	return true;
+}
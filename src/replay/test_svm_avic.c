@@ -0,0 +1,167 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file tests the AVIC table maintenance and IPI routing of SVM CVM.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_svm_avic.c
+*/
+
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvbdk.h>
+#include <nvstatus.h>
+#include <noirhvm.h>
+#include <nv_intrin.h>
+#include <amd64.h>
+#include "../svm_core/svm_def.h"
+#include "../svm_core/svm_avic.h"
+#include "replay.h"
+#include "replay_test.h"
+
+#define noir_replay_test_avic_dfr_flat		0xFFFFFFFF
+#define noir_replay_test_avic_dfr_cluster	0x0FFFFFFF
+#define noir_replay_test_avic_vcpus			4
+
+// The ICR encodes the destination mode at bit 11 and the shorthand at bits 18-19.
+#define noir_replay_test_avic_icr_lo(mode,shorthand)	(0x40|((mode)<<11)|((shorthand)<<18))
+#define noir_replay_test_avic_icr_hi(dest)				((u32)(dest)<<24)
+#define noir_replay_test_avic_ldr(id)					((u32)(id)<<24)
+
+u64 static _Alignas(page_size) noir_replay_test_avic_physical[page_size>>3];
+u32 static _Alignas(page_size) noir_replay_test_avic_logical[page_size>>2];
+
+nvc_svm_avic_logical_apic_id_entry static noir_replay_test_avic_logical_entry(u32 index)
+{
+	nvc_svm_avic_logical_apic_id_entry entry;
+	entry.value=noir_replay_test_avic_logical[index];
+	return entry;
+}
+
+nvc_svm_avic_physical_apic_id_entry static noir_replay_test_avic_physical_entry(u32 index)
+{
+	nvc_svm_avic_physical_apic_id_entry entry;
+	entry.value=noir_replay_test_avic_physical[index];
+	return entry;
+}
+
+// Four vCPUs with valid backing pages. Nothing is running and no logical ID is assigned.
+void static noir_replay_test_avic_reset()
+{
+	noir_stosb(noir_replay_test_avic_physical,0,sizeof(noir_replay_test_avic_physical));
+	noir_stosb(noir_replay_test_avic_logical,0,sizeof(noir_replay_test_avic_logical));
+	for(u32 i=0;i<noir_replay_test_avic_vcpus;i++)
+		nvc_svm_avic_set_physical_entry(noir_replay_test_avic_physical,i,0x10000+(i<<page_shift));
+}
+
+bool noir_replay_test_svm_avic_logical_id()
+{
+	// Flat model: the index is the position of the only bit set.
+	noir_replay_assert(nvc_svm_avic_get_logical_index(noir_replay_test_avic_ldr(0x01),noir_replay_test_avic_dfr_flat)==0);
+	noir_replay_assert(nvc_svm_avic_get_logical_index(noir_replay_test_avic_ldr(0x80),noir_replay_test_avic_dfr_flat)==7);
+	noir_replay_assert(nvc_svm_avic_get_logical_index(noir_replay_test_avic_ldr(0x03),noir_replay_test_avic_dfr_flat)==noir_svm_avic_invalid_index);
+	noir_replay_assert(nvc_svm_avic_get_logical_index(0,noir_replay_test_avic_dfr_flat)==noir_svm_avic_invalid_index);
+	// Cluster model: the index is cluster*4+bit. Cluster 15 is broadcast and designates no entry.
+	noir_replay_assert(nvc_svm_avic_get_logical_index(noir_replay_test_avic_ldr(0x21),noir_replay_test_avic_dfr_cluster)==8);
+	noir_replay_assert(nvc_svm_avic_get_logical_index(noir_replay_test_avic_ldr(0xE8),noir_replay_test_avic_dfr_cluster)==noir_svm_avic_max_logical_index);
+	noir_replay_assert(nvc_svm_avic_get_logical_index(noir_replay_test_avic_ldr(0xF1),noir_replay_test_avic_dfr_cluster)==noir_svm_avic_invalid_index);
+	noir_replay_assert(nvc_svm_avic_get_logical_index(noir_replay_test_avic_ldr(0x23),noir_replay_test_avic_dfr_cluster)==noir_svm_avic_invalid_index);
+	noir_replay_test_avic_reset();
+	// vCPU 1 takes logical ID 0x02, then moves to 0x04. The stale entry is removed.
+	nvc_svm_avic_update_logical_table(noir_replay_test_avic_logical,0,noir_replay_test_avic_dfr_flat,noir_replay_test_avic_ldr(0x02),noir_replay_test_avic_dfr_flat,1);
+	noir_replay_assert(noir_replay_test_avic_logical_entry(1).valid && noir_replay_test_avic_logical_entry(1).guest_physical_apic_id==1);
+	nvc_svm_avic_update_logical_table(noir_replay_test_avic_logical,noir_replay_test_avic_ldr(0x02),noir_replay_test_avic_dfr_flat,noir_replay_test_avic_ldr(0x04),noir_replay_test_avic_dfr_flat,1);
+	noir_replay_assert(noir_replay_test_avic_logical[1]==0);
+	noir_replay_assert(noir_replay_test_avic_logical_entry(2).valid && noir_replay_test_avic_logical_entry(2).guest_physical_apic_id==1);
+	// vCPU 3 takes the same logical ID. vCPU 1 leaving it must not remove the entry of vCPU 3.
+	nvc_svm_avic_update_logical_table(noir_replay_test_avic_logical,0,noir_replay_test_avic_dfr_flat,noir_replay_test_avic_ldr(0x04),noir_replay_test_avic_dfr_flat,3);
+	nvc_svm_avic_update_logical_table(noir_replay_test_avic_logical,noir_replay_test_avic_ldr(0x04),noir_replay_test_avic_dfr_flat,noir_replay_test_avic_ldr(0x10),noir_replay_test_avic_dfr_flat,1);
+	noir_replay_assert(noir_replay_test_avic_logical_entry(2).valid && noir_replay_test_avic_logical_entry(2).guest_physical_apic_id==3);
+	noir_replay_assert(noir_replay_test_avic_logical_entry(4).guest_physical_apic_id==1);
+	// Logical ID 0x10 designates no entry in the cluster model. Switching the model removes the entry.
+	nvc_svm_avic_update_logical_table(noir_replay_test_avic_logical,noir_replay_test_avic_ldr(0x10),noir_replay_test_avic_dfr_flat,noir_replay_test_avic_ldr(0x10),noir_replay_test_avic_dfr_cluster,1);
+	noir_replay_assert(noir_replay_test_avic_logical[4]==0);
+	// Logical ID 0x21 is cluster 2, bit 0 in the cluster model.
+	nvc_svm_avic_update_logical_table(noir_replay_test_avic_logical,noir_replay_test_avic_ldr(0x10),noir_replay_test_avic_dfr_cluster,noir_replay_test_avic_ldr(0x21),noir_replay_test_avic_dfr_cluster,1);
+	noir_replay_assert(noir_replay_test_avic_logical_entry(8).valid && noir_replay_test_avic_logical_entry(8).guest_physical_apic_id==1);
+	return true;
+}
+
+bool noir_replay_test_svm_avic_ipi_routing()
+{
+	u64 targets[noir_svm_avic_target_bitmap_size];
+	noir_replay_test_avic_reset();
+	// Shorthands: self, all including self, all excluding self. Invalid entries are never targeted.
+	noir_replay_assert(nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(0,amd64_apic_icr_dsh_self),0,noir_replay_test_avic_dfr_flat,2,targets)==1);
+	noir_replay_assert(targets[0]==0x4 && targets[1]==0 && targets[2]==0 && targets[3]==0);
+	noir_replay_assert(nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(0,amd64_apic_icr_dsh_inclusive),0,noir_replay_test_avic_dfr_flat,2,targets)==4);
+	noir_replay_assert(targets[0]==0xF);
+	noir_replay_assert(nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(0,amd64_apic_icr_dsh_exclusive),0,noir_replay_test_avic_dfr_flat,2,targets)==3);
+	noir_replay_assert(targets[0]==0xB);
+	// Physical destination, physical broadcast and a destination without a vCPU.
+	noir_replay_assert(nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(0,amd64_apic_icr_dsh_destination),noir_replay_test_avic_icr_hi(3),noir_replay_test_avic_dfr_flat,0,targets)==1);
+	noir_replay_assert(targets[0]==0x8);
+	noir_replay_assert(nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(0,amd64_apic_icr_dsh_destination),noir_replay_test_avic_icr_hi(noir_svm_avic_broadcast),noir_replay_test_avic_dfr_flat,0,targets)==4);
+	noir_replay_assert(nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(0,amd64_apic_icr_dsh_destination),noir_replay_test_avic_icr_hi(0x40),noir_replay_test_avic_dfr_flat,0,targets)==0);
+	noir_replay_assert(targets[0]==0 && targets[1]==0);
+	// Logical destination, flat model: vCPU n has logical ID 1<<n.
+	for(u32 i=0;i<noir_replay_test_avic_vcpus;i++)
+		nvc_svm_avic_update_logical_table(noir_replay_test_avic_logical,0,noir_replay_test_avic_dfr_flat,noir_replay_test_avic_ldr(1<<i),noir_replay_test_avic_dfr_flat,i);
+	noir_replay_assert(nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(1,amd64_apic_icr_dsh_destination),noir_replay_test_avic_icr_hi(0x05),noir_replay_test_avic_dfr_flat,0,targets)==2);
+	noir_replay_assert(targets[0]==0x5);
+	noir_replay_assert(nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(1,amd64_apic_icr_dsh_destination),noir_replay_test_avic_icr_hi(0xFF),noir_replay_test_avic_dfr_flat,0,targets)==4);
+	// Logical destination, cluster model: vCPUs 0 and 1 in cluster 1, vCPUs 2 and 3 in cluster 2.
+	noir_replay_test_avic_reset();
+	for(u32 i=0;i<noir_replay_test_avic_vcpus;i++)
+		nvc_svm_avic_update_logical_table(noir_replay_test_avic_logical,0,noir_replay_test_avic_dfr_cluster,noir_replay_test_avic_ldr((((i>>1)+1)<<4)|(1<<(i&1))),noir_replay_test_avic_dfr_cluster,i);
+	noir_replay_assert(nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(1,amd64_apic_icr_dsh_destination),noir_replay_test_avic_icr_hi(0x23),noir_replay_test_avic_dfr_cluster,0,targets)==2);
+	noir_replay_assert(targets[0]==0xC);
+	noir_replay_assert(nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(1,amd64_apic_icr_dsh_destination),noir_replay_test_avic_icr_hi(0x12),noir_replay_test_avic_dfr_cluster,0,targets)==1);
+	noir_replay_assert(targets[0]==0x2);
+	// Cluster 15 broadcasts to the selected bits of every cluster.
+	noir_replay_assert(nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(1,amd64_apic_icr_dsh_destination),noir_replay_test_avic_icr_hi(0xF1),noir_replay_test_avic_dfr_cluster,0,targets)==2);
+	noir_replay_assert(targets[0]==0x5);
+	// A vCPU designated by two logical entries is targeted once.
+	nvc_svm_avic_update_logical_table(noir_replay_test_avic_logical,0,noir_replay_test_avic_dfr_cluster,noir_replay_test_avic_ldr(0x31),noir_replay_test_avic_dfr_cluster,0);
+	noir_replay_assert(nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(1,amd64_apic_icr_dsh_destination),noir_replay_test_avic_icr_hi(0xF1),noir_replay_test_avic_dfr_cluster,0,targets)==2);
+	noir_replay_assert(targets[0]==0x5);
+	// A removed vCPU is no longer targeted even if its logical entry is left over.
+	nvc_svm_avic_clear_physical_entry(noir_replay_test_avic_physical,3);
+	noir_replay_assert(nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(1,amd64_apic_icr_dsh_destination),noir_replay_test_avic_icr_hi(0x23),noir_replay_test_avic_dfr_cluster,0,targets)==1);
+	noir_replay_assert(targets[0]==0x4);
+	return true;
+}
+
+bool noir_replay_test_svm_avic_running_filter()
+{
+	u64 targets[noir_svm_avic_target_bitmap_size];
+	noir_replay_test_avic_reset();
+	nvc_svm_avic_set_running(noir_replay_test_avic_physical,0,0x10,true);
+	nvc_svm_avic_set_running(noir_replay_test_avic_physical,2,0x12,true);
+	noir_replay_assert(noir_replay_test_avic_physical_entry(2).is_running && noir_replay_test_avic_physical_entry(2).host_physical_apic_id==0x12);
+	noir_replay_assert(noir_replay_test_avic_physical_entry(2).valid && noir_replay_test_avic_physical_entry(2).backing_page_pointer==0x12);
+	// The hardware has delivered the IPI to the running vCPUs. Only the others are left to the hypervisor.
+	nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(0,amd64_apic_icr_dsh_inclusive),0,noir_replay_test_avic_dfr_flat,0,targets);
+	noir_replay_assert(nvc_svm_avic_filter_running(noir_replay_test_avic_physical,targets)==2);
+	noir_replay_assert(targets[0]==0xA);
+	// Descheduling keeps the host APIC ID.
+	nvc_svm_avic_set_running(noir_replay_test_avic_physical,2,0x13,false);
+	noir_replay_assert(!noir_replay_test_avic_physical_entry(2).is_running && noir_replay_test_avic_physical_entry(2).host_physical_apic_id==0x12);
+	targets[0]=0xF;
+	noir_replay_assert(nvc_svm_avic_filter_running(noir_replay_test_avic_physical,targets)==3);
+	noir_replay_assert(targets[0]==0xE);
+	// A vCPU above 63 is tracked in the next word of the bitmap.
+	nvc_svm_avic_set_physical_entry(noir_replay_test_avic_physical,noir_svm_avic_max_physical_index,0x90000);
+	nvc_svm_avic_route_ipi(noir_replay_test_avic_physical,noir_replay_test_avic_logical,noir_replay_test_avic_icr_lo(0,amd64_apic_icr_dsh_destination),noir_replay_test_avic_icr_hi(noir_svm_avic_max_physical_index),noir_replay_test_avic_dfr_flat,0,targets);
+	noir_replay_assert(targets[0]==0 && targets[3]==(u64)1<<(noir_svm_avic_max_physical_index&63));
+	noir_replay_assert(nvc_svm_avic_filter_running(noir_replay_test_avic_physical,targets)==1);
+	// Writes to LDR and ICR are trap-like. Writes to TPR and reads of IRR are not.
+	noir_replay_assert(nvc_svm_avic_is_trap_access(amd64_apic_ldr) && nvc_svm_avic_is_trap_access(amd64_apic_icr_lo));
+	noir_replay_assert(!nvc_svm_avic_is_trap_access(amd64_apic_tpr) && !nvc_svm_avic_is_trap_access(amd64_apic_irr));
+	return true;
+}
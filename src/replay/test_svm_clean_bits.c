@@ -0,0 +1,162 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file tests the VMCB clean bits and the state synchronization of SVM CVM.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_svm_clean_bits.c
+*/
+
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvbdk.h>
+#include <nvstatus.h>
+#include <noirhvm.h>
+#include <svm_intrin.h>
+#include <nv_intrin.h>
+#include <amd64.h>
+#include "../svm_core/svm_vmcb.h"
+#include "../svm_core/svm_def.h"
+#include "replay.h"
+#include "replay_test.h"
+
+#define noir_replay_test_clean_all		0xFFFFFFFF
+
+// Groups with clean bits that the VMM may write back unchanged.
+#define noir_replay_test_clean_groups	(noir_cvm_state_cache_cr_valid|noir_cvm_state_cache_cr2valid|noir_cvm_state_cache_dr_valid|noir_cvm_state_cache_sr_valid|noir_cvm_state_cache_dt_valid|noir_cvm_state_cache_tp_valid|noir_cvm_state_cache_ef_valid|noir_cvm_state_cache_pa_valid|noir_cvm_state_cache_ts_valid)
+
+extern noir_svm_vcpu_p noir_replay_svm_vcpu;
+
+u8 static _Alignas(page_size) noir_replay_test_clean_vmcb[page_size];
+noir_svm_custom_vm static noir_replay_test_clean_vm;
+noir_svm_custom_vcpu static noir_replay_test_clean_cvcpu;
+
+// Build a vCPU as it is right after a VM-Exit: every group is valid in the VMCB and nothing is dumped yet.
+noir_svm_custom_vcpu_p static noir_replay_test_clean_reset()
+{
+	noir_svm_custom_vcpu_p cvcpu=&noir_replay_test_clean_cvcpu;
+	void* vmcb=noir_replay_test_clean_vmcb;
+	noir_stosb(vmcb,0,page_size);
+	noir_stosb(&noir_replay_test_clean_vm,0,sizeof(noir_svm_custom_vm));
+	noir_stosb(cvcpu,0,sizeof(noir_svm_custom_vcpu));
+	cvcpu->vm=&noir_replay_test_clean_vm;
+	cvcpu->vmcb.virt=vmcb;
+	cvcpu->vmcb.phys=(u64)vmcb;
+	noir_svm_vmwrite64(vmcb,guest_cr0,0x80050033);
+	noir_svm_vmwrite64(vmcb,guest_cr2,0xFFFFF80000001000);
+	noir_svm_vmwrite64(vmcb,guest_cr3,0x1AB000);
+	noir_svm_vmwrite64(vmcb,guest_cr4,0x3506F8);
+	noir_svm_vmwrite64(vmcb,guest_dr6,0xFFFF0FF0);
+	noir_svm_vmwrite64(vmcb,guest_dr7,0x400);
+	noir_svm_vmwrite8(vmcb,avic_control,2);
+	noir_svm_vmwrite16(vmcb,guest_cs_selector,0x10);
+	noir_svm_vmwrite16(vmcb,guest_cs_attrib,0x29B);
+	noir_svm_vmwrite16(vmcb,guest_ss_selector,0x18);
+	noir_svm_vmwrite16(vmcb,guest_ss_attrib,0x493);
+	noir_svm_vmwrite32(vmcb,guest_ss_limit,0xFFFFFFFF);
+	noir_svm_vmwrite32(vmcb,guest_gdtr_limit,0x57);
+	noir_svm_vmwrite64(vmcb,guest_gdtr_base,0xFFFFF80000002000);
+	noir_svm_vmwrite32(vmcb,guest_idtr_limit,0xFFF);
+	noir_svm_vmwrite64(vmcb,guest_idtr_base,0xFFFFF80000003000);
+	noir_svm_vmwrite64(vmcb,guest_efer,0x1D01);
+	noir_svm_vmwrite64(vmcb,guest_pat,0x0007040600070406);
+	noir_svm_vmwrite64(vmcb,tsc_offset,0x1000);
+	cvcpu->header.tsc_offset=0x1000;
+	cvcpu->header.state_cache.value=noir_cvm_state_cache_all_groups;
+	cvcpu->header.state_cache.tl_valid=true;
+	return cvcpu;
+}
+
+// The layered hypervisor writes the groups back and switches to the guest. Returns the clean bits of the VMCB.
+u32 static noir_replay_test_clean_switch(noir_svm_custom_vcpu_p cvcpu,u32 edited_groups)
+{
+	noir_gpr_state gpr_state={0};
+	noir_svm_vmwrite32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_replay_test_clean_all);
+	noir_svm_vmwrite8(cvcpu->vmcb.virt,tlb_control,0);
+	cvcpu->header.state_cache.value&=~edited_groups;
+	nvc_svm_switch_to_guest_vcpu(&gpr_state,noir_replay_svm_vcpu,cvcpu);
+	return noir_svm_vmread32(cvcpu->vmcb.virt,vmcb_clean_bits);
+}
+
+bool noir_replay_test_svm_state_synchronization()
+{
+	noir_svm_custom_vcpu_p cvcpu=noir_replay_test_clean_reset();
+	u32 stale;
+	// Only the requested groups are dumped.
+	stale=noir_cvm_stale_state_groups(&cvcpu->header,noir_cvm_state_cache_cr_valid|noir_cvm_state_cache_sr_valid);
+	noir_replay_assert(stale==(noir_cvm_state_cache_cr_valid|noir_cvm_state_cache_sr_valid));
+	cvcpu->header.synchronizing_groups=stale;
+	nvc_svm_dump_guest_vcpu_state(cvcpu);
+	noir_replay_assert(cvcpu->header.crs.cr3==0x1AB000 && cvcpu->header.seg.cs.selector==0x10);
+	noir_replay_assert(cvcpu->header.drs.dr7==0 && cvcpu->header.seg.gdtr.limit==0);
+	noir_replay_assert(cvcpu->header.synchronized_groups==stale && cvcpu->header.synchronizing_groups==0);
+	noir_replay_assert(!cvcpu->header.state_cache.synchronized);
+	// Dumped groups are not dumped again until the next VM-Exit.
+	noir_replay_assert(noir_cvm_stale_state_groups(&cvcpu->header,noir_cvm_state_cache_cr_valid)==0);
+	// Groups edited by the VMM are never dumped. Dumping them would discard the edits.
+	cvcpu->header.drs.dr7=0x401;
+	cvcpu->header.state_cache.dr_valid=false;
+	stale=noir_cvm_stale_state_groups(&cvcpu->header,noir_cvm_state_cache_all_groups);
+	noir_replay_assert(stale==(noir_cvm_state_cache_all_groups&~(noir_cvm_state_cache_cr_valid|noir_cvm_state_cache_sr_valid|noir_cvm_state_cache_dr_valid)));
+	cvcpu->header.synchronizing_groups=stale;
+	nvc_svm_dump_guest_vcpu_state(cvcpu);
+	noir_replay_assert(cvcpu->header.drs.dr7==0x401 && cvcpu->header.seg.gdtr.limit==0x57);
+	// The SVME bit is shadowed.
+	noir_replay_assert(cvcpu->header.msrs.efer==0xD01);
+	// Requesting no specific group dumps all valid groups.
+	cvcpu->header.synchronizing_groups=0;
+	nvc_svm_dump_guest_vcpu_state(cvcpu);
+	noir_replay_assert(cvcpu->header.state_cache.synchronized);
+	noir_replay_assert(cvcpu->header.drs.dr7==0x401);
+	return true;
+}
+
+bool noir_replay_test_svm_clean_bits()
+{
+	noir_svm_custom_vcpu_p cvcpu=noir_replay_test_clean_reset();
+	cvcpu->header.synchronizing_groups=0;
+	nvc_svm_dump_guest_vcpu_state(cvcpu);
+	// Writing back unchanged groups keeps every clean bit and does not flush the TLB.
+	noir_replay_assert(noir_replay_test_clean_switch(cvcpu,noir_replay_test_clean_groups)==noir_replay_test_clean_all);
+	noir_replay_assert(noir_svm_vmread8(cvcpu->vmcb.virt,tlb_control)==0);
+	// Every width of field comparison clears only the clean bit of its own group.
+	cvcpu->header.crs.cr8=5;
+	noir_replay_assert(noir_replay_test_clean_switch(cvcpu,noir_cvm_state_cache_tp_valid)==(noir_replay_test_clean_all&~(1<<noir_svm_clean_tpr)));
+	noir_replay_assert(noir_svm_vmread8(cvcpu->vmcb.virt,avic_control)==5);
+	cvcpu->header.seg.ss.selector=0x2B;
+	noir_replay_assert(noir_replay_test_clean_switch(cvcpu,noir_cvm_state_cache_sr_valid)==(noir_replay_test_clean_all&~(1<<noir_svm_clean_segment_reg)));
+	noir_replay_assert(noir_svm_vmread16(cvcpu->vmcb.virt,guest_ss_selector)==0x2B);
+	cvcpu->header.seg.ss.limit=0xFFFFF;
+	noir_replay_assert(noir_replay_test_clean_switch(cvcpu,noir_cvm_state_cache_sr_valid)==(noir_replay_test_clean_all&~(1<<noir_svm_clean_segment_reg)));
+	cvcpu->header.seg.gdtr.limit=0x7F;
+	noir_replay_assert(noir_replay_test_clean_switch(cvcpu,noir_cvm_state_cache_dt_valid)==(noir_replay_test_clean_all&~(1<<noir_svm_clean_idt_gdt)));
+	noir_replay_assert(noir_svm_vmread32(cvcpu->vmcb.virt,guest_gdtr_limit)==0x7F);
+	cvcpu->header.crs.cr2=0x7FF000;
+	noir_replay_assert(noir_replay_test_clean_switch(cvcpu,noir_cvm_state_cache_cr2valid)==(noir_replay_test_clean_all&~(1<<noir_svm_clean_cr2)));
+	cvcpu->header.drs.dr7=0x401;
+	noir_replay_assert(noir_replay_test_clean_switch(cvcpu,noir_cvm_state_cache_dr_valid)==(noir_replay_test_clean_all&~(1<<noir_svm_clean_debug_reg)));
+	cvcpu->header.msrs.pat=0x0007010600070106;
+	noir_replay_assert(noir_replay_test_clean_switch(cvcpu,noir_cvm_state_cache_pa_valid)==(noir_replay_test_clean_all&~(1<<noir_svm_clean_npt)));
+	cvcpu->header.tsc_offset=0x2000;
+	noir_replay_assert(noir_replay_test_clean_switch(cvcpu,noir_cvm_state_cache_ts_valid)==(noir_replay_test_clean_all&~(1<<noir_svm_clean_interception)));
+	noir_replay_assert(noir_svm_vmread8(cvcpu->vmcb.virt,tlb_control)==0);
+	// Changing a control register flushes the TLB of the guest.
+	cvcpu->header.crs.cr3=0x2CD000;
+	noir_replay_assert(noir_replay_test_clean_switch(cvcpu,noir_cvm_state_cache_cr_valid)==(noir_replay_test_clean_all&~(1<<noir_svm_clean_control_reg)));
+	noir_replay_assert(noir_svm_vmread8(cvcpu->vmcb.virt,tlb_control)==nvc_svm_tlb_control_flush_guest);
+	noir_replay_assert(noir_svm_vmread64(cvcpu->vmcb.virt,guest_cr3)==0x2CD000);
+	// EFER is written with SVME set. Toggling NXE invalidates the control registers and the TLB.
+	cvcpu->header.msrs.efer^=amd64_efer_nxe_bit;
+	noir_replay_assert(noir_replay_test_clean_switch(cvcpu,noir_cvm_state_cache_ef_valid)==(noir_replay_test_clean_all&~(1<<noir_svm_clean_control_reg)));
+	noir_replay_assert(noir_svm_vmread8(cvcpu->vmcb.virt,tlb_control)==nvc_svm_tlb_control_flush_guest);
+	noir_replay_assert(noir_svm_vmread64(cvcpu->vmcb.virt,guest_efer)==0x1501);
+	// Rescheduling the vCPU to another processor invalidates every cached state.
+	cvcpu->proc_id=1;
+	noir_replay_assert(noir_replay_test_clean_switch(cvcpu,0)==0);
+	return true;
+}
@@ -0,0 +1,168 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file tests the handling of VM-Exits from the nested guest in the SVM core.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_svm_nested.c
+*/
+
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvbdk.h>
+#include <nvstatus.h>
+#include <noirhvm.h>
+#include <svm_intrin.h>
+#include <nv_intrin.h>
+#include <amd64.h>
+#include "../svm_core/svm_vmcb.h"
+#include "../svm_core/svm_exit.h"
+#include "../svm_core/svm_def.h"
+#include "replay.h"
+#include "replay_test.h"
+
+#define noir_replay_test_svm_rip		0x1000
+#define noir_replay_test_svm_length		2
+
+extern noir_svm_vcpu_p noir_replay_svm_vcpu;
+extern noir_gpr_state noir_replay_svm_gpr;
+
+// Structures referenced by physical addresses. Virtual addresses are used as physical addresses.
+u8 static _Alignas(page_size) noir_replay_test_svm_vmcb_c[page_size];
+u8 static _Alignas(page_size) noir_replay_test_svm_vmcb_t[page_size];
+u8 static _Alignas(page_size) noir_replay_test_svm_l0_iopm[page_size*3];
+u8 static _Alignas(page_size) noir_replay_test_svm_l0_msrpm[page_size*2];
+u8 static _Alignas(page_size) noir_replay_test_svm_l1_iopm[page_size*3];
+u8 static _Alignas(page_size) noir_replay_test_svm_l1_msrpm[page_size*2];
+u8 static _Alignas(page_size) noir_replay_test_svm_iopm_t[page_size*3];
+u8 static _Alignas(page_size) noir_replay_test_svm_msrpm_t[page_size*2];
+noir_svm_nested_vcpu_node static noir_replay_test_svm_node;
+noir_exit_trace_record static noir_replay_test_svm_record;
+
+// Simulate a VM-Exit from the nested guest. Returns true if it is reflected to the nested hypervisor.
+bool static noir_replay_test_svm_nested_exit(i32 intercept_code,u64 info1,u64 info2,u64 rcx)
+{
+	noir_svm_initial_stack_p loader_stack=noir_svm_get_loader_stack(noir_replay_svm_vcpu->hv_stack);
+	noir_svm_nested_vcpu_node_p node=&noir_replay_test_svm_node;
+	void* vmcb_t=node->vmcb_t.virt;
+	// The length of the instruction is decoded from the record.
+	noir_replay_test_svm_record.vendor=noir_exit_trace_vendor_svm;
+	noir_replay_test_svm_record.rip=noir_replay_test_svm_rip;
+	noir_replay_test_svm_record.info[2]=noir_replay_test_svm_rip+noir_replay_test_svm_length;
+	noir_replay_record=&noir_replay_test_svm_record;
+	noir_svm_vmwrite64(vmcb_t,exit_code,(u64)(i64)intercept_code);
+	noir_svm_vmwrite64(vmcb_t,exit_info1,info1);
+	noir_svm_vmwrite64(vmcb_t,exit_info2,info2);
+	noir_svm_vmwrite64(vmcb_t,next_rip,noir_replay_test_svm_rip+noir_replay_test_svm_length);
+	noir_svm_vmwrite64(vmcb_t,guest_rip,noir_replay_test_svm_rip);
+	noir_svm_vmwrite64(vmcb_t,event_injection,0);
+	loader_stack->nested_vcpu=node;
+	loader_stack->guest_vmcb_pa=node->vmcb_t.phys;
+	noir_replay_svm_gpr.rax=node->vmcb_t.phys;
+	noir_replay_svm_gpr.rcx=rcx;
+	noir_replay_svm.invoke();
+	return loader_stack->guest_vmcb_pa==noir_replay_svm_vcpu->vmcb.phys;
+}
+
+// VM-Exits are reflected only if the nested hypervisor intercepts them. Others take the fast paths of NoirVisor.
+bool noir_replay_test_svm_nested_fast_path()
+{
+	noir_svm_nested_vcpu_node_p node=&noir_replay_test_svm_node;
+	noir_svm_hvm_p relative_hvm=noir_replay_svm_vcpu->relative_hvm;
+	noir_rmt_entry rmt={0};
+	void* vmcb_c=noir_replay_test_svm_vmcb_c;
+	void* vmcb_t=noir_replay_test_svm_vmcb_t;
+	const u64 efer=amd64_efer_svme_bit|0xD01;		// SCE, LME, LMA and NXE.
+	nvc_svm_io_exit_info io;
+	noir_replay_identity_memory=true;
+	noir_stosb(vmcb_c,0,page_size);
+	noir_stosb(vmcb_t,0,page_size);
+	noir_stosb(noir_replay_test_svm_l0_iopm,0,page_size*3);
+	noir_stosb(noir_replay_test_svm_l0_msrpm,0,page_size*2);
+	noir_stosb(noir_replay_test_svm_l1_iopm,0,page_size*3);
+	noir_stosb(noir_replay_test_svm_l1_msrpm,0,page_size*2);
+	noir_stosb(node,0,sizeof(noir_svm_nested_vcpu_node));
+	// NoirVisor intercepts EFER and port 0x1000.
+	relative_hvm->iopm.virt=noir_replay_test_svm_l0_iopm;
+	relative_hvm->msrpm.virt=noir_replay_test_svm_l0_msrpm;
+	noir_set_bitmap(noir_replay_test_svm_l0_iopm,0x1000);
+	noir_set_bitmap((void*)((ulong_ptr)noir_replay_test_svm_l0_msrpm+0x800),svm_msrpm_bit(2,amd64_efer,0));
+	noir_set_bitmap((void*)((ulong_ptr)noir_replay_test_svm_l0_msrpm+0x800),svm_msrpm_bit(2,amd64_efer,1));
+	// The nested hypervisor intercepts port 0x60 and reads from TSC with NPT enabled.
+	noir_set_bitmap(noir_replay_test_svm_l1_iopm,0x60);
+	noir_set_bitmap(noir_replay_test_svm_l1_msrpm,svm_msrpm_bit(1,amd64_tsc,0));
+	noir_svm_vmcb_bts32(vmcb_c,intercept_instruction1,nvc_svm_intercept_vector1_io);
+	noir_svm_vmcb_bts32(vmcb_c,intercept_instruction1,nvc_svm_intercept_vector1_msr);
+	noir_svm_vmwrite64(vmcb_c,iopm_physical_address,(u64)noir_replay_test_svm_l1_iopm);
+	noir_svm_vmwrite64(vmcb_c,msrpm_physical_address,(u64)noir_replay_test_svm_l1_msrpm);
+	noir_svm_vmcb_bts32(vmcb_c,npt_control,nvc_svm_npt_control_npt);
+	noir_svm_vmwrite64(vmcb_c,guest_efer,efer);
+	noir_svm_vmwrite16(vmcb_c,guest_cs_attrib,0x29B);
+	node->vmcb_c.virt=vmcb_c;
+	node->vmcb_c.phys=(u64)vmcb_c;
+	node->vmcb_t.virt=vmcb_t;
+	node->vmcb_t.phys=(u64)vmcb_t;
+	node->iopm_t.virt=noir_replay_test_svm_iopm_t;
+	node->iopm_t.phys=(u64)noir_replay_test_svm_iopm_t;
+	node->msrpm_t.virt=noir_replay_test_svm_msrpm_t;
+	node->msrpm_t.phys=(u64)noir_replay_test_svm_msrpm_t;
+	nvc_svm_switch_to_nested_vcpu(&noir_replay_svm_gpr,noir_replay_svm_vcpu,node);
+	// The nested guest exits if either NoirVisor or the nested hypervisor intercepts the access.
+	noir_replay_assert(noir_svm_vmread64(vmcb_t,iopm_physical_address)==node->iopm_t.phys);
+	noir_replay_assert(noir_svm_vmread64(vmcb_t,msrpm_physical_address)==node->msrpm_t.phys);
+	noir_replay_assert(noir_test_bitmap(noir_replay_test_svm_iopm_t,0x60) && noir_test_bitmap(noir_replay_test_svm_iopm_t,0x1000));
+	noir_replay_assert(!noir_test_bitmap(noir_replay_test_svm_iopm_t,0x61));
+	noir_replay_assert(noir_test_bitmap(noir_replay_test_svm_msrpm_t,svm_msrpm_bit(1,amd64_tsc,0)));
+	noir_replay_assert(!noir_test_bitmap(noir_replay_test_svm_msrpm_t,svm_msrpm_bit(1,amd64_tsc,1)));
+	noir_replay_assert(noir_test_bitmap(noir_replay_test_svm_msrpm_t,0x4000+svm_msrpm_bit(2,amd64_efer,1)));
+	// Reading TSC is reflected. Writing TSC is performed by NoirVisor.
+	noir_replay_assert(noir_replay_test_svm_nested_exit(intercepted_msr,0,0,amd64_tsc));
+	noir_replay_svm_gpr.rdx=0x1;
+	noir_svm_vmwrite64(vmcb_t,guest_rax,0x2345);
+	noir_replay_assert(!noir_replay_test_svm_nested_exit(intercepted_msr,1,0,amd64_tsc));
+	noir_replay_assert(noir_rdmsr(amd64_tsc)==0x100002345);
+	noir_replay_assert(noir_svm_vmread64(vmcb_t,guest_rip)==noir_replay_test_svm_rip+noir_replay_test_svm_length);
+	// MSRs out of MSRPM are always reflected if the nested hypervisor protects MSRs.
+	noir_replay_assert(noir_replay_test_svm_nested_exit(intercepted_msr,0,0,0x40000000));
+	// EFER of the nested guest is emulated with SVM hidden.
+	noir_replay_assert(!noir_replay_test_svm_nested_exit(intercepted_msr,0,0,amd64_efer));
+	noir_replay_assert(noir_svm_vmread64(vmcb_t,guest_rax)==(efer&~amd64_efer_svme_bit));
+	noir_replay_svm_gpr.rdx=0;
+	noir_svm_vmwrite64(vmcb_t,guest_rax,efer);
+	noir_replay_assert(!noir_replay_test_svm_nested_exit(intercepted_msr,1,0,amd64_efer));
+	noir_replay_assert(noir_svm_vmread64(vmcb_t,guest_rip)==noir_replay_test_svm_rip && noir_svm_vmread64(vmcb_t,event_injection)!=0);
+	// Port I/O: A word access at 0x5F covers the intercepted port 0x60.
+	io.value=0;
+	io.type=1;
+	io.op_size=2;
+	io.port=0x5F;
+	noir_replay_assert(noir_replay_test_svm_nested_exit(intercepted_io,io.value,noir_replay_test_svm_rip+1,0));
+	io.port=0x61;
+	noir_replay_assert(!nvc_svm_nested_exit_reflected(node,intercepted_io,io.value,0));
+	// Port 0x1000 is intercepted by NoirVisor only. The access is performed without the nested hypervisor.
+	io.op_size=1;
+	io.port=0x1000;
+	noir_svm_vmwrite64(vmcb_t,guest_rax,0x1234);
+	noir_replay_assert(!noir_replay_test_svm_nested_exit(intercepted_io,io.value,noir_replay_test_svm_rip+1,0));
+	noir_replay_assert(noir_svm_vmread64(vmcb_t,guest_rax)==0x12FF);
+	noir_replay_assert(noir_svm_vmread64(vmcb_t,guest_rip)==noir_replay_test_svm_rip+1);
+	// The interrupt window requested by NoirVisor is closed without the nested hypervisor.
+	noir_svm_vmcb_bts32(vmcb_t,intercept_instruction1,nvc_svm_intercept_vector1_vint);
+	noir_replay_assert(!noir_replay_test_svm_nested_exit(intercepted_vintr,0,0,0));
+	noir_replay_assert(!noir_svm_vmcb_bt32(vmcb_t,intercept_instruction1,nvc_svm_intercept_vector1_vint));
+	node->l1_intercepts[intercepted_vintr>>5]|=1<<(intercepted_vintr&31);
+	noir_replay_assert(nvc_svm_nested_exit_reflected(node,intercepted_vintr,0,0));
+	// Nested page faults on NoirVisor's NPT are classified by the reverse-mapping table.
+	node->flags.l1_npt=false;
+	noir_replay_rmt_entry=&rmt;
+	noir_replay_assert(!noir_replay_test_svm_nested_exit(nested_page_fault,7,0x2000,0));
+	noir_replay_assert(noir_svm_vmread64(vmcb_t,guest_rip)==noir_replay_test_svm_rip+noir_replay_test_svm_length);
+	node->flags.l1_npt=true;
+	noir_replay_assert(noir_replay_test_svm_nested_exit(nested_page_fault,7,0x2000,0));
+	return true;
+}
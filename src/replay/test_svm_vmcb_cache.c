@@ -0,0 +1,180 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file tests and benchmarks the nested VMCB cache of the SVM core.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_svm_vmcb_cache.c
+*/
+
+#include <stdio.h>
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvbdk.h>
+#include <nvstatus.h>
+#include <noirhvm.h>
+#include <svm_intrin.h>
+#include <nv_intrin.h>
+#include <amd64.h>
+#include "replay.h"
+#include "replay_test.h"
+
+#define noir_replay_test_cache_capacity		8
+#define noir_replay_test_cache_max_capacity	1024
+#define noir_replay_test_cache_trace_length	0x4000
+
+// Nested VMCBs are never dereferenced by the cache. Page-aligned fake GPAs suffice.
+#define noir_replay_test_cache_vmcb(i)		(0x100000+((u64)(i)<<page_shift))
+
+noir_svm_nested_vcpu_node static noir_replay_test_cache_pool[noir_replay_test_cache_max_capacity];
+noir_svm_nested_vcpu static noir_replay_test_cache_nvcpu;
+// Reference model of the cache: VMCBs ordered by time of reference. The first is the most recently used.
+u64 static noir_replay_test_cache_model[noir_replay_test_cache_max_capacity];
+u32 static noir_replay_test_cache_model_size;
+
+noir_svm_nested_vcpu_p static noir_replay_test_cache_reset(u32 capacity)
+{
+	noir_svm_nested_vcpu_p nvcpu=&noir_replay_test_cache_nvcpu;
+	noir_stosb(noir_replay_test_cache_pool,0,sizeof(noir_replay_test_cache_pool));
+	noir_stosb(nvcpu,0,sizeof(noir_svm_nested_vcpu));
+	nvcpu->node_pool=noir_replay_test_cache_pool;
+	nvcpu->cache.capacity=capacity;
+	nvc_svm_initialize_nested_vcpu_cache(nvcpu);
+	noir_replay_test_cache_model_size=0;
+	return nvcpu;
+}
+
+// Returns true if the reference hits. The model behaves as an ideal LRU cache.
+bool static noir_replay_test_cache_model_reference(u64 vmcb,u32 capacity)
+{
+	u32 i=0;
+	bool hit=false;
+	for(;i<noir_replay_test_cache_model_size;i++)
+	{
+		if(noir_replay_test_cache_model[i]==vmcb)
+		{
+			hit=true;
+			break;
+		}
+	}
+	if(!hit)
+	{
+		if(noir_replay_test_cache_model_size<capacity)noir_replay_test_cache_model_size++;
+		i=noir_replay_test_cache_model_size-1;
+	}
+	for(;i>0;i--)noir_replay_test_cache_model[i]=noir_replay_test_cache_model[i-1];
+	noir_replay_test_cache_model[0]=vmcb;
+	return hit;
+}
+
+// Returns the height of the subtree, or -1 if the subtree is not a valid AVL tree of cached nodes within the range.
+i64 static noir_replay_test_cache_check_avl(noir_svm_nested_vcpu_node_p node,u64 low,u64 high,u32p count)
+{
+	i64 left_height,right_height;
+	if(node==null)return 0;
+	if(!node->flags.cached || node->vmcb_c.phys<low || node->vmcb_c.phys>high)return -1;
+	left_height=noir_replay_test_cache_check_avl((noir_svm_nested_vcpu_node_p)node->avl.left,low,node->vmcb_c.phys-1,count);
+	right_height=noir_replay_test_cache_check_avl((noir_svm_nested_vcpu_node_p)node->avl.right,node->vmcb_c.phys+1,high,count);
+	if(left_height<0 || right_height<0)return -1;
+	if(left_height-right_height>1 || right_height-left_height>1)return -1;
+	if(node->avl.height!=(left_height>right_height?left_height:right_height)+1)return -1;
+	(*count)++;
+	return node->avl.height;
+}
+
+// The cache list must be ordered exactly as the reference model.
+bool static noir_replay_test_cache_check_list(noir_svm_nested_vcpu_p nvcpu)
+{
+	list_entry_p entry=nvcpu->cache.head.next;
+	for(u32 i=0;i<noir_replay_test_cache_model_size;i++)
+	{
+		noir_svm_nested_vcpu_node_p node=(noir_svm_nested_vcpu_node_p)((ulong_ptr)entry-field_offset(noir_svm_nested_vcpu_node,cache_list));
+		if(entry==&nvcpu->cache.head)return false;
+		if(!node->flags.cached || node->vmcb_c.phys!=noir_replay_test_cache_model[i])return false;
+		entry=entry->next;
+	}
+	// The remaining nodes are not assigned yet.
+	for(;entry!=&nvcpu->cache.head;entry=entry->next)
+	{
+		noir_svm_nested_vcpu_node_p node=(noir_svm_nested_vcpu_node_p)((ulong_ptr)entry-field_offset(noir_svm_nested_vcpu_node,cache_list));
+		if(node->flags.cached)return false;
+	}
+	return true;
+}
+
+// Synthetic VMCB working set: most switches go to a few hot VMCBs, the rest scatter over many cold VMCBs.
+u64 static noir_replay_test_cache_trace(u32p seed,u32 hot,u32 cold)
+{
+	u32 r;
+	*seed=*seed*1103515245+12345;
+	r=*seed>>8;
+	if((r&3)!=0)return noir_replay_test_cache_vmcb((r>>2)%hot);
+	return noir_replay_test_cache_vmcb(hot+(r>>2)%cold);
+}
+
+bool noir_replay_test_svm_vmcb_cache()
+{
+	noir_svm_nested_vcpu_p nvcpu=noir_replay_test_cache_reset(noir_replay_test_cache_capacity);
+	noir_svm_nested_vcpu_node_p first,node;
+	u32 count=0;
+	// Cold misses fill the cache without eviction.
+	first=nvc_svm_get_nested_vcpu_node(nvcpu,noir_replay_test_cache_vmcb(0));
+	noir_replay_assert(first->flags.cached && first->vmcb_c.phys==noir_replay_test_cache_vmcb(0));
+	for(u32 i=1;i<noir_replay_test_cache_capacity;i++)nvc_svm_get_nested_vcpu_node(nvcpu,noir_replay_test_cache_vmcb(i));
+	noir_replay_assert(nvcpu->cache.misses==noir_replay_test_cache_capacity);
+	noir_replay_assert(nvcpu->cache.hits==0 && nvcpu->cache.evictions==0);
+	noir_replay_assert(noir_replay_test_cache_check_avl(nvcpu->cache.root,0,maxu64,&count)>0);
+	noir_replay_assert(count==noir_replay_test_cache_capacity);
+	// A hit returns the same node and refreshes it.
+	node=nvc_svm_get_nested_vcpu_node(nvcpu,noir_replay_test_cache_vmcb(0));
+	noir_replay_assert(node==first && nvcpu->cache.hits==1);
+	// VMCB 1 is the least recently used. It is evicted for a new VMCB.
+	node=nvc_svm_get_nested_vcpu_node(nvcpu,noir_replay_test_cache_vmcb(noir_replay_test_cache_capacity));
+	noir_replay_assert(node!=first && nvcpu->cache.evictions==1);
+	noir_replay_assert(nvc_svm_get_nested_vcpu_node(nvcpu,noir_replay_test_cache_vmcb(0))==first);
+	noir_replay_assert(nvcpu->cache.hits==2);
+	nvc_svm_get_nested_vcpu_node(nvcpu,noir_replay_test_cache_vmcb(1));
+	noir_replay_assert(nvcpu->cache.misses==noir_replay_test_cache_capacity+2 && nvcpu->cache.evictions==2);
+	// Replay a synthetic trace against the reference model. Every reference must agree on hit or miss.
+	nvcpu=noir_replay_test_cache_reset(noir_replay_test_cache_capacity);
+	for(u32 i=0,seed=1;i<noir_replay_test_cache_trace_length;i++)
+	{
+		const u64 vmcb=noir_replay_test_cache_trace(&seed,noir_replay_test_cache_capacity>>1,noir_replay_test_cache_capacity*4);
+		const u64 hits=nvcpu->cache.hits;
+		node=nvc_svm_get_nested_vcpu_node(nvcpu,vmcb);
+		noir_replay_assert(node->vmcb_c.phys==vmcb);
+		noir_replay_assert(noir_replay_test_cache_model_reference(vmcb,noir_replay_test_cache_capacity)==(nvcpu->cache.hits>hits));
+		// The tree must stay balanced and index exactly the nodes of the model.
+		count=0;
+		noir_replay_assert(noir_replay_test_cache_check_avl(nvcpu->cache.root,0,maxu64,&count)>0);
+		noir_replay_assert(count==noir_replay_test_cache_model_size);
+		noir_replay_assert(noir_replay_test_cache_check_list(nvcpu));
+	}
+	noir_replay_assert(nvcpu->cache.hits+nvcpu->cache.misses==noir_replay_test_cache_trace_length);
+	noir_replay_assert(nvcpu->cache.misses-nvcpu->cache.evictions==noir_replay_test_cache_capacity);
+	// The hot VMCBs fit in the cache. At least the hot references hit after the warm-up.
+	noir_replay_assert(nvcpu->cache.hits*2>noir_replay_test_cache_trace_length);
+	return true;
+}
+
+// Hit rates and lookup costs of the synthetic trace with different capacities.
+void noir_replay_benchmark_svm_vmcb_cache(u32 rounds)
+{
+	const u32 capacities[]={2,16,64,noir_replay_test_cache_max_capacity};
+	printf("  Capacity   Hit Rate   Ticks per Lookup\n");
+	for(u32 i=0;i<sizeof(capacities)/sizeof(u32);i++)
+	{
+		noir_svm_nested_vcpu_p nvcpu=noir_replay_test_cache_reset(capacities[i]);
+		u64 start,total;
+		u32 seed=1;
+		start=__rdtsc();
+		for(u32 j=0;j<rounds;j++)nvc_svm_get_nested_vcpu_node(nvcpu,noir_replay_test_cache_trace(&seed,8,256));
+		total=__rdtsc()-start;
+		printf("  %8u   %7.2f%%   %llu\n",capacities[i],(double)nvcpu->cache.hits*100/rounds,total/rounds);
+	}
+}
@@ -0,0 +1,127 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file tests the posted-interrupt and virtual-APIC model of Intel VT-x CVM.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_vt_apicv.c
+*/
+
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvstatus.h>
+#include <nvbdk.h>
+#include <noirhvm.h>
+#include <nv_intrin.h>
+#include <ia32.h>
+#include "../vt_core/vt_def.h"
+#include "../vt_core/vt_apicv.h"
+#include "replay.h"
+#include "replay_test.h"
+
+#define noir_replay_test_apicv_vcpu_id	3
+
+/*
+  The processor merges PIR into VIRR on notification in the following steps:
+  1. Clear ON in the descriptor.
+  2. OR the PIR into VIRR and clear the PIR, atomically.
+  3. Set RVI to the maximum of the old RVI and the highest vector in VIRR.
+  NoirVisor performs the same steps before VM-Entry if the notification was suppressed.
+  The results of the model must conform to these steps.
+*/
+u32 static noir_replay_test_virtual_apic[0x400] __attribute__((aligned(0x1000)));
+ia32_posted_interrupt_descriptor static noir_replay_test_pi_desc __attribute__((aligned(64)));
+
+bool static noir_replay_test_virr_bit(u8 vector)
+{
+	return (noir_replay_test_virtual_apic[(ia32_apic_irr>>2)+((vector>>5)<<2)]>>(vector&31))&1;
+}
+
+bool noir_replay_test_vt_apicv_pir_merge()
+{
+	ia32_posted_interrupt_descriptor_p pi_desc=&noir_replay_test_pi_desc;
+	void* virtual_apic=noir_replay_test_virtual_apic;
+	u16 status;
+	// The reset page has no pending interrupts.
+	nvc_vt_apicv_reset_page(virtual_apic,noir_replay_test_apicv_vcpu_id);
+	noir_replay_assert(noir_replay_test_virtual_apic[ia32_apic_id>>2]==noir_replay_test_apicv_vcpu_id<<24);
+	noir_replay_assert(nvc_vt_apicv_highest_vector(virtual_apic,ia32_apic_irr)==noir_vt_apicv_no_vector);
+	// Notifications are suppressed while the vCPU is not running.
+	pi_desc->control.value=0;
+	pi_desc->control.notification_vector=noir_vt_posted_interrupt_vector;
+	pi_desc->control.suppress_notification=1;
+	noir_replay_assert(!nvc_vt_apicv_post_interrupt(pi_desc,0x41));
+	noir_replay_assert(pi_desc->control.outstanding_notification);
+	noir_replay_assert(pi_desc->pir[2]==2);
+	// Requests in different PIR words are all merged.
+	noir_replay_assert(!nvc_vt_apicv_post_interrupt(pi_desc,0x20));
+	noir_replay_assert(!nvc_vt_apicv_post_interrupt(pi_desc,0xFF));
+	status=nvc_vt_apicv_merge_pir(pi_desc,virtual_apic,0x3000);
+	noir_replay_assert(!pi_desc->control.outstanding_notification);
+	for(u32 i=0;i<8;i++)noir_replay_assert(pi_desc->pir[i]==0);
+	noir_replay_assert(noir_replay_test_virr_bit(0x20) && noir_replay_test_virr_bit(0x41) && noir_replay_test_virr_bit(0xFF));
+	noir_replay_assert(!noir_replay_test_virr_bit(0x21));
+	// RVI is the highest vector. SVI is unchanged.
+	noir_replay_assert(noir_vt_apicv_rvi(status)==0xFF);
+	noir_replay_assert(noir_vt_apicv_svi(status)==0x30);
+	// Nothing is merged if ON is clear, even if PIR is not empty.
+	pi_desc->pir[1]=1;
+	noir_replay_assert(nvc_vt_apicv_merge_pir(pi_desc,virtual_apic,0x1234)==0x1234);
+	noir_replay_assert(pi_desc->pir[1]==1);
+	noir_replay_assert(noir_replay_test_virtual_apic[(ia32_apic_irr>>2)+(1<<2)]==1);
+	pi_desc->pir[1]=0;
+	// RVI is not lowered by merging a lower vector.
+	nvc_vt_apicv_reset_page(virtual_apic,noir_replay_test_apicv_vcpu_id);
+	nvc_vt_apicv_post_interrupt(pi_desc,0x51);
+	status=nvc_vt_apicv_merge_pir(pi_desc,virtual_apic,0x00E0);
+	noir_replay_assert(noir_vt_apicv_rvi(status)==0xE0);
+	noir_replay_assert(nvc_vt_apicv_highest_vector(virtual_apic,ia32_apic_irr)==0x51);
+	return true;
+}
+
+bool noir_replay_test_vt_apicv_notification()
+{
+	ia32_posted_interrupt_descriptor_p pi_desc=&noir_replay_test_pi_desc;
+	void* virtual_apic=noir_replay_test_virtual_apic;
+	nvc_vt_apicv_reset_page(virtual_apic,noir_replay_test_apicv_vcpu_id);
+	noir_stosb(pi_desc,0,sizeof(ia32_posted_interrupt_descriptor));
+	pi_desc->control.notification_vector=noir_vt_posted_interrupt_vector;
+	// The first post to a running vCPU sends the notification.
+	noir_replay_assert(nvc_vt_apicv_post_interrupt(pi_desc,0x60));
+	// ON is set. The outstanding notification covers the following posts.
+	noir_replay_assert(!nvc_vt_apicv_post_interrupt(pi_desc,0x61));
+	noir_replay_assert(pi_desc->pir[3]==3);
+	// After the merge, a new post sends the notification again.
+	nvc_vt_apicv_merge_pir(pi_desc,virtual_apic,0);
+	noir_replay_assert(nvc_vt_apicv_post_interrupt(pi_desc,0x62));
+	// Posting a vector already pending neither loses nor duplicates it.
+	noir_replay_assert(!nvc_vt_apicv_post_interrupt(pi_desc,0x62));
+	nvc_vt_apicv_merge_pir(pi_desc,virtual_apic,0);
+	noir_replay_assert(noir_replay_test_virtual_apic[(ia32_apic_irr>>2)+(3<<2)]==7);
+	// The vector is not lost if SN is set after ON is cleared.
+	pi_desc->control.suppress_notification=1;
+	noir_replay_assert(!nvc_vt_apicv_post_interrupt(pi_desc,0x70));
+	noir_replay_assert(pi_desc->control.outstanding_notification);
+	return true;
+}
+
+bool noir_replay_test_vt_apicv_priority()
+{
+	// VPPR follows VTPR if its priority class is not lower than SVI's.
+	noir_replay_assert(nvc_vt_apicv_compute_ppr(0x35,0x20)==0x35);
+	noir_replay_assert(nvc_vt_apicv_compute_ppr(0x35,0x3F)==0x35);
+	noir_replay_assert(nvc_vt_apicv_compute_ppr(0x10,0x4A)==0x40);
+	// Delivery requires RVI[7:4]>VPPR[7:4].
+	noir_replay_assert(nvc_vt_apicv_is_deliverable(0x0051,0x40));
+	noir_replay_assert(!nvc_vt_apicv_is_deliverable(0x004F,0x40));
+	noir_replay_assert(!nvc_vt_apicv_is_deliverable(0x0000,0x00));
+	// An in-service interrupt of higher class blocks the request.
+	noir_replay_assert(!nvc_vt_apicv_is_deliverable(0x6051,0x00));
+	noir_replay_assert(nvc_vt_apicv_is_deliverable(0x6071,0x00));
+	return true;
+}
@@ -0,0 +1,110 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file tests the memory types of EPT and the failures of splitting pages.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_vt_ept.c
+*/
+
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvstatus.h>
+#include <nvbdk.h>
+#include <vt_intrin.h>
+#include <noirhvm.h>
+#include <nv_intrin.h>
+#include <ia32.h>
+#include "../vt_core/vt_vmcs.h"
+#include "../vt_core/vt_ept.h"
+#include "replay.h"
+#include "replay_test.h"
+
+#define noir_replay_test_ept_mtrr_valid		0x800
+
+// Memory is write-back, except for one uncacheable 4KiB page specified by the only variable MTRR.
+void static noir_replay_test_ept_set_mtrr(u64 uc_page)
+{
+	noir_wrmsr(ia32_mtrr_cap,1);
+	noir_wrmsr(ia32_mtrr_def_type,noir_replay_test_ept_mtrr_valid|ia32_write_back);
+	noir_wrmsr(ia32_mtrr_phys_base0,uc_page|ia32_uncacheable);
+	noir_wrmsr(ia32_mtrr_phys_base0+1,(0xFFFFFFFFFF000&~(u64)(page_4kb_size-1))|noir_replay_test_ept_mtrr_valid);
+}
+
+// Returns the memory type of the address, and whether the address is mapped by a 1GiB page.
+u8 static noir_replay_test_ept_memory_type(noir_ept_manager_p eptm,u64 gpa,bool* huge)
+{
+	noir_ept_pde_descriptor_p pde_p;
+	noir_ept_pte_descriptor_p pte_p;
+	ia32_addr_translator gat;
+	gat.value=gpa;
+	*huge=eptm->pdpt.virt[page_1gb_count(gpa)].huge_pdpte;
+	if(*huge)return (u8)eptm->pdpt.virt[page_1gb_count(gpa)].memory_type;
+	pde_p=nvc_ept_split_pdpte(eptm,gpa,false,false);
+	if(pde_p->large[gat.pde_offset].large_pde)return (u8)pde_p->large[gat.pde_offset].memory_type;
+	pte_p=nvc_ept_split_pde(eptm,gpa,false,false);
+	return (u8)pte_p->virt[gat.pte_offset].memory_type;
+}
+
+bool static noir_replay_test_ept_split_failure(noir_ept_manager_p eptm)
+{
+	bool huge;
+	// The uncacheable page splits its 1GiB and 2MiB pages. The rest stays write-back.
+	noir_replay_assert(noir_replay_test_ept_memory_type(eptm,0x40200000,&huge)==ia32_uncacheable && !huge);
+	noir_replay_assert(noir_replay_test_ept_memory_type(eptm,0x40201000,&huge)==ia32_write_back && !huge);
+	noir_replay_assert(noir_replay_test_ept_memory_type(eptm,0x40000000,&huge)==ia32_write_back && !huge);
+	noir_replay_assert(noir_replay_test_ept_memory_type(eptm,0x80200000,&huge)==ia32_write_back && huge);
+	// Splitting fails at every allocation, including those of splitting the 1GiB page for a 2MiB page.
+	// Nothing is updated and nothing is dereferenced.
+	for(u32 i=0;i<4;i++)
+	{
+		noir_replay_allocation_budget=i;
+		if(i<2)noir_replay_assert(nvc_ept_split_pdpte(eptm,0xC0000000,true,true)==null);
+		noir_replay_allocation_budget=i;
+		noir_replay_assert(nvc_ept_split_pde(eptm,0xC0001000,true,true)==null);
+		noir_replay_allocation_budget=i;
+		noir_replay_assert(nvc_ept_update_pte(eptm,0xC0001000,0xC0001000,true,true,true,true,0,true)==null);
+		noir_replay_assert(eptm->pdpt.virt[3].huge_pdpte && eptm->pde.head==eptm->pde.tail && eptm->pte.head==eptm->pte.tail);
+	}
+	// The guest moves the uncacheable page into an unsplit 1GiB page, as the MTRR-write exit does.
+	// The 1GiB page cannot be split. It takes the stricter type, rather than leaving the page cacheable.
+	noir_replay_allocation_budget=0;
+	noir_replay_test_ept_set_mtrr(0x80200000);
+	noir_replay_assert(nvc_ept_update_by_mtrr(eptm)==false);
+	noir_replay_assert(noir_replay_test_ept_memory_type(eptm,0x80200000,&huge)==ia32_uncacheable && huge);
+	// Pages that are split already are updated without allocations.
+	noir_replay_assert(noir_replay_test_ept_memory_type(eptm,0x40200000,&huge)==ia32_write_back && !huge);
+	noir_replay_assert(noir_replay_test_ept_memory_type(eptm,0xC0000000,&huge)==ia32_write_back && huge);
+	// Once memory is available, the update splits the page as usual.
+	noir_replay_allocation_budget=maxu32;
+	noir_replay_assert(nvc_ept_update_by_mtrr(eptm)==true);
+	noir_replay_assert(noir_replay_test_ept_memory_type(eptm,0x80200000,&huge)==ia32_uncacheable && !huge);
+	noir_replay_assert(noir_replay_test_ept_memory_type(eptm,0x80000000,&huge)==ia32_write_back && !huge);
+	return true;
+}
+
+bool noir_replay_test_vt_ept_split_failure()
+{
+	noir_ept_manager_p eptm=null;
+	bool result;
+	noir_replay_reset_processor();
+	noir_replay_test_ept_set_mtrr(0x40200000);
+	// Every allocation of the build may fail, including those of splitting pages for MTRRs.
+	for(u32 i=0;eptm==null;i++)
+	{
+		noir_replay_assert(i<0x10);
+		noir_replay_allocation_budget=i;
+		eptm=nvc_ept_build_identity_map(0);
+	}
+	noir_replay_allocation_budget=maxu32;
+	result=noir_replay_test_ept_split_failure(eptm);
+	noir_replay_allocation_budget=maxu32;
+	nvc_ept_cleanup(eptm);
+	noir_replay_reset_processor();
+	return result;
+}
@@ -0,0 +1,163 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file tests the bounded waits of Intel VT-d against simulated registers.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_vt_iommu.c
+*/
+
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvstatus.h>
+#include <nvbdk.h>
+#include <noirhvm.h>
+#include <nv_intrin.h>
+#include <ia32.h>
+#include "../vt_core/vt_iommu.h"
+#include "replay.h"
+#include "replay_test.h"
+
+#define noir_replay_test_iommu_iotlb_offset		0x100
+
+// The registers are plain memory: the simulated IOMMU never completes anything by itself.
+// The test plays the hardware by writing the registers before NoirVisor polls them.
+u8 static _Alignas(page_size) noir_replay_test_iommu_regs[page_size];
+u8 static _Alignas(page_size) noir_replay_test_iommu_queue[page_size];
+u8 static _Alignas(page_size) noir_replay_test_iommu_manager[sizeof(noir_dmar_manager)+sizeof(noir_dmar_iommu_bar_descriptor)];
+
+#define noir_replay_test_iommu_reg32(o)		(*(u32v*)&noir_replay_test_iommu_regs[o])
+#define noir_replay_test_iommu_reg64(o)		(*(u64v*)&noir_replay_test_iommu_regs[o])
+
+noir_dmar_manager_p static noir_replay_test_iommu_reset()
+{
+	noir_dmar_manager_p dmarm=(noir_dmar_manager_p)noir_replay_test_iommu_manager;
+	noir_dmar_iommu_bar_descriptor_p bar=&dmarm->bars[0];
+	noir_stosb(noir_replay_test_iommu_regs,0,page_size);
+	noir_stosb(noir_replay_test_iommu_queue,0,page_size);
+	noir_stosb(dmarm,0,sizeof(noir_replay_test_iommu_manager));
+	dmarm->iommu_count=1;
+	bar->virt=noir_replay_test_iommu_regs;
+	bar->phys=(u64)noir_replay_test_iommu_regs;
+	bar->inval_queue.hv_queue.virt=noir_replay_test_iommu_queue;
+	bar->inval_queue.hv_queue.phys=(u64)noir_replay_test_iommu_queue;
+	bar->inval_queue.wait_status_phys=(u64)&bar->inval_queue.wait_status;
+	bar->iotlb_reg_offset=noir_replay_test_iommu_iotlb_offset;
+	bar->page_selective=true;
+	bar->max_address_mask=6;
+	return dmarm;
+}
+
+bool noir_replay_test_vt_iommu_register_polls()
+{
+	noir_dmar_iommu_bar_descriptor_p bar=&noir_replay_test_iommu_reset()->bars[0];
+	// The status already matches the command: the wait completes immediately.
+	noir_replay_assert(nvc_vt_iommu_set_global_command(bar,intel_iommu_global_queue_invalidation_enable,false)==noir_success);
+	noir_replay_test_iommu_reg32(mmio_offset_global_status)=1<<intel_iommu_global_translation_enable;
+	noir_replay_assert(nvc_vt_iommu_set_global_command(bar,intel_iommu_global_translation_enable,true)==noir_success);
+	noir_replay_assert(noir_replay_test_iommu_reg32(mmio_offset_global_command)==1<<intel_iommu_global_translation_enable);
+	// The hardware never acknowledges the command. NoirVisor gives up instead of hanging.
+	noir_replay_assert(nvc_vt_iommu_set_global_command(bar,intel_iommu_global_set_root_ptr,true)==noir_hardware_error);
+	noir_replay_assert(nvc_vt_iommu_set_global_command(bar,intel_iommu_global_translation_enable,false)==noir_hardware_error);
+	// The invalidation bits are never cleared by the hardware.
+	noir_replay_assert(nvc_vt_iommu_flush_context_cache(bar,0,0,0,intel_iommu_context_inval_global)==noir_hardware_error);
+	noir_replay_assert(nvc_vt_iommu_flush_iotlb(bar,0,true,true,intel_iommu_iotlb_inval_global,0x7000)==noir_hardware_error);
+	// The IOTLB invalidation is polled at the command register, not at the address register.
+	noir_replay_assert(noir_replay_test_iommu_reg64(noir_replay_test_iommu_iotlb_offset+mmio_offset_iotlb_inval_addr)==0x7000);
+	noir_replay_assert(noir_replay_test_iommu_reg64(noir_replay_test_iommu_iotlb_offset+mmio_offset_iotlb_inval_cmd)>>63);
+	return true;
+}
+
+bool noir_replay_test_vt_iommu_queue_polls()
+{
+	noir_dmar_manager_p dmarm=noir_replay_test_iommu_reset();
+	noir_dmar_iommu_bar_descriptor_p bar=&dmarm->bars[0];
+	// The hardware has consumed the wait descriptor before NoirVisor polls.
+	noir_replay_test_iommu_reg64(mmio_offset_inval_queue_head)=sizeof(intel_iommu_queued_inval_legacy_descriptor);
+	noir_replay_assert(nvc_vt_iommu_wait_invalidation_queue(bar,false,false,false,false,0,0)==noir_success);
+	// The head is stuck.
+	noir_replay_assert(nvc_vt_iommu_wait_invalidation_queue(bar,false,false,false,false,0,0)==noir_hardware_error);
+	noir_replay_assert(noir_replay_test_iommu_reg64(mmio_offset_inval_queue_tail)==sizeof(intel_iommu_queued_inval_legacy_descriptor)*2);
+	// Nothing pending: nothing to wait for.
+	noir_replay_assert(nvc_vt_iommu_commit_invalidations(dmarm)==noir_success);
+	// The wait descriptor never writes its status. The lock is released and the batch is retired anyway.
+	nvc_vt_iommu_queue_page_invalidation(dmarm,0x200000);
+	nvc_vt_iommu_queue_page_invalidation(dmarm,0x201000);
+	noir_replay_assert(dmarm->inval_batch.count==1);
+	noir_replay_assert(nvc_vt_iommu_commit_invalidations(dmarm)==noir_hardware_error);
+	noir_replay_assert(bar->inval_queue.lock==0 && dmarm->inval_batch.count==0);
+	// The merged range is submitted as one IOTLB descriptor, followed by one wait descriptor.
+	noir_replay_assert(noir_replay_test_iommu_reg64(mmio_offset_inval_queue_tail)==sizeof(intel_iommu_queued_inval_legacy_descriptor)*4);
+	return true;
+}
+
+// Walk the identity map of 48-bit AGAW. Returns the size of the leaf, or zero if the address is not mapped.
+u64 static noir_replay_test_iommu_translate(noir_dmar_manager_p dmarm,u64 gpa,u64p hpa)
+{
+	ia32_addr_translator gat={.value=gpa};
+	intel_iommu_stage2_pml4e_p pml4e_p=&dmarm->pml4.virt[gat.pml4e_offset];
+	intel_iommu_stage2_pdpte_p pdpte_p;
+	intel_iommu_stage2_large_pde_p pde_p;
+	if(pml4e_p->read==false)return 0;
+	pdpte_p=&((intel_iommu_stage2_pdpte_p)(ulong_ptr)page_mult((u64)pml4e_p->pdpt_ptr))[gat.pdpte_offset];
+	if(pdpte_p->read==false)return 0;
+	if(pdpte_p->huge_page)
+	{
+		*hpa=page_1gb_mult((u64)((intel_iommu_stage2_huge_pdpte_p)pdpte_p)->page_ptr)+page_1gb_offset(gpa);
+		return page_1gb_size;
+	}
+	pde_p=&((intel_iommu_stage2_large_pde_p)(ulong_ptr)page_mult((u64)pdpte_p->pde_ptr))[gat.pde_offset];
+	if(pde_p->read==false || pde_p->large_page==false)return 0;
+	*hpa=page_2mb_mult((u64)pde_p->page_ptr)+page_2mb_offset(gpa);
+	return page_2mb_size;
+}
+
+// The replay engine enumerates no RAM and reports no physical-address width. The map is limited by the AGAW.
+noir_dmar_manager_p static noir_replay_test_iommu_create(bool huge_page)
+{
+	noir_dmar_manager_p dmarm=noir_alloc_nonpg_memory(sizeof(noir_dmar_manager));
+	if(dmarm)
+	{
+		dmarm->minimum_features.using_agaw=intel_iommu_context_agaw_48_bit;
+		dmarm->minimum_features.large_page=true;
+		dmarm->minimum_features.huge_page=huge_page;
+		dmarm->pml4.virt=noir_alloc_contd_memory(page_size);
+		dmarm->pml4.phys=noir_get_physical_address(dmarm->pml4.virt);
+		hvm_p->relative_hvm->dmar_manager=dmarm;
+	}
+	return dmarm;
+}
+
+bool noir_replay_test_vt_iommu_identity_map()
+{
+	noir_dmar_manager_p dmarm=noir_replay_test_iommu_create(true);
+	// 64-bit BARs far above the top of RAM are mapped with 1GiB pages, up to the width of the AGAW.
+	const u64 probes[]={0,0xFEE00000,0x100000000,0x38000000000,page_512gb_size*511+0x12345000};
+	u64 hpa=0;
+	u32 tables=0;
+	noir_replay_assert(dmarm && dmarm->pml4.virt);
+	noir_replay_assert(nvc_vt_iommu_build_identity_map(dmarm)==noir_success);
+	for(u32 i=0;i<sizeof(probes)/sizeof(u64);i++)
+		noir_replay_assert(noir_replay_test_iommu_translate(dmarm,probes[i],&hpa)==page_1gb_size && hpa==probes[i]);
+	for(noir_dmar_pdpte_descriptor_p cur=dmarm->pdpte.head;cur;cur=cur->next)tables++;
+	noir_replay_assert(tables==512 && dmarm->pde.head==null && dmarm->pte.head==null);
+	nvc_vt_iommu_cleanup();
+	// Without 1GiB pages, each GiB costs a page table. The lower 512GiB are covered, as is in NPT.
+	dmarm=noir_replay_test_iommu_create(false);
+	noir_replay_assert(dmarm && dmarm->pml4.virt);
+	noir_replay_assert(nvc_vt_iommu_build_identity_map(dmarm)==noir_success);
+	noir_replay_assert(noir_replay_test_iommu_translate(dmarm,0x7000000000,&hpa)==page_2mb_size && hpa==0x7000000000);
+	noir_replay_assert(noir_replay_test_iommu_translate(dmarm,page_512gb_size-page_2mb_size,&hpa)==page_2mb_size);
+	noir_replay_assert(noir_replay_test_iommu_translate(dmarm,page_512gb_size,&hpa)==0);
+	tables=0;
+	for(noir_dmar_pde_descriptor_p cur=dmarm->pde.head;cur;cur=cur->next)tables++;
+	noir_replay_assert(tables==512);
+	nvc_vt_iommu_cleanup();
+	hvm_p->relative_hvm->dmar_manager=null;
+	return true;
+}
@@ -0,0 +1,68 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file tests the NUMA placement of the EPT paging structures with a mocked topology.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_vt_numa.c
+*/
+
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvstatus.h>
+#include <nvbdk.h>
+#include <vt_intrin.h>
+#include <noirhvm.h>
+#include <nv_intrin.h>
+#include <ia32.h>
+#include "../vt_core/vt_vmcs.h"
+#include "../vt_core/vt_ept.h"
+#include "replay.h"
+#include "replay_test.h"
+
+// Four processors on two nodes. Per-processor setup runs on the owning processor.
+u32 static const noir_replay_test_numa_topology[]={0,0,1,1};
+
+bool noir_replay_test_numa_policy()
+{
+	void* p;
+	noir_replay_numa_node=1;
+	noir_replay_assert(noir_select_numa_node(noir_memory_local)==1);
+	noir_replay_assert(noir_select_numa_node(noir_memory_shared)==noir_numa_node_any);
+	p=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
+	noir_replay_assert(p && noir_replay_query_numa_node(p)==1);
+	noir_free_contd_memory(p,page_size);
+	p=noir_alloc_contd_memory_with_locality(noir_memory_shared,page_size);
+	noir_replay_assert(p && noir_replay_query_numa_node(p)==noir_numa_node_any);
+	noir_free_contd_memory(p,page_size);
+	return true;
+}
+
+// The EPT of each vCPU, including the tables split on demand, comes from the node of its processor.
+bool noir_replay_test_numa_ept_placement()
+{
+	for(u32 i=0;i<sizeof(noir_replay_test_numa_topology)/sizeof(u32);i++)
+	{
+		const u32 node=noir_replay_test_numa_topology[i];
+		noir_ept_manager_p eptm;
+		noir_ept_pte_descriptor_p pte_p;
+		noir_replay_numa_node=node;
+		eptm=nvc_ept_build_identity_map(0);
+		noir_replay_assert(eptm!=null);
+		noir_replay_assert(noir_replay_query_numa_node(eptm->eptp.virt)==node);
+		// Splitting a 2MiB page splits its 1GiB page as well.
+		pte_p=nvc_ept_update_pte(eptm,0x40201000,0x40201000,true,false,true,true,ia32_write_back,true);
+		noir_replay_assert(pte_p!=null);
+		noir_replay_assert(eptm->pde.head && eptm->pde.head==eptm->pde.tail);
+		noir_replay_assert(noir_replay_query_numa_node(eptm->pde.head->virt)==node);
+		noir_replay_assert(noir_replay_query_numa_node(pte_p->virt)==node);
+		noir_replay_assert(pte_p->virt[1].write==false && pte_p->virt[0].write==true);
+		nvc_ept_cleanup(eptm);
+	}
+	return true;
+}
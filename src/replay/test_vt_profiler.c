@@ -0,0 +1,92 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file tests and benchmarks the VM-Exit profiler of Intel VT-x core.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_vt_profiler.c
+*/
+
+#include <stdio.h>
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvstatus.h>
+#include <nvbdk.h>
+#include <vt_intrin.h>
+#include <noirhvm.h>
+#include <nv_intrin.h>
+#include <ia32.h>
+#include "../vt_core/vt_def.h"
+#include "../vt_core/vt_vmcs.h"
+#include "../vt_core/vt_exit.h"
+#include "replay.h"
+#include "replay_test.h"
+
+#define noir_replay_test_profiler_rip		0x2000
+#define noir_replay_test_profiler_length	2
+
+extern noir_vt_vcpu_p noir_replay_vt_vcpu;
+
+// Load a cpuid exit. The profiler times the exit if the sequence number is a multiple of the sampling period.
+void static noir_replay_test_profiler_load(u64 sequence)
+{
+	noir_exit_trace_record record={0};
+	record.vendor=noir_exit_trace_vendor_vmx;
+	record.exit_code=intercept_cpuid;
+	record.info[2]=noir_replay_test_profiler_length;
+	record.rip=noir_replay_test_profiler_rip;
+	record.rflags=2;
+	noir_replay_vt.load(&record);
+	noir_replay_vt_vcpu->exit_statistics.sequence=sequence;
+}
+
+// Every exit is counted. Only one exit in each sampling period is timed.
+bool noir_replay_test_vt_exit_statistics()
+{
+	noir_exit_statistics_p stats=&noir_replay_vt_vcpu->exit_statistics.reason[intercept_cpuid];
+	noir_replay_test_profiler_load(0);
+	for(u32 i=0;i<=noir_exit_profiler_sample_mask;i++)noir_replay_vt.invoke();
+	noir_replay_assert(stats->count==noir_exit_profiler_sample_mask+1);
+	noir_replay_assert(stats->sampled_count==1);
+	noir_replay_assert(stats->max_time==stats->sampled_time);
+	noir_replay_vt.invoke();
+	noir_replay_assert(stats->sampled_count==2);
+	noir_replay_assert(stats->max_time<=stats->sampled_time);
+	// Exits from the host are not accounted to CVM exits.
+	noir_replay_assert(noir_replay_vt_vcpu->exit_statistics.cvm_reason[intercept_cpuid].count==0);
+	return true;
+}
+
+// Average TSC ticks of the cpuid exit, with the profiler sampling every exit or none of them.
+u64 static noir_replay_benchmark_profiler_run(u32 rounds,bool sampled)
+{
+	u64 total=0;
+	for(u32 i=0;i<rounds;i++)
+	{
+		u64 start;
+		noir_replay_test_profiler_load(sampled?0:1);
+		start=__rdtsc();
+		noir_replay_vt.invoke();
+		total+=__rdtsc()-start;
+	}
+	return total/rounds;
+}
+
+void noir_replay_benchmark_vt_exit_profiler(u32 rounds)
+{
+	u64 sampled,unsampled,overhead;
+	// Warm up the caches and the branch predictors before timing.
+	noir_replay_benchmark_profiler_run(rounds>>4,true);
+	noir_replay_benchmark_profiler_run(rounds>>4,false);
+	sampled=noir_replay_benchmark_profiler_run(rounds,true);
+	unsampled=noir_replay_benchmark_profiler_run(rounds,false);
+	overhead=sampled>unsampled?sampled-unsampled:0;
+	printf("  Sampled Exit:   %llu ticks\n",sampled);
+	printf("  Unsampled Exit: %llu ticks\n",unsampled);
+	printf("  Sampling Cost:  %llu ticks, amortized to %llu ticks per exit\n",overhead,overhead/(noir_exit_profiler_sample_mask+1));
+}
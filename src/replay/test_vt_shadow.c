@@ -0,0 +1,130 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file tests VMCS Shadowing of the VT core.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /replay/test_vt_shadow.c
+*/
+
+#include "replay_compat.h"
+#include <nvdef.h>
+#include <nvstatus.h>
+#include <nvbdk.h>
+#include <vt_intrin.h>
+#include <noirhvm.h>
+#include <nv_intrin.h>
+#include <ia32.h>
+#include "../vt_core/vt_def.h"
+#include "../vt_core/vt_vmcs.h"
+#include "../vt_core/vt_exit.h"
+#include "replay.h"
+#include "replay_test.h"
+
+#define noir_replay_test_vt_rip			0x1000
+#define noir_replay_test_vt_length		3
+
+extern noir_vt_vcpu_p noir_replay_vt_vcpu;
+
+// Simulate a VMX instruction of the nested hypervisor with a memory operand at the displacement.
+u64 static noir_replay_test_vt_exit(u32 reason,u64* operand)
+{
+	noir_exit_trace_record record={0};
+	u64 rflags;
+	record.vendor=noir_exit_trace_vendor_vmx;
+	record.exit_code=reason;
+	record.info[0]=(u64)operand;
+	record.info[2]=noir_replay_test_vt_length;
+	record.rip=noir_replay_test_vt_rip;
+	record.rflags=2;
+	noir_replay_vt.load(&record);
+	// Instruction Information: ES segment, rax as base, without index.
+	noir_vt_vmwrite(vmexit_instruction_information,0);
+	noir_replay_vt.invoke();
+	noir_vt_vmread(guest_rflags,&rflags);
+	return rflags;
+}
+
+u64 static noir_replay_test_vt_guest_rip()
+{
+	u64 rip;
+	noir_vt_vmread(guest_rip,&rip);
+	return rip;
+}
+
+u64 static noir_replay_test_vt_instruction_error(void* vmcs)
+{
+	ulong_ptr error=0;
+	noir_vt_nested_vmread(vmcs,vm_instruction_error,&error);
+	return error;
+}
+
+// Structures referenced by physical addresses. Virtual addresses are used as physical addresses.
+u64 static noir_replay_test_vt_shadow[0x8000];
+u8 static _Alignas(page_size) noir_replay_test_vt_vmcs_a[page_size];
+u8 static _Alignas(page_size) noir_replay_test_vt_vmcs_b[page_size];
+
+// Fields written into the shadow VMCS without VM-Exit must survive vmptrld and reach the software VMCS.
+bool noir_replay_test_vt_shadow_vmcs()
+{
+	noir_vt_nested_vcpu_p nested_vcpu=&noir_replay_vt_vcpu->nested_vcpu;
+	noir_vt_nested_vmcs_header_p vmcs_a=(noir_vt_nested_vmcs_header_p)noir_replay_test_vt_vmcs_a;
+	noir_vt_nested_vmcs_header_p vmcs_b=(noir_vt_nested_vmcs_header_p)noir_replay_test_vt_vmcs_b;
+	u64p shadow=noir_replay_test_vt_shadow;
+	u64 vmxon_region=0,operand,rflags;
+	ulong_ptr data;
+	noir_replay_identity_memory=true;
+	nvc_vt_build_nested_vmcs_field_table();
+	noir_stosq(shadow,0,0x8000);
+	noir_stosb(vmcs_a,0,page_size);
+	noir_stosb(vmcs_b,0,page_size);
+	noir_replay_vt_vcpu->virtual_msr.vmx_msr[0]=1;
+	vmcs_a->revision_id=vmcs_b->revision_id=1;
+	noir_vt_nested_vmwrite(vmcs_a,guest_rip,0x1111);
+	noir_vt_nested_vmwrite(vmcs_b,guest_rip,0x3333);
+	// The nested hypervisor is in VMX operation without a current VMCS.
+	nested_vcpu->vmxon.phys=(u64)&vmxon_region;
+	nested_vcpu->vmcs_c.phys=maxu64;
+	nested_vcpu->vmcs_c.virt=null;
+	nested_vcpu->vmcs_s.phys=(u64)shadow;
+	nested_vcpu->vmcs_s.virt=shadow;
+	noir_bts(&nested_vcpu->status,noir_nvt_vmxon);
+	// Load A into the shadow VMCS.
+	operand=(u64)vmcs_a;
+	rflags=noir_replay_test_vt_exit(intercept_vmptrld,&operand);
+	noir_replay_assert((rflags&0x41)==0);
+	noir_replay_assert(shadow[guest_rip]==0x1111);
+	noir_replay_assert(noir_replay_test_vt_guest_rip()==noir_replay_test_vt_rip+noir_replay_test_vt_length);
+	// The nested hypervisor writes the shadow VMCS without VM-Exit, then loads A again.
+	shadow[guest_rip]=0x2222;
+	rflags=noir_replay_test_vt_exit(intercept_vmptrld,&operand);
+	noir_replay_assert((rflags&0x41)==0);
+	noir_replay_assert(shadow[guest_rip]==0x2222);
+	// Loading B writes the shadow VMCS back to A.
+	operand=(u64)vmcs_b;
+	rflags=noir_replay_test_vt_exit(intercept_vmptrld,&operand);
+	noir_replay_assert((rflags&0x41)==0);
+	noir_replay_assert(noir_vt_nested_vmread(vmcs_a,guest_rip,&data) && data==0x2222);
+	noir_replay_assert(shadow[guest_rip]==0x3333);
+	// Nested VM-Entry fails with a defined error and retires the instruction.
+	rflags=noir_replay_test_vt_exit(intercept_vmlaunch,null);
+	noir_replay_assert(noir_bt(&rflags,6) && noir_replay_test_vt_instruction_error(vmcs_b)==vmentry_failed_invalid_control_fields);
+	noir_replay_assert(noir_replay_test_vt_guest_rip()==noir_replay_test_vt_rip+noir_replay_test_vt_length);
+	rflags=noir_replay_test_vt_exit(intercept_vmresume,null);
+	noir_replay_assert(noir_bt(&rflags,6) && noir_replay_test_vt_instruction_error(vmcs_b)==vmresume_non_launched_vmcs);
+	vmcs_b->clean_fields.launched=1;
+	rflags=noir_replay_test_vt_exit(intercept_vmlaunch,null);
+	noir_replay_assert(noir_bt(&rflags,6) && noir_replay_test_vt_instruction_error(vmcs_b)==vmlaunch_non_clear_vmcs);
+	// Without a current VMCS, VM-Entry fails with VMfailInvalid.
+	rflags=noir_replay_test_vt_exit(intercept_vmclear,&operand);
+	noir_replay_assert((rflags&0x41)==0);
+	noir_replay_assert(nested_vcpu->vmcs_c.virt==null);
+	rflags=noir_replay_test_vt_exit(intercept_vmlaunch,null);
+	noir_replay_assert(noir_bt(&rflags,0));
+	return true;
+}
@@ -0,0 +1,220 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file maintains AVIC tables and routes IPIs for Customizable VMs.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /svm_core/svm_avic.c
+*/
+
+#include <nvdef.h>
+#include <amd64.h>
+#include "svm_def.h"
+#include "svm_avic.h"
+
+/*
+  Functions in this file operate on the AVIC tables only.
+  They do not call any intrinsics or access the hypervisor structures,
+  so that they can be built into a user-mode simulator as is.
+
+  The Physical APIC ID Table is indexed by the guest physical APIC ID.
+  NoirVisor assigns the vCPU ID as the guest physical APIC ID.
+  The Logical APIC ID Table is indexed according to the LDR and DFR:
+  - Flat Model: The index is the position of the bit set in the logical ID.
+  - Cluster Model: The index is (cluster*4)+bit. Cluster 15 is broadcast.
+*/
+
+u32 static noir_hvcode nvc_svm_avic_single_bit_position(u32 bits)
+{
+	// Exactly one bit must be set. Otherwise, the logical ID designates no entry.
+	if(bits==0 || (bits&(bits-1)))return noir_svm_avic_invalid_index;
+	for(u32 i=0;i<8;i++)
+		if(bits&(1<<i))
+			return i;
+	return noir_svm_avic_invalid_index;
+}
+
+u32 noir_hvcode nvc_svm_avic_get_logical_index(u32 ldr,u32 dfr)
+{
+	const u32 logical_id=ldr>>24;
+	if(noir_svm_avic_dfr_is_flat(dfr))
+		return nvc_svm_avic_single_bit_position(logical_id);
+	else
+	{
+		const u32 cluster=logical_id>>4;
+		const u32 position=nvc_svm_avic_single_bit_position(logical_id&0xF);
+		if(cluster==0xF || position==noir_svm_avic_invalid_index)return noir_svm_avic_invalid_index;
+		return (cluster<<2)+position;
+	}
+}
+
+void noir_hvcode nvc_svm_avic_update_logical_table(void* logical_table,u32 old_ldr,u32 old_dfr,u32 new_ldr,u32 new_dfr,u32 physical_id)
+{
+	nvc_svm_avic_logical_apic_id_entry_p logical=(nvc_svm_avic_logical_apic_id_entry_p)logical_table;
+	const u32 old_index=nvc_svm_avic_get_logical_index(old_ldr,old_dfr);
+	const u32 new_index=nvc_svm_avic_get_logical_index(new_ldr,new_dfr);
+	// Remove the stale entry only if it still designates this vCPU.
+	if(old_index!=noir_svm_avic_invalid_index)
+		if(logical[old_index].valid && logical[old_index].guest_physical_apic_id==physical_id)
+			logical[old_index].value=0;
+	if(new_index!=noir_svm_avic_invalid_index)
+	{
+		nvc_svm_avic_logical_apic_id_entry entry;
+		entry.value=0;
+		entry.guest_physical_apic_id=physical_id;
+		entry.valid=true;
+		// Write the entry at once so that the processor would never see a partial update.
+		logical[new_index].value=entry.value;
+	}
+}
+
+void nvc_svm_avic_set_physical_entry(void* physical_table,u32 physical_id,u64 backing_page)
+{
+	nvc_svm_avic_physical_apic_id_entry_p physical=(nvc_svm_avic_physical_apic_id_entry_p)physical_table;
+	nvc_svm_avic_physical_apic_id_entry entry;
+	entry.value=0;
+	entry.backing_page_pointer=backing_page>>12;
+	entry.valid=true;
+	physical[physical_id].value=entry.value;
+}
+
+void nvc_svm_avic_clear_physical_entry(void* physical_table,u32 physical_id)
+{
+	nvc_svm_avic_physical_apic_id_entry_p physical=(nvc_svm_avic_physical_apic_id_entry_p)physical_table;
+	physical[physical_id].value=0;
+}
+
+void noir_hvcode nvc_svm_avic_set_running(void* physical_table,u32 physical_id,u32 host_apic_id,bool running)
+{
+	nvc_svm_avic_physical_apic_id_entry_p physical=(nvc_svm_avic_physical_apic_id_entry_p)physical_table;
+	nvc_svm_avic_physical_apic_id_entry entry;
+	entry.value=physical[physical_id].value;
+	// Keep the host APIC ID on descheduling. Late doorbells are then harmlessly sent to the last processor.
+	if(running)entry.host_physical_apic_id=host_apic_id;
+	entry.is_running=running;
+	physical[physical_id].value=entry.value;
+}
+
+u32 static noir_hvcode nvc_svm_avic_add_target(nvc_svm_avic_physical_apic_id_entry_p physical,u32 physical_id,u64p targets)
+{
+	const u64 bit=(u64)1<<(physical_id&63);
+	if(physical_id>noir_svm_avic_max_physical_index)return 0;
+	if(!physical[physical_id].valid)return 0;
+	if(targets[physical_id>>6]&bit)return 0;
+	targets[physical_id>>6]|=bit;
+	return 1;
+}
+
+u32 static noir_hvcode nvc_svm_avic_add_logical_target(nvc_svm_avic_physical_apic_id_entry_p physical,nvc_svm_avic_logical_apic_id_entry_p logical,u32 logical_index,u64p targets)
+{
+	if(!logical[logical_index].valid)return 0;
+	return nvc_svm_avic_add_target(physical,logical[logical_index].guest_physical_apic_id,targets);
+}
+
+// Resolve the destination of an IPI into a bitmap of guest physical APIC IDs. Returns the number of targets.
+u32 noir_hvcode nvc_svm_avic_route_ipi(void* physical_table,void* logical_table,u32 icr_lo,u32 icr_hi,u32 dfr,u32 source_id,u64p targets)
+{
+	nvc_svm_avic_physical_apic_id_entry_p physical=(nvc_svm_avic_physical_apic_id_entry_p)physical_table;
+	nvc_svm_avic_logical_apic_id_entry_p logical=(nvc_svm_avic_logical_apic_id_entry_p)logical_table;
+	amd64_apic_register_icr_lo lo;
+	amd64_apic_register_icr_hi hi;
+	u32 count=0;
+	lo.value=icr_lo;
+	hi.value=icr_hi;
+	for(u32 i=0;i<noir_svm_avic_target_bitmap_size;i++)targets[i]=0;
+	switch(lo.dest_shorthand)
+	{
+		case amd64_apic_icr_dsh_self:
+			return nvc_svm_avic_add_target(physical,source_id,targets);
+		case amd64_apic_icr_dsh_inclusive:
+		case amd64_apic_icr_dsh_exclusive:
+		{
+			for(u32 i=0;i<=noir_svm_avic_max_physical_index;i++)
+				if(i!=source_id || lo.dest_shorthand==amd64_apic_icr_dsh_inclusive)
+					count+=nvc_svm_avic_add_target(physical,i,targets);
+			return count;
+		}
+	}
+	// There is no shorthand. Resolve the destination field.
+	if(lo.dest_mode==0)
+	{
+		// Physical Destination Mode
+		if(hi.destination==noir_svm_avic_broadcast)
+		{
+			for(u32 i=0;i<=noir_svm_avic_max_physical_index;i++)
+				count+=nvc_svm_avic_add_target(physical,i,targets);
+		}
+		else
+			count+=nvc_svm_avic_add_target(physical,hi.destination,targets);
+	}
+	else if(noir_svm_avic_dfr_is_flat(dfr))
+	{
+		// Logical Destination Mode, Flat Model
+		for(u32 i=0;i<8;i++)
+			if(hi.destination&(1<<i))
+				count+=nvc_svm_avic_add_logical_target(physical,logical,i,targets);
+	}
+	else
+	{
+		// Logical Destination Mode, Cluster Model
+		const u32 cluster=hi.destination>>4;
+		const u32 first=cluster==0xF?0:cluster;
+		const u32 last=cluster==0xF?0xE:cluster;
+		for(u32 c=first;c<=last;c++)
+			for(u32 i=0;i<4;i++)
+				if(hi.destination&(1<<i))
+					count+=nvc_svm_avic_add_logical_target(physical,logical,(c<<2)+i,targets);
+	}
+	return count;
+}
+
+// Remove the running vCPUs from the bitmap. AVIC hardware has delivered the IPI to them.
+u32 noir_hvcode nvc_svm_avic_filter_running(void* physical_table,u64p targets)
+{
+	nvc_svm_avic_physical_apic_id_entry_p physical=(nvc_svm_avic_physical_apic_id_entry_p)physical_table;
+	u32 count=0;
+	for(u32 i=0;i<=noir_svm_avic_max_physical_index;i++)
+	{
+		const u64 bit=(u64)1<<(i&63);
+		if(targets[i>>6]&bit)
+		{
+			if(physical[i].is_running)
+				targets[i>>6]&=~bit;
+			else
+				count++;
+		}
+	}
+	return count;
+}
+
+// Writes to these registers are trap-like. The instruction is retired when the VM-Exit occurs.
+// Other unaccelerated accesses are fault-like. The instruction must be emulated.
+bool noir_hvcode nvc_svm_avic_is_trap_access(u32 offset)
+{
+	switch(offset)
+	{
+		case amd64_apic_id:
+		case amd64_apic_eoi:
+		case amd64_apic_remote_read_register:
+		case amd64_apic_ldr:
+		case amd64_apic_dfr:
+		case amd64_apic_spurious_int_vector:
+		case amd64_apic_esr:
+		case amd64_apic_icr_lo:
+		case amd64_apic_timer_lvt:
+		case amd64_apic_thermal_lvt:
+		case amd64_apic_perfcnt_lvt:
+		case amd64_apic_lint0_lvt:
+		case amd64_apic_lint1_lvt:
+		case amd64_apic_evt:
+		case amd64_apic_timer_init_count:
+		case amd64_apic_timer_div_conf:
+			return true;
+	}
+	return false;
+}
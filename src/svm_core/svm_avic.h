@@ -0,0 +1,42 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file defines the AVIC table maintenance and IPI routing facility.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /svm_core/svm_avic.h
+*/
+
+#include <nvdef.h>
+
+// xAPIC ID 0xFF is the broadcast destination. Hence only 255 physical APIC IDs are available.
+#define noir_svm_avic_max_physical_index	0xFE
+#define noir_svm_avic_max_logical_index		0x3B
+#define noir_svm_avic_invalid_index			0xFFFFFFFF
+#define noir_svm_avic_broadcast				0xFF
+
+// The flat model is indicated by DFR[31:28]=1111b.
+#define noir_svm_avic_dfr_is_flat(dfr)		((dfr>>28)==0xF)
+
+// Number of 64-bit words in a bitmap of vCPUs.
+#define noir_svm_avic_target_bitmap_size	4
+
+// Reasons of incomplete IPIs reported in EXITINFO2[63:32].
+#define noir_svm_avic_ipi_invalid_int_type	0
+#define noir_svm_avic_ipi_not_running		1
+#define noir_svm_avic_ipi_invalid_target	2
+#define noir_svm_avic_ipi_invalid_backing	3
+
+u32 nvc_svm_avic_get_logical_index(u32 ldr,u32 dfr);
+void nvc_svm_avic_update_logical_table(void* logical_table,u32 old_ldr,u32 old_dfr,u32 new_ldr,u32 new_dfr,u32 physical_id);
+void nvc_svm_avic_set_physical_entry(void* physical_table,u32 physical_id,u64 backing_page);
+void nvc_svm_avic_clear_physical_entry(void* physical_table,u32 physical_id);
+void nvc_svm_avic_set_running(void* physical_table,u32 physical_id,u32 host_apic_id,bool running);
+u32 nvc_svm_avic_route_ipi(void* physical_table,void* logical_table,u32 icr_lo,u32 icr_hi,u32 dfr,u32 source_id,u64p targets);
+u32 nvc_svm_avic_filter_running(void* physical_table,u64p targets);
+bool nvc_svm_avic_is_trap_access(u32 offset);
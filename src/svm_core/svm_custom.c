@@ -22,6 +22,7 @@
 #include "svm_vmcb.h"
 #include "svm_def.h"
 #include "svm_npt.h"
+#include "svm_avic.h"
 
 void noir_hvcode nvc_svm_switch_to_host_vcpu(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu)
 {
@@ -49,6 +50,8 @@ void noir_hvcode nvc_svm_switch_to_host_vcpu(noir_gpr_state_p gpr_state,noir_svm
 		cvcpu->header.drs.dr1=noir_readdr1();
 		cvcpu->header.drs.dr2=noir_readdr2();
 		cvcpu->header.drs.dr3=noir_readdr3();
+		// Save TSC_AUX...
+		cvcpu->header.msrs.tsc_aux=noir_rdmsr(amd64_tsc_aux);
 		cvcpu->special_state.switch_success=true;
 	}
 	// Save the event injection field...
@@ -67,10 +70,7 @@ void noir_hvcode nvc_svm_switch_to_host_vcpu(noir_gpr_state_p gpr_state,noir_svm
 	}
 	// If AVIC is supported, set it to be not runnning so IPIs won't be delivered to a wrong processor.
 	if(noir_bt(&hvm_p->relative_hvm->virt_cap.capabilities,amd64_cpuid_avic))
-	{
-		nvc_svm_avic_physical_apic_id_entry_p apic_physical=(nvc_svm_avic_physical_apic_id_entry_p)cvcpu->vm->avic_physical.virt;
-		apic_physical[cvcpu->vcpu_id].is_running=false;
-	}
+		nvc_svm_avic_set_running(cvcpu->vm->avic_physical.virt,cvcpu->vcpu_id,vcpu->apic_id,false);
 	// The rest of processor states are already saved in VMCB.
 	// Step 2: Load Host State.
 	// Load General-Purpose Registers...
@@ -86,12 +86,51 @@ void noir_hvcode nvc_svm_switch_to_host_vcpu(noir_gpr_state_p gpr_state,noir_svm
 	noir_writedr1(vcpu->cvm_state.drs.dr1);
 	noir_writedr2(vcpu->cvm_state.drs.dr2);
 	noir_writedr3(vcpu->cvm_state.drs.dr3);
+	// Load TSC_AUX...
+	if(cvcpu->header.msrs.tsc_aux!=vcpu->cvm_state.msrs.tsc_aux)noir_wrmsr(amd64_tsc_aux,vcpu->cvm_state.msrs.tsc_aux);
 	// Step 3: Switch vCPU to Host.
 	loader_stack->custom_vcpu=&nvc_svm_idle_cvcpu;		// Indicate that CVM is not running.
 	loader_stack->guest_vmcb_pa=vcpu->vmcb.phys;
 	// The context will go to the host when vmrun is executed.
 }
 
+/*
+  Clean-bit aware VMCB updates:
+
+  Editing a register group invalidates its state cache, even if the VMM
+  wrote back the same values. Hence, fields are compared against the VMCB
+  before being written. The clean bit of a group is cleared only if any of
+  its fields are actually changed, so that the processor does not reload
+  unchanged state from VMCB on vmrun.
+*/
+bool static noir_hvcode nvc_svm_vmcb_update8(void* vmcb,u32 offset,u8 value)
+{
+	if(noir_svm_vmread8(vmcb,offset)==value)return false;
+	noir_svm_vmwrite8(vmcb,offset,value);
+	return true;
+}
+
+bool static noir_hvcode nvc_svm_vmcb_update16(void* vmcb,u32 offset,u16 value)
+{
+	if(noir_svm_vmread16(vmcb,offset)==value)return false;
+	noir_svm_vmwrite16(vmcb,offset,value);
+	return true;
+}
+
+bool static noir_hvcode nvc_svm_vmcb_update32(void* vmcb,u32 offset,u32 value)
+{
+	if(noir_svm_vmread32(vmcb,offset)==value)return false;
+	noir_svm_vmwrite32(vmcb,offset,value);
+	return true;
+}
+
+bool static noir_hvcode nvc_svm_vmcb_update64(void* vmcb,u32 offset,u64 value)
+{
+	if(noir_svm_vmread64(vmcb,offset)==value)return false;
+	noir_svm_vmwrite64(vmcb,offset,value);
+	return true;
+}
+
 void noir_hvcode nvc_svm_switch_to_guest_vcpu(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu)
 {
 	noir_svm_initial_stack_p loader_stack=noir_svm_get_loader_stack(vcpu->hv_stack);
@@ -115,6 +154,8 @@ void noir_hvcode nvc_svm_switch_to_guest_vcpu(noir_gpr_state_p gpr_state,noir_sv
 	vcpu->cvm_state.drs.dr1=noir_readdr1();
 	vcpu->cvm_state.drs.dr2=noir_readdr2();
 	vcpu->cvm_state.drs.dr3=noir_readdr3();
+	// Save TSC_AUX...
+	vcpu->cvm_state.msrs.tsc_aux=noir_rdmsr(amd64_tsc_aux);
 	// Step 2: Load Guest State.
 	if(cvcpu->vm->header.properties.nsv_guest)
 	{
@@ -145,59 +186,63 @@ void noir_hvcode nvc_svm_switch_to_guest_vcpu(noir_gpr_state_p gpr_state,noir_sv
 		noir_writedr3(cvcpu->header.drs.dr3);
 		if(!cvcpu->header.state_cache.dr_valid)
 		{
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_dr6,cvcpu->header.drs.dr6);
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_dr7,cvcpu->header.drs.dr7);
-			noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_debug_reg);
+			bool changed=nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_dr6,cvcpu->header.drs.dr6);
+			changed|=nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_dr7,cvcpu->header.drs.dr7);
+			if(changed)noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_debug_reg);
 			cvcpu->header.state_cache.dr_valid=true;
 		}
 		// Load Control Registers...
 		if(!cvcpu->header.state_cache.cr_valid)
 		{
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_cr0,cvcpu->header.crs.cr0);
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_cr3,cvcpu->header.crs.cr3);
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_cr4,cvcpu->header.crs.cr4);
-			noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_control_reg);
+			bool changed=nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_cr0,cvcpu->header.crs.cr0);
+			changed|=nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_cr3,cvcpu->header.crs.cr3);
+			changed|=nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_cr4,cvcpu->header.crs.cr4);
+			if(changed)
+			{
+				noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_control_reg);
+				// Changes made to control registers can cause TLBs to be invalid.
+				noir_svm_vmwrite8(cvcpu->vmcb.virt,tlb_control,nvc_svm_tlb_control_flush_guest);
+			}
 			cvcpu->header.state_cache.cr_valid=true;
-			// Changes made to control registers can cause TLBs to be invalid.
-			noir_svm_vmwrite8(cvcpu->vmcb.virt,tlb_control,nvc_svm_tlb_control_flush_guest);
 		}
 		if(!cvcpu->header.state_cache.cr2valid)
 		{
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_cr2,cvcpu->header.crs.cr2);
-			noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_cr2);
+			if(nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_cr2,cvcpu->header.crs.cr2))
+				noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_cr2);
 			cvcpu->header.state_cache.cr2valid=true;
 		}
 		if(!cvcpu->header.state_cache.tp_valid)
 		{
-			noir_svm_vmwrite8(cvcpu->vmcb.virt,avic_control,(u8)cvcpu->header.crs.cr8&0xf);
-			noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_tpr);
+			// V_TPR is the lowest byte of AVIC Control field.
+			if(nvc_svm_vmcb_update8(cvcpu->vmcb.virt,avic_control,(u8)cvcpu->header.crs.cr8&0xf))
+				noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_tpr);
 			cvcpu->header.state_cache.tp_valid=true;
 		}
 		// Load Segment Registers...
 		if(!cvcpu->header.state_cache.sr_valid)
 		{
 			// Load segment selectors.
-			noir_svm_vmwrite16(cvcpu->vmcb.virt,guest_cs_selector,cvcpu->header.seg.cs.selector);
-			noir_svm_vmwrite16(cvcpu->vmcb.virt,guest_ds_selector,cvcpu->header.seg.ds.selector);
-			noir_svm_vmwrite16(cvcpu->vmcb.virt,guest_es_selector,cvcpu->header.seg.es.selector);
-			noir_svm_vmwrite16(cvcpu->vmcb.virt,guest_ss_selector,cvcpu->header.seg.ss.selector);
+			bool changed=nvc_svm_vmcb_update16(cvcpu->vmcb.virt,guest_cs_selector,cvcpu->header.seg.cs.selector);
+			changed|=nvc_svm_vmcb_update16(cvcpu->vmcb.virt,guest_ds_selector,cvcpu->header.seg.ds.selector);
+			changed|=nvc_svm_vmcb_update16(cvcpu->vmcb.virt,guest_es_selector,cvcpu->header.seg.es.selector);
+			changed|=nvc_svm_vmcb_update16(cvcpu->vmcb.virt,guest_ss_selector,cvcpu->header.seg.ss.selector);
 			// Load segment attributes.
-			noir_svm_vmwrite16(cvcpu->vmcb.virt,guest_cs_attrib,svm_attrib(cvcpu->header.seg.cs.attrib));
-			noir_svm_vmwrite16(cvcpu->vmcb.virt,guest_ds_attrib,svm_attrib(cvcpu->header.seg.ds.attrib));
-			noir_svm_vmwrite16(cvcpu->vmcb.virt,guest_es_attrib,svm_attrib(cvcpu->header.seg.es.attrib));
-			noir_svm_vmwrite16(cvcpu->vmcb.virt,guest_ss_attrib,svm_attrib(cvcpu->header.seg.ss.attrib));
+			changed|=nvc_svm_vmcb_update16(cvcpu->vmcb.virt,guest_cs_attrib,svm_attrib(cvcpu->header.seg.cs.attrib));
+			changed|=nvc_svm_vmcb_update16(cvcpu->vmcb.virt,guest_ds_attrib,svm_attrib(cvcpu->header.seg.ds.attrib));
+			changed|=nvc_svm_vmcb_update16(cvcpu->vmcb.virt,guest_es_attrib,svm_attrib(cvcpu->header.seg.es.attrib));
+			changed|=nvc_svm_vmcb_update16(cvcpu->vmcb.virt,guest_ss_attrib,svm_attrib(cvcpu->header.seg.ss.attrib));
 			// Load segment limits.
-			noir_svm_vmwrite32(cvcpu->vmcb.virt,guest_cs_limit,cvcpu->header.seg.cs.limit);
-			noir_svm_vmwrite32(cvcpu->vmcb.virt,guest_ds_limit,cvcpu->header.seg.ds.limit);
-			noir_svm_vmwrite32(cvcpu->vmcb.virt,guest_es_limit,cvcpu->header.seg.es.limit);
-			noir_svm_vmwrite32(cvcpu->vmcb.virt,guest_ss_limit,cvcpu->header.seg.ss.limit);
+			changed|=nvc_svm_vmcb_update32(cvcpu->vmcb.virt,guest_cs_limit,cvcpu->header.seg.cs.limit);
+			changed|=nvc_svm_vmcb_update32(cvcpu->vmcb.virt,guest_ds_limit,cvcpu->header.seg.ds.limit);
+			changed|=nvc_svm_vmcb_update32(cvcpu->vmcb.virt,guest_es_limit,cvcpu->header.seg.es.limit);
+			changed|=nvc_svm_vmcb_update32(cvcpu->vmcb.virt,guest_ss_limit,cvcpu->header.seg.ss.limit);
 			// Load segment bases.
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_cs_base,cvcpu->header.seg.cs.base);
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_ds_base,cvcpu->header.seg.ds.base);
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_es_base,cvcpu->header.seg.es.base);
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_ss_base,cvcpu->header.seg.ss.base);
-			// Mark the VMCB cache invalid.
-			noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_segment_reg);
+			changed|=nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_cs_base,cvcpu->header.seg.cs.base);
+			changed|=nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_ds_base,cvcpu->header.seg.ds.base);
+			changed|=nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_es_base,cvcpu->header.seg.es.base);
+			changed|=nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_ss_base,cvcpu->header.seg.ss.base);
+			// Mark the VMCB cache invalid only if segments are changed.
+			if(changed)noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_segment_reg);
 			cvcpu->header.state_cache.sr_valid=true;	// Cache is refreshed. Mark it valid.
 		}
 		if(!cvcpu->header.state_cache.fg_valid)
@@ -240,36 +285,36 @@ void noir_hvcode nvc_svm_switch_to_guest_vcpu(noir_gpr_state_p gpr_state,noir_sv
 		if(!cvcpu->header.state_cache.dt_valid)
 		{
 			// Load descriptor table limits.
-			noir_svm_vmwrite32(cvcpu->vmcb.virt,guest_gdtr_limit,cvcpu->header.seg.gdtr.limit);
-			noir_svm_vmwrite32(cvcpu->vmcb.virt,guest_idtr_limit,cvcpu->header.seg.idtr.limit);
+			bool changed=nvc_svm_vmcb_update32(cvcpu->vmcb.virt,guest_gdtr_limit,cvcpu->header.seg.gdtr.limit);
+			changed|=nvc_svm_vmcb_update32(cvcpu->vmcb.virt,guest_idtr_limit,cvcpu->header.seg.idtr.limit);
 			// Load descriptor table bases.
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_gdtr_base,cvcpu->header.seg.gdtr.base);
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_idtr_base,cvcpu->header.seg.idtr.base);
-			// Mark the VMCB cache invalid.
-			noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_idt_gdt);
+			changed|=nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_gdtr_base,cvcpu->header.seg.gdtr.base);
+			changed|=nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_idtr_base,cvcpu->header.seg.idtr.base);
+			// Mark the VMCB cache invalid only if descriptor tables are changed.
+			if(changed)noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_idt_gdt);
 			cvcpu->header.state_cache.dt_valid=true;
 		}
 		// Load EFER MSR
 		if(!cvcpu->header.state_cache.ef_valid)
 		{
-			const u64 efer_tlb_mask=amd64_efer_lme|amd64_efer_lma|amd64_efer_nxe;
+			const u64 efer_tlb_mask=amd64_efer_lme_bit|amd64_efer_lma_bit|amd64_efer_nxe_bit;
 			// SVME Shadowing
 			cvcpu->shadowed_bits.svme=noir_bt((u32*)&cvcpu->header.msrs.efer,amd64_efer_svme);
 			// Changes made to EFER can cause TLBs to be invalid.
 			if((noir_svm_vmread64(cvcpu->vmcb.virt,guest_efer)&efer_tlb_mask)!=(cvcpu->header.msrs.efer&efer_tlb_mask))
 				noir_svm_vmwrite8(cvcpu->vmcb.virt,tlb_control,nvc_svm_tlb_control_flush_guest);
 			// Always enable EFER.SVME.
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_efer,cvcpu->header.msrs.efer|amd64_efer_svme_bit);
 			// Writing to EFER causes cached copy of control registers in VMCB to be invalid.
-			noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_control_reg);
+			if(nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_efer,cvcpu->header.msrs.efer|amd64_efer_svme_bit))
+				noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_control_reg);
 			cvcpu->header.state_cache.ef_valid=true;
 		}
 		// Load PAT MSR
 		if(!cvcpu->header.state_cache.pa_valid)
 		{
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,guest_pat,cvcpu->header.msrs.pat);
-			// Mark the VMCB cache invalid.
-			noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_npt);
+			// Mark the VMCB cache invalid if PAT is changed.
+			if(nvc_svm_vmcb_update64(cvcpu->vmcb.virt,guest_pat,cvcpu->header.msrs.pat))
+				noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_npt);
 			cvcpu->header.state_cache.pa_valid=true;
 		}
 		// Load MSRs for System Call (sysenter/sysexit)
@@ -291,14 +336,25 @@ void noir_hvcode nvc_svm_switch_to_guest_vcpu(noir_gpr_state_p gpr_state,noir_sv
 			// No need to invalidate VMCB. The vmload instruction will load them.
 			cvcpu->header.state_cache.sc_valid=true;
 		}
+		// Load the APIC Base. AVIC redirects guest accesses to this page into the backing page.
+		if(!cvcpu->header.state_cache.ap_valid)
+		{
+			if(cvcpu->vm->header.properties.apic_enable)
+				if(nvc_svm_vmcb_update64(cvcpu->vmcb.virt,avic_apic_bar,page_base(cvcpu->header.msrs.apic.value)))
+					noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_avic);
+			cvcpu->header.state_cache.ap_valid=true;
+		}
 		// Load the TSC offset.
 		if(!cvcpu->header.state_cache.ts_valid)
 		{
-			noir_svm_vmwrite64(cvcpu->vmcb.virt,tsc_offset,cvcpu->header.tsc_offset);
 			// Writing to TSC Offset causes the interception controls in VMCB to be invalid.
-			noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_interception);
+			if(nvc_svm_vmcb_update64(cvcpu->vmcb.virt,tsc_offset,cvcpu->header.tsc_offset))
+				noir_svm_vmcb_btr32(cvcpu->vmcb.virt,vmcb_clean_bits,noir_svm_clean_interception);
 			cvcpu->header.state_cache.ts_valid=true;
 		}
+		// Load TSC_AUX. It is not a VMCB field, so it is swapped on every switch.
+		if(cvcpu->header.msrs.tsc_aux!=vcpu->cvm_state.msrs.tsc_aux)noir_wrmsr(amd64_tsc_aux,cvcpu->header.msrs.tsc_aux);
+		cvcpu->header.state_cache.ta_valid=true;
 		cvcpu->special_state.switch_success=true;
 	}
 	// Set the event injection
@@ -338,13 +394,13 @@ void noir_hvcode nvc_svm_switch_to_guest_vcpu(noir_gpr_state_p gpr_state,noir_sv
 		noir_svm_vmwrite8(cvcpu->vmcb.virt,tlb_control,nvc_svm_tlb_control_flush_guest);
 		cvcpu->header.state_cache.tl_valid=true;
 	}
+	// Deliver the LAPIC timer interrupt if it expired while the vCPU was not running.
+	nvc_svm_update_cvm_timer(cvcpu);
+	nvc_svm_deliver_queued_interrupts(cvcpu);
 	// If AVIC is supported, set the Physical APIC ID Entry to be running.
+	// Doorbells are sent to the host physical APIC ID, not the processor number.
 	if(noir_bt(&hvm_p->relative_hvm->virt_cap.capabilities,amd64_cpuid_avic))
-	{
-		nvc_svm_avic_physical_apic_id_entry_p apic_physical=(nvc_svm_avic_physical_apic_id_entry_p)cvcpu->vm->avic_physical.virt;
-		apic_physical[cvcpu->vcpu_id].is_running=true;
-		apic_physical[cvcpu->vcpu_id].host_physical_apic_id=cvcpu->proc_id;
-	}
+		nvc_svm_avic_set_running(cvcpu->vm->avic_physical.virt,cvcpu->vcpu_id,vcpu->apic_id,true);
 	// Step 3. Switch vCPU to Guest.
 	loader_stack->custom_vcpu=cvcpu;
 	loader_stack->guest_vmcb_pa=cvcpu->vmcb.phys;
@@ -352,6 +408,54 @@ void noir_hvcode nvc_svm_switch_to_guest_vcpu(noir_gpr_state_p gpr_state,noir_sv
 	// The context will go to the guest when vmrun is executed.
 }
 
+// AVIC evaluates the IRR on vmrun. No doorbell is needed if the vCPU is about to be resumed.
+void static noir_hvcode nvc_svm_set_backing_irr(noir_svm_custom_vcpu_p cvcpu,u8 vector)
+{
+	u32v* irr=(u32v*)((ulong_ptr)cvcpu->apic_backing.virt+amd64_apic_irr+((vector>>5)<<4));
+	noir_locked_bts(irr,vector&31);
+}
+
+// Post the interrupts at the head of the VPCB submission queue to the backing page.
+void noir_hvcode nvc_svm_deliver_queued_interrupts(noir_svm_custom_vcpu_p cvcpu)
+{
+	noir_cvm_vpcb_queue_p queue=nvc_cvm_get_vpcb_queue(&cvcpu->header);
+	u8 vector;
+	// Without AVIC, the interrupt cannot be posted regardless of RFLAGS.IF. Leave it to the VMM.
+	if(queue==null || !cvcpu->vm->header.properties.apic_enable)return;
+	while(nvc_cvm_vpcb_queue_peek_interrupt(queue,&vector))
+	{
+		nvc_svm_set_backing_irr(cvcpu,vector);
+		nvc_cvm_vpcb_queue_pop(queue);
+		cvcpu->header.statistics.queue_completions++;
+	}
+}
+
+// Post the LAPIC timer interrupt to the backing page if the timer expires. Returns true if the interrupt is posted.
+bool noir_hvcode nvc_svm_update_cvm_timer(noir_svm_custom_vcpu_p cvcpu)
+{
+	noir_cvm_lapic_timer_p timer=&cvcpu->header.lapic_timer;
+	if(cvcpu->vm->header.properties.apic_enable && noir_cvm_lapic_timer_enabled(timer))
+	{
+		const u64 now=noir_rdtsc()+noir_svm_vmread64(cvcpu->vmcb.virt,tsc_offset);
+		u8 vector;
+		if(nvc_cvm_lapic_timer_expire(timer,now,&vector))
+		{
+			nvc_svm_set_backing_irr(cvcpu,vector);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Returns true if the LAPIC timer is going to expire before the host timer interrupts the processor.
+bool noir_hvcode nvc_svm_cvm_timer_unarmed(noir_svm_custom_vcpu_p cvcpu)
+{
+	noir_cvm_lapic_timer_p timer=&cvcpu->header.lapic_timer;
+	if(cvcpu->vm->header.properties.apic_enable && noir_cvm_lapic_timer_enabled(timer) && !noir_cvm_lapic_timer_masked(timer->lvt))
+		return nvc_cvm_lapic_timer_unarmed(timer,noir_rdtsc(),noir_svm_vmread64(cvcpu->vmcb.virt,tsc_offset));
+	return false;
+}
+
 void noir_hvcode nvc_svm_load_basic_exit_context(noir_svm_custom_vcpu_p cvcpu)
 {
 	void* vmcb_va=cvcpu->vmcb.virt;
@@ -413,33 +517,36 @@ void noir_hvcode nvc_svm_dump_guest_fs_gs(noir_cvm_virtual_cpu_p vcpu,void* vmcb
 void noir_hvcode nvc_svm_dump_guest_vcpu_state(noir_svm_custom_vcpu_p vcpu)
 {
 	void* vmcb=vcpu->vmcb.virt;
+	// Only dump the requested groups. Zero stands for all groups.
+	const u32 requested=vcpu->header.synchronizing_groups?vcpu->header.synchronizing_groups:noir_cvm_state_cache_all_groups;
 	// If the state is marked invalid, do not dump from VMCB in that
 	// the state is changed by layered hypervisor.
-	if(vcpu->header.state_cache.cr_valid)
+	const u32 groups=requested&vcpu->header.state_cache.value;
+	if(groups&noir_cvm_state_cache_cr_valid)
 	{
 		vcpu->header.crs.cr0=noir_svm_vmread64(vmcb,guest_cr0);
 		vcpu->header.crs.cr3=noir_svm_vmread64(vmcb,guest_cr3);
 		vcpu->header.crs.cr4=noir_svm_vmread64(vmcb,guest_cr4);
 	}
-	if(vcpu->header.state_cache.cr2valid)
+	if(groups&noir_cvm_state_cache_cr2valid)
 		vcpu->header.crs.cr2=noir_svm_vmread64(vmcb,guest_cr2);
-	if(vcpu->header.state_cache.dr_valid)
+	if(groups&noir_cvm_state_cache_dr_valid)
 	{
 		vcpu->header.drs.dr6=noir_svm_vmread64(vmcb,guest_dr6);
 		vcpu->header.drs.dr7=noir_svm_vmread64(vmcb,guest_dr7);
 	}
-	if(vcpu->header.state_cache.sr_valid)
+	if(groups&noir_cvm_state_cache_sr_valid)
 		nvc_svm_dump_guest_segments(&vcpu->header,vmcb);
-	if(vcpu->header.state_cache.fg_valid)
+	if(groups&noir_cvm_state_cache_fg_valid)
 		nvc_svm_dump_guest_fs_gs(&vcpu->header,vmcb);
-	if(vcpu->header.state_cache.dt_valid)
+	if(groups&noir_cvm_state_cache_dt_valid)
 	{
 		vcpu->header.seg.gdtr.limit=noir_svm_vmread32(vmcb,guest_gdtr_limit);
 		vcpu->header.seg.idtr.limit=noir_svm_vmread32(vmcb,guest_idtr_limit);
 		vcpu->header.seg.gdtr.base=noir_svm_vmread64(vmcb,guest_gdtr_base);
 		vcpu->header.seg.idtr.base=noir_svm_vmread64(vmcb,guest_idtr_base);
 	}
-	if(vcpu->header.state_cache.lt_valid)
+	if(groups&noir_cvm_state_cache_lt_valid)
 	{
 		vcpu->header.seg.ldtr.selector=noir_svm_vmread16(vmcb,guest_ldtr_selector);
 		vcpu->header.seg.ldtr.attrib=svm_attrib_inverse(noir_svm_vmread16(vmcb,guest_ldtr_attrib));
@@ -450,31 +557,33 @@ void noir_hvcode nvc_svm_dump_guest_vcpu_state(noir_svm_custom_vcpu_p vcpu)
 		vcpu->header.seg.tr.limit=noir_svm_vmread32(vmcb,guest_tr_limit);
 		vcpu->header.seg.tr.base=noir_svm_vmread64(vmcb,guest_tr_base);
 	}
-	if(vcpu->header.state_cache.sc_valid)
+	if(groups&noir_cvm_state_cache_sc_valid)
 	{
 		vcpu->header.msrs.star=noir_svm_vmread64(vmcb,guest_star);
 		vcpu->header.msrs.lstar=noir_svm_vmread64(vmcb,guest_lstar);
 		vcpu->header.msrs.cstar=noir_svm_vmread64(vmcb,guest_cstar);
 		vcpu->header.msrs.sfmask=noir_svm_vmread64(vmcb,guest_sfmask);
 	}
-	if(vcpu->header.state_cache.se_valid)
+	if(groups&noir_cvm_state_cache_se_valid)
 	{
 		vcpu->header.msrs.sysenter_cs=noir_svm_vmread64(vmcb,guest_sysenter_cs);
 		vcpu->header.msrs.sysenter_esp=noir_svm_vmread64(vmcb,guest_sysenter_esp);
 		vcpu->header.msrs.sysenter_eip=noir_svm_vmread64(vmcb,guest_sysenter_eip);
 	}
-	if(vcpu->header.state_cache.tp_valid)
+	if(groups&noir_cvm_state_cache_tp_valid)
 		vcpu->header.crs.cr8=noir_svm_vmread8(vmcb,avic_control)&0xf;
-	if(vcpu->header.state_cache.ef_valid)
+	if(groups&noir_cvm_state_cache_ef_valid)
 	{
 		vcpu->header.msrs.efer=noir_svm_vmread64(vmcb,guest_efer);
 		// Shadow the SVME bit.
 		if(!vcpu->shadowed_bits.svme)noir_btr((u32*)&vcpu->header.msrs.efer,amd64_efer_svme);
 	}
-	if(vcpu->header.state_cache.pa_valid)
+	if(groups&noir_cvm_state_cache_pa_valid)
 		vcpu->header.msrs.pat=noir_svm_vmread64(vmcb,guest_pat);
-	// Tell the layered hypervisor that the vCPU state is already synchronized.
-	vcpu->header.state_cache.synchronized=1;
+	// Tell the layered hypervisor which groups of vCPU state are already synchronized.
+	vcpu->header.synchronized_groups|=groups;
+	if(requested==noir_cvm_state_cache_all_groups)vcpu->header.state_cache.synchronized=1;
+	vcpu->header.synchronizing_groups=0;
 }
 
 void noir_hvcode nvc_svm_initialize_cvm_vmcb(noir_svm_custom_vcpu_p vcpu)
@@ -536,6 +645,18 @@ void noir_hvcode nvc_svm_initialize_cvm_vmcb(noir_svm_custom_vcpu_p vcpu)
 	avic_ctrl.value=0;
 	// Virtual interrupt masking must be enabled. Otherwise, the vCPU might block the host forever.
 	avic_ctrl.virtual_interrupt_masking=1;
+	// Accelerate the virtual APIC if the VMM requests so.
+	if(vcpu->vm->header.properties.apic_enable)
+	{
+		nvc_svm_avic_physical_table physical_table;
+		physical_table.value=vcpu->vm->avic_physical.phys;
+		physical_table.max_index=noir_svm_avic_max_physical_index;
+		noir_svm_vmwrite64(vmcb,avic_apic_bar,page_base(vcpu->header.msrs.apic.value));
+		noir_svm_vmwrite64(vmcb,avic_backing_page_pointer,vcpu->apic_backing.phys);
+		noir_svm_vmwrite64(vmcb,avic_logical_table_pointer,vcpu->vm->avic_logical.phys);
+		noir_svm_vmwrite64(vmcb,avic_physical_table_pointer,physical_table.value);
+		avic_ctrl.enable_avic=1;
+	}
 	noir_svm_vmwrite64(vmcb,avic_control,avic_ctrl.value);
 	// Initialize Nested Paging.
 	npt_ctrl.value=0;
@@ -616,6 +737,25 @@ void nvc_svmc_free_exclusion(noir_svm_custom_vcpu_p vcpu)
 	noir_release_reslock(vm->header.vcpu_list_lock);
 }
 
+// AMD-V has no preemption timer. Arm the host timer to interrupt this processor when the LAPIC timer expires.
+// The interrupt is intercepted and the expiration is noticed when the guest is resumed.
+void static nvc_svmc_arm_host_timer(noir_svm_custom_vcpu_p vcpu)
+{
+	noir_cvm_lapic_timer_p timer=&vcpu->header.lapic_timer;
+	const u64 ticks=nvc_tsc_ticks_per_100ns();
+	timer->armed=0;
+	if(vcpu->vm->header.properties.apic_enable && noir_cvm_lapic_timer_enabled(timer) && !noir_cvm_lapic_timer_masked(timer->lvt) && ticks)
+	{
+		const u64 remaining=nvc_cvm_lapic_timer_arm(timer,noir_rdtsc(),noir_svm_vmread64(vcpu->vmcb.virt,tsc_offset));
+		if(remaining!=maxu64)
+		{
+			noir_set_timer(vcpu->header.host_timer,remaining/ticks);
+			return;
+		}
+	}
+	noir_cancel_timer(vcpu->header.host_timer);
+}
+
 noir_status nvc_svmc_run_vcpu(noir_svm_custom_vcpu_p vcpu)
 {
 	noir_status st=noir_success;
@@ -625,9 +765,14 @@ noir_status nvc_svmc_run_vcpu(noir_svm_custom_vcpu_p vcpu)
 		vcpu->header.exit_context.intercept_code=cv_rescission;
 	else
 	{
+		u8 irql;
 		if(vcpu->header.injected_event.attributes.valid && vcpu->header.injected_event.attributes.type==0)
 			vcpu->special_state.prev_virq=true;
+		// The host timer must interrupt the processor running the guest. Do not migrate until the world is switched back.
+		irql=noir_raise_irql_to_dispatch();
+		nvc_svmc_arm_host_timer(vcpu);
 		noir_svm_vmmcall(noir_svm_run_custom_vcpu,(ulong_ptr)vcpu);
+		noir_lower_irql(irql);
 		// Check if the world-switch is successful.
 		if(vcpu->special_state.switch_success==false)
 		{
@@ -720,11 +865,37 @@ noir_status nvc_svmc_rescind_vcpu(noir_svm_custom_vcpu_p vcpu)
 	return noir_locked_bts64(&vcpu->special_state,63)?noir_already_rescinded:noir_success;
 }
 
+// Post an external interrupt to the virtual APIC. Returns false if the virtual APIC is not accelerated.
+bool nvc_svmc_post_interrupt(noir_svm_custom_vcpu_p vcpu,u8 vector)
+{
+	if(vcpu->vm->header.properties.apic_enable)
+	{
+		nvc_svm_avic_physical_apic_id_entry_p physical=(nvc_svm_avic_physical_apic_id_entry_p)vcpu->vm->avic_physical.virt;
+		nvc_svm_avic_physical_apic_id_entry entry;
+		u32v* irr=(u32v*)((ulong_ptr)vcpu->apic_backing.virt+amd64_apic_irr+((vector>>5)<<4));
+		noir_locked_bts(irr,vector&31);
+		// The locked operation orders the IRR update before reading the running state.
+		// If the vCPU is not running, AVIC evaluates the IRR on the next vmrun.
+		entry.value=physical[vcpu->vcpu_id].value;
+		if(entry.is_running)noir_wrmsr(amd64_apic_doorbell,entry.host_physical_apic_id);
+		return true;
+	}
+	return false;
+}
+
 u32 nvc_svmc_get_vm_asid(noir_svm_custom_vm_p vm)
 {
 	return vm->asid;
 }
 
+u32 nvc_svmc_get_supported_vm_properties()
+{
+	noir_cvm_vm_properties supported={0};
+	// The virtual APIC can be accelerated by AVIC.
+	supported.apic_enable=noir_bt(&hvm_p->relative_hvm->virt_cap.capabilities,amd64_cpuid_avic);
+	return supported.value;
+}
+
 u64 nvc_svmc_get_vcpu_npt_base(noir_cvm_virtual_cpu_p vcpu)
 {
 	noir_svm_custom_vcpu_p cvcpu=(noir_svm_custom_vcpu_p)vcpu;
@@ -906,10 +1077,8 @@ void nvc_svmc_release_vcpu(noir_svm_custom_vcpu_p vcpu)
 		if(noir_bt(&hvm_p->relative_hvm->virt_cap.capabilities,amd64_cpuid_avic))
 		{
 			// Remove from AVIC Logical & Physical APIC ID Table.
-			nvc_svm_avic_physical_apic_id_entry_p avic_physical=(nvc_svm_avic_physical_apic_id_entry_p)vcpu->vm->avic_physical.virt;
-			nvc_svm_avic_logical_apic_id_entry_p avic_logical=(nvc_svm_avic_logical_apic_id_entry_p)vcpu->vm->avic_logical.virt;
-			avic_physical[vcpu->vcpu_id].value=0;
-			avic_logical[vcpu->vcpu_id].value=0;
+			nvc_svm_avic_update_logical_table(vcpu->vm->avic_logical.virt,vcpu->avic_ldr,vcpu->avic_dfr,0,maxu32,vcpu->vcpu_id);
+			nvc_svm_avic_clear_physical_entry(vcpu->vm->avic_physical.virt,vcpu->vcpu_id);
 			// Release APIC Backing Page.
 			if(vcpu->apic_backing.virt)noir_free_contd_memory(vcpu->apic_backing.virt,page_size);
 		}
@@ -922,6 +1091,19 @@ void nvc_svmc_release_vcpu(noir_svm_custom_vcpu_p vcpu)
 	}
 }
 
+// Set the virtual APIC registers to their states after reset.
+void static nvc_svm_reset_apic_backing_page(void* backing_page,u32 vcpu_id)
+{
+	u32p apic_regs=(u32p)backing_page;
+	noir_stosb(backing_page,0,page_size);
+	apic_regs[amd64_apic_id>>2]=vcpu_id<<24;
+	apic_regs[amd64_apic_version>>2]=0x50010;		// Version 0x10, with 6 LVT entries.
+	apic_regs[amd64_apic_dfr>>2]=maxu32;
+	apic_regs[amd64_apic_spurious_int_vector>>2]=0xFF;
+	for(u32 i=amd64_apic_timer_lvt;i<=amd64_apic_evt;i+=0x10)
+		apic_regs[i>>2]=0x10000;					// All LVT entries are masked.
+}
+
 noir_status nvc_svmc_create_vcpu(noir_svm_custom_vcpu_p* virtual_cpu,noir_svm_custom_vm_p virtual_machine,u32 vcpu_id)
 {
 	noir_status st=noir_vcpu_already_created;
@@ -931,8 +1113,8 @@ noir_status nvc_svmc_create_vcpu(noir_svm_custom_vcpu_p* virtual_cpu,noir_svm_cu
 		noir_svm_custom_vcpu_p vcpu=noir_alloc_nonpg_memory(sizeof(noir_svm_custom_vcpu));
 		if(vcpu)
 		{
-			// Allocate VMCB
-			vcpu->vmcb.virt=noir_alloc_contd_memory(page_size);
+			// Allocate VMCB. Hot structures of vCPU follow the VMM thread which is creating the vCPU.
+			vcpu->vmcb.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
 			if(vcpu->vmcb.virt)
 				vcpu->vmcb.phys=noir_get_physical_address(vcpu->vmcb.virt);
 			else
@@ -944,27 +1126,26 @@ noir_status nvc_svmc_create_vcpu(noir_svm_custom_vcpu_p* virtual_cpu,noir_svm_cu
 					goto alloc_failure;
 			if(noir_bt(&hvm_p->relative_hvm->virt_cap.capabilities,amd64_cpuid_avic))
 			{
-				nvc_svm_avic_physical_apic_id_entry_p avic_physical=(nvc_svm_avic_physical_apic_id_entry_p)virtual_machine->avic_physical.virt;
-				nvc_svm_avic_logical_apic_id_entry_p avic_logical=(nvc_svm_avic_logical_apic_id_entry_p)virtual_machine->avic_logical.virt;
 				// Allocate APIC Backing Page
-				vcpu->apic_backing.virt=noir_alloc_contd_memory(page_size);
+				vcpu->apic_backing.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
 				if(vcpu->apic_backing.virt)
 					vcpu->apic_backing.phys=noir_get_physical_address(vcpu->apic_backing.virt);
 				else
 					goto alloc_failure;
-				// Setup the AVIC Physical/Logical APIC ID Tables.
-				avic_physical[vcpu_id].backing_page_pointer=vcpu->apic_backing.phys>>12;
-				avic_physical[vcpu_id].valid=true;
-				avic_logical[vcpu_id].guest_physical_apic_id=vcpu_id;
-				avic_logical[vcpu_id].valid=true;
+				nvc_svm_reset_apic_backing_page(vcpu->apic_backing.virt,vcpu_id);
+				// Setup the AVIC Physical APIC ID Table. The guest physical APIC ID is the vCPU ID.
+				// The Logical APIC ID Table is set up when the guest writes to the LDR.
+				nvc_svm_avic_set_physical_entry(virtual_machine->avic_physical.virt,vcpu_id,vcpu->apic_backing.phys);
+				vcpu->avic_ldr=0;
+				vcpu->avic_dfr=maxu32;
 			}
 			// Allocate XSAVE State Area
-			vcpu->header.xsave_area=noir_alloc_contd_memory(hvm_p->xfeat.supported_size_max);
+			vcpu->header.xsave_area=noir_alloc_contd_memory_with_locality(noir_memory_local,hvm_p->xfeat.supported_size_max);
 			if(vcpu->header.xsave_area==null)goto alloc_failure;
 			if(hvm_p->options.enable_nsv)
 			{
 				// Allocate NSV Area.
-				vcpu->header.vmsa.virt=noir_alloc_contd_memory(page_size);
+				vcpu->header.vmsa.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
 				if(vcpu->header.vmsa.virt)
 					vcpu->header.vmsa.phys=noir_get_physical_address(vcpu->header.vmsa.virt);
 				else
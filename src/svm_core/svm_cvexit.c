@@ -23,6 +23,7 @@
 #include "svm_npt.h"
 #include "svm_exit.h"
 #include "svm_def.h"
+#include "svm_avic.h"
 
 void noir_hvcode nvc_svm_inject_cvm_exception(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu,u8 vector,bool ev,u32 error_code,u64 pf_addr,u8 fetch_length,u8p fetched_instruction)
 {
@@ -489,6 +490,26 @@ void static noir_hvcode fastcall nvc_svm_invd_cvexit_handler(noir_gpr_state_p gp
 // Expected Intercept Code: 0x78
 void static noir_hvcode fastcall nvc_svm_hlt_cvexit_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu)
 {
+	noir_cvm_lapic_timer_p timer=&cvcpu->header.lapic_timer;
+	const u64 rflags=noir_svm_vmread64(cvcpu->vmcb.virt,guest_rflags);
+	// If interrupts are enabled, the halt can be completed by NoirVisor. (e.g.: polling and LAPIC timer)
+	cvcpu->header.halt_poll.halted=noir_bt64(&rflags,amd64_rflags_if) && !cvcpu->vm->header.properties.nsv_guest;
+	if(noir_cvm_lapic_timer_enabled(timer) && cvcpu->header.halt_poll.halted)
+	{
+		// If the LAPIC timer interrupt is pending, the vCPU is woken up at once.
+		if(nvc_svm_update_cvm_timer(cvcpu))
+		{
+			noir_svm_advance_rip(cvcpu->vmcb.virt);
+			cvcpu->header.statistics_internal.selector=&cvcpu->header.statistics.interceptions.halt;
+			return;
+		}
+		// Otherwise, the vCPU is halted in NoirVisor until the timer expires.
+		if(cvcpu->vm->header.properties.apic_enable && !noir_cvm_lapic_timer_masked(timer->lvt))
+		{
+			const u64 remaining=nvc_cvm_lapic_timer_remaining(timer,noir_rdtsc()+noir_svm_vmread64(cvcpu->vmcb.virt,tsc_offset));
+			if(remaining!=maxu64)timer->wakeup=noir_rdtsc()+remaining;
+		}
+	}
 	// The hlt instruction halts the execution of processor.
 	// In this regard, schedule the host to the processor.
 	nvc_svm_switch_to_host_vcpu(gpr_state,vcpu);
@@ -512,6 +533,7 @@ void static noir_hvcode fastcall nvc_svm_invlpga_cvexit_handler(noir_gpr_state_p
 void static noir_hvcode fastcall nvc_svm_io_cvexit_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu)
 {
 	noir_nsv_virtual_cpu_p nsvcpu=(noir_nsv_virtual_cpu_p)cvcpu->header.vmsa.virt;
+	noir_cvm_vpcb_queue_p queue=nvc_cvm_get_vpcb_queue(&cvcpu->header);
 	nvc_svm_io_exit_info info;
 	info.value=noir_svm_vmread32(cvcpu->vmcb.virt,exit_info1);
 	cvcpu->header.exit_context.io.access.io_type=(u16)info.type;
@@ -528,6 +550,14 @@ void static noir_hvcode fastcall nvc_svm_io_cvexit_handler(noir_gpr_state_p gpr_
 		nsvcpu->nsvs.vc_info1=(u64)cvcpu->header.exit_context.io.access.value;
 		nsvcpu->nsvs.vc_info2=(u64)cvcpu->header.exit_context.io.port;
 	}
+	else if(!info.string && queue && nvc_cvm_vpcb_queue_complete_io(queue,(u16)info.port,info.op_size,info.type,(u64p)&gpr_state->rax))
+	{
+		// The VMM has queued the response in the VPCB. No need to switch to the VMM.
+		noir_svm_advance_rip(cvcpu->vmcb.virt);
+		cvcpu->header.statistics.queue_completions++;
+		// Profiler: Classify the interception.
+		cvcpu->header.statistics_internal.selector=&cvcpu->header.statistics.interceptions.emulation;
+	}
 	else
 	{
 		// Deliver the I/O interception to subverted host.
@@ -754,6 +784,28 @@ bool static fastcall nvc_svm_wrmsr_cvexit_handler(noir_gpr_state_p gpr_state,noi
 	return advance;
 }
 
+// Emulate the MSR access to the LAPIC timer. Returns false if the access is not subject to the emulation.
+bool static noir_hvcode nvc_svm_lapic_timer_msr_handler(noir_gpr_state_p gpr_state,noir_svm_custom_vcpu_p cvcpu,u32 index,bool op_write)
+{
+	noir_cvm_lapic_timer_p timer=&cvcpu->header.lapic_timer;
+	u64 now;
+	large_integer val;
+	if(!cvcpu->vm->header.properties.apic_enable || !noir_cvm_lapic_timer_enabled(timer))return false;
+	// The x2APIC timer registers are accessible only in x2APIC mode.
+	if(index!=amd64_tsc_deadline && !noir_bt64(&cvcpu->header.msrs.apic.value,amd64_apic_extd))return false;
+	now=noir_rdtsc()+noir_svm_vmread64(cvcpu->vmcb.virt,tsc_offset);
+	if(op_write)
+	{
+		val.low=(u32)gpr_state->rax;
+		val.high=(u32)gpr_state->rdx;
+		return nvc_cvm_lapic_timer_wrmsr(timer,index,val.value,now);
+	}
+	if(!nvc_cvm_lapic_timer_rdmsr(timer,index,now,&val.value))return false;
+	*(u32*)&gpr_state->rax=val.low;
+	*(u32*)&gpr_state->rdx=val.high;
+	return true;
+}
+
 void static noir_hvcode fastcall nvc_svm_msr_cvexit_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu)
 {
 	// Determine whether MSR-Interception is subject to be delivered to subverted host.
@@ -766,6 +818,12 @@ void static noir_hvcode fastcall nvc_svm_msr_cvexit_handler(noir_gpr_state_p gpr
 		bool no_exit=op_write?nvc_svm_wrmsr_nsvexit_handler(gpr_state,vcpu,cvcpu):nvc_svm_rdmsr_nsvexit_handler(gpr_state,vcpu,cvcpu);
 		if(!no_exit)nvc_svm_switch_to_host_vcpu(gpr_state,vcpu);
 	}
+	else if(nvc_svm_lapic_timer_msr_handler(gpr_state,cvcpu,index,op_write))
+	{
+		// The LAPIC timer is emulated by NoirVisor.
+		noir_svm_advance_rip(cvcpu->vmcb.virt);
+		cvcpu->header.statistics_internal.selector=&cvcpu->header.statistics.interceptions.emulation;
+	}
 	else if(cvcpu->header.vcpu_options.intercept_msr)
 	{
 		bool intercept=true;
@@ -1012,11 +1070,66 @@ void static noir_hvcode fastcall nvc_svm_nested_pf_cvexit_handler(noir_gpr_state
 // Expected Intercept Code: 0x401
 void static noir_hvcode fastcall nvc_svm_incomplete_ipi_cvexit_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu)
 {
-	;
+	noir_cvm_apic_ipi_context_p ipi=&cvcpu->header.exit_context.apic_ipi;
+	const u64 info1=noir_svm_vmread64(cvcpu->vmcb.virt,exit_info1);
+	const u64 info2=noir_svm_vmread64(cvcpu->vmcb.virt,exit_info2);
+	// The write to ICR is trap-like. The instruction is already retired.
+	// IPIs to running vCPUs are delivered by AVIC. Only the rest have to be handled by VMM.
+	ipi->icr_lo=(u32)info1;
+	ipi->icr_hi=(u32)(info1>>32);
+	ipi->reason=(u32)(info2>>32);
+	ipi->target_count=0;
+	noir_stosb(ipi->targets,0,sizeof(ipi->targets));
+	if(ipi->reason==noir_svm_avic_ipi_not_running)
+	{
+		// AVIC has set the IRR of all targets. Tell the VMM which vCPUs are to be woken up.
+		const u32 dfr=*(u32p)((ulong_ptr)cvcpu->apic_backing.virt+amd64_apic_dfr);
+		nvc_svm_avic_route_ipi(cvcpu->vm->avic_physical.virt,cvcpu->vm->avic_logical.virt,ipi->icr_lo,ipi->icr_hi,dfr,cvcpu->vcpu_id,ipi->targets);
+		ipi->target_count=nvc_svm_avic_filter_running(cvcpu->vm->avic_physical.virt,ipi->targets);
+	}
+	// Other reasons (e.g.: INIT, SIPI and NMI) require the VMM to emulate the IPI.
+	nvc_svm_switch_to_host_vcpu(gpr_state,vcpu);
+	cvcpu->header.exit_context.intercept_code=cv_apic_ipi;
+	// Profiler: Classify the interception.
+	cvcpu->header.statistics_internal.selector=&cvcpu->header.statistics.interceptions.apic;
 }
 
 // Expected Intercept Code: 0x402
 void static noir_hvcode fastcall nvc_svm_unaccelerated_avic_cvexit_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_custom_vcpu_p cvcpu)
 {
-	;
+	u32p apic_regs=(u32p)cvcpu->apic_backing.virt;
+	const u64 info1=noir_svm_vmread64(cvcpu->vmcb.virt,exit_info1);
+	const u32 offset=(u32)info1&0xFF0;
+	const bool write=noir_bt64(&info1,32);
+	const bool trap=write && nvc_svm_avic_is_trap_access(offset);
+	if(trap && (offset==amd64_apic_ldr || offset==amd64_apic_dfr))
+	{
+		// The Logical APIC ID Table is maintained by NoirVisor. No need to switch to the VMM.
+		const u32 ldr=apic_regs[amd64_apic_ldr>>2],dfr=apic_regs[amd64_apic_dfr>>2];
+		nvc_svm_avic_update_logical_table(cvcpu->vm->avic_logical.virt,cvcpu->avic_ldr,cvcpu->avic_dfr,ldr,dfr,cvcpu->vcpu_id);
+		cvcpu->avic_ldr=ldr;
+		cvcpu->avic_dfr=dfr;
+	}
+	else if(trap && noir_cvm_lapic_timer_enabled(&cvcpu->header.lapic_timer) && nvc_cvm_lapic_timer_write_register(&cvcpu->header.lapic_timer,offset,apic_regs[offset>>2],noir_rdtsc()+noir_svm_vmread64(cvcpu->vmcb.virt,tsc_offset)))
+	{
+		// The LAPIC timer is emulated by NoirVisor. No need to switch to the VMM.
+	}
+	else
+	{
+		// The rest of accesses (e.g.: timer and LVT registers) are emulated by the VMM.
+		// Fault-like accesses are not retired. The VMM has to emulate the instruction.
+		noir_cvm_apic_access_context_p access=&cvcpu->header.exit_context.apic_access;
+		access->offset=offset;
+		access->write=write;
+		access->trap=trap;
+		access->reserved=0;
+		access->value=trap?apic_regs[offset>>2]:0;
+		// The current count is computed by NoirVisor if the LAPIC timer is emulated.
+		if(!write && offset==amd64_apic_timer_cur_count && noir_cvm_lapic_timer_enabled(&cvcpu->header.lapic_timer))
+			access->value=nvc_cvm_lapic_timer_read_current_count(&cvcpu->header.lapic_timer,noir_rdtsc()+noir_svm_vmread64(cvcpu->vmcb.virt,tsc_offset));
+		nvc_svm_switch_to_host_vcpu(gpr_state,vcpu);
+		cvcpu->header.exit_context.intercept_code=cv_apic_access;
+	}
+	// Profiler: Classify the interception.
+	cvcpu->header.statistics_internal.selector=&cvcpu->header.statistics.interceptions.apic;
 }
\ No newline at end of file
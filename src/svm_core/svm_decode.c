@@ -53,14 +53,12 @@ bool nvc_svm_translate_custom_gpa(u64 pt,u32 level,u64 gpa,u32 access,u64p hpa,n
 			{
 				const u64 offset_mask=(1<<(shift_diff+page_4kb_shift))-1;
 				const u64 base=(table[index].base>>shift_diff)<<(shift_diff+page_4kb_shift);
-				nvd_printf("[SVM-GPA Translate] GPA 0x%016llX is translated into HPA 0x%016llX at level %u!\n",gpa,*hpa,level);
 				*hpa=base+(gpa&offset_mask);
 				return true;
 			}
 			else
 			{
 				const u64 base=page_4kb_mult(table[index].base);
-				nvd_printf("[SVM-GPA Translate] Base of Next Level (%u): 0x%016llX\n",level-1,base);
 				return nvc_svm_translate_custom_gpa(base,level-1,gpa,access,hpa,err_code);
 			}
 		}
@@ -69,7 +67,6 @@ bool nvc_svm_translate_custom_gpa(u64 pt,u32 level,u64 gpa,u32 access,u64p hpa,n
 			// Final Level
 			const u64 base=page_4kb_mult(table[index].base);
 			*hpa=base+page_offset(gpa);
-			nvd_printf("[SVM-GPA Translate] GPA 0x%016llX is translated into HPA 0x%016llX!\n",gpa,*hpa);
 			return true;
 		}
 	}
@@ -1068,19 +1068,9 @@ void static noir_hvcode fastcall nvc_svm_vmrun_handler(noir_gpr_state_p gpr_stat
 			noir_svm_inject_event(vmcb,amd64_general_protection,amd64_fault_trap_exception,true,true,0);
 		else
 		{
-			void* nested_vmcb_va=(void*)nested_vmcb_pa;
 			// Get a node.
 			noir_svm_nested_vcpu_node_p nvcpu=nvc_svm_get_nested_vcpu_node(&vcpu->nested_hvm,nested_vmcb_pa);
 			nvd_printf("Intercepted Nested VM-Entry! Guest VMCB: 0x%p, Shadowed VMCB: 0x%p\n",nested_vmcb_pa,nvcpu->vmcb_t.phys);
-			if(nvcpu->vmcb_c.phys!=nested_vmcb_pa)
-			{
-				nvd_printf("New/Collided VMCB! Assigning shadowed VMCB: 0x%p for 0x%p!\n",nvcpu->vmcb_t.phys,nested_vmcb_pa);
-				// Collision occured!
-				nvcpu->vmcb_c.phys=nested_vmcb_pa;
-				nvcpu->vmcb_c.virt=nested_vmcb_va;
-				// Invalidate the cached state of VMCB.
-				nvcpu->flags.clean=false;
-			}
 			nvc_svm_switch_to_nested_vcpu(gpr_state,vcpu,nvcpu);
 			noir_svm_advance_rip(vmcb);
 		}
@@ -1236,6 +1226,35 @@ void static noir_hvcode fastcall nvc_svm_vmmcall_handler(noir_gpr_state_p gpr_st
 			}
 			break;
 		}
+		case noir_svm_guest_memory_operation:
+		{
+			if(gip>=hvm_p->layered_hv_image.base && gip<hvm_p->layered_hv_image.base+hvm_p->layered_hv_image.size)
+			{
+#if defined(_hv_type1)
+				// FIXME: Translate GVAs in the structure.
+				noir_cvm_gmem_op_context_p gmem_op=null;
+#else
+				noir_cvm_gmem_op_context_p gmem_op=(noir_cvm_gmem_op_context_p)context;
+#endif
+				noir_svm_custom_vcpu_p cvcpu=(noir_svm_custom_vcpu_p)gmem_op->vcpu;
+				// If the cached control registers are not pending to be written, the guest may have changed them.
+				if(cvcpu->header.state_cache.cr_valid)
+				{
+					cvcpu->header.crs.cr0=noir_svm_vmread64(cvcpu->vmcb.virt,guest_cr0);
+					cvcpu->header.crs.cr3=noir_svm_vmread64(cvcpu->vmcb.virt,guest_cr3);
+					cvcpu->header.crs.cr4=noir_svm_vmread64(cvcpu->vmcb.virt,guest_cr4);
+				}
+				if(cvcpu->header.state_cache.ef_valid)
+				{
+					cvcpu->header.msrs.efer=noir_svm_vmread64(cvcpu->vmcb.virt,guest_efer);
+					if(!cvcpu->shadowed_bits.svme)noir_btr((u32*)&cvcpu->header.msrs.efer,amd64_efer_svme);
+				}
+				nvc_operate_guest_memory_hvrt(gmem_op);
+			}
+			else
+				noir_svm_inject_event(vcpu->vmcb.virt,amd64_invalid_opcode,amd64_fault_trap_exception,false,false,0);
+			break;
+		}
 		case noir_svm_nsv_reassign_rmt:
 		{
 			if(gip>=hvm_p->layered_hv_image.base && gip<hvm_p->layered_hv_image.base+hvm_p->layered_hv_image.size)
@@ -1350,9 +1369,14 @@ void static noir_hvcode fastcall nvc_svm_vmload_handler(noir_gpr_state_p gpr_sta
 			nvd_printf("Intercepted vmload! Source VMCB: 0x%p\n",nested_vmcb_pa);
 			// Load to Current VMCB.
 			nvc_svm_vmsl_helper(vmcb,nested_vmcb);
-			// Broadcast to all nodes in nested VMCB.
-			for(u32 i=0;i<noir_svm_cached_nested_vmcb;i++)
-				nvc_svm_vmsl_helper(vcpu->nested_hvm.node_pool[i].vmcb_t.virt,nested_vmcb);
+			// Broadcast to all cached nodes in nested VMCB.
+			// Invalid nodes are never referenced, so they stay behind all cached nodes in the cache list.
+			for(list_entry_p entry=vcpu->nested_hvm.cache.head.next;entry!=&vcpu->nested_hvm.cache.head;entry=entry->next)
+			{
+				noir_svm_nested_vcpu_node_p node=(noir_svm_nested_vcpu_node_p)((ulong_ptr)entry-field_offset(noir_svm_nested_vcpu_node,cache_list));
+				if(!node->flags.cached)break;
+				nvc_svm_vmsl_helper(node->vmcb_t.virt,nested_vmcb);
+			}
 			// Everything are loaded to Current VMCB. Return to guest.
 			noir_svm_advance_rip(vmcb);
 		}
@@ -1559,8 +1583,18 @@ void static noir_hvcode fastcall nvc_svm_nested_pf_handler(noir_gpr_state_p gpr_
 				// Hence we should advance rip by software analysis.
 				// Usually, if #NPF handler goes here, it might be induced by Hardware-Enforced CI.
 				// In this regard, we assume this instruction is writing protected page.
+				// Other faults on protected pages are CI-events as well. They must not be sent to the debugger.
 				void* gva;
-				if(noir_ci_is_ci_phys_page(gpa,&gva))
+				u32 ci_action=noir_ci_fault_not_protected;
+				if(fault.write)
+					ci_action=noir_ci_verify_on_write_fault(gpa,&gva);
+				else if(noir_ci_is_ci_phys_page(gpa,&gva))
+					ci_action=noir_ci_fault_discarded;
+				if(ci_action==noir_ci_fault_corrupted)
+					nvd_printf("CI detected corruption in Page 0x%p on write fault! GPA=0x%p, rip=0x%p\n",gva,gpa,gip);
+				else if(ci_action==noir_ci_fault_restored)
+					nvd_printf("CI restored the corrupted Page 0x%p from its snapshot on write fault! GPA=0x%p, rip=0x%p\n",gva,gpa,gip);
+				else if(ci_action==noir_ci_fault_discarded)
 					nvd_printf("CI-event is intercepted! #NPF Code: 0x%x, GPA=0x%p, GVA=0x%p, rip=0x%p\n",fault.value,gpa,gva,gip);
 				else
 				{
@@ -1716,6 +1750,40 @@ void static noir_hvcode fastcall nvc_svm_nested_pf_handler(noir_gpr_state_p gpr_
 	}
 }
 
+#if defined(_hv_exit_trace)
+void static noir_hvcode nvc_svm_trace_exit(noir_gpr_state_p gpr_state,const void* vmcb,u32 processor,bool cvm_exit)
+{
+	noir_exit_trace_record_p record=nvc_begin_exit_trace(processor);
+	if(record)
+	{
+		const u8 fetched=noir_svm_vmread8(vmcb,number_of_bytes_fetched);
+		record->vendor=noir_exit_trace_vendor_svm;
+		record->flags=cvm_exit?noir_exit_trace_cvm_exit:0;
+		record->exit_code=noir_svm_vmread32(vmcb,exit_code);
+		record->info[0]=noir_svm_vmread64(vmcb,exit_info1);
+		record->info[1]=noir_svm_vmread64(vmcb,exit_info2);
+		record->info[2]=noir_svm_vmread64(vmcb,next_rip);
+		record->info[3]=noir_svm_vmread64(vmcb,exit_interrupt_info);
+		record->rip=noir_svm_vmread64(vmcb,guest_rip);
+		record->rflags=noir_svm_vmread64(vmcb,guest_rflags);
+		noir_movsp(record->gpr,gpr_state,sizeof(void*)*2);
+		record->gpr[4]=noir_svm_vmread64(vmcb,guest_rsp);
+		// Instruction bytes fetched by Decode Assists are what the decoder reads from guest memory.
+		if(fetched)
+			nvc_trace_exit_memory(record,record->rip,(void*)((ulong_ptr)vmcb+guest_instruction_bytes),fetched);
+		else if(!cvm_exit)
+		{
+			// Decode Assists did not fetch the instruction. Read it from the host as the software fetcher does.
+			const u64 gip=noir_svm_vmread64(vmcb,guest_cs_base)+record->rip;
+			u8 ins_bytes[15];
+			u32 err=0;
+			const size_t len=nvc_copy_host_virtual_memory64(noir_svm_vmread64(vmcb,guest_cr3),gip,ins_bytes,sizeof(ins_bytes),false,noir_svm_vmcb_bt32(vmcb,guest_cr4,amd64_cr4_la57),&err);
+			if(len)nvc_trace_exit_memory(record,gip,ins_bytes,(u32)len);
+		}
+	}
+}
+#endif
+
 void noir_hvcode fastcall nvc_svm_exit_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu)
 {
 	// Get the linear address of VMCB.
@@ -1733,6 +1801,9 @@ void noir_hvcode fastcall nvc_svm_exit_handler(noir_gpr_state_p gpr_state,noir_s
 		u16 code_num=(u16)(intercept_code&0x3FF);
 		// rax is saved to VMCB, not GPR state.
 		gpr_state->rax=noir_svm_vmread(vmcb_va,guest_rax);
+#if defined(_hv_exit_trace)
+		nvc_svm_trace_exit(gpr_state,vmcb_va,loader_stack->proc_id,false);
+#endif
 		// Set VMCB Cache State as all to be cached.
 		if(vcpu->enabled_feature & noir_svm_vmcb_caching)
 			noir_svm_vmwrite32(vmcb_va,vmcb_clean_bits,0xffffffff);
@@ -1767,10 +1838,12 @@ void noir_hvcode fastcall nvc_svm_exit_handler(noir_gpr_state_p gpr_state,noir_s
 		u8 code_group=(u8)((intercept_code&0xC00)>>10);
 		u16 code_num=(u16)(intercept_code&0x3FF);
 		// Profiler: Accumulate the Guest vCPU runtime.
-		cvcpu->header.statistics.runtime+=profiler_time-cvcpu->header.statistics_internal.runtime_start;
-		cvcpu->header.statistics_internal.selector=&cvcpu->header.statistics.interceptions.scheduler;
+		nvc_cvm_profiler_enter(&cvcpu->header,profiler_time);
 		// rax is saved to VMCB, not GPR state.
 		gpr_state->rax=noir_svm_vmread(vmcb_va,guest_rax);
+#if defined(_hv_exit_trace)
+		nvc_svm_trace_exit(gpr_state,vmcb_va,loader_stack->proc_id,true);
+#endif
 		// Set VMCB Cache State as all to be cached.
 		if(vcpu->enabled_feature & noir_svm_vmcb_caching)
 			noir_svm_vmwrite32(vmcb_va,vmcb_clean_bits,0xffffffff);
@@ -1778,6 +1851,7 @@ void noir_hvcode fastcall nvc_svm_exit_handler(noir_gpr_state_p gpr_state,noir_s
 		noir_svm_vmwrite32(vmcb_va,tlb_control,nvc_svm_tlb_control_do_nothing);
 		// Mark the state as not synchronized.
 		cvcpu->header.state_cache.synchronized=0;
+		cvcpu->header.synchronized_groups=0;
 		cvcpu->header.exit_context.vcpu_state.loaded=false;
 		// Check if the interception is due to invalid guest state.
 		// Invoke the handler accordingly.
@@ -1794,7 +1868,23 @@ void noir_hvcode fastcall nvc_svm_exit_handler(noir_gpr_state_p gpr_state,noir_s
 		// Since rax register is operated, save to VMCB.
 		// If world is switched, do not write to VMCB.
 		if(loader_stack->guest_vmcb_pa==cvcpu->vmcb.phys)
+		{
 			noir_svm_vmwrite(vmcb_va,guest_rax,gpr_state->rax);
+			// AMD-V has no preemption timer. The LAPIC timer is checked whenever the guest is resumed.
+			nvc_svm_update_cvm_timer(cvcpu);
+			// If the host timer would miss the next expiration (e.g.: the guest reprogrammed the timer), re-arm it in the host.
+			// The run loop re-arms the host timer and resumes the guest without returning to the VMM.
+			if(nvc_svm_cvm_timer_unarmed(cvcpu))
+			{
+				nvc_svm_switch_to_host_vcpu(gpr_state,vcpu);
+				cvcpu->header.exit_context.intercept_code=cv_scheduler_timer_rearm;
+			}
+		}
+		if(loader_stack->guest_vmcb_pa==cvcpu->vmcb.phys)
+		{
+			// Interrupts queued in the VPCB are posted after the preceding entries are consumed.
+			nvc_svm_deliver_queued_interrupts(cvcpu);
+		}
 		else
 		{
 			// VM-Exit to User Hypervisor occurs.
@@ -1809,8 +1899,7 @@ void noir_hvcode fastcall nvc_svm_exit_handler(noir_gpr_state_p gpr_state,noir_s
 			}
 		}
 		// Profiler: accumulate the Hypervisor runtime.
-		cvcpu->header.statistics_internal.selector->time+=noir_get_system_time()-profiler_time;
-		cvcpu->header.statistics_internal.selector->count++;
+		nvc_cvm_profiler_leave(&cvcpu->header,profiler_time);
 	}
 	else if(gpr_state->rax==loader_stack->nested_vcpu->vmcb_t.phys)
 	{
@@ -1821,16 +1910,14 @@ void noir_hvcode fastcall nvc_svm_exit_handler(noir_gpr_state_p gpr_state,noir_s
 		u8 code_group=(u8)((intercept_code&0xC00)>>10);
 		u16 code_num=(u16)(intercept_code&0x3FF);
 		u64 ngrip=noir_svm_vmread32(loader_stack->nested_vcpu->vmcb_t.virt,guest_rip);
-		vcpu->nested_hvm.forward=true;
 		nvd_printf("Intercepted Nested VM-Exit! VMCB: 0x%p, Code: 0x%X, rip=0x%p\n",loader_stack->guest_vmcb_pa,intercept_code,ngrip);
-		// FIXME: Add additional filtering by NoirVisor.
-		void* l2_vmcb=(void*)loader_stack->nested_vcpu->vmcb_t.virt;
 		// Cache L1 VMCB for nested guest.
 		noir_svm_vmwrite32(loader_stack->nested_vcpu->vmcb_t.virt,vmcb_clean_bits,0xffffffff);
-		// Do additional filtering. Note that the rax register is not processed.
+		// VM-Exits not intercepted by the nested hypervisor are handled by NoirVisor. Note that the rax register is not processed.
+		vcpu->nested_hvm.forward=nvc_svm_nested_exit_reflected(loader_stack->nested_vcpu,intercept_code,noir_svm_vmread64(loader_stack->nested_vcpu->vmcb_t.virt,exit_info1),(u32)gpr_state->rcx);
 		if(unlikely(intercept_code<0))
 			svm_nvexit_handler_negative[~intercept_code](gpr_state,vcpu,loader_stack->nested_vcpu);
-		else
+		else if(!vcpu->nested_hvm.forward)
 			svm_nvexit_handlers[code_group][code_num](gpr_state,vcpu,loader_stack->nested_vcpu);
 		// Nested VM is exiting, switch to L1 Guest.
 		if(vcpu->nested_hvm.forward)nvc_svm_switch_from_nested_vcpu(gpr_state,vcpu);
@@ -451,6 +451,10 @@ void nvc_svm_nsv_load_nae_synthetic_msr_state(noir_svm_custom_vcpu_p cvcpu);
 void static fastcall nvc_svm_nvexit_default_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu);
 void static fastcall nvc_svm_nvexit_cpuid_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu);
 void static fastcall nvc_svm_nvexit_shutdown_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu);
+void static fastcall nvc_svm_nvexit_npf_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu);
+void static fastcall nvc_svm_nvexit_vintr_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu);
+void static fastcall nvc_svm_nvexit_io_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu);
+void static fastcall nvc_svm_nvexit_msr_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu);
 
 noir_hvdata noir_svm_nvexit_handler_routine svm_nvexit_handler_group1[noir_svm_maximum_code1]=
 {
@@ -486,7 +490,7 @@ noir_hvdata noir_svm_nvexit_handler_routine svm_nvexit_handler_group1[noir_svm_m
 	nvc_svm_nvexit_default_handler,			// Non-Maskable Interrupts
 	nvc_svm_nvexit_default_handler,			// System Management Interrupts
 	nvc_svm_nvexit_default_handler,			// INIT Signals
-	nvc_svm_nvexit_default_handler,			// Virtual Interrupts
+	nvc_svm_nvexit_vintr_handler,			// Virtual Interrupts
 	nvc_svm_nvexit_default_handler,			// Write to CR0 other than TS/MP bits.
 	nvc_svm_nvexit_default_handler,			// sidt Instruction
 	nvc_svm_nvexit_default_handler,			// sgdt Instruction
@@ -509,8 +513,8 @@ noir_hvdata noir_svm_nvexit_handler_routine svm_nvexit_handler_group1[noir_svm_m
 	nvc_svm_nvexit_default_handler,			// hlt Instruction
 	nvc_svm_nvexit_default_handler,			// invlpg Instruction
 	nvc_svm_nvexit_default_handler,			// invlpga Instruction
-	nvc_svm_nvexit_default_handler,			// I/O Instruction
-	nvc_svm_nvexit_default_handler,			// MSR Instruction
+	nvc_svm_nvexit_io_handler,				// I/O Instruction
+	nvc_svm_nvexit_msr_handler,				// MSR Instruction
 	nvc_svm_nvexit_default_handler,			// Task Switches
 	nvc_svm_nvexit_default_handler,			// FP Error Freezing
 	nvc_svm_nvexit_shutdown_handler,		// Shutdown Condition
@@ -546,7 +550,7 @@ noir_hvdata noir_svm_nvexit_handler_routine svm_nvexit_handler_group1[noir_svm_m
 
 noir_hvdata noir_svm_nvexit_handler_routine svm_nvexit_handler_group2[noir_svm_maximum_code2]=
 {
-	nvc_svm_nvexit_default_handler,					// Nested Page Fault
+	nvc_svm_nvexit_npf_handler,						// Nested Page Fault
 	nvc_svm_nvexit_default_handler,					// AVIC Incomplete Virtual IPI Delivery
 	nvc_svm_nvexit_default_handler,					// Virtual APIC Access Unhandled by AVIC Hardware
 	nvc_svm_nvexit_default_handler					// vmgexit Instruction
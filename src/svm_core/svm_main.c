@@ -559,12 +559,23 @@ void nvc_svm_cleanup(noir_hypervisor_p hvm_p)
 			if(vcpu->hvmcb.virt)
 				noir_free_contd_memory(vcpu->hvmcb.virt,page_size);
 			if(vcpu->hv_stack)
-				noir_free_nonpg_memory(vcpu->hv_stack);
+				noir_free_contd_memory(vcpu->hv_stack,nvc_stack_size);
 			if(vcpu->cvm_state.xsave_area)
 				noir_free_contd_memory(vcpu->cvm_state.xsave_area,page_size);
-			for(u32 j=0;j<noir_svm_cached_nested_vmcb;j++)
-				if(vcpu->nested_hvm.node_pool[j].vmcb_t.virt)
-					noir_free_contd_memory(vcpu->nested_hvm.node_pool[j].vmcb_t.virt,page_size);
+			if(vcpu->nested_hvm.node_pool)
+			{
+				nv_dprintf("Nested VMCB Cache of vCPU %u: %llu hits, %llu misses, %llu evictions.\n",i,vcpu->nested_hvm.cache.hits,vcpu->nested_hvm.cache.misses,vcpu->nested_hvm.cache.evictions);
+				for(u32 j=0;j<vcpu->nested_hvm.cache.capacity;j++)
+				{
+					if(vcpu->nested_hvm.node_pool[j].vmcb_t.virt)
+						noir_free_contd_memory(vcpu->nested_hvm.node_pool[j].vmcb_t.virt,page_size);
+					if(vcpu->nested_hvm.node_pool[j].iopm_t.virt)
+						noir_free_contd_memory(vcpu->nested_hvm.node_pool[j].iopm_t.virt,page_size*3);
+					if(vcpu->nested_hvm.node_pool[j].msrpm_t.virt)
+						noir_free_contd_memory(vcpu->nested_hvm.node_pool[j].msrpm_t.virt,page_size*2);
+				}
+				noir_free_nonpg_memory(vcpu->nested_hvm.node_pool);
+			}
 		}
 		noir_free_nonpg_memory(hvm_p->virtual_cpu);
 	}
@@ -602,8 +613,70 @@ void nvc_svm_cleanup(noir_hypervisor_p hvm_p)
 	}
 }
 
+// Per-processor structures are allocated on the processor that owns them.
+// Therefore, local allocations come from the NUMA node of the processor.
+bool static nvc_svm_alloc_vcpu(noir_hypervisor_p hvm_p,noir_svm_vcpu_p vcpu,u32 index)
+{
+	vcpu->vmcb.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
+	if(vcpu->vmcb.virt==null)return false;
+	vcpu->vmcb.phys=noir_get_physical_address(vcpu->vmcb.virt);
+	vcpu->hsave.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
+	if(vcpu->hsave.virt==null)return false;
+	vcpu->hsave.phys=noir_get_physical_address(vcpu->hsave.virt);
+	vcpu->hvmcb.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
+	if(vcpu->hvmcb.virt==null)return false;
+	vcpu->hvmcb.phys=noir_get_physical_address(vcpu->hvmcb.virt);
+	vcpu->hv_stack=noir_alloc_contd_memory_with_locality(noir_memory_local,nvc_stack_size);
+	if(vcpu->hv_stack==null)return false;
+	vcpu->cvm_state.xsave_area=noir_alloc_contd_memory_with_locality(noir_memory_local,hvm_p->xfeat.supported_size_max);
+	if(vcpu->cvm_state.xsave_area==null)return false;
+	vcpu->relative_hvm=(noir_svm_hvm_p)hvm_p->reserved;
+	if(hvm_p->options.nested_virtualization)		// Setup Nested Hypervisor
+	{
+		vcpu->nested_hvm.node_pool=noir_alloc_nonpg_memory(hvm_p->nested_cache_capacity*sizeof(noir_svm_nested_vcpu_node));
+		if(vcpu->nested_hvm.node_pool==null)return false;
+		vcpu->nested_hvm.cache.capacity=hvm_p->nested_cache_capacity;
+		for(u32 j=0;j<vcpu->nested_hvm.cache.capacity;j++)
+		{
+			vcpu->nested_hvm.node_pool[j].vmcb_t.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
+			if(vcpu->nested_hvm.node_pool[j].vmcb_t.virt==null)return false;
+			vcpu->nested_hvm.node_pool[j].vmcb_t.phys=noir_get_physical_address(vcpu->nested_hvm.node_pool[j].vmcb_t.virt);
+			// Permission maps of the nested guest are merged from NoirVisor's and the nested hypervisor's.
+			vcpu->nested_hvm.node_pool[j].iopm_t.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size*3);
+			if(vcpu->nested_hvm.node_pool[j].iopm_t.virt==null)return false;
+			vcpu->nested_hvm.node_pool[j].iopm_t.phys=noir_get_physical_address(vcpu->nested_hvm.node_pool[j].iopm_t.virt);
+			vcpu->nested_hvm.node_pool[j].msrpm_t.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size*2);
+			if(vcpu->nested_hvm.node_pool[j].msrpm_t.virt==null)return false;
+			vcpu->nested_hvm.node_pool[j].msrpm_t.phys=noir_get_physical_address(vcpu->nested_hvm.node_pool[j].msrpm_t.virt);
+		}
+		nvc_svm_initialize_nested_vcpu_cache(&vcpu->nested_hvm);
+	}
+#if !defined(_hv_type1)
+	if(hvm_p->options.stealth_msr_hook)vcpu->enabled_feature|=noir_svm_syscall_hook;
+	if(hvm_p->options.stealth_inline_hook)vcpu->enabled_feature|=noir_svm_npt_with_hooks;
+	if(hvm_p->options.kva_shadow_presence)vcpu->enabled_feature|=noir_svm_kva_shadow_present;
+#endif
+	// Microsoft TLFS.
+	vcpu->mshvcpu.root_vcpu=(void*)vcpu;
+	vcpu->mshvcpu.vp_index=index;
+	// Finally, enable self-reference.
+	vcpu->self=vcpu;
+	return true;
+}
+
+void static nvc_svm_alloc_vcpu_thunk(void* context,u32 processor_id)
+{
+	if(nvc_svm_alloc_vcpu(hvm_p,&hvm_p->virtual_cpu[processor_id],processor_id)==false)
+	{
+		nv_dprintf("Failed to allocate structures for processor %u!\n",processor_id);
+		noir_locked_inc((u32v*)context);
+	}
+}
+
 noir_status nvc_svm_subvert_system(noir_hypervisor_p hvm_p)
 {
+	u64 phase_time[5];
+	phase_time[0]=noir_get_system_time();
 	hvm_p->cpu_count=noir_get_processor_count();
 	hvm_p->relative_hvm=(noir_svm_hvm_p)hvm_p->reserved;
 	// Query available virtualization capabilities.
@@ -616,63 +689,14 @@ noir_status nvc_svm_subvert_system(noir_hypervisor_p hvm_p)
 	// Query Extended State Enumeration - Useful for xsetbv handler, CVM scheduler, etc.
 	noir_cpuid(amd64_cpuid_std_pestate_enum,0,&hvm_p->xfeat.support_mask.low,&hvm_p->xfeat.enabled_size_max,&hvm_p->xfeat.supported_size_max,&hvm_p->xfeat.support_mask.high);
 	noir_cpuid(amd64_cpuid_std_pestate_enum,1,&hvm_p->xfeat.supported_instructions,null,&hvm_p->xfeat.supported_xss_bits,null);
-	// Initialize vCPUs.
-	hvm_p->virtual_cpu=noir_alloc_nonpg_memory(hvm_p->cpu_count*sizeof(noir_svm_vcpu));
-	// Implementation of Generic Call might differ.
-	// In subversion routine, it might not be allowed to allocate memory.
-	// Thus allocate everything at this moment, even if it costs more on single processor core.
-	if(hvm_p->virtual_cpu)
-	{
-		for(u32 i=0;i<hvm_p->cpu_count;i++)
-		{
-			noir_svm_vcpu_p vcpu=&hvm_p->virtual_cpu[i];
-			vcpu->vmcb.virt=noir_alloc_contd_memory(page_size);
-			if(vcpu->vmcb.virt)
-				vcpu->vmcb.phys=noir_get_physical_address(vcpu->vmcb.virt);
-			else
-				goto alloc_failure;
-			vcpu->hsave.virt=noir_alloc_contd_memory(page_size);
-			if(vcpu->hsave.virt)
-				vcpu->hsave.phys=noir_get_physical_address(vcpu->hsave.virt);
-			else
-				goto alloc_failure;
-			vcpu->hvmcb.virt=noir_alloc_contd_memory(page_size);
-			if(vcpu->hvmcb.virt)
-				vcpu->hvmcb.phys=noir_get_physical_address(vcpu->hvmcb.virt);
-			else
-				goto alloc_failure;
-			vcpu->hv_stack=noir_alloc_nonpg_memory(nvc_stack_size);
-			if(vcpu->hv_stack==null)goto alloc_failure;
-			vcpu->cvm_state.xsave_area=noir_alloc_contd_memory(hvm_p->xfeat.supported_size_max);
-			if(vcpu->cvm_state.xsave_area==null)goto alloc_failure;
-			vcpu->relative_hvm=(noir_svm_hvm_p)hvm_p->reserved;
-			if(hvm_p->options.nested_virtualization)		// Setup Nested Hypervisor
-			{
-				for(u32 j=0;j<noir_svm_cached_nested_vmcb;j++)
-				{
-					vcpu->nested_hvm.node_pool[j].vmcb_t.virt=noir_alloc_contd_memory(page_size);
-					if(vcpu->nested_hvm.node_pool[j].vmcb_t.virt)
-						vcpu->nested_hvm.node_pool[j].vmcb_t.phys=noir_get_physical_address(vcpu->nested_hvm.node_pool[j].vmcb_t.virt);
-					else
-						goto alloc_failure;
-				}
-			}
 #if !defined(_hv_type1)
-			if(hvm_p->options.stealth_msr_hook)vcpu->enabled_feature|=noir_svm_syscall_hook;
-			if(hvm_p->options.stealth_inline_hook)vcpu->enabled_feature|=noir_svm_npt_with_hooks;
-			if(hvm_p->options.kva_shadow_presence)
-			{
-				vcpu->enabled_feature|=noir_svm_kva_shadow_present;
-				nv_dprintf("Warning: KVA-Shadow is present! Stealthy MSR-Hook on AMD Processors is untested in regards of KVA-Shadow!\n");
-			}
+	if(hvm_p->options.kva_shadow_presence)
+		nv_dprintf("Warning: KVA-Shadow is present! Stealthy MSR-Hook on AMD Processors is untested in regards of KVA-Shadow!\n");
 #endif
-			// Microsoft TLFS.
-			vcpu->mshvcpu.root_vcpu=(void*)vcpu;
-			vcpu->mshvcpu.vp_index=i;
-			// Finally, enable self-reference.
-			vcpu->self=vcpu;
-		}
-	}
+	// Initialize vCPUs.
+	hvm_p->virtual_cpu=noir_alloc_nonpg_memory(hvm_p->cpu_count*sizeof(noir_svm_vcpu));
+	if(hvm_p->virtual_cpu==null)goto alloc_failure;
+	// Phase I: Build structures shared by all processors.
 	hvm_p->relative_hvm->primary_nptm=nvc_npt_build_identity_map();
 	if(hvm_p->relative_hvm->primary_nptm==null)goto alloc_failure;
 #if !defined(_hv_type1)
@@ -734,20 +758,29 @@ noir_status nvc_svm_subvert_system(noir_hypervisor_p hvm_p)
 		nv_dprintf("Failed to build hypervisor's paging structure...\n");
 	nvc_svm_setup_msr_hook(hvm_p);
 	nvc_svm_setup_io_hook(hvm_p);
-	// Build Reverse Mapping Table
+	hvm_p->options.tlfs_passthrough=noir_is_under_hvm();
+	if(hvm_p->options.tlfs_passthrough && hvm_p->options.cpuid_hv_presence)
+		nv_dprintf("Note: Hypervisor is detected! The cpuid presence will be in pass-through mode!\n");
+	nvc_svm_set_mshv_handler(hvm_p->options.tlfs_passthrough?false:hvm_p->options.cpuid_hv_presence);
+	phase_time[1]=noir_get_system_time();
+	// Phase II: Allocate per-processor structures on each processor.
+	if(nvc_setup_per_processor(nvc_svm_alloc_vcpu_thunk))goto alloc_failure;
+	phase_time[2]=noir_get_system_time();
+	// Phase III: Protect the hypervisor in the shared NPT.
 	if(nvc_npt_protect_critical_hypervisor(hvm_p)==false)goto alloc_failure;
-	if(hvm_p->virtual_cpu==null)goto alloc_failure;
+	// Build Reverse Mapping Table
 	if(hvm_p->options.enable_nsv)
 	{
 		if(!nvc_build_reverse_mapping_table())goto alloc_failure;
 		nvc_npt_build_reverse_map();
 	}
-	hvm_p->options.tlfs_passthrough=noir_is_under_hvm();
-	if(hvm_p->options.tlfs_passthrough && hvm_p->options.cpuid_hv_presence)
-		nv_dprintf("Note: Hypervisor is detected! The cpuid presence will be in pass-through mode!\n");
-	nvc_svm_set_mshv_handler(hvm_p->options.tlfs_passthrough?false:hvm_p->options.cpuid_hv_presence);
+	phase_time[3]=noir_get_system_time();
+	// Phase IV: Subvert all processors. Nothing is allocated from now on.
 	nv_dprintf("All allocations are done, start subversion!\n");
 	noir_generic_call(nvc_svm_subvert_processor_thunk,hvm_p->virtual_cpu);
+	phase_time[4]=noir_get_system_time();
+	// The system time is in unit of 100ns.
+	nv_dprintf("Subversion phases of %u processors (us): Shared=%llu, Allocation=%llu, Protection=%llu, Subversion=%llu\n",hvm_p->cpu_count,(phase_time[1]-phase_time[0])/10,(phase_time[2]-phase_time[1])/10,(phase_time[3]-phase_time[2])/10,(phase_time[4]-phase_time[3])/10);
 	nv_dprintf("Subversion completed!\n");
 	return noir_success;
 alloc_failure:
@@ -341,11 +341,15 @@ bool nvc_npt_protect_critical_hypervisor(noir_hypervisor_p hvm)
 bool nvc_npt_initialize_ci(noir_npt_manager_p nptm)
 {
 	bool r=true;
-	for(u32 i=0;i<noir_ci->pages;i++)
+	// Code integrity might not be initialized.
+	if(noir_ci)
 	{
-		u64 phys=noir_ci->page_ci[i].phys;
-		r&=nvc_npt_update_pte(nptm,phys,phys,true,false,true,true);
-		if(!r)break;
+		for(u32 i=0;i<noir_ci->pages;i++)
+		{
+			u64 phys=noir_ci->page_ci[i].phys;
+			r&=nvc_npt_update_pte(nptm,phys,phys,true,false,true,true);
+			if(!r)break;
+		}
 	}
 	return r;
 }
@@ -165,6 +165,32 @@ void noir_hvcode nvc_svm_switch_from_nested_vcpu(noir_gpr_state_p gpr_state,noir
 	loader_stack->guest_vmcb_pa=vcpu->vmcb.phys;
 }
 
+// The nested guest must exit if either NoirVisor or the nested hypervisor intercepts the access.
+void static noir_hvcode nvc_svm_merge_nested_permission_maps(noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu_node)
+{
+	void* vmcb_c=nvcpu_node->vmcb_c.virt;
+	void* vmcb_t=nvcpu_node->vmcb_t.virt;
+	u64p l0_iopm=(u64p)vcpu->relative_hvm->iopm.virt;
+	u64p l0_msrpm=(u64p)vcpu->relative_hvm->msrpm.virt;
+	u64p iopm_t=(u64p)nvcpu_node->iopm_t.virt;
+	u64p msrpm_t=(u64p)nvcpu_node->msrpm_t.virt;
+	u64p l1_iopm=null,l1_msrpm=null;
+	// Permission maps are ignored unless the nested hypervisor enables them.
+	if(noir_bt(&nvcpu_node->l1_intercepts[intercepted_io>>5],intercepted_io&31))
+		l1_iopm=(u64p)noir_find_virt_by_phys(page_base(noir_svm_vmread64(vmcb_c,iopm_physical_address)));
+	if(noir_bt(&nvcpu_node->l1_intercepts[intercepted_msr>>5],intercepted_msr&31))
+		l1_msrpm=(u64p)noir_find_virt_by_phys(page_base(noir_svm_vmread64(vmcb_c,msrpm_physical_address)));
+	for(u32 i=0;i<(page_size*3)>>3;i++)
+		iopm_t[i]=l1_iopm?l0_iopm[i]|l1_iopm[i]:l0_iopm[i];
+	for(u32 i=0;i<(page_size*2)>>3;i++)
+		msrpm_t[i]=l1_msrpm?l0_msrpm[i]|l1_msrpm[i]:l0_msrpm[i];
+	nvcpu_node->l1_iopm=l1_iopm;
+	nvcpu_node->l1_msrpm=l1_msrpm;
+	noir_svm_vmwrite64(vmcb_t,iopm_physical_address,nvcpu_node->iopm_t.phys);
+	noir_svm_vmwrite64(vmcb_t,msrpm_physical_address,nvcpu_node->msrpm_t.phys);
+	noir_svm_vmcb_btr32(vmcb_t,vmcb_clean_bits,noir_svm_clean_iomsrpm);
+}
+
 void noir_hvcode nvc_svm_switch_to_nested_vcpu(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu_node)
 {
 	noir_svm_initial_stack_p loader_stack=noir_svm_get_loader_stack(vcpu->hv_stack);
@@ -174,6 +200,16 @@ void noir_hvcode nvc_svm_switch_to_nested_vcpu(noir_gpr_state_p gpr_state,noir_s
 	for(u32 i=0;i<noir_svm_maximum_clean_state_bits;i++)
 		if(!nvcpu_node->flags.clean || noir_svm_vmcb_bt32(vmcb_c,vmcb_clean_bits,i)==false)
 			svm_clean_vmcb[i](vmcb_c,vmcb_t);
+	// Snapshot the interceptions of the nested hypervisor so that VM-Exits can be dispatched without reading its VMCB.
+	// Intercept vectors are contiguous in VMCB and ordered by the intercept codes.
+	if(!nvcpu_node->flags.clean || noir_svm_vmcb_bt32(vmcb_c,vmcb_clean_bits,noir_svm_clean_interception)==false)
+		for(u32 i=0;i<noir_svm_nested_intercept_words;i++)
+			nvcpu_node->l1_intercepts[i]=noir_svm_vmread32(vmcb_c,intercept_access_cr+(i<<2));
+	if(!nvcpu_node->flags.clean || noir_svm_vmcb_bt32(vmcb_c,vmcb_clean_bits,noir_svm_clean_npt)==false)
+		nvcpu_node->flags.l1_npt=noir_svm_vmcb_bt32(vmcb_c,npt_control,nvc_svm_npt_control_npt);
+	// Whether the nested hypervisor protects I/O and MSRs is specified in the intercept vectors.
+	if(!nvcpu_node->flags.clean || noir_svm_vmcb_bt32(vmcb_c,vmcb_clean_bits,noir_svm_clean_interception)==false || noir_svm_vmcb_bt32(vmcb_c,vmcb_clean_bits,noir_svm_clean_iomsrpm)==false)
+		nvc_svm_merge_nested_permission_maps(vcpu,nvcpu_node);
 	// Special Treatments.
 	if(noir_svm_vmcb_bt64(vmcb_t,avic_control,nvc_svm_avic_control_vintr_mask))
 	{
@@ -216,6 +252,9 @@ void static noir_hvcode fastcall nvc_svm_clean_vmcb_interceptions(void* vmcb_c,v
 	// Always-intercept options.
 	noir_svm_vmcb_bts32(vmcb_t,intercept_instruction1,nvc_svm_intercept_vector1_cpuid);
 	noir_svm_vmcb_bts32(vmcb_t,intercept_instruction1,nvc_svm_intercept_vector1_shutdown);
+	// NoirVisor's I/O and MSR interceptions are merged into the permission maps of the nested guest.
+	noir_svm_vmcb_bts32(vmcb_t,intercept_instruction1,nvc_svm_intercept_vector1_io);
+	noir_svm_vmcb_bts32(vmcb_t,intercept_instruction1,nvc_svm_intercept_vector1_msr);
 	// noir_svm_vmcb_bts32(vmcb_t,intercept_instruction2,nvc_svm_intercept_vector2_vmmcall);
 	// Clean the cache.
 	noir_svm_vmcb_btr32(vmcb_t,vmcb_clean_bits,noir_svm_clean_interception);
@@ -223,11 +262,8 @@ void static noir_hvcode fastcall nvc_svm_clean_vmcb_interceptions(void* vmcb_c,v
 
 void static noir_hvcode fastcall nvc_svm_clean_vmcb_iomsrpm(void* vmcb_c,void* vmcb_t)
 {
-	// FIXME: Emulate I/O and MSR Permission Map.
 	// Cached States for I/O and MSR Permission Map are invalidated.
-	noir_svm_vmcopy64(vmcb_t,vmcb_c,iopm_physical_address);
-	noir_svm_vmcopy64(vmcb_t,vmcb_c,msrpm_physical_address);
-	// Clean the cache.
+	// The maps are merged by nvc_svm_merge_nested_permission_maps because NoirVisor's maps are required.
 	noir_svm_vmcb_btr32(vmcb_t,vmcb_clean_bits,noir_svm_clean_iomsrpm);
 }
 
@@ -369,53 +405,360 @@ void static noir_hvcode fastcall nvc_svm_clean_vmcb_cet(void* vmcb_c,void* vmcb_
 	noir_svm_vmcb_btr32(vmcb_t,vmcb_clean_bits,noir_svm_clean_cet);
 }
 
+/*
+  Nested VMCB Cache...
+
+  Shadowed VMCBs are cached with AVL tree and Cache List. See doc/cache_list.md for details.
+  Lookup and insertion take logarithmic time. Reference and eviction take constant time.
+  The cache does not hold states newer than L1 VMCB: the states are written back to L1 VMCB on every nested VM-Exit.
+  Hence, evicting a node only requires the node to be invalidated.
+*/
+
+i32 static cdecl nvc_svm_compare_nested_vcpu_nodes(const void* a,const void* b)
+{
+	const noir_svm_nested_vcpu_node_p node_a=(noir_svm_nested_vcpu_node_p)a,node_b=(noir_svm_nested_vcpu_node_p)b;
+	if(node_a->vmcb_c.phys<node_b->vmcb_c.phys)
+		return -1;
+	else if(node_a->vmcb_c.phys>node_b->vmcb_c.phys)
+		return 1;
+	return 0;
+}
+
+i32 static cdecl nvc_svm_bst_search_nested_vcpu_node(avl_node_p node,const void* item)
+{
+	noir_svm_nested_vcpu_node_p nvcpu_node=(noir_svm_nested_vcpu_node_p)node;
+	u64 vmcb=*(u64p)item;
+	if(vmcb<nvcpu_node->vmcb_c.phys)
+		return -1;
+	else if(vmcb>nvcpu_node->vmcb_c.phys)
+		return 1;
+	return 0;
+}
+
+void nvc_svm_initialize_nested_vcpu_cache(noir_svm_nested_vcpu_p nvcpu)
+{
+	nvcpu->cache.root=null;
+	noir_initialize_list_entry(&nvcpu->cache.head);
+	// All nodes are invalid at first.
+	for(u32 i=0;i<nvcpu->cache.capacity;i++)
+	{
+		noir_svm_nested_vcpu_node_p node=&nvcpu->node_pool[i];
+		node->avl.left=node->avl.right=null;
+		node->avl.height=1;
+		node->flags.value=0;
+		noir_insert_to_prev(&nvcpu->cache.head,&node->cache_list);
+	}
+}
+
 noir_svm_nested_vcpu_node_p noir_hvcode nvc_svm_get_nested_vcpu_node(noir_svm_nested_vcpu_p nvcpu,u64 vmcb)
 {
-	// Hash the VMCB GPA into 4 bits.
-	u8 hash=0xC;
-	for(u32 i=12;i<64;i+=4)
+	noir_svm_nested_vcpu_node_p node=(noir_svm_nested_vcpu_node_p)noir_search_avl_node((avl_node_p)nvcpu->cache.root,&vmcb,nvc_svm_bst_search_nested_vcpu_node);
+	if(node)
+		nvcpu->cache.hits++;
+	else
 	{
-		u8 cur_value=(u8)((vmcb>>i)&0xF);
-		hash^=cur_value;
+		// Cache miss. Pick the least recently used node.
+		node=(noir_svm_nested_vcpu_node_p)((ulong_ptr)nvcpu->cache.head.prev-field_offset(noir_svm_nested_vcpu_node,cache_list));
+		nvcpu->cache.misses++;
+		if(node->flags.cached)
+		{
+			nvd_printf("Evicting shadowed VMCB 0x%p of 0x%p for 0x%p!\n",node->vmcb_t.phys,node->vmcb_c.phys,vmcb);
+			nvcpu->cache.root=(noir_svm_nested_vcpu_node_p)noir_remove_avl_node((avl_node_p)nvcpu->cache.root,&node->avl,nvc_svm_compare_nested_vcpu_nodes);
+			nvcpu->cache.evictions++;
+		}
+		// Assign the node to the VMCB. Cached states must be invalidated.
+		node->vmcb_c.phys=vmcb;
+		node->vmcb_c.virt=(void*)vmcb;
+		node->flags.value=0;
+		node->flags.cached=true;
+		nvcpu->cache.root=(noir_svm_nested_vcpu_node_p)noir_insert_avl_node((avl_node_p)nvcpu->cache.root,&node->avl,nvc_svm_compare_nested_vcpu_nodes);
 	}
-	// Use the hash as index to locate the node.
-	return &nvcpu->node_pool[hash];
-	// It is caller's responsibility to check hash collision!
+	// Reference the node in the cache list.
+	noir_remove_list_entry(&node->cache_list);
+	noir_insert_to_next(&nvcpu->cache.head,&node->cache_list);
+	return node;
 }
 
 /*
   Handling VM-Exits from Nested Guest...
+
+  A VM-Exit is reflected to the nested hypervisor if and only if the nested hypervisor intercepts it.
+  Otherwise, the VM-Exit is due to interceptions by NoirVisor, and NoirVisor handles it without switching to L1.
+  The decision only consults the snapshot of the nested vCPU node, so it does not read the VMCB of L1.
 */
 
-// FIXME: Implement handlers for interceptions not used by nested hypervisor!
+// Returns the bit position of the MSR in MSRPM. Accesses to MSRs out of MSRPM always cause VM-Exits.
+i32 static noir_hvcode nvc_svm_msrpm_bit_position(u32 index,bool write)
+{
+	if(index<0x2000)
+		return svm_msrpm_bit(1,index,write);
+	else if(index>=0xC0000000 && index<0xC0002000)
+		return 0x4000+svm_msrpm_bit(2,index,write);
+	else if(index>=0xC0010000 && index<0xC0012000)
+		return 0x8000+svm_msrpm_bit(3,index,write);
+	return -1;
+}
+
+bool noir_hvcode nvc_svm_nested_exit_reflected(noir_svm_nested_vcpu_node_p nvcpu,i32 intercept_code,u64 exit_info1,u32 msr_index)
+{
+	// Negative intercept codes (e.g.: invalid guest state) always belong to the nested hypervisor.
+	if(intercept_code<0)return true;
+	if(intercept_code<noir_svm_nested_intercept_words*32)
+	{
+		if(!noir_bt(&nvcpu->l1_intercepts[intercept_code>>5],intercept_code&31))return false;
+		// The nested hypervisor filters I/O and MSR accesses with its permission maps.
+		if(intercept_code==intercepted_io)
+		{
+			nvc_svm_io_exit_info info;
+			info.value=(u32)exit_info1;
+			// The access is intercepted if any of the accessed ports is intercepted. Operand size is in bytes.
+			for(u32 i=0;i<info.op_size;i++)
+				if(noir_test_bitmap(nvcpu->l1_iopm,info.port+i))
+					return true;
+			return false;
+		}
+		else if(intercept_code==intercepted_msr)
+		{
+			const i32 bit=nvc_svm_msrpm_bit_position(msr_index,(bool)(exit_info1&1));
+			return bit<0?true:noir_test_bitmap(nvcpu->l1_msrpm,bit);
+		}
+		return true;
+	}
+	// If the nested hypervisor disabled NPT, the nested guest runs on NoirVisor's NPT.
+	if(intercept_code==nested_page_fault)
+		return nvcpu->flags.l1_npt;
+	return true;
+}
 
 // Default handler of VM-Exit.
 void static noir_hvcode fastcall nvc_svm_nvexit_default_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu)
 {
-	;
+	// NoirVisor does not know how to handle this VM-Exit. Let the nested hypervisor handle it.
+	vcpu->nested_hvm.forward=true;
 }
 
 // Expected Intercept Code: 0x72
 // CPUID is an optional interception in AMD-V!
 void static noir_hvcode fastcall nvc_svm_nvexit_cpuid_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu)
 {
-	vcpu->nested_hvm.forward=noir_svm_vmcb_bt32(nvcpu->vmcb_c.virt,intercept_instruction1,nvc_svm_intercept_vector1_cpuid);
-	if(!vcpu->nested_hvm.forward)
+	// Nested hypervisor did not specify to intercept cpuid!
+	u32 ia=noir_svm_vmread32(nvcpu->vmcb_t.virt,guest_rax);
+	u32 ic=(u32)gpr_state->rcx;
+	noir_cpuid_general_info info;
+	// Forward to our handler.
+	nvcp_svm_cpuid_handler(ia,ic,&info);
+	// Return info.
+	noir_svm_vmwrite32(nvcpu->vmcb_t.virt,guest_rax,info.eax);
+	*(u32p)&gpr_state->rbx=info.ebx;
+	*(u32p)&gpr_state->rcx=info.ecx;
+	*(u32p)&gpr_state->rdx=info.edx;
+	// Advance instruction pointer.
+	noir_svm_advance_rip(nvcpu->vmcb_t.virt);
+}
+
+// Expected Intercept Code: 0x64
+// NoirVisor requested the interrupt window of the nested guest, but the nested hypervisor did not.
+void static noir_hvcode fastcall nvc_svm_nvexit_vintr_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu)
+{
+	void* vmcb_t=nvcpu->vmcb_t.virt;
+	// The window is open. Withdraw the request and resume the nested guest.
+	noir_svm_vmcb_btr32(vmcb_t,intercept_instruction1,nvc_svm_intercept_vector1_vint);
+	noir_svm_vmcb_btr32(vmcb_t,vmcb_clean_bits,noir_svm_clean_interception);
+}
+
+// Expected Intercept Code: 0x7B
+// NoirVisor intercepts the port, but the nested hypervisor does not.
+void static noir_hvcode fastcall nvc_svm_nvexit_io_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu)
+{
+	void* vmcb_t=nvcpu->vmcb_t.virt;
+	nvc_svm_io_exit_info info;
+	info.value=noir_svm_vmread32(vmcb_t,exit_info1);
+	// Port I/O hooks are not generalized yet. Perform the access on behalf of the nested guest.
+	if(info.string)
+	{
+		// FIXME: String I/O requires translating the addresses of the nested guest.
+		nvd_printf("String I/O on port 0x%04X from nested guest is ignored!\n",info.port);
+	}
+	else if(info.type)
+	{
+		u64 rax=noir_svm_vmread64(vmcb_t,guest_rax);
+		switch(info.op_size)
+		{
+			case 1:
+			{
+				rax=(rax&~0xFFull)|noir_inb((u16)info.port);
+				break;
+			}
+			case 2:
+			{
+				rax=(rax&~0xFFFFull)|noir_inw((u16)info.port);
+				break;
+			}
+			case 4:
+			{
+				// Writing to a 32-bit register clears the upper half.
+				rax=(u64)noir_ind((u16)info.port);
+				break;
+			}
+		}
+		noir_svm_vmwrite64(vmcb_t,guest_rax,rax);
+	}
+	else
+	{
+		u64 rax=noir_svm_vmread64(vmcb_t,guest_rax);
+		switch(info.op_size)
+		{
+			case 1:
+			{
+				noir_outb((u16)info.port,(u8)rax);
+				break;
+			}
+			case 2:
+			{
+				noir_outw((u16)info.port,(u16)rax);
+				break;
+			}
+			case 4:
+			{
+				noir_outd((u16)info.port,(u32)rax);
+				break;
+			}
+		}
+	}
+	// The next rip of I/O interception is saved in exit_info2.
+	noir_svm_vmwrite64(vmcb_t,guest_rip,noir_svm_vmread64(vmcb_t,exit_info2));
+}
+
+// Expected Intercept Code: 0x7C
+// NoirVisor intercepts the MSR, but the nested hypervisor does not.
+void static noir_hvcode fastcall nvc_svm_nvexit_msr_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu)
+{
+	void* vmcb_t=nvcpu->vmcb_t.virt;
+	const bool op_write=noir_svm_vmread8(vmcb_t,exit_info1);
+	const u32 index=(u32)gpr_state->rcx;
+	large_integer val={0};
+	if(op_write)
+	{
+		val.low=noir_svm_vmread32(vmcb_t,guest_rax);
+		val.high=(u32)gpr_state->rdx;
+	}
+	switch(index)
+	{
+		case amd64_efer:
+		{
+			// EFER of the nested guest lives in its VMCB. SVM is not exposed to the nested guest.
+			if(!op_write)
+				val.value=noir_svm_vmread64(vmcb_t,guest_efer)&~amd64_efer_svme_bit;
+			else if(noir_bt(&val.low,amd64_efer_svme))
+			{
+				noir_svm_inject_event(vmcb_t,amd64_general_protection,amd64_fault_trap_exception,true,true,0);
+				return;
+			}
+			else
+			{
+				// VMRUN requires the SVME bit in the nested guest.
+				noir_svm_vmwrite64(vmcb_t,guest_efer,val.value|amd64_efer_svme_bit);
+				noir_svm_vmcb_btr32(vmcb_t,vmcb_clean_bits,noir_svm_clean_control_reg);
+			}
+			break;
+		}
+		case amd64_vmcr:
+		case amd64_hsave_pa:
+		case amd64_svm_key:
+		{
+			// SVM is not exposed to the nested guest. Reads return zero and writes are ignored.
+			break;
+		}
+#if defined(_amd64)
+		case amd64_lstar:
+		{
+			// System-Call hooks only apply to the subverted host. LSTAR of the nested guest lives in its VMCB.
+			if(op_write)
+				noir_svm_vmwrite64(vmcb_t,guest_lstar,val.value);
+			else
+				val.value=noir_svm_vmread64(vmcb_t,guest_lstar);
+			break;
+		}
+#else
+		case amd64_sysenter_eip:
+		{
+			if(op_write)
+				noir_svm_vmwrite64(vmcb_t,guest_sysenter_eip,val.value);
+			else
+				val.value=noir_svm_vmread64(vmcb_t,guest_sysenter_eip);
+			break;
+		}
+#endif
+		default:
+		{
+			// Other MSRs intercepted by NoirVisor (e.g.: APIC) are passed through.
+			if(op_write)
+				noir_wrmsr(index,val.value);
+			else
+				val.value=noir_rdmsr(index);
+			break;
+		}
+	}
+	if(!op_write)
+	{
+		noir_svm_vmwrite64(vmcb_t,guest_rax,(u64)val.low);
+		gpr_state->rdx=(ulong_ptr)val.high;
+	}
+	noir_svm_advance_rip(vmcb_t);
+}
+
+// Expected Intercept Code: 0x400
+// This handler is called only if the nested guest runs on NoirVisor's NPT.
+void static noir_hvcode fastcall nvc_svm_nvexit_npf_handler(noir_gpr_state_p gpr_state,noir_svm_vcpu_p vcpu,noir_svm_nested_vcpu_node_p nvcpu)
+{
+	void* vmcb_t=nvcpu->vmcb_t.virt;
+	const u64 gpa=noir_svm_vmread64(vmcb_t,exit_info2);
+	amd64_npt_fault_code fault;
+	// GPAs of the nested guest are GPAs of the subverted host. Classify the page by the reverse-mapping table.
+	noir_rmt_entry_p rm_table=nvc_get_rmt_entry(gpa);
+	void* instruction=(void*)((ulong_ptr)vmcb_t+guest_instruction_bytes);
+	const bool long_mode=noir_svm_vmcb_bt32(vmcb_t,guest_cs_attrib,9);
+	ulong_ptr gip=noir_svm_vmread(vmcb_t,guest_rip);
+	fault.value=noir_svm_vmread64(vmcb_t,exit_info1);
+	if(rm_table==null)
+	{
+		// MMIO ranges are not reverse-mapped. NoirVisor does not emulate MMIO for the nested guest.
+		nvd_printf("Nested guest accessed protected MMIO! #NPF Code: 0x%x, GPA=0x%p, rip=0x%p\n",fault.value,gpa,gip);
+	}
+	else if(rm_table->low.asid==1)
 	{
-		// Nested hypervisor did not specify to intercept cpuid!
-		u32 ia=noir_svm_vmread32(nvcpu->vmcb_t.virt,guest_rax);
-		u32 ic=(u32)gpr_state->rcx;
-		noir_cpuid_general_info info;
-		// Forward to our handler.
-		nvcp_svm_cpuid_handler(ia,ic,&info);
-		// Return info.
-		noir_svm_vmwrite32(nvcpu->vmcb_t.virt,guest_rax,info.eax);
-		*(u32p)&gpr_state->rbx=info.ebx;
-		*(u32p)&gpr_state->rcx=info.ecx;
-		*(u32p)&gpr_state->rdx=info.edx;
-		// Advance instruction pointer.
-		noir_svm_advance_rip(nvcpu->vmcb_t.virt);
+		// Memory of the subverted host.
+#if !defined(_hv_type1)
+		if(fault.execute)
+		{
+			// For #NPF due to execution, it is assumed to be due to stealthy hooks.
+			noir_npt_manager_p pri_nptm=vcpu->relative_hvm->primary_nptm;
+			noir_npt_manager_p sec_nptm=vcpu->relative_hvm->secondary_nptm;
+			u64 cur_ncr3=noir_svm_vmread64(vmcb_t,npt_cr3);
+			// Switch the page table. Switching NPT does not advance rip.
+			noir_svm_vmwrite64(vmcb_t,npt_cr3,pri_nptm->ncr3.phys==cur_ncr3?sec_nptm->ncr3.phys:pri_nptm->ncr3.phys);
+			noir_svm_vmcb_btr32(vmcb_t,vmcb_clean_bits,noir_svm_clean_npt);
+			noir_svm_vmwrite8(vmcb_t,tlb_control,nvc_svm_tlb_control_flush_guest);
+			return;
+		}
+#endif
+		if(fault.write)
+		{
+			void* gva;
+			const u32 ci_action=noir_ci_verify_on_write_fault(gpa,&gva);
+			if(ci_action==noir_ci_fault_corrupted)
+				nvd_printf("CI detected corruption in Page 0x%p on write fault from nested guest! GPA=0x%p, rip=0x%p\n",gva,gpa,gip);
+			else if(ci_action==noir_ci_fault_restored)
+				nvd_printf("CI restored the corrupted Page 0x%p from its snapshot on write fault from nested guest! GPA=0x%p, rip=0x%p\n",gva,gpa,gip);
+		}
+		else
+			nvd_printf("Unknown #NPF is intercepted from nested guest! #NPF Code: 0x%x, GPA=0x%p, rip=0x%p\n",fault.value,gpa,gip);
 	}
+	// ASID zero is reserved by NoirVisor. Other ASIDs belong to NSV guests.
+	// In all cases, the nested guest is accessing memory protected by NoirVisor. Ignore the instruction.
+	gip+=noir_get_instruction_length(instruction,long_mode);
+	if(!long_mode)gip&=maxu32;
+	noir_svm_vmwrite(vmcb_t,guest_rip,gip);
 }
 
 // Expected Intercept Code: 0x7F
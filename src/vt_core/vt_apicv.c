@@ -0,0 +1,103 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file maintains posted interrupts and virtual-APIC pages for Customizable VMs.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /vt_core/vt_apicv.c
+*/
+
+#include <nvdef.h>
+#include <nv_intrin.h>
+#include <ia32.h>
+#include "vt_def.h"
+#include "vt_apicv.h"
+
+/*
+  Functions in this file operate on the posted-interrupt descriptor and the
+  virtual-APIC page only. They do not access the hypervisor structures, and
+  the only intrinsics are atomic operations, so that they can be built into
+  a user-mode model as is.
+
+  Posting an interrupt sets the bit in PIR, then sets ON (Outstanding Notification).
+  The notification is sent only if ON was clear and SN (Suppress Notification) is clear.
+  - If the vCPU is running, the processor merges PIR into VIRR on the notification.
+  - Otherwise, SN is set. NoirVisor merges PIR into VIRR before the next VM-Entry.
+  A virtual interrupt is delivered if RVI[7:4]>VPPR[7:4] while RFLAGS.IF=1.
+*/
+
+#define nvc_vt_apicv_register(page,offset,i)	((u32*)((ulong_ptr)page+offset+((i)<<4)))
+
+// Search the highest vector set in a 256-bit register (e.g.: VIRR and VISR) of the virtual-APIC page.
+u32 noir_hvcode nvc_vt_apicv_highest_vector(void* virtual_apic,u32 offset)
+{
+	for(u32 i=8;i>0;i--)
+	{
+		const u32 bits=*nvc_vt_apicv_register(virtual_apic,offset,i-1);
+		for(u32 j=32;j>0;j--)
+			if(bits&((u32)1<<(j-1)))
+				return ((i-1)<<5)+j-1;
+	}
+	return noir_vt_apicv_no_vector;
+}
+
+u8 noir_hvcode nvc_vt_apicv_compute_ppr(u8 vtpr,u8 svi)
+{
+	// VPPR is VTPR if VTPR[7:4]>=SVI[7:4]. Otherwise, it is SVI[7:4]:0000b.
+	if((vtpr&0xF0)>=(svi&0xF0))return vtpr;
+	return svi&0xF0;
+}
+
+bool noir_hvcode nvc_vt_apicv_is_deliverable(u16 interrupt_status,u8 vtpr)
+{
+	const u8 rvi=noir_vt_apicv_rvi(interrupt_status);
+	const u8 vppr=nvc_vt_apicv_compute_ppr(vtpr,noir_vt_apicv_svi(interrupt_status));
+	return (rvi&0xF0)>(vppr&0xF0);
+}
+
+// Post an interrupt to the descriptor. Returns true if the notification is supposed to be sent.
+bool nvc_vt_apicv_post_interrupt(ia32_posted_interrupt_descriptor_p pi_desc,u8 vector)
+{
+	noir_locked_bts((u32v*)&pi_desc->pir[vector>>5],vector&31);
+	// If ON is already set, the previous notification will have this request merged as well.
+	if(noir_locked_bts((u32v*)&pi_desc->control.value,ia32_pi_outstanding_notification))return false;
+	// The locked operation orders the ON update before reading SN.
+	return !pi_desc->control.suppress_notification;
+}
+
+// Move the posted requests into VIRR. Returns the new Guest Interrupt Status.
+u16 noir_hvcode nvc_vt_apicv_merge_pir(ia32_posted_interrupt_descriptor_p pi_desc,void* virtual_apic,u16 interrupt_status)
+{
+	u8 rvi=noir_vt_apicv_rvi(interrupt_status);
+	u32 highest;
+	// Clear ON before fetching PIR. A request posted after this point will set ON again.
+	if(!noir_locked_btr((u32v*)&pi_desc->control.value,ia32_pi_outstanding_notification))return interrupt_status;
+	for(u32 i=0;i<8;i++)
+	{
+		// Fetch and clear the requests atomically. Other processors may be posting simultaneously.
+		const u32 requests=pi_desc->pir[i]?(u32)noir_locked_xchg((u32v*)&pi_desc->pir[i],0):0;
+		*nvc_vt_apicv_register(virtual_apic,ia32_apic_irr,i)|=requests;
+	}
+	// RVI must not be lower than the highest vector in VIRR.
+	highest=nvc_vt_apicv_highest_vector(virtual_apic,ia32_apic_irr);
+	if(highest>rvi)rvi=(u8)highest;
+	return (interrupt_status&0xFF00)|rvi;
+}
+
+void nvc_vt_apicv_reset_page(void* virtual_apic,u32 vcpu_id)
+{
+	u32p apic_regs=(u32p)virtual_apic;
+	// The virtual-APIC page is 4KiB in size.
+	for(u32 i=0;i<0x400;i++)apic_regs[i]=0;
+	apic_regs[ia32_apic_id>>2]=vcpu_id<<24;
+	apic_regs[ia32_apic_version>>2]=0x50014;		// Version 0x14, with 6 LVT entries.
+	apic_regs[ia32_apic_dfr>>2]=maxu32;
+	apic_regs[ia32_apic_spurious_int_vector>>2]=0xFF;
+	for(u32 i=ia32_apic_timer_lvt;i<=ia32_apic_error_lvt;i+=0x10)
+		apic_regs[i>>2]=0x10000;					// All LVT entries are masked.
+}
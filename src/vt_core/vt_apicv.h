@@ -0,0 +1,29 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file defines the APIC virtualization facility for Customizable VMs.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /vt_core/vt_apicv.h
+*/
+
+#include <nvdef.h>
+
+// Vector 0 is never delivered. Hence it indicates there is no vector.
+#define noir_vt_apicv_no_vector		0
+
+// Guest Interrupt Status consists of RVI (Bits 0-7) and SVI (Bits 8-15).
+#define noir_vt_apicv_rvi(s)		((u8)(s))
+#define noir_vt_apicv_svi(s)		((u8)((s)>>8))
+
+u32 nvc_vt_apicv_highest_vector(void* virtual_apic,u32 offset);
+u8 nvc_vt_apicv_compute_ppr(u8 vtpr,u8 svi);
+bool nvc_vt_apicv_is_deliverable(u16 interrupt_status,u8 vtpr);
+bool nvc_vt_apicv_post_interrupt(ia32_posted_interrupt_descriptor_p pi_desc,u8 vector);
+u16 nvc_vt_apicv_merge_pir(ia32_posted_interrupt_descriptor_p pi_desc,void* virtual_apic,u16 interrupt_status);
+void nvc_vt_apicv_reset_page(void* virtual_apic,u32 vcpu_id);
@@ -23,6 +23,28 @@
 #include "vt_vmcs.h"
 #include "vt_exit.h"
 #include "vt_ept.h"
+#include "vt_apicv.h"
+
+/*
+  VMCS Residency of CVM vCPUs:
+
+  The VMCS of a CVM vCPU is either clear, or active on exactly one processor.
+  The proc_id field of the vCPU records the processor where its VMCS is active.
+  A VMCS must be cleared on the processor where it is active. Hence, the VMM
+  thread evicts the VMCS from its resident processor only if the vCPU really
+  migrates. If the vCPU runs on its resident processor again, neither vmclear
+  nor vmlaunch is required.
+
+  The VMM may give a soft affinity hint. If the vCPU exits on a processor other
+  than the hinted one, its VMCS is cleared locally, which is much cheaper than
+  evicting it remotely when the vCPU returns to the hinted processor.
+*/
+void noir_hvcode nvc_vt_clear_cvm_vmcs(noir_vt_custom_vcpu_p cvcpu)
+{
+	noir_vt_vmclear(&cvcpu->vmcs.phys);
+	cvcpu->proc_id=noir_vt_vmcs_not_resident;
+	cvcpu->launched=false;
+}
 
 void noir_hvcode nvc_vt_switch_to_host_vcpu(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu)
 {
@@ -62,23 +84,94 @@ void noir_hvcode nvc_vt_switch_to_host_vcpu(noir_gpr_state_p gpr_state,noir_vt_v
 	// Load Control Registers
 	noir_writecr2(vcpu->cvm_state.crs.cr2);
 	// Step 3: Switch the vCPU to Host.
+	// Interrupts posted from now on are merged on the next VM-Entry. Do not notify this processor.
+	if(cvcpu->vm->header.properties.apic_enable)
+		noir_locked_bts((u32v*)&((ia32_posted_interrupt_descriptor_p)cvcpu->pi_desc.virt)->control.value,ia32_pi_suppress_notification);
+	if(cvcpu->header.affinity_hint!=noir_cvm_no_affinity_hint && cvcpu->header.affinity_hint!=loader_stack->proc_id)
+		nvc_vt_clear_cvm_vmcs(cvcpu);
 	loader_stack->custom_vcpu=&nvc_vt_idle_cvcpu;
 	noir_vt_vmptrld(&vcpu->vmcs.phys);
+	vcpu->exit_cache.valid=0;
 	// The context will go to the host when vmresume is executed.
 }
 
+// Post the interrupt and merge it into VIRR right away. No notification is needed. The VMCS of the vCPU must be current.
+void static noir_hvcode nvc_vt_post_cvm_interrupt(noir_vt_custom_vcpu_p cvcpu,u8 vector)
+{
+	ia32_posted_interrupt_descriptor_p pi_desc=(ia32_posted_interrupt_descriptor_p)cvcpu->pi_desc.virt;
+	ulong_ptr int_status;
+	nvc_vt_apicv_post_interrupt(pi_desc,vector);
+	noir_vt_vmread(guest_interrupt_status,&int_status);
+	noir_vt_vmwrite(guest_interrupt_status,nvc_vt_apicv_merge_pir(pi_desc,cvcpu->virtual_apic.virt,(u16)int_status));
+}
+
+// Post the interrupts at the head of the VPCB submission queue to the virtual APIC.
+void noir_hvcode nvc_vt_deliver_queued_interrupts(noir_vt_custom_vcpu_p cvcpu)
+{
+	noir_cvm_vpcb_queue_p queue=nvc_cvm_get_vpcb_queue(&cvcpu->header);
+	u8 vector;
+	// Without APIC virtualization, the interrupt cannot be posted regardless of RFLAGS.IF. Leave it to the VMM.
+	if(queue==null || !cvcpu->vm->header.properties.apic_enable)return;
+	while(nvc_cvm_vpcb_queue_peek_interrupt(queue,&vector))
+	{
+		nvc_vt_post_cvm_interrupt(cvcpu,vector);
+		nvc_cvm_vpcb_queue_pop(queue);
+		cvcpu->header.statistics.queue_completions++;
+	}
+}
+
+// Post the LAPIC timer interrupt if the timer expires, and arm the VMX-preemption timer for the next expiration.
+// Returns true if the interrupt is posted. The VMCS of the vCPU must be current.
+bool noir_hvcode nvc_vt_update_cvm_timer(noir_vt_custom_vcpu_p cvcpu)
+{
+	noir_cvm_lapic_timer_p timer=&cvcpu->header.lapic_timer;
+	bool posted=false;
+	if(cvcpu->vm->header.properties.apic_enable && noir_cvm_lapic_timer_enabled(timer))
+	{
+		// The TSC of the guest is not offset in Intel VT-x.
+		const u64 now=noir_rdtsc();
+		u8 vector;
+		if(nvc_cvm_lapic_timer_expire(timer,now,&vector))
+		{
+			nvc_vt_post_cvm_interrupt(cvcpu,vector);
+			posted=true;
+		}
+		if(hvm_p->relative_hvm->preemption_timer)
+		{
+			const u64 remaining=nvc_cvm_lapic_timer_remaining(timer,now);
+			ia32_vmx_pinbased_controls pin_ctrl;
+			noir_vt_vmread(pin_based_vm_execution_controls,&pin_ctrl.value);
+			pin_ctrl.activate_vmx_preemption_timer=remaining!=maxu64 && !noir_cvm_lapic_timer_masked(timer->lvt);
+			if(pin_ctrl.activate_vmx_preemption_timer)
+			{
+				const u64 ticks=remaining>>hvm_p->relative_hvm->preemption_timer_rate;
+				noir_vt_vmwrite(vmx_preemption_timer_value,ticks>maxu32?maxu32:(u32)ticks);
+			}
+			noir_vt_vmwrite(pin_based_vm_execution_controls,pin_ctrl.value);
+		}
+	}
+	return posted;
+}
+
 void noir_hvcode nvc_vt_switch_to_guest_vcpu(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu)
 {
 	noir_vt_initial_stack_p loader_stack=(noir_vt_initial_stack_p)((ulong_ptr)vcpu->hv_stack+nvc_stack_size-sizeof(noir_vt_initial_stack));
 	ia32_vmx_msr_auto_p msr_auto=(ia32_vmx_msr_auto_p)cvcpu->msr_auto.virt;
-	// IMPORTANT: If vCPU is scheduled to a different processor, clear the state of VMCS is required.
-	if(cvcpu->proc_id!=loader_stack->proc_id)
+	// IMPORTANT: If vCPU is scheduled to a different processor, the VMCS must be evicted from the previous one.
+	const bool migrated=cvcpu->proc_id!=loader_stack->proc_id;
+	if(migrated)
 	{
+		if(cvcpu->proc_id!=noir_vt_vmcs_not_resident)
+		{
+			// The VMM thread migrated after eviction. Let the VMM run this vCPU again.
+			cvcpu->header.exit_context.intercept_code=cv_scheduler_exit;
+			return;
+		}
 		cvcpu->proc_id=loader_stack->proc_id;
-		noir_vt_vmclear(&cvcpu->vmcs.phys);
-		// Mark that the vmlaunch instruction is supposed to be executed.
-		loader_stack->flags.initial_vmcs=true;
 	}
+	// Mark that the vmlaunch instruction is supposed to be executed if the VMCS is clear.
+	loader_stack->flags.initial_vmcs=!cvcpu->launched;
+	cvcpu->launched=true;
 	// Step 1: Save State of the Subverted Host.
 	// Please note that it is unnecessary to save states which are already saved in VMCS.
 	// Save General-Purpose Registers...
@@ -98,6 +191,30 @@ void noir_hvcode nvc_vt_switch_to_guest_vcpu(noir_gpr_state_p gpr_state,noir_vt_
 	// Step 2: Switch vCPU to Guest.
 	loader_stack->custom_vcpu=cvcpu;
 	noir_vt_vmptrld(&cvcpu->vmcs.phys);
+	// Cached VM-Exit information belongs to the previous VMCS.
+	vcpu->exit_cache.valid=0;
+	// Host MSRs such as TSC_AUX are per-processor. Load them from this processor's list on VM-Exit.
+	if(migrated)noir_vt_vmwrite64(vmexit_msr_load_address,vcpu->msr_auto.phys+0xC00);
+	// Options set while the VMCS was resident on another processor.
+	if(cvcpu->options_pending)
+	{
+		nvc_vt_apply_guest_vcpu_options(cvcpu);
+		cvcpu->options_pending=false;
+	}
+	if(cvcpu->vm->header.properties.apic_enable)
+	{
+		ia32_posted_interrupt_descriptor_p pi_desc=(ia32_posted_interrupt_descriptor_p)cvcpu->pi_desc.virt;
+		ulong_ptr int_status;
+		// Notifications are sent to this processor from now on.
+		pi_desc->notification_destination=vcpu->pi_destination;
+		noir_locked_btr((u32v*)&pi_desc->control.value,ia32_pi_suppress_notification);
+		// Interrupts posted while the vCPU was descheduled were not notified. Merge them into VIRR.
+		noir_vt_vmread(guest_interrupt_status,&int_status);
+		noir_vt_vmwrite(guest_interrupt_status,nvc_vt_apicv_merge_pir(pi_desc,cvcpu->virtual_apic.virt,(u16)int_status));
+		// Deliver the LAPIC timer interrupt if it expired while the vCPU was not running.
+		nvc_vt_update_cvm_timer(cvcpu);
+		nvc_vt_deliver_queued_interrupts(cvcpu);
+	}
 	// Step 3: Load Guest State.
 	// Load General-Purpose Registers...
 	noir_movsp(gpr_state,&cvcpu->header.gpr,sizeof(void*)*2);
@@ -145,6 +262,13 @@ void noir_hvcode nvc_vt_switch_to_guest_vcpu(noir_gpr_state_p gpr_state,noir_vt_
 		cvcpu->header.state_cache.cr_valid=true;
 	}
 	// Do not write to CR8 because it is subject to be virtualized.
+	// With TPR shadow, CR8 is virtualized by VTPR in the virtual-APIC page.
+	if(!cvcpu->header.state_cache.tp_valid)
+	{
+		if(cvcpu->vm->header.properties.apic_enable)
+			*(u32p)((ulong_ptr)cvcpu->virtual_apic.virt+ia32_apic_tpr)=((u32)cvcpu->header.crs.cr8&0xF)<<4;
+		cvcpu->header.state_cache.tp_valid=true;
+	}
 	// Load Segment Registers...
 	if(!cvcpu->header.state_cache.sr_valid)
 	{
@@ -253,6 +377,12 @@ void noir_hvcode nvc_vt_switch_to_guest_vcpu(noir_gpr_state_p gpr_state,noir_vt_
 		msr_auto[noir_vt_cvm_msr_auto_sfmask].data=cvcpu->header.msrs.sfmask;
 		cvcpu->header.state_cache.sc_valid=true;
 	}
+	// Load TSC_AUX
+	if(!cvcpu->header.state_cache.ta_valid)
+	{
+		msr_auto[noir_vt_cvm_msr_auto_tsc_aux].data=cvcpu->header.msrs.tsc_aux;
+		cvcpu->header.state_cache.ta_valid=true;
+	}
 	// Set the event injection
 	if(!cvcpu->header.injected_event.attributes.valid)
 		noir_vt_vmwrite(vmentry_interruption_information_field,0);
@@ -387,12 +517,16 @@ void noir_hvcode nvc_vt_dump_vcpu_state(noir_vt_custom_vcpu_p vcpu)
 		vcpu->header.msrs.cstar=msr_auto[noir_vt_cvm_msr_auto_cstar].data;
 		vcpu->header.msrs.sfmask=msr_auto[noir_vt_cvm_msr_auto_sfmask].data;
 	}
+	if(vcpu->header.state_cache.ta_valid)
+		vcpu->header.msrs.tsc_aux=msr_auto[noir_vt_cvm_msr_auto_tsc_aux].data;
 	if(vcpu->header.state_cache.se_valid)
 	{
 		noir_vt_vmread(guest_msr_ia32_sysenter_cs,&vcpu->header.msrs.sysenter_cs);
 		noir_vt_vmread(guest_msr_ia32_sysenter_esp,&vcpu->header.msrs.sysenter_esp);
 		noir_vt_vmread(guest_msr_ia32_sysenter_eip,&vcpu->header.msrs.sysenter_eip);
 	}
+	if(vcpu->header.state_cache.tp_valid && vcpu->vm->header.properties.apic_enable)
+		vcpu->header.crs.cr8=(*(u32p)((ulong_ptr)vcpu->virtual_apic.virt+ia32_apic_tpr)>>4)&0xF;
 }
 
 void static noir_hvcode nvc_vt_initialize_cvm_pin_based_controls(bool true_msr)
@@ -545,6 +679,7 @@ void static noir_hvcode nvc_vt_initialize_cvm_msr_auto_list(noir_vt_vcpu_p vcpu,
 	auto_list[noir_vt_cvm_msr_auto_cstar].index=ia32_cstar;
 	auto_list[noir_vt_cvm_msr_auto_sfmask].index=ia32_fmask;
 	auto_list[noir_vt_cvm_msr_auto_gsswap].index=ia32_kernel_gs_base;
+	auto_list[noir_vt_cvm_msr_auto_tsc_aux].index=ia32_tsc_aux;
 	// Write to VMCS.
 	noir_vt_vmwrite64(vmentry_msr_load_address,cvcpu->msr_auto.phys);
 	noir_vt_vmwrite64(vmexit_msr_load_address,vcpu->msr_auto.phys+0xC00);
@@ -554,6 +689,44 @@ void static noir_hvcode nvc_vt_initialize_cvm_msr_auto_list(noir_vt_vcpu_p vcpu,
 	noir_vt_vmwrite(vmentry_msr_load_count,noir_vt_cvm_msr_auto_max);
 }
 
+void static noir_hvcode nvc_vt_initialize_cvm_apicv(noir_vt_custom_vcpu_p cvcpu)
+{
+	ia32_vmx_pinbased_controls pin_ctrl;
+	ia32_vmx_priproc_controls proc_ctrl1;
+	ia32_vmx_2ndproc_controls proc_ctrl2;
+	ia32_vmx_exit_controls exit_ctrl;
+	// The capabilities are checked on creation of the VM. Set the controls directly.
+	noir_vt_vmread(pin_based_vm_execution_controls,&pin_ctrl.value);
+	noir_vt_vmread(primary_processor_based_vm_execution_controls,&proc_ctrl1.value);
+	noir_vt_vmread(secondary_processor_based_vm_execution_controls,&proc_ctrl2.value);
+	noir_vt_vmread(vmexit_controls,&exit_ctrl.value);
+	pin_ctrl.process_posted_interrupts=1;
+	proc_ctrl1.use_tpr_shadow=1;				// CR8 is virtualized by VTPR.
+	proc_ctrl1.cr8_load_exiting=0;
+	proc_ctrl1.cr8_store_exiting=0;
+	proc_ctrl2.virtualize_apic_accesses=1;
+	proc_ctrl2.apic_register_virtualization=1;
+	proc_ctrl2.virtual_interrupt_delivery=1;
+	// Posted interrupts require the vector of external interrupts be acknowledged on VM-Exit.
+	exit_ctrl.acknowledge_interrupt_on_exit=1;
+	noir_vt_vmwrite(pin_based_vm_execution_controls,pin_ctrl.value);
+	noir_vt_vmwrite(primary_processor_based_vm_execution_controls,proc_ctrl1.value);
+	noir_vt_vmwrite(secondary_processor_based_vm_execution_controls,proc_ctrl2.value);
+	noir_vt_vmwrite(vmexit_controls,exit_ctrl.value);
+	// Virtual-APIC Page, APIC-Access Page and Posted-Interrupt Descriptor.
+	noir_vt_vmwrite64(virtual_apic_address,cvcpu->virtual_apic.phys);
+	noir_vt_vmwrite64(apic_access_address,cvcpu->vm->apic_access.phys);
+	noir_vt_vmwrite64(posted_interrupt_descriptor_address,cvcpu->pi_desc.phys);
+	noir_vt_vmwrite(posted_interrupt_notification_vector,noir_vt_posted_interrupt_vector);
+	// EOIs are virtualized without VM-Exits.
+	noir_vt_vmwrite64(eoi_exit_bitmap0,0);
+	noir_vt_vmwrite64(eoi_exit_bitmap1,0);
+	noir_vt_vmwrite64(eoi_exit_bitmap2,0);
+	noir_vt_vmwrite64(eoi_exit_bitmap3,0);
+	noir_vt_vmwrite(tpr_threshold,0);
+	noir_vt_vmwrite(guest_interrupt_status,0);
+}
+
 void noir_hvcode nvc_vt_initialize_cvm_vmcs(noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu)
 {
 	ia32_vmx_basic_msr vt_basic_msr;
@@ -573,6 +746,8 @@ void noir_hvcode nvc_vt_initialize_cvm_vmcs(noir_vt_vcpu_p vcpu,noir_vt_custom_v
 			nvc_vt_initialize_cvm_proc_based_controls(vt_basic_msr.use_true_msr);
 			nvc_vt_initialize_cvm_vmexit_controls(vt_basic_msr.use_true_msr);
 			nvc_vt_initialize_cvm_vmentry_controls(vt_basic_msr.use_true_msr);
+			if(cvcpu->vm->header.properties.apic_enable)
+				nvc_vt_initialize_cvm_apicv(cvcpu);
 			nvc_vt_initialize_cvm_host_state(vcpu);
 			// Miscellaneous stuff...
 			nvc_vt_initialize_cvm_msr_auto_list(vcpu,cvcpu);
@@ -592,11 +767,9 @@ void noir_hvcode nvc_vt_initialize_cvm_vmcs(noir_vt_vcpu_p vcpu,noir_vt_custom_v
 	}
 }
 
-void noir_hvcode nvc_vt_set_guest_vcpu_options(noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu)
+void noir_hvcode nvc_vt_apply_guest_vcpu_options(noir_vt_custom_vcpu_p cvcpu)
 {
 	ia32_vmx_priproc_controls proc_ctrl1;
-	// Load VMCS for CVM.
-	noir_vt_vmptrld(&cvcpu->vmcs.phys);
 	// Read Primary Processor-Based VM Execution Controls
 	noir_vt_vmread(primary_processor_based_vm_execution_controls,&proc_ctrl1.value);
 	// Set interception vectors according to the options.
@@ -613,20 +786,66 @@ void noir_hvcode nvc_vt_set_guest_vcpu_options(noir_vt_vcpu_p vcpu,noir_vt_custo
 	proc_ctrl1.use_msr_bitmap=!cvcpu->header.vcpu_options.intercept_msr;
 	// Write to VMCS.
 	noir_vt_vmwrite(primary_processor_based_vm_execution_controls,proc_ctrl1.value);
+}
+
+void noir_hvcode nvc_vt_set_guest_vcpu_options(noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu)
+{
+	noir_vt_initial_stack_p loader_stack=(noir_vt_initial_stack_p)((ulong_ptr)vcpu->hv_stack+nvc_stack_size-sizeof(noir_vt_initial_stack));
+	if(cvcpu->proc_id!=loader_stack->proc_id && cvcpu->proc_id!=noir_vt_vmcs_not_resident)
+	{
+		// The VMCS is active on another processor. Apply the options on next run.
+		cvcpu->options_pending=true;
+		return;
+	}
+	// Load VMCS for CVM. It becomes active on this processor.
+	cvcpu->proc_id=loader_stack->proc_id;
+	noir_vt_vmptrld(&cvcpu->vmcs.phys);
+	nvc_vt_apply_guest_vcpu_options(cvcpu);
 	// Load Host's VMCS.
 	noir_vt_vmptrld(&vcpu->vmcs.phys);
 }
 
 #if !defined(_hv_type1)
+void static nvc_vtc_evict_vmcs_worker(void* context,u32 processor_id)
+{
+	noir_vt_custom_vcpu_p vcpu=(noir_vt_custom_vcpu_p)context;
+	// Only the processor where the VMCS is active can clear it.
+	if(processor_id==vcpu->proc_id)
+		noir_vt_vmcall(noir_vt_clear_custom_vmcs,(ulong_ptr)vcpu);
+}
+
+// Clear the VMCS on its resident processor. This is required if the vCPU migrates or is released.
+void static nvc_vtc_evict_vmcs(noir_vt_custom_vcpu_p vcpu,bool migration_only)
+{
+	const u32 resident=vcpu->proc_id;
+	if(resident!=noir_vt_vmcs_not_resident)
+		if(!migration_only || resident!=noir_get_current_processor())
+			noir_targeted_call(nvc_vtc_evict_vmcs_worker,vcpu,resident);
+}
+
 noir_status nvc_vtc_run_vcpu(noir_vt_custom_vcpu_p vcpu)
 {
 	noir_status st=noir_success;
+	// The APIC base is reloaded. Relocation requires paging structures to be allocated, so do it here.
+	if(!vcpu->header.state_cache.ap_valid)
+	{
+		const u64 apic_base=page_base(vcpu->header.msrs.apic.value);
+		if(vcpu->vm->header.properties.apic_enable && apic_base)
+		{
+			st=nvc_vtc_relocate_apic_access(vcpu->vm,apic_base);
+			if(st!=noir_success)return st;
+		}
+		vcpu->header.state_cache.ap_valid=true;
+	}
 	noir_acquire_reslock_shared(vcpu->vm->header.vcpu_list_lock);
 	// Abort execution if rescission is specified.
 	if(noir_locked_btr64(&vcpu->special_state,63))
 		vcpu->header.exit_context.intercept_code=cv_rescission;
 	else
+	{
+		nvc_vtc_evict_vmcs(vcpu,true);
 		noir_vt_vmcall(noir_vt_run_custom_vcpu,(ulong_ptr)vcpu);
+	}
 	noir_release_reslock(vcpu->vm->header.vcpu_list_lock);
 	return st;
 }
@@ -645,6 +864,44 @@ u32 nvc_vtc_get_vm_asid(noir_vt_custom_vm_p vm)
 	return vm->vpid;
 }
 
+u32 nvc_vtc_get_supported_vm_properties()
+{
+	return hvm_p->relative_hvm->cvm_properties;
+}
+
+void static nvc_vtc_send_notification(u32 destination)
+{
+	if(hvm_p->relative_hvm->host_apic)
+	{
+		u32v* icr_lo=(u32v*)((ulong_ptr)hvm_p->relative_hvm->host_apic+ia32_apic_icr_lo);
+		u32v* icr_hi=(u32v*)((ulong_ptr)hvm_p->relative_hvm->host_apic+ia32_apic_icr_hi);
+		// The interrupt handlers of the host must not write to ICR in between.
+		// The caller might have disabled interrupts. Restore RFlags.IF as it was.
+		const u64 rflags=noir_readflags();
+		noir_cli();
+		while(*icr_lo&0x1000)noir_pause();		// Wait until the previous IPI is sent.
+		*icr_hi=destination<<16;
+		*icr_lo=noir_vt_posted_interrupt_vector;
+		if(noir_bt64(&rflags,ia32_rflags_if))noir_sti();
+	}
+	else
+		noir_wrmsr(ia32_x2apic_icr,((u64)destination<<32)|noir_vt_posted_interrupt_vector);
+}
+
+// Post an external interrupt to the virtual APIC. Returns false if the virtual APIC is not accelerated.
+bool nvc_vtc_post_interrupt(noir_vt_custom_vcpu_p vcpu,u8 vector)
+{
+	if(vcpu->vm->header.properties.apic_enable)
+	{
+		ia32_posted_interrupt_descriptor_p pi_desc=(ia32_posted_interrupt_descriptor_p)vcpu->pi_desc.virt;
+		// If the vCPU is running, the processor delivers the interrupt without a VM-Exit.
+		if(nvc_vt_apicv_post_interrupt(pi_desc,vector))
+			nvc_vtc_send_notification(pi_desc->notification_destination);
+		return true;
+	}
+	return false;
+}
+
 noir_vt_custom_vcpu_p nvc_vtc_reference_vcpu(noir_vt_custom_vm_p vm,u32 vcpu_id)
 {
 	return vm->vcpu[vcpu_id];
@@ -916,7 +1173,11 @@ noir_status nvc_vtc_set_mapping(noir_vt_custom_vm_p virtual_machine,noir_cvm_add
 			{
 				u64 gpa=mapping_info->gpa+(i<<increment[mapping_info->attributes.psize]);
 				u64 hpa=noir_get_user_physical_address((void*)hva);
-				st=nvc_vtc_set_page_map(&virtual_machine->eptm,gpa,hpa,mapping_info->attributes);
+				// The APIC-Access Page must stay in place. Do not let the VMM overwrite it.
+				if(virtual_machine->apic_access.virt && gpa==virtual_machine->apic_access_gpa)
+					st=noir_success;
+				else
+					st=nvc_vtc_set_page_map(&virtual_machine->eptm,gpa,hpa,mapping_info->attributes);
 			}
 		}
 		if(st!=noir_success)break;
@@ -924,16 +1185,47 @@ noir_status nvc_vtc_set_mapping(noir_vt_custom_vm_p virtual_machine,noir_cvm_add
 	return st;
 }
 
+// Move the APIC-Access Page to where the guest relocated its APIC base.
+// The page previously occupied by the APIC-Access Page is left unmapped for the VMM to remap.
+noir_status nvc_vtc_relocate_apic_access(noir_vt_custom_vm_p vm,u64 gpa)
+{
+	noir_status st=noir_success;
+	noir_acquire_reslock_exclusive(vm->header.vcpu_list_lock);
+	if(vm->apic_access.virt && gpa!=vm->apic_access_gpa)
+	{
+		noir_cvm_mapping_attributes map_attrib={0};
+		map_attrib.present=map_attrib.write=1;
+		map_attrib.caching=ia32_uncacheable;
+		st=nvc_vtc_set_page_map(&vm->eptm,gpa,vm->apic_access.phys,map_attrib);
+		if(st==noir_success)
+		{
+			noir_cvm_mapping_attributes null_map={0};
+			nvc_vtc_set_page_map(&vm->eptm,vm->apic_access_gpa,0,null_map);
+			vm->apic_access_gpa=gpa;
+		}
+	}
+	noir_release_reslock(vm->header.vcpu_list_lock);
+	return st;
+}
+
 void nvc_vtc_release_vcpu(noir_vt_custom_vcpu_p virtual_processor)
 {
 	if(virtual_processor)
 	{
-		// Release VMCS
+		// Release VMCS. It must not be active on any processor.
 		if(virtual_processor->vmcs.virt)
+		{
+			nvc_vtc_evict_vmcs(virtual_processor,false);
 			noir_free_contd_memory(virtual_processor->vmcs.virt,page_size);
+		}
 		// Release MSR-Auto List.
 		if(virtual_processor->msr_auto.virt)
 			noir_free_contd_memory(virtual_processor->msr_auto.virt,page_size);
+		// Release Virtual-APIC Page and Posted-Interrupt Descriptor.
+		if(virtual_processor->virtual_apic.virt)
+			noir_free_contd_memory(virtual_processor->virtual_apic.virt,page_size);
+		if(virtual_processor->pi_desc.virt)
+			noir_free_contd_memory(virtual_processor->pi_desc.virt,page_size);
 		// Release Extended State.
 		if(virtual_processor->header.xsave_area)
 			noir_free_contd_memory(virtual_processor->header.xsave_area,page_size);
@@ -954,25 +1246,59 @@ noir_status nvc_vtc_create_vcpu(noir_vt_custom_vcpu_p *virtual_processor,noir_vt
 			if(vcpu)
 			{
 				*virtual_processor=vcpu;
-				vcpu->vmcs.virt=noir_alloc_contd_memory(page_size);
+				vcpu->proc_id=noir_vt_vmcs_not_resident;
+				vcpu->header.affinity_hint=noir_cvm_no_affinity_hint;
+				// Hot structures of vCPU follow the VMM thread which is creating the vCPU.
+				vcpu->vmcs.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
 				if(vcpu->vmcs.virt)
 					vcpu->vmcs.phys=noir_get_physical_address(vcpu->vmcs.virt);
 				else
 					goto alloc_failure;
-				vcpu->msr_auto.virt=noir_alloc_contd_memory(page_size);
+				vcpu->msr_auto.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
 				if(vcpu->msr_auto.virt)
 					vcpu->msr_auto.phys=noir_get_physical_address(vcpu->msr_auto.virt);
 				else
 					goto alloc_failure;
 				// Allocate XSAVE State Area
-				vcpu->header.xsave_area=noir_alloc_contd_memory(hvm_p->xfeat.supported_size_max);
+				vcpu->header.xsave_area=noir_alloc_contd_memory_with_locality(noir_memory_local,hvm_p->xfeat.supported_size_max);
 				if(vcpu->header.xsave_area==null)goto alloc_failure;
+				if(virtual_machine->header.properties.apic_enable)
+				{
+					ia32_posted_interrupt_descriptor_p pi_desc;
+					// Allocate Virtual-APIC Page and Posted-Interrupt Descriptor.
+					vcpu->virtual_apic.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
+					vcpu->pi_desc.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
+					if(vcpu->virtual_apic.virt==null || vcpu->pi_desc.virt==null)goto alloc_failure;
+					vcpu->virtual_apic.phys=noir_get_physical_address(vcpu->virtual_apic.virt);
+					vcpu->pi_desc.phys=noir_get_physical_address(vcpu->pi_desc.virt);
+					nvc_vt_apicv_reset_page(vcpu->virtual_apic.virt,vcpu_id);
+					// Notifications are suppressed until the vCPU is scheduled.
+					pi_desc=(ia32_posted_interrupt_descriptor_p)vcpu->pi_desc.virt;
+					pi_desc->control.notification_vector=noir_vt_posted_interrupt_vector;
+					pi_desc->control.suppress_notification=1;
+					// The APIC-Access Page is shared by all vCPUs. Map it at the default APIC base.
+					if(virtual_machine->apic_access.virt==null)
+					{
+						noir_cvm_mapping_attributes map_attrib={0};
+						void* apic_access=noir_alloc_contd_memory(page_size);
+						if(apic_access==null)goto alloc_failure;
+						map_attrib.present=map_attrib.write=1;
+						map_attrib.caching=ia32_uncacheable;
+						if(nvc_vtc_set_page_map(&virtual_machine->eptm,ia32_apic_default_base,noir_get_physical_address(apic_access),map_attrib)!=noir_success)
+						{
+							noir_free_contd_memory(apic_access,page_size);
+							goto alloc_failure;
+						}
+						virtual_machine->apic_access.virt=apic_access;
+						virtual_machine->apic_access.phys=noir_get_physical_address(apic_access);
+						virtual_machine->apic_access_gpa=ia32_apic_default_base;
+					}
+				}
 				// Set the parent VM.
 				vcpu->vm=virtual_machine;
 				virtual_machine->vcpu[vcpu_id]=vcpu;
 				// vCPU basic info
 				vcpu->vcpu_id=vcpu_id;
-				vcpu->proc_id=0xffffffff;
 				// Initialize VMCS via a hypercall.
 				noir_vt_vmcall(noir_vt_init_custom_vmcs,(ulong_ptr)vcpu);
 				st=noir_success;
@@ -993,6 +1319,8 @@ void nvc_vtc_release_vm(noir_vt_custom_vm_p virtual_machine)
 	{
 		if(virtual_machine->msr_bitmap.virt)
 			noir_free_contd_memory(virtual_machine->msr_bitmap.virt,page_size);
+		if(virtual_machine->apic_access.virt)
+			noir_free_contd_memory(virtual_machine->apic_access.virt,page_size);
 		// Release vCPU List...
 		noir_acquire_reslock_exclusive(virtual_machine->header.vcpu_list_lock);
 		if(virtual_machine->vcpu)
@@ -1099,6 +1427,63 @@ void nvc_vtc_finalize_cvm_module()
 {
 	if(noir_vm_list_lock)
 		noir_finalize_reslock(noir_vm_list_lock);
+	if(hvm_p->relative_hvm->notification_interrupt)
+		noir_disconnect_interrupt(hvm_p->relative_hvm->notification_interrupt);
+	if(hvm_p->relative_hvm->host_apic)
+		noir_unmap_physical_memory(hvm_p->relative_hvm->host_apic,page_size);
+}
+
+u32 static nvc_vtc_probe_vm_properties()
+{
+	noir_cvm_vm_properties supported={0};
+	ia32_vmx_basic_msr vt_basic;
+	ia32_vmx_pinbased_ctrl_msr pin_ctrl_msr;
+	ia32_vmx_priproc_ctrl_msr proc_ctrl1_msr;
+	ia32_vmx_exit_ctrl_msr exit_ctrl_msr;
+	bool apicv=true;
+	vt_basic.value=noir_rdmsr(ia32_vmx_basic);
+	pin_ctrl_msr.value=noir_rdmsr(vt_basic.use_true_msr?ia32_vmx_true_pinbased_ctrl:ia32_vmx_pinbased_ctrl);
+	proc_ctrl1_msr.value=noir_rdmsr(vt_basic.use_true_msr?ia32_vmx_true_priproc_ctrl:ia32_vmx_priproc_ctrl);
+	exit_ctrl_msr.value=noir_rdmsr(vt_basic.use_true_msr?ia32_vmx_true_exit_ctrl:ia32_vmx_exit_ctrl);
+	// The virtual APIC is accelerated only if posted interrupts and virtual-interrupt delivery are all supported.
+	apicv&=pin_ctrl_msr.allowed1_settings.process_posted_interrupts;
+	apicv&=proc_ctrl1_msr.allowed1_settings.use_tpr_shadow;
+	apicv&=exit_ctrl_msr.allowed1_settings.acknowledge_interrupt_on_exit;
+	if(apicv)
+	{
+		ia32_vmx_2ndproc_ctrl_msr proc_ctrl2_msr;
+		proc_ctrl2_msr.value=noir_rdmsr(ia32_vmx_2ndproc_ctrl);
+		apicv&=proc_ctrl2_msr.allowed1_settings.virtualize_apic_accesses;
+		apicv&=proc_ctrl2_msr.allowed1_settings.apic_register_virtualization;
+		apicv&=proc_ctrl2_msr.allowed1_settings.virtual_interrupt_delivery;
+	}
+	if(apicv)
+	{
+		// Notifications are sent through ICR. Map the xAPIC page of the host if x2APIC is not enabled.
+		const u64 apic_base=noir_rdmsr(ia32_apic_base);
+		if(!noir_bt64(&apic_base,ia32_apic_extd))
+		{
+			hvm_p->relative_hvm->host_apic=noir_map_uncached_memory(page_base(apic_base),page_size);
+			apicv=hvm_p->relative_hvm->host_apic!=null;
+		}
+	}
+	if(apicv)
+	{
+		// A notification may arrive after the target vCPU has exited to the host.
+		// Such notification is delivered through the host IDT. Make sure it is acknowledged.
+		hvm_p->relative_hvm->notification_interrupt=noir_connect_noop_interrupt(noir_vt_posted_interrupt_vector);
+		apicv=hvm_p->relative_hvm->notification_interrupt!=null;
+	}
+	supported.apic_enable=apicv;
+	// The LAPIC timer of CVM guests is emulated with the VMX-preemption timer.
+	hvm_p->relative_hvm->preemption_timer=pin_ctrl_msr.allowed1_settings.activate_vmx_preemption_timer;
+	if(hvm_p->relative_hvm->preemption_timer)
+	{
+		ia32_vmx_misc_msr misc;
+		misc.value=noir_rdmsr(ia32_vmx_misc);
+		hvm_p->relative_hvm->preemption_timer_rate=(u8)misc.tsc_preemption_scale;
+	}
+	return supported.value;
 }
 
 noir_status nvc_vtc_initialize_cvm_module()
@@ -1110,6 +1495,7 @@ noir_status nvc_vtc_initialize_cvm_module()
 		st=noir_success;
 		hvm_p->idle_vm=&noir_idle_vm;
 		noir_initialize_list_entry(&noir_idle_vm.active_vm_list);
+		hvm_p->relative_hvm->cvm_properties=nvc_vtc_probe_vm_properties();
 	}
 	return st;
 }
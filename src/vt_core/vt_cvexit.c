@@ -116,8 +116,17 @@ void static noir_hvcode fastcall nvc_vt_exception_nmi_cvexit_handler(noir_gpr_st
 // Expected Exit Reason: 1
 void static noir_hvcode fastcall nvc_vt_extint_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu)
 {
+	ia32_vmexit_interruption_information_field exit_int_info;
+	exit_int_info.value=0;
+	// With posted interrupts, the external interrupt is acknowledged on VM-Exit.
+	if(cvcpu->vm->header.properties.apic_enable)
+		noir_vt_vmread(vmexit_interruption_information,&exit_int_info);
 	// Setting the RFlags.IF should have the external interrupt transferred to the host.
 	nvc_vt_switch_to_host_vcpu(gpr_state,vcpu);
+	// The acknowledged interrupt must be injected to the host.
+	// The host is interruptible in that it is executing vmcall instruction to run the vCPU.
+	if(exit_int_info.valid)
+		noir_vt_inject_event((u8)exit_int_info.vector,ia32_external_interrupt,false,0,0);
 	cvcpu->header.exit_context.intercept_code=cv_scheduler_exit;
 }
 
@@ -270,6 +279,26 @@ void static noir_hvcode fastcall nvc_vt_cpuid_cvexit_handler(noir_gpr_state_p gp
 
 void static noir_hvcode fastcall nvc_vt_hlt_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu)
 {
+	noir_cvm_lapic_timer_p timer=&cvcpu->header.lapic_timer;
+	u64 rflags;
+	noir_vt_vmread(guest_rflags,&rflags);
+	// If interrupts are enabled, the halt can be completed by NoirVisor. (e.g.: polling and LAPIC timer)
+	cvcpu->header.halt_poll.halted=noir_bt64(&rflags,ia32_rflags_if);
+	if(noir_cvm_lapic_timer_enabled(timer) && cvcpu->header.halt_poll.halted)
+	{
+		// If the LAPIC timer interrupt is pending, the vCPU is woken up at once.
+		if(nvc_vt_update_cvm_timer(cvcpu))
+		{
+			noir_vt_advance_rip();
+			return;
+		}
+		// Otherwise, the vCPU is halted in NoirVisor until the timer expires.
+		if(cvcpu->vm->header.properties.apic_enable && !noir_cvm_lapic_timer_masked(timer->lvt))
+		{
+			const u64 remaining=nvc_cvm_lapic_timer_remaining(timer,noir_rdtsc());
+			if(remaining!=maxu64)timer->wakeup=noir_rdtsc()+remaining;
+		}
+	}
 	// The hlt instruction halts the execution of the processor.
 	// Schedule the host to the processor.
 	nvc_vt_save_generic_cvexit_context(cvcpu);
@@ -608,8 +637,16 @@ void static noir_hvcode fastcall nvc_vt_io_cvexit_handler(noir_gpr_state_p gpr_s
 	ia32_io_access_qualification info;
 	ia32_vmexit_instruction_information exit_info;
 	u32 seg_ar;
+	noir_cvm_vpcb_queue_p queue=nvc_cvm_get_vpcb_queue(&cvcpu->header);
 	noir_vt_vmread(vmexit_qualification,&info.value);
 	noir_vt_vmread(vmexit_instruction_information,&exit_info.value);
+	if(!info.string && queue && nvc_cvm_vpcb_queue_complete_io(queue,(u16)info.port,size_array[info.access_size],(bool)info.direction,(u64p)&gpr_state->rax))
+	{
+		// The VMM has queued the response in the VPCB. No need to switch to the VMM.
+		noir_vt_advance_rip();
+		cvcpu->header.statistics.queue_completions++;
+		return;
+	}
 	// Deliver the I/O interception to subverted host.
 	nvc_vt_save_generic_cvexit_context(cvcpu);
 	// Before the VMCS is switched, read essential data from VMCS.
@@ -633,8 +670,35 @@ void static noir_hvcode fastcall nvc_vt_io_cvexit_handler(noir_gpr_state_p gpr_s
 	cvcpu->header.exit_context.io.rdi=cvcpu->header.gpr.rdi;
 }
 
+// Emulate the MSR access to the LAPIC timer. Returns false if the access is not subject to the emulation.
+bool static noir_hvcode nvc_vt_lapic_timer_msr_handler(noir_gpr_state_p gpr_state,noir_vt_custom_vcpu_p cvcpu,bool op_write)
+{
+	noir_cvm_lapic_timer_p timer=&cvcpu->header.lapic_timer;
+	const u32 index=(u32)gpr_state->rcx;
+	large_integer val;
+	if(!cvcpu->vm->header.properties.apic_enable || !noir_cvm_lapic_timer_enabled(timer))return false;
+	// The x2APIC timer registers are accessible only in x2APIC mode.
+	if(index!=ia32_tsc_deadline && !noir_bt64(&cvcpu->header.msrs.apic.value,ia32_apic_extd))return false;
+	if(op_write)
+	{
+		val.low=(u32)gpr_state->rax;
+		val.high=(u32)gpr_state->rdx;
+		if(!nvc_cvm_lapic_timer_wrmsr(timer,index,val.value,noir_rdtsc()))return false;
+	}
+	else
+	{
+		if(!nvc_cvm_lapic_timer_rdmsr(timer,index,noir_rdtsc(),&val.value))return false;
+		*(u32*)&gpr_state->rax=val.low;
+		*(u32*)&gpr_state->rdx=val.high;
+	}
+	noir_vt_advance_rip();
+	return true;
+}
+
 void static noir_hvcode fastcall nvc_vt_rdmsr_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu)
 {
+	// The LAPIC timer is emulated by NoirVisor.
+	if(nvc_vt_lapic_timer_msr_handler(gpr_state,cvcpu,false))return;
 	if(cvcpu->header.vcpu_options.intercept_msr)
 	{
 		// Switch to subverted host in order to handle rdmsr instruction.
@@ -664,6 +728,8 @@ void static noir_hvcode fastcall nvc_vt_rdmsr_cvexit_handler(noir_gpr_state_p gp
 
 void static noir_hvcode fastcall nvc_vt_wrmsr_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu)
 {
+	// The LAPIC timer is emulated by NoirVisor.
+	if(nvc_vt_lapic_timer_msr_handler(gpr_state,cvcpu,true))return;
 	if(cvcpu->header.vcpu_options.intercept_msr)
 	{
 		// Switch to subverted host in order to handle wrmsr instruction.
@@ -778,6 +844,74 @@ void static noir_hvcode fastcall nvc_vt_invalid_msr_loading_cvexit_handler(noir_
 	cvcpu->header.exit_context.intercept_code=cv_invalid_state;
 }
 
+// Expected Exit Reason: 44
+void static noir_hvcode fastcall nvc_vt_apic_access_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu)
+{
+	noir_cvm_apic_access_context_p access=&cvcpu->header.exit_context.apic_access;
+	ulong_ptr info;
+	noir_vt_vmread(vmexit_qualification,&info);
+	// Accesses to unvirtualized registers (e.g.: timer current count) are fault-like.
+	// The instruction is not retired. The VMM has to emulate the instruction.
+	nvc_vt_save_generic_cvexit_context(cvcpu);
+	// Bits 0-11 are the offset. Bits 12-15 are the access type: 0 for reads and 1 for writes.
+	access->offset=(u32)info&0xFFF;
+	access->write=((info>>12)&0xF)==1;
+	access->trap=false;
+	access->reserved=0;
+	access->value=0;
+	// The current count is computed by NoirVisor if the LAPIC timer is emulated.
+	if(!access->write && access->offset==ia32_apic_timer_cur_count && noir_cvm_lapic_timer_enabled(&cvcpu->header.lapic_timer))
+		access->value=nvc_cvm_lapic_timer_read_current_count(&cvcpu->header.lapic_timer,noir_rdtsc());
+	nvc_vt_switch_to_host_vcpu(gpr_state,vcpu);
+	cvcpu->header.exit_context.intercept_code=cv_apic_access;
+}
+
+// Expected Exit Reason: 56
+void static noir_hvcode fastcall nvc_vt_apic_write_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu)
+{
+	u32p apic_regs=(u32p)cvcpu->virtual_apic.virt;
+	ulong_ptr offset;
+	noir_vt_vmread(vmexit_qualification,&offset);
+	offset&=0xFF0;
+	// The write is trap-like. The instruction is retired and the value is in the virtual-APIC page.
+	// The LAPIC timer is emulated by NoirVisor. No need to switch to the VMM.
+	if(noir_cvm_lapic_timer_enabled(&cvcpu->header.lapic_timer))
+		if(nvc_cvm_lapic_timer_write_register(&cvcpu->header.lapic_timer,(u32)offset,apic_regs[offset>>2],noir_rdtsc()))
+			return;
+	nvc_vt_save_generic_cvexit_context(cvcpu);
+	if(offset==ia32_apic_icr_lo)
+	{
+		// Intel VT-x does not deliver IPIs. The VMM posts the interrupt to the targets.
+		noir_cvm_apic_ipi_context_p ipi=&cvcpu->header.exit_context.apic_ipi;
+		ipi->icr_lo=apic_regs[ia32_apic_icr_lo>>2];
+		ipi->icr_hi=apic_regs[ia32_apic_icr_hi>>2];
+		ipi->reason=noir_cvm_apic_ipi_unaccelerated;
+		ipi->target_count=0;
+		noir_stosb(ipi->targets,0,sizeof(ipi->targets));
+		nvc_vt_switch_to_host_vcpu(gpr_state,vcpu);
+		cvcpu->header.exit_context.intercept_code=cv_apic_ipi;
+	}
+	else
+	{
+		// The rest of writes (e.g.: timer and LVT registers) are emulated by the VMM.
+		noir_cvm_apic_access_context_p access=&cvcpu->header.exit_context.apic_access;
+		access->offset=(u32)offset;
+		access->write=true;
+		access->trap=true;
+		access->reserved=0;
+		access->value=apic_regs[offset>>2];
+		nvc_vt_switch_to_host_vcpu(gpr_state,vcpu);
+		cvcpu->header.exit_context.intercept_code=cv_apic_access;
+	}
+}
+
+// Expected Exit Reason: 52
+void static noir_hvcode fastcall nvc_vt_preemption_timer_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu)
+{
+	// The VMX-preemption timer is armed for the LAPIC timer.
+	// The timer interrupt is posted as the guest is resumed. There is nothing to do here.
+}
+
 void static noir_hvcode fastcall nvc_vt_ept_violation_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu)
 {
 	ia32_ept_violation_qualification info;
@@ -402,6 +402,29 @@ typedef enum _ia32_vmx_guest_activity_state
 	guest_is_waiting_for_sipi=3
 }ia32_vmx_guest_activity_state,*ia32_vmx_guest_activity_state_p;
 
+// Posted-Interrupt Descriptor. It must be aligned on 64-byte boundary.
+typedef struct _ia32_posted_interrupt_descriptor
+{
+	u32 pir[8];			// Posted-Interrupt Requests. One bit for each vector.
+	union
+	{
+		struct
+		{
+			u32 outstanding_notification:1;		// Bit	0
+			u32 suppress_notification:1;		// Bit	1
+			u32 reserved0:14;					// Bits	2-15
+			u32 notification_vector:8;			// Bits	16-23
+			u32 reserved1:8;					// Bits	24-31
+		};
+		u32 value;
+	}control;
+	u32 notification_destination;
+	u32 reserved[6];
+}ia32_posted_interrupt_descriptor,*ia32_posted_interrupt_descriptor_p;
+
+#define ia32_pi_outstanding_notification	0
+#define ia32_pi_suppress_notification		1
+
 #if defined(_vt_main)
 char* vt_error_message[0x20]=
 {
@@ -78,7 +78,7 @@ noir_ept_pde_descriptor_p nvc_ept_split_pdpte(noir_ept_manager_p eptm,u64 gpa,bo
 		pde_p=noir_alloc_nonpg_memory(sizeof(noir_ept_pde_descriptor));
 		if(pde_p)
 		{
-			pde_p->virt=noir_alloc_contd_memory(page_size);
+			pde_p->virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
 			if(pde_p->virt)
 			{
 				const u64 index=page_1gb_count(gpa);
@@ -110,11 +110,12 @@ noir_ept_pde_descriptor_p nvc_ept_split_pdpte(noir_ept_manager_p eptm,u64 gpa,bo
 				goto update_pdpte;
 			}
 			noir_free_nonpg_memory(pde_p);
+			pde_p=null;
 		}
 	}
 update_pdpte:
-	// If in host mode, update PDPTE.
-	if(host)
+	// If in host mode, update PDPTE. Nothing to update if the PDPTE cannot be split.
+	if(host && pde_p)
 	{
 		const u64 index=page_1gb_count(gpa);
 		ia32_ept_pdpte_p pdpte_p=(ia32_ept_pdpte_p)&eptm->pdpt.virt[index];
@@ -141,7 +142,7 @@ noir_ept_pte_descriptor_p nvc_ept_split_pde(noir_ept_manager_p eptm,u64 gpa,bool
 		pte_p=noir_alloc_nonpg_memory(sizeof(noir_ept_pte_descriptor));
 		if(pte_p)
 		{
-			pte_p->virt=noir_alloc_contd_memory(page_size);
+			pte_p->virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
 			if(pte_p->virt)
 			{
 				// Split the PDPTE first.
@@ -179,12 +180,13 @@ noir_ept_pte_descriptor_p nvc_ept_split_pde(noir_ept_manager_p eptm,u64 gpa,bool
 				noir_free_contd_memory(pte_p->virt,page_size);
 			}
 			noir_free_nonpg_memory(pte_p);
+			pte_p=null;
 		}
 	}
 update_pde:
-	if(host)
+	if(host && pte_p)
 	{
-		// If in host mode, update PDE.
+		// If in host mode, update PDE. Nothing to update if the PDE cannot be split.
 		noir_ept_pde_descriptor_p pde_p=nvc_ept_split_pdpte(eptm,gpa,host,alloc);
 		if(pde_p)
 		{
@@ -208,73 +210,6 @@ u8 nvc_ept_merge_memory_type(u8 old_type,u8 new_type,bool force)
 	return new_type;
 }
 
-bool nvc_ept_update_pte_memory_type(noir_ept_manager_p eptm,u64 gpa,u8 memory_type,bool force)
-{
-	noir_ept_pte_descriptor_p pte_p=nvc_ept_split_pde(eptm,gpa,true,true);
-	if(pte_p)
-	{
-		ia32_addr_translator gat;
-		gat.value=gpa;
-		// Simply update this PTE entry.
-		pte_p->virt[gat.pte_offset].memory_type=pte_p->virt[gat.pte_offset].var_mtrr_covered?nvc_ept_merge_memory_type((u8)pte_p->virt[gat.pte_offset].memory_type,memory_type,force):memory_type;
-		// Mark this PTE is covered by variable MTRR.
-		pte_p->virt[gat.pte_offset].var_mtrr_covered=true;
-		return true;
-	}
-	return false;
-}
-
-bool nvc_ept_update_pde_memory_type(noir_ept_manager_p eptm,u64 gpa,u8 memory_type,bool force)
-{
-	noir_ept_pde_descriptor_p pde_p=nvc_ept_split_pdpte(eptm,gpa,true,true);
-	if(pde_p)
-	{
-		ia32_addr_translator gat;
-		gat.value=gpa;
-		if(pde_p->large[gat.pde_offset].large_pde)
-		{
-			// If this is Large PDE, simply update the PDE.
-			pde_p->large[gat.pde_offset].memory_type=pde_p->large[gat.pde_offset].var_mtrr_covered?nvc_ept_merge_memory_type((u8)pde_p->large[gat.pde_offset].memory_type,memory_type,force):memory_type;
-			// Mark this PDE is covered by variable MTRR.
-			pde_p->large[gat.pde_offset].var_mtrr_covered=true;
-			return true;
-		}
-		else
-		{
-			// Otherwise, update all underlying PTE entries.
-			for(u32 i=0;i<page_table_entries64;i++)
-			{
-				bool result=nvc_ept_update_pte_memory_type(eptm,gpa+page_4kb_mult(i),memory_type,force);
-				if(!result)return false;
-			}
-		}
-	}
-	return false;
-}
-
-bool nvc_ept_update_pdpte_memory_type(noir_ept_manager_p eptm,u64 gpa,u8 memory_type,bool force)
-{
-	const u64 index=page_1gb_count(gpa);
-	if(eptm->pdpt.virt[index].huge_pdpte)
-	{
-		// If this is Huge PDPTE, simply update the PDPTE.
-		eptm->pdpt.virt[index].memory_type=eptm->pdpt.virt[index].var_mtrr_covered?nvc_ept_merge_memory_type((u8)eptm->pdpt.virt[index].memory_type,memory_type,force):memory_type;
-		// Mark this PDPTE is covered by variable MTRR.
-		eptm->pdpt.virt[index].var_mtrr_covered=true;
-		return true;
-	}
-	else
-	{
-		// Otherwise, update all underlying PDE entries.
-		for(u32 i=0;i<page_table_entries64;i++)
-		{
-			bool result=nvc_ept_update_pde_memory_type(eptm,gpa+page_2mb_mult(i),memory_type,force);
-			if(!result)return false;
-		}
-		return true;
-	}
-}
-
 bool nvc_ept_update_pdpte(noir_ept_manager_p eptm,u64 hpa,u64 gpa,bool r,bool w,bool x,bool h,bool ignore_mt,u8 memory_type,bool alloc)
 {
 	const u64 index=page_1gb_count(gpa);
@@ -354,12 +289,17 @@ noir_ept_pte_descriptor_p nvc_ept_update_pte(noir_ept_manager_p eptm,u64 hpa,u64
 }
 
 #if !defined(_hv_type1)
-bool nvc_ept_insert_pte(noir_ept_manager_p eptm,noir_hook_page_p nhp)
+bool nvc_ept_insert_pte(noir_ept_manager_p eptm,noir_hook_page_p nhp,u32 view)
 {
 	// Traverse all hook pages and set hooks.
 	for(u32 i=0;i<noir_hook_pages_count;i++)
 	{
-		noir_ept_pte_descriptor_p pte_p=nvc_ept_update_pte(eptm,nhp[i].hook.phys,nhp[i].orig.phys,false,false,true,true,0,true);
+		noir_ept_pte_descriptor_p pte_p;
+		// The hook view executes the hook page. The data view reads and writes the original page.
+		if(view==noir_ept_view_data)
+			pte_p=nvc_ept_update_pte(eptm,nhp[i].orig.phys,nhp[i].orig.phys,true,true,false,true,0,true);
+		else
+			pte_p=nvc_ept_update_pte(eptm,nhp[i].hook.phys,nhp[i].orig.phys,false,false,true,true,0,true);
 		ia32_addr_translator addr;
 		if(!pte_p)return false;
 		addr.value=nhp[i].orig.phys;
@@ -367,6 +307,62 @@ bool nvc_ept_insert_pte(noir_ept_manager_p eptm,noir_hook_page_p nhp)
 	}
 	return true;
 }
+
+/*
+  Resolve an EPT violation on a hooked page.
+
+  In single-view mode, the PTE of the hooked page is substituted
+  between the hook page (--X) and the original page (RW-).
+  In dual-view mode, both mappings are permanent in their own views,
+  so the EPT pointer is switched instead. No PTE would be modified,
+  and no invalidation is required because the views have separate EP4TAs.
+  If the instruction accesses data in its own page, neither mapping
+  suffices and the instruction has to be stepped over with MTF.
+
+  This function has no side effects so that it can be tested in user mode.
+*/
+noir_ept_hook_action nvc_ept_resolve_hook_violation(bool dual_view,bool execute,bool same_page)
+{
+	if(execute)
+		return dual_view?noir_ept_hook_switch_to_hook_view:noir_ept_hook_map_hook_page;
+	if(same_page)
+		return noir_ept_hook_step_over;
+	return dual_view?noir_ept_hook_switch_to_data_view:noir_ept_hook_map_orig_page;
+}
+
+bool nvc_ept_build_hook_lookup(noir_vt_hvm_p rhvm)
+{
+	// Keep the load factor no more than one half.
+	u32 size=1;
+	while(size<(noir_hook_pages_count<<1))size<<=1;
+	rhvm->hook_lookup.table=noir_alloc_nonpg_memory(size*sizeof(u32));
+	if(rhvm->hook_lookup.table==null)return false;
+	rhvm->hook_lookup.mask=size-1;
+	for(u32 i=0;i<noir_hook_pages_count;i++)
+	{
+		u32 j=noir_ept_hook_hash(noir_hook_pages[i].orig.phys,rhvm->hook_lookup.mask);
+		// Linear probing.
+		while(rhvm->hook_lookup.table[j])j=(j+1)&rhvm->hook_lookup.mask;
+		rhvm->hook_lookup.table[j]=i+1;
+	}
+	return true;
+}
+
+// Returns the index of the hook page, or maxu32 if the GPA is not hooked.
+u32 nvc_ept_find_hook_page(noir_vt_hvm_p rhvm,u64 gpa)
+{
+	if(rhvm->hook_lookup.table)
+	{
+		u32 j=noir_ept_hook_hash(gpa,rhvm->hook_lookup.mask);
+		while(rhvm->hook_lookup.table[j])
+		{
+			const u32 i=rhvm->hook_lookup.table[j]-1;
+			if(page_base(gpa)==noir_hook_pages[i].orig.phys)return i;
+			j=(j+1)&rhvm->hook_lookup.mask;
+		}
+	}
+	return maxu32;
+}
 #endif
 
 /*
@@ -378,176 +374,229 @@ bool nvc_ept_insert_pte(noir_ept_manager_p eptm,noir_hook_page_p nhp)
 
 	Therefore, we may simply compare the value of memory type.
 	The final value of the memory type will be the one that have smallest value.
+
+	The effective memory type map is resolved into ascending runs of the same type first.
+	Fixed MTRRs precede variable MTRRs in the first MiB, and the default type applies to the rest.
+	Each run is then applied to the EPT, so a page is split only if its memory type is not uniform.
 */
 
-void static nvc_ept_update_per_var_mtrr(noir_ept_manager_p eptm,u32 mtrr_msr_index)
+// If the table to split into cannot be allocated, merge the memory type into the large page instead.
+// The merge follows the precedence of overlapping MTRRs. Returns the end of the large page.
+u64 static nvc_ept_merge_large_page_memory_type(noir_ept_manager_p eptm,u64 addr,u8 memory_type)
 {
-	ia32_mtrr_phys_mask_msr phys_mask;
-	phys_mask.value=noir_rdmsr(mtrr_msr_index+1);
-	if(phys_mask.valid)
+	const u64 index=page_1gb_count(addr);
+	noir_ept_pde_descriptor_p pde_p=nvc_ept_split_pdpte(eptm,addr,false,false);
+	if(pde_p)
 	{
-		ia32_mtrr_phys_base_msr phys_base;
-		phys_base.value=noir_rdmsr(mtrr_msr_index);
-		// Ignore MTRRs that defines the same memory type as default MTRR.
-		if(phys_base.type!=eptm->def_type.type)
+		ia32_addr_translator gat;
+		gat.value=addr;
+		pde_p->large[gat.pde_offset].memory_type=nvc_ept_merge_memory_type((u8)pde_p->large[gat.pde_offset].memory_type,memory_type,false);
+		return page_2mb_mult(page_2mb_count(addr)+1);
+	}
+	eptm->pdpt.virt[index].memory_type=nvc_ept_merge_memory_type((u8)eptm->pdpt.virt[index].memory_type,memory_type,false);
+	return page_1gb_mult(index+1);
+}
+
+/*
+  Apply a run of memory type to the EPT. The run must be 4KiB-aligned.
+  Splitting a page allocates memory, even in VM-Exit handlers.
+  If the allocation fails, the rest of the run in that page is merged
+  into the page, and the function returns false after the whole run.
+*/
+bool static nvc_ept_apply_memory_type(noir_ept_manager_p eptm,u64 base,u64 end,u8 memory_type)
+{
+	u64 addr=base;
+	bool result=true;
+	while(addr<end)
+	{
+		const u64 index=page_1gb_count(addr);
+		if(page_1gb_offset(addr)==0 && end-addr>=page_1gb_size && eptm->pdpt.virt[index].huge_pdpte)
 		{
-			u32 exponential;
-			u64 len=0,increment=0,base=page_mult(phys_base.phys_base);
-			noir_bsf64(&exponential,page_mult(phys_mask.phys_mask));
-			len=1ui64<<exponential;
-			nv_dprintf("Variable MTRR (0x%X) Base: 0x%016llX, Mask: 0x%016llX, Length: 0x%016llX, Type: %u\n",mtrr_msr_index,phys_base.value,phys_mask.value,len,phys_base.type);
-			for(u64 addr=base;addr<base+len;addr+=increment)
+			eptm->pdpt.virt[index].memory_type=memory_type;
+			addr+=page_1gb_size;
+		}
+		else if(page_2mb_offset(addr)==0 && end-addr>=page_2mb_size)
+		{
+			noir_ept_pde_descriptor_p pde_p=nvc_ept_split_pdpte(eptm,addr,true,true);
+			if(pde_p==null)
 			{
-				// The increment depends on address alignment and remainder length.
-				const u64 remainder=base+len-addr;
-				if(page_1gb_offset(addr)==0)
-				{
-					if(remainder>=page_1gb_size)
-						increment=page_1gb_size;
-					else if(remainder>=page_2mb_size)
-						increment=page_2mb_size;
-					else
-						increment=page_4kb_size;
-				}
-				else if(page_2mb_offset(addr)==0)
-				{
-					if(remainder>=page_2mb_size)
-						increment=page_2mb_size;
-					else
-						increment=page_4kb_size;
-				}
+				addr=nvc_ept_merge_large_page_memory_type(eptm,addr,memory_type);
+				result=false;
+				continue;
+			}
+			// Update all 2MiB pages of this run in this 1GiB page.
+			do
+			{
+				ia32_addr_translator gat;
+				gat.value=addr;
+				if(pde_p->large[gat.pde_offset].large_pde)
+					pde_p->large[gat.pde_offset].memory_type=memory_type;
 				else
-					increment=page_4kb_size;
-				// Update the paging structure.
-				switch(increment)
 				{
-					case page_1gb_size:
-					{
-						nvc_ept_update_pdpte_memory_type(eptm,addr,(u8)phys_base.type,false);
-						break;
-					}
-					case page_2mb_size:
-					{
-						nvc_ept_update_pde_memory_type(eptm,addr,(u8)phys_base.type,false);
-						break;
-					}
-					case page_4kb_size:
-					{
-						nvc_ept_update_pte_memory_type(eptm,addr,(u8)phys_base.type,false);
-						break;
-					}
-					default:
-					{
-						nv_dprintf("[Variable MTRR] Unknown increment: 0x%llX!\n",increment);
-						break;
-					}
+					noir_ept_pte_descriptor_p pte_p=nvc_ept_split_pde(eptm,addr,false,false);
+					if(pte_p==null)return false;
+					for(u32 i=0;i<page_table_entries64;i++)
+						pte_p->virt[i].memory_type=memory_type;
 				}
+				addr+=page_2mb_size;
+			}while(page_1gb_offset(addr) && end-addr>=page_2mb_size);
+		}
+		else
+		{
+			noir_ept_pte_descriptor_p pte_p=nvc_ept_split_pde(eptm,addr,true,true);
+			if(pte_p==null)
+			{
+				addr=nvc_ept_merge_large_page_memory_type(eptm,addr,memory_type);
+				result=false;
+				continue;
 			}
+			// Update all 4KiB pages of this run in this 2MiB page.
+			do
+			{
+				ia32_addr_translator gat;
+				gat.value=addr;
+				pte_p->virt[gat.pte_offset].memory_type=memory_type;
+				addr+=page_4kb_size;
+			}while(page_2mb_offset(addr) && addr<end);
 		}
 	}
+	return result;
+}
+
+// Append a range to the pending run. If the range cannot be coalesced, the pending run is applied.
+void static nvc_ept_emit_memory_type(noir_ept_manager_p eptm,noir_ept_memory_type_run_p run,u64 base,u64 end,u8 memory_type)
+{
+	if(run->end==base && run->memory_type==memory_type)
+		run->end=end;
+	else
+	{
+		if(run->end>run->base)
+		{
+			if(nvc_ept_apply_memory_type(eptm,run->base,run->end,run->memory_type)==false)
+			{
+				nv_dprintf("Failed to split pages for memory type %u at 0x%016llX-0x%016llX!\n",run->memory_type,run->base,run->end);
+				run->failures++;
+			}
+			run->count++;
+		}
+		run->base=base;
+		run->end=end;
+		run->memory_type=memory_type;
+	}
+}
+
+u32 static nvc_ept_read_var_mtrr(noir_ept_memory_type_range_p range,u32 mtrr_msr_index)
+{
+	ia32_mtrr_phys_mask_msr phys_mask;
+	phys_mask.value=noir_rdmsr(mtrr_msr_index+1);
+	if(phys_mask.valid)
+	{
+		ia32_mtrr_phys_base_msr phys_base;
+		u32 exponential;
+		phys_base.value=noir_rdmsr(mtrr_msr_index);
+		noir_bsf64(&exponential,page_mult(phys_mask.phys_mask));
+		range->base=page_mult(phys_base.phys_base);
+		range->end=range->base+((u64)1<<exponential);
+		range->memory_type=(u8)phys_base.type;
+		return 1;
+	}
+	return 0;
 }
 
-void nvc_ept_update_by_mtrr(noir_ept_manager_p eptm)
+// Returns false if any page could not be split. Such pages take the merged memory type of their runs.
+bool nvc_ept_update_by_mtrr(noir_ept_manager_p eptm)
 {
+	noir_ept_memory_type_range var_mtrr[noir_ept_max_var_mtrr+1];
+	u64 bounds[(noir_ept_max_var_mtrr+1)*2+2];
+	noir_ept_memory_type_run run={0};
+	u32 var_count=0,bound_count=0;
+	u64 start=0;
+	const u64 limit=page_1gb_mult((u64)page_table_entries64*page_table_entries64);
+	// If MTRRs are disabled, all memory is uncacheable.
+	const u8 def_type=eptm->def_type.enabled?(u8)eptm->def_type.type:ia32_uncacheable;
 	if(eptm->def_type.enabled)
 	{
 		ia32_mtrr_cap_msr mtrr_cap;
+		u32 mtrr_count;
 		// Read MTRR capabilities.
 		mtrr_cap.value=noir_rdmsr(ia32_mtrr_cap);
-		// Traverse variable-range MTRRs.
-		for(u32 i=0;i<mtrr_cap.variable_count;i++)
-			nvc_ept_update_per_var_mtrr(eptm,ia32_mtrr_phys_base0+(i<<1));
-		// By the way, set the SMRR.
+		mtrr_count=(u32)mtrr_cap.variable_count;
+		if(mtrr_count>noir_ept_max_var_mtrr)
+		{
+			nv_dprintf("Only %u of %u variable MTRRs are supported!\n",noir_ept_max_var_mtrr,mtrr_count);
+			mtrr_count=noir_ept_max_var_mtrr;
+		}
+		// Read variable-range MTRRs.
+		for(u32 i=0;i<mtrr_count;i++)
+			var_count+=nvc_ept_read_var_mtrr(&var_mtrr[var_count],ia32_mtrr_phys_base0+(i<<1));
+		// By the way, read the SMRR.
 		if(mtrr_cap.support_smrr)
-			nvc_ept_update_per_var_mtrr(eptm,ia32_smrr_phys_base);
+			var_count+=nvc_ept_read_var_mtrr(&var_mtrr[var_count],ia32_smrr_phys_base);
+		// Resolve fixed-range MTRRs. All Fixed Range MTRRs span the first MiB of system memory.
+		if(eptm->def_type.fix_enabled)
+		{
+			const u32 fixed_msr[11]=
+			{
+				ia32_mtrr_fix64k_00000,ia32_mtrr_fix16k_80000,ia32_mtrr_fix16k_a0000,
+				ia32_mtrr_fix4k_c0000,ia32_mtrr_fix4k_c8000,ia32_mtrr_fix4k_d0000,ia32_mtrr_fix4k_d8000,
+				ia32_mtrr_fix4k_e0000,ia32_mtrr_fix4k_e8000,ia32_mtrr_fix4k_f0000,ia32_mtrr_fix4k_f8000
+			};
+			for(u32 i=0;i<11;i++)
+			{
+				// Each register specifies eight ranges of 64KiB, 16KiB or 4KiB.
+				const u64 unit=i==0?0x10000:i<3?0x4000:0x1000;
+				u64 fixed_type=noir_rdmsr(fixed_msr[i]);
+				u8* type=(u8*)&fixed_type;
+				for(u32 j=0;j<8;j++)
+				{
+					nvc_ept_emit_memory_type(eptm,&run,start,start+unit,type[j]);
+					start+=unit;
+				}
+			}
+		}
+	}
+	// Collect the boundaries of variable MTRRs in ascending order.
+	bounds[bound_count++]=start;
+	bounds[bound_count++]=limit;
+	for(u32 i=0;i<var_count;i++)
+	{
+		const u64 points[2]={var_mtrr[i].base,var_mtrr[i].end};
+		for(u32 j=0;j<2;j++)
+		{
+			if(points[j]>start && points[j]<limit)
+			{
+				u32 k=bound_count++;
+				for(;k && bounds[k-1]>points[j];k--)bounds[k]=bounds[k-1];
+				bounds[k]=points[j];
+			}
+		}
 	}
-	// Traverse fixed-range MTRRs.
-	if(eptm->def_type.enabled && eptm->def_type.fix_enabled)
+	for(u32 i=1;i<bound_count;i++)
 	{
-		u8* type;
-		// Read Fixed Range MTRRs.
-		// All Fixed Range MTRRs span the first MiB of system memory.
-		u64 fix64k_00000=noir_rdmsr(ia32_mtrr_fix64k_00000);
-		u64 fix16k_80000=noir_rdmsr(ia32_mtrr_fix16k_80000);
-		u64 fix16k_a0000=noir_rdmsr(ia32_mtrr_fix16k_a0000);
-		u64 fix4k_c0000=noir_rdmsr(ia32_mtrr_fix4k_c0000);
-		u64 fix4k_c8000=noir_rdmsr(ia32_mtrr_fix4k_c8000);
-		u64 fix4k_d0000=noir_rdmsr(ia32_mtrr_fix4k_d0000);
-		u64 fix4k_d8000=noir_rdmsr(ia32_mtrr_fix4k_d8000);
-		u64 fix4k_e0000=noir_rdmsr(ia32_mtrr_fix4k_e0000);
-		u64 fix4k_e8000=noir_rdmsr(ia32_mtrr_fix4k_e8000);
-		u64 fix4k_f0000=noir_rdmsr(ia32_mtrr_fix4k_f0000);
-		u64 fix4k_f8000=noir_rdmsr(ia32_mtrr_fix4k_f8000);
-		// Locate the PTE descriptor for first 2MiB.
-		noir_ept_pte_descriptor_p pte_p=nvc_ept_split_pde(eptm,0,true,true);
-		// MTRR Fixed64K 00000
-		// This register specifies eight 64KiB ranges, 512KiB in total.
-		type=(u8*)&fix64k_00000;
-		for(u32 i=0;i<8;i++)
-			for(u32 j=0;j<16;j++)	// 64KiB is actually 16 pages.
-				pte_p->virt[(i<<4)+j].memory_type=type[i];
-		// MTRR Fixed16K_80000
-		// This register specifies eight 16KiB ranges, 128KiB in total.
-		type=(u8*)&fix16k_80000;
-		for(u32 i=0;i<8;i++)
-			for(u32 j=0;j<4;j++)	// 16KiB is actually 4 pages.
-				pte_p->virt[0x80+(i<<2)+j].memory_type=type[i];
-		// MTRR Fixed16K_a0000
-		// This register specifies eight 16KiB ranges, 128KiB in total.
-		type=(u8*)&fix16k_a0000;
-		for(u32 i=0;i<8;i++)
-			for(u32 j=0;j<4;j++)	// 16KiB is actually 4 pages.
-				pte_p->virt[0xa0+(i<<2)+j].memory_type=type[i];
-		// MTRR Fixed4K_c0000
-		// This register specifies eight 4KiB ranges, 32KiB in total
-		type=(u8*)&fix4k_c0000;
-		for(u32 i=0;i<8;i++)
-			pte_p->virt[0xc0+i].memory_type=type[i];
-		// MTRR Fixed4K_c8000
-		// This register specifies eight 4KiB ranges, 32KiB in total
-		type=(u8*)&fix4k_c8000;
-		for(u32 i=0;i<8;i++)
-			pte_p->virt[0xc8+i].memory_type=type[i];
-		// MTRR Fixed4K_d0000
-		// This register specifies eight 4KiB ranges, 32KiB in total
-		type=(u8*)&fix4k_d0000;
-		for(u32 i=0;i<8;i++)
-			pte_p->virt[0xd0+i].memory_type=type[i];
-		// MTRR Fixed4K_d8000
-		// This register specifies eight 4KiB ranges, 32KiB in total
-		type=(u8*)&fix4k_d8000;
-		for(u32 i=0;i<8;i++)
-			pte_p->virt[0xd8+i].memory_type=type[i];
-		// MTRR Fixed4K_e0000
-		// This register specifies eight 4KiB ranges, 32KiB in total
-		type=(u8*)&fix4k_e0000;
-		for(u32 i=0;i<8;i++)
-			pte_p->virt[0xe0+i].memory_type=type[i];
-		// MTRR Fixed4K_e8000
-		// This register specifies eight 4KiB ranges, 32KiB in total
-		type=(u8*)&fix4k_e8000;
-		for(u32 i=0;i<8;i++)
-			pte_p->virt[0xe8+i].memory_type=type[i];
-		// MTRR Fixed4K_f0000
-		// This register specifies eight 4KiB ranges, 32KiB in total
-		type=(u8*)&fix4k_f0000;
-		for(u32 i=0;i<8;i++)
-			pte_p->virt[0xf0+i].memory_type=type[i];
-		// MTRR Fixed4K_f8000
-		// This register specifies eight 4KiB ranges, 32KiB in total
-		type=(u8*)&fix4k_f8000;
-		for(u32 i=0;i<8;i++)
-			pte_p->virt[0xf8+i].memory_type=type[i];
+		if(bounds[i]>bounds[i-1])
+		{
+			u8 memory_type=def_type;
+			bool covered=false;
+			for(u32 j=0;j<var_count;j++)
+			{
+				if(bounds[i-1]>=var_mtrr[j].base && bounds[i-1]<var_mtrr[j].end)
+				{
+					memory_type=covered?nvc_ept_merge_memory_type(memory_type,var_mtrr[j].memory_type,false):var_mtrr[j].memory_type;
+					covered=true;
+				}
+			}
+			nvc_ept_emit_memory_type(eptm,&run,bounds[i-1],bounds[i],memory_type);
+		}
 	}
-	// Clear all MTRR-related bits.
-	for(u32 i=0;i<512*512;i++)
-		eptm->pdpt.virt[i].var_mtrr_covered=false;
-	for(noir_ept_pde_descriptor_p pde_p=eptm->pde.head;pde_p;pde_p=pde_p->next)
-		for(u32 i=0;i<512;i++)
-			pde_p->large[i].var_mtrr_covered=false;
-	for(noir_ept_pte_descriptor_p pte_p=eptm->pte.head;pte_p;pte_p=pte_p->next)
-		for(u32 i=0;i<512;i++)
-			pte_p->virt[i].var_mtrr_covered=false;
+	// Apply the last run.
+	if(nvc_ept_apply_memory_type(eptm,run.base,run.end,run.memory_type)==false)
+	{
+		nv_dprintf("Failed to split pages for memory type %u at 0x%016llX-0x%016llX!\n",run.memory_type,run.base,run.end);
+		run.failures++;
+	}
+	run.count++;
+	nvd_printf("Applied %u memory-type runs from %u variable MTRRs.\n",run.count,var_count);
+	return run.failures==0;
 }
 
 bool nvc_ept_install_mmio_hook(noir_ept_manager_p eptm,noir_io_avl_node_p node)
@@ -582,11 +631,15 @@ bool nvc_ept_setup_mmio_hooks(noir_ept_manager_p eptm)
 bool nvc_ept_initialize_ci(noir_ept_manager_p eptm)
 {
 	bool r=true;
-	for(u32 i=0;i<noir_ci->pages;i++)
+	// Code integrity might not be initialized.
+	if(noir_ci)
 	{
-		u64 phys=noir_ci->page_ci[i].phys;
-		r&=(nvc_ept_update_pte(eptm,phys,phys,true,false,true,true,0,true)!=null);
-		if(!r)break;
+		for(u32 i=0;i<noir_ci->pages;i++)
+		{
+			u64 phys=noir_ci->page_ci[i].phys;
+			r&=(nvc_ept_update_pte(eptm,phys,phys,true,false,true,true,0,true)!=null);
+			if(!r)break;
+		}
 	}
 	return r;
 }
@@ -630,6 +683,13 @@ bool nvc_ept_protect_hypervisor(noir_hypervisor_p hvm,noir_ept_manager_p eptm)
 			result&=(nvc_ept_update_pte(eptm,eptmt->eptp.phys.value,eptm->blank_page.phys,true,true,true,true,0,true)!=null);
 			// Allow Guest read the original PDPTE so that EPT-violation VM-Exits can be reduced.
 			result&=nvc_ept_update_pde(eptm,eptmt->pdpt.phys,eptmt->pdpt.phys,true,false,false,true,true,0,true);
+			// Protect the data view if it is present.
+			if(vcpu->ept_data_view)
+			{
+				noir_ept_manager_p eptmd=(noir_ept_manager_p)vcpu->ept_data_view;
+				result&=(nvc_ept_update_pte(eptm,eptmd->eptp.phys.value,eptm->blank_page.phys,true,true,true,true,0,true)!=null);
+				result&=nvc_ept_update_pde(eptm,eptmd->pdpt.phys,eptmd->pdpt.phys,true,false,false,true,true,0,true);
+			}
 			// Update PDEs of paging structure.
 			for(cur_d=eptm->pde.head;cur_d;cur_d=cur_d->next)
 				result&=(nvc_ept_update_pte(eptm,cur_d->phys,eptm->blank_page.phys,true,true,true,true,0,true)!=null);
@@ -660,8 +720,9 @@ bool nvc_ept_protect_hypervisor(noir_hypervisor_p hvm,noir_ept_manager_p eptm)
   Note that we expect only lower 512GB are used as physical RAM. Higher physical addresses are intended for MMIO.
   We will allocate the PDPTEs and PDEs on two single 2MB-aligned pages.
 */
-noir_ept_manager_p nvc_ept_build_identity_map()
+noir_ept_manager_p nvc_ept_build_identity_map(u32 view)
 {
+	// Each vCPU owns an EPT which is built and split on that processor. Hence the paging structures are local.
 	bool alloc_success=false;
 	// Allocate structures for EPT Manager.
 #if defined(_hv_type1)
@@ -671,7 +732,7 @@ noir_ept_manager_p nvc_ept_build_identity_map()
 #endif
 	if(eptm)
 	{
-		eptm->eptp.virt=noir_alloc_contd_memory(page_size);
+		eptm->eptp.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
 		if(eptm->eptp.virt)
 		{
 			eptm->pdpt.virt=noir_alloc_2mb_page();
@@ -716,12 +777,13 @@ noir_ept_manager_p nvc_ept_build_identity_map()
 			eptm->eptp.virt[i].execute=1;
 		}
 		// Update MTRR.
-		nvc_ept_update_by_mtrr(eptm);
+		if(nvc_ept_update_by_mtrr(eptm)==false)
+			goto alloc_failure;
 #if !defined(_hv_type1)
 		// Make Hooked Pages.
 		noir_copy_memory(eptm->hook_pages,noir_hook_pages,sizeof(noir_hook_page)*noir_hook_pages_count);
 		if(hvm_p->options.stealth_inline_hook)
-			if(nvc_ept_insert_pte(eptm,eptm->hook_pages)==false)
+			if(nvc_ept_insert_pte(eptm,eptm->hook_pages,view)==false)
 				goto alloc_failure;
 #endif
 		// Initialize CI.
@@ -213,6 +213,25 @@ typedef struct _noir_ept_pte_descriptor
 	u64 gpa_start;
 }noir_ept_pte_descriptor,*noir_ept_pte_descriptor_p;
 
+// Effective memory type of a range of physical address.
+#define noir_ept_max_var_mtrr		32
+
+typedef struct _noir_ept_memory_type_range
+{
+	u64 base;
+	u64 end;
+	u8 memory_type;
+}noir_ept_memory_type_range,*noir_ept_memory_type_range_p;
+
+typedef struct _noir_ept_memory_type_run
+{
+	u64 base;
+	u64 end;
+	u32 count;
+	u32 failures;
+	u8 memory_type;
+}noir_ept_memory_type_run,*noir_ept_memory_type_run_p;
+
 typedef struct _noir_ept_manager
 {
 	struct
@@ -245,6 +264,23 @@ typedef struct _noir_ept_manager
 #endif
 }noir_ept_manager,*noir_ept_manager_p;
 
+// Views of EPT for Stealth Inline Hook.
+#define noir_ept_view_hook		0		// Hooked pages are mapped to the hook pages with execute-only access.
+#define noir_ept_view_data		1		// Hooked pages are mapped to the original pages without execute access.
+
+// Actions to resolve an EPT violation on a hooked page.
+typedef enum _noir_ept_hook_action
+{
+	noir_ept_hook_map_hook_page,		// Substitute the PTE with the hook page and grant execute access only.
+	noir_ept_hook_map_orig_page,		// Substitute the PTE with the original page and revoke execute access.
+	noir_ept_hook_step_over,			// Grant all accesses to the original page and step over with MTF.
+	noir_ept_hook_switch_to_hook_view,	// Switch the EPT pointer to the hook view.
+	noir_ept_hook_switch_to_data_view	// Switch the EPT pointer to the data view.
+}noir_ept_hook_action,*noir_ept_hook_action_p;
+
+// The hook-lookup table is an open-addressing hash table keyed on GPA pages.
+#define noir_ept_hook_hash(gpa,mask)	((u32)((((gpa)>>page_shift)*0x9E3779B97F4A7C15)>>32)&(mask))
+
 typedef union _ia32_ept_violation_qualification
 {
 	struct
@@ -277,6 +313,15 @@ typedef union _ia32_ept_violation_qualification
 
 bool nvc_ept_protect_hypervisor(noir_hypervisor_p hvm,noir_ept_manager_p eptm);
 bool nvc_ept_setup_mmio_hooks(noir_ept_manager_p eptm);
-noir_ept_manager_p nvc_ept_build_identity_map();
+noir_ept_manager_p nvc_ept_build_identity_map(u32 view);
 void nvc_ept_cleanup(noir_ept_manager_p eptm);
-void nvc_ept_update_by_mtrr(noir_ept_manager_p eptm);
\ No newline at end of file
+bool nvc_ept_update_by_mtrr(noir_ept_manager_p eptm);
+noir_ept_pde_descriptor_p nvc_ept_split_pdpte(noir_ept_manager_p eptm,u64 gpa,bool host,bool alloc);
+noir_ept_pte_descriptor_p nvc_ept_split_pde(noir_ept_manager_p eptm,u64 gpa,bool host,bool alloc);
+bool nvc_ept_update_pde(noir_ept_manager_p eptm,u64 hpa,u64 gpa,bool r,bool w,bool x,bool l,bool ignore_mt,u8 memory_type,bool alloc);
+noir_ept_pte_descriptor_p nvc_ept_update_pte(noir_ept_manager_p eptm,u64 hpa,u64 gpa,bool r,bool w,bool x,bool ignore_mt,u8 memory_type,bool alloc);
+#if !defined(_hv_type1)
+noir_ept_hook_action nvc_ept_resolve_hook_violation(bool dual_view,bool execute,bool same_page);
+bool nvc_ept_build_hook_lookup(noir_vt_hvm_p rhvm);
+u32 nvc_ept_find_hook_page(noir_vt_hvm_p rhvm,u64 gpa);
+#endif
\ No newline at end of file
@@ -117,9 +117,7 @@ void noir_hvcode nvc_vt_dump_vmcs_guest_state()
 // You might want to debug your code if this function is invoked.
 void static noir_hvcode fastcall nvc_vt_default_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu)
 {
-	u32 exit_reason;
-	noir_vt_vmread(vmexit_reason,&exit_reason);
-	nv_dprintf("Unhandled VM-Exit!, Exit Reason: %s\n",vmx_exit_msg[exit_reason&0xFFFF]);
+	nv_dprintf("Unhandled VM-Exit!, Exit Reason: %s\n",vmx_exit_msg[vcpu->exit_cache.reason]);
 }
 
 // Expected Exit Reason: 0
@@ -127,7 +125,7 @@ void static noir_hvcode fastcall nvc_vt_default_handler(noir_gpr_state_p gpr_sta
 void static noir_hvcode fastcall nvc_vt_exception_nmi_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu)
 {
 	ia32_vmexit_interruption_information_field exit_int_info;
-	noir_vt_vmread(vmexit_interruption_information,&exit_int_info.value);
+	exit_int_info.value=(u32)noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_interruption_information);
 	if(exit_int_info.valid)
 	{
 		switch(exit_int_info.vector)
@@ -137,9 +135,9 @@ void static noir_hvcode fastcall nvc_vt_exception_nmi_handler(noir_gpr_state_p g
 			{
 				ulong_ptr gcr2;
 				ia32_page_fault_error_code err_code;
-				noir_vt_vmread(vmexit_interruption_error_code,&err_code.value);
+				err_code.value=(u32)noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_interruption_error_code);
 				// Processor does not update CR2 on #PF Exit, but the faulting address is saved in Exit Qualification.
-				noir_vt_vmread(vmexit_qualification,&gcr2);
+				gcr2=(ulong_ptr)noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_qualification);
 				if(gcr2==(ulong_ptr)noir_system_call)
 				{
 					// ulong_ptr gcr4;
@@ -168,8 +166,7 @@ void static noir_hvcode fastcall nvc_vt_exception_nmi_handler(noir_gpr_state_p g
 #endif
 			default:
 			{
-				u32 err_code;
-				noir_vt_vmread(vmexit_interruption_error_code,&err_code);
+				const u32 err_code=(u32)noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_interruption_error_code);
 				nvd_printf("Unexpected Exception is intercepted! Vector=%u, Error-Code: 0x%X\n",exit_int_info.vector,err_code);
 				noir_int3();
 			}
@@ -490,6 +487,7 @@ void static noir_hvcode fastcall nvc_vt_vmcall_handler(noir_gpr_state_p gpr_stat
 				noir_vt_custom_vcpu_p cvcpu=(noir_vt_custom_vcpu_p)gpr_state->rdx;
 #endif
 				noir_vt_advance_rip();
+				cvcpu->header.statistics_internal.runtime_start=noir_get_system_time();
 				nvc_vt_switch_to_guest_vcpu(gpr_state,vcpu,cvcpu);
 			}
 			break;
@@ -526,6 +524,22 @@ void static noir_hvcode fastcall nvc_vt_vmcall_handler(noir_gpr_state_p gpr_stat
 			}
 			break;
 		}
+		case noir_vt_clear_custom_vmcs:
+		{
+			// For CVM hypercalls, the caller must be located in Layered Hypervisor.
+			if(gip>=hvm_p->layered_hv_image.base && gip<hvm_p->layered_hv_image.base+hvm_p->layered_hv_image.size)
+			{
+#if defined(_hv_type1)
+				// FIXME: Translate the GVA in the structure.
+				noir_vt_custom_vcpu_p cvcpu=null;
+#else
+				noir_vt_custom_vcpu_p cvcpu=(noir_vt_custom_vcpu_p)gpr_state->rdx;
+#endif
+				nvc_vt_clear_cvm_vmcs(cvcpu);
+				noir_vt_advance_rip();
+			}
+			break;
+		}
 		default:
 		{
 			// Unexpected vmcall occured. This could be possible when NoirVisor is loaded as nested hypervisor.
@@ -534,7 +548,7 @@ void static noir_hvcode fastcall nvc_vt_vmcall_handler(noir_gpr_state_p gpr_stat
 	}
 }
 
-ulong_ptr static nvc_vt_parse_vmx_pointer(noir_gpr_state_p gpr_state)
+ulong_ptr static nvc_vt_parse_vmx_pointer(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu)
 {
 	ia32_vmexit_instruction_information info;
 	ulong_ptr* gpr=(ulong_ptr*)gpr_state;
@@ -542,9 +556,9 @@ ulong_ptr static nvc_vt_parse_vmx_pointer(noir_gpr_state_p gpr_state)
 	ulong_ptr pointer,seg_base;
 	u32 seg_base_field=guest_es_base;
 	// Load Instruction Information.
-	noir_vt_vmread(vmexit_instruction_information,(u32*)&info);
+	info.value=(u32)noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_instruction_information);
 	// Get Displacement
-	noir_vt_vmread(vmexit_qualification,(ulong_ptr*)&displacement);
+	displacement=(long_ptr)noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_qualification);
 	// Load Base Register.
 	pointer=gpr[info.f5.base];
 	// Load Index Register.
@@ -568,7 +582,7 @@ void static noir_hvcode fastcall nvc_vt_vmclear_handler(noir_gpr_state_p gpr_sta
 	// Check if Guest is under VMX Operation.
 	if(noir_bt(&nested_vcpu->status,noir_nvt_vmxon))
 	{
-		ulong_ptr pointer=nvc_vt_parse_vmx_pointer(gpr_state);
+		ulong_ptr pointer=nvc_vt_parse_vmx_pointer(gpr_state,vcpu);
 		u64 vmcs_pa=*(u64*)pointer;
 		if(vmcs_pa & 0xfff)
 			noir_vt_vmfail(nested_vcpu,vmclear_with_invalid_pa);
@@ -579,6 +593,9 @@ void static noir_hvcode fastcall nvc_vt_vmclear_handler(noir_gpr_state_p gpr_sta
 			else
 			{
 				noir_vt_nested_vmcs_header_p header=noir_find_virt_by_phys(vmcs_pa);
+				// Fields in the shadow VMCS must be written to memory before the VMCS is cleared.
+				if(vmcs_pa==nested_vcpu->vmcs_c.phys)
+					nvc_vt_unload_shadow_vmcs(vcpu);
 				header->clean_fields.active=0;
 				header->clean_fields.launched=0;
 				if(vmcs_pa==nested_vcpu->vmcs_c.phys)
@@ -603,7 +620,7 @@ void static noir_hvcode fastcall nvc_vt_vmptrld_handler(noir_gpr_state_p gpr_sta
 	// Check if Guest is under VMX Operation.
 	if(noir_bt(&nested_vcpu->status,noir_nvt_vmxon))
 	{
-		ulong_ptr pointer=nvc_vt_parse_vmx_pointer(gpr_state);
+		ulong_ptr pointer=nvc_vt_parse_vmx_pointer(gpr_state,vcpu);
 		u64 vmcs_pa=*(u64*)pointer;
 		if(vmcs_pa & 0xfff)
 			noir_vt_vmfail(nested_vcpu,vmptrld_with_invalid_pa);
@@ -619,9 +636,16 @@ void static noir_hvcode fastcall nvc_vt_vmptrld_handler(noir_gpr_state_p gpr_sta
 					noir_vt_vmfail(nested_vcpu,vmptrld_with_incorrect_revid);
 				else
 				{
-					header->clean_fields.active=1;
-					nested_vcpu->vmcs_c.phys=vmcs_pa;
-					nested_vcpu->vmcs_c.virt=(void*)header;
+					// Reloading the current VMCS must not discard fields written to the shadow VMCS.
+					if(nested_vcpu->vmcs_c.phys!=vmcs_pa)
+					{
+						// Fields in the shadow VMCS belong to the previous current VMCS.
+						nvc_vt_sync_shadow_vmcs(vcpu);
+						header->clean_fields.active=1;
+						nested_vcpu->vmcs_c.phys=vmcs_pa;
+						nested_vcpu->vmcs_c.virt=(void*)header;
+						nvc_vt_load_shadow_vmcs(vcpu);
+					}
 					noir_vt_vmsuccess();
 				}
 			}
@@ -639,7 +663,7 @@ void static noir_hvcode fastcall nvc_vt_vmptrst_handler(noir_gpr_state_p gpr_sta
 	noir_vt_nested_vcpu_p nested_vcpu=&vcpu->nested_vcpu;
 	if(noir_bt(&nested_vcpu->status,noir_nvt_vmxon))
 	{
-		ulong_ptr pointer=nvc_vt_parse_vmx_pointer(gpr_state);
+		ulong_ptr pointer=nvc_vt_parse_vmx_pointer(gpr_state,vcpu);
 		*(u64*)pointer=nested_vcpu->vmcs_c.phys;
 		noir_vt_advance_rip();
 		return;
@@ -647,6 +671,116 @@ void static noir_hvcode fastcall nvc_vt_vmptrst_handler(noir_gpr_state_p gpr_sta
 	noir_vt_inject_event(ia32_invalid_opcode,ia32_hardware_exception,false,0,0);
 }
 
+// Expected Exit Reason: 20, 24
+// This is VM-Exit of obligation.
+void static noir_hvcode fastcall nvc_vt_vmentry_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu)
+{
+	noir_vt_nested_vcpu_p nested_vcpu=&vcpu->nested_vcpu;
+	if(noir_bt(&nested_vcpu->status,noir_nvt_vmxon))
+	{
+		if(nested_vcpu->vmcs_c.virt==null)
+			noir_vt_vmfail_invalid();
+		else
+		{
+			noir_vt_nested_vmcs_header_p header=(noir_vt_nested_vmcs_header_p)nested_vcpu->vmcs_c.virt;
+			if(vcpu->exit_cache.reason==intercept_vmlaunch && header->clean_fields.launched)
+				noir_vt_vmfail(nested_vcpu,vmlaunch_non_clear_vmcs);
+			else if(vcpu->exit_cache.reason==intercept_vmresume && !header->clean_fields.launched)
+				noir_vt_vmfail(nested_vcpu,vmresume_non_launched_vmcs);
+			else
+				// Nested VM-Entry is not supported. Fail as if the control fields were invalid.
+				noir_vt_vmfail(nested_vcpu,vmentry_failed_invalid_control_fields);
+		}
+		noir_vt_advance_rip();
+		return;
+	}
+	noir_vt_inject_event(ia32_invalid_opcode,ia32_hardware_exception,false,0,0);
+}
+
+// Expected Exit Reason: 23
+// This VM-Exit occurs only if the field is not shadowed.
+void static noir_hvcode fastcall nvc_vt_vmread_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu)
+{
+	noir_vt_nested_vcpu_p nested_vcpu=&vcpu->nested_vcpu;
+	if(noir_bt(&nested_vcpu->status,noir_nvt_vmxon))
+	{
+		if(nested_vcpu->vmcs_c.virt==null)
+			noir_vt_vmfail_invalid();
+		else
+		{
+			ia32_vmexit_instruction_information info;
+			ulong_ptr* gpr=(ulong_ptr*)gpr_state;
+			ulong_ptr data;
+			info.value=(u32)noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_instruction_information);
+			noir_vt_vmread(guest_rsp,&gpr_state->rsp);		// Note that rsp can be used as operand.
+			if(noir_vt_nested_vmread(nested_vcpu->vmcs_c.virt,(u32)gpr[info.f6.reg2],&data))
+			{
+				if(info.f6.use_register)
+				{
+					gpr[info.f6.reg1]=data;
+					if(info.f6.reg1==4)noir_vt_vmwrite(guest_rsp,data);
+				}
+				else
+				{
+					vmx_segment_access_right cs_attrib;
+					ulong_ptr pointer=nvc_vt_parse_vmx_pointer(gpr_state,vcpu);
+					noir_vt_vmread(guest_cs_access_rights,&cs_attrib.value);
+					// Operand size is 64 bits in 64-bit mode. Otherwise, it is 32 bits.
+					if(cs_attrib.long_mode)
+						*(u64p)pointer=data;
+					else
+						*(u32p)pointer=(u32)data;
+				}
+			}
+		}
+		noir_vt_advance_rip();
+		return;
+	}
+	noir_vt_inject_event(ia32_invalid_opcode,ia32_hardware_exception,false,0,0);
+}
+
+// Expected Exit Reason: 25
+// This VM-Exit occurs only if the field is not shadowed.
+void static noir_hvcode fastcall nvc_vt_vmwrite_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu)
+{
+	noir_vt_nested_vcpu_p nested_vcpu=&vcpu->nested_vcpu;
+	if(noir_bt(&nested_vcpu->status,noir_nvt_vmxon))
+	{
+		if(nested_vcpu->vmcs_c.virt==null)
+			noir_vt_vmfail_invalid();
+		else
+		{
+			ia32_vmexit_instruction_information info;
+			ia32_vmx_vmcs_encoding encoding;
+			ia32_vmx_misc_msr misc_msr;
+			ulong_ptr* gpr=(ulong_ptr*)gpr_state;
+			ulong_ptr data;
+			info.value=(u32)noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_instruction_information);
+			noir_vt_vmread(guest_rsp,&gpr_state->rsp);		// Note that rsp can be used as operand.
+			encoding.value=(u32)gpr[info.f6.reg2];
+			misc_msr.value=vcpu->virtual_msr.vmx_msr[ia32_vmx_misc-ia32_vmx_basic];
+			if(info.f6.use_register)
+				data=gpr[info.f6.reg1];
+			else
+			{
+				vmx_segment_access_right cs_attrib;
+				ulong_ptr pointer=nvc_vt_parse_vmx_pointer(gpr_state,vcpu);
+				noir_vt_vmread(guest_cs_access_rights,&cs_attrib.value);
+				// Operand size is 64 bits in 64-bit mode. Otherwise, it is 32 bits.
+				data=cs_attrib.long_mode?(ulong_ptr)*(u64p)pointer:(ulong_ptr)*(u32p)pointer;
+			}
+			// Type 1 indicates the field is read-only.
+			if(encoding.type==1 && !misc_msr.allow_any_writing_to_vmcs)
+				noir_vt_vmfail(nested_vcpu,vmwrite_to_read_only_field);
+			else
+				noir_vt_nested_vmwrite(nested_vcpu->vmcs_c.virt,encoding.value,data);
+		}
+		noir_vt_advance_rip();
+		return;
+	}
+	noir_vt_inject_event(ia32_invalid_opcode,ia32_hardware_exception,false,0,0);
+}
+
 // Expected Exit Reason: 26
 // This is VM-Exit of obligation.
 void static noir_hvcode fastcall nvc_vt_vmxoff_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu)
@@ -655,6 +789,7 @@ void static noir_hvcode fastcall nvc_vt_vmxoff_handler(noir_gpr_state_p gpr_stat
 	// Check if VMXON has been executed. Plus, revoke vmxon.
 	if(noir_btr(&nested_vcpu->status,noir_nvt_vmxon))
 	{
+		if(nested_vcpu->vmcs_c.virt)nvc_vt_unload_shadow_vmcs(vcpu);
 		// Mark as success operation.
 		noir_vt_vmsuccess();
 		noir_vt_advance_rip();
@@ -677,7 +812,7 @@ void static noir_hvcode fastcall nvc_vt_vmxon_handler(noir_gpr_state_p gpr_state
 		// Check if VMXON has been executed.
 		if(!noir_bt(&nested_vcpu->status,noir_nvt_vmxon))
 		{
-			ulong_ptr pointer=nvc_vt_parse_vmx_pointer(gpr_state);
+			ulong_ptr pointer=nvc_vt_parse_vmx_pointer(gpr_state,vcpu);
 			nv_dprintf("VMXON Region VA: 0x%p!\n",pointer);
 			// Get the VMXON Region Physical Address.
 			nested_vcpu->vmxon.phys=*(u64*)pointer;
@@ -726,6 +861,26 @@ void static noir_hvcode fastcall nvc_vt_vmxon_handler(noir_gpr_state_p gpr_state
 	}
 }
 
+// Reset the memory types in all EPT views of this vCPU.
+void static noir_hvcode nvc_vt_reset_ept_by_mtrr(noir_vt_vcpu_p vcpu)
+{
+	invept_descriptor ied;
+	ied.reserved=0;
+	// If pages cannot be split, they take the merged memory type. The guest keeps running either way.
+	if(nvc_ept_update_by_mtrr(vcpu->ept_manager)==false)
+		nv_dprintf("Memory types of some pages are merged due to insufficient memory!\n");
+	// Flush EPT TLB due to the update.
+	ied.eptp=vcpu->ept_manager->eptp.phys.value;
+	noir_vt_invept(ept_single_invd,&ied);
+	if(vcpu->ept_data_view)
+	{
+		if(nvc_ept_update_by_mtrr(vcpu->ept_data_view)==false)
+			nv_dprintf("Memory types of some pages in the data view are merged due to insufficient memory!\n");
+		ied.eptp=vcpu->ept_data_view->eptp.phys.value;
+		noir_vt_invept(ept_single_invd,&ied);
+	}
+}
+
 // Expected Exit Reason: 28
 // Filter unwanted behaviors.
 // Besides, we need to virtualize CR4.VMXE and CR4.SMXE here.
@@ -756,13 +911,8 @@ void static noir_hvcode fastcall nvc_vt_cr_access_handler(noir_gpr_state_p gpr_s
 						// The CR0.CD bit is being changed.
 						if(noir_bt((u32*)&data,ia32_cr0_cd)==0 && vcpu->mtrr_dirty)
 						{
-							invept_descriptor ied;
 							// Reset EPT entries.
-							nvc_ept_update_by_mtrr(vcpu->ept_manager);
-							// Flush EPT TLB due to the update.
-							ied.eptp=vcpu->ept_manager->eptp.phys.value;
-							ied.reserved=0;
-							noir_vt_invept(ept_single_invd,&ied);
+							nvc_vt_reset_ept_by_mtrr(vcpu);
 							// Mark this vCPU's MTRR is clean
 							vcpu->mtrr_dirty=0;
 						}
@@ -1037,13 +1187,8 @@ void static noir_hvcode fastcall nvc_vt_wrmsr_handler(noir_gpr_state_p gpr_state
 						vcpu->mtrr_dirty=1;
 					else
 					{
-						invept_descriptor ied;
 						// Reset EPT entries.
-						nvc_ept_update_by_mtrr(vcpu->ept_manager);
-						// Flush EPT TLB due to the update.
-						ied.eptp=vcpu->ept_manager->eptp.phys.value;
-						ied.reserved=0;
-						noir_vt_invept(ept_single_invd,&ied);
+						nvc_vt_reset_ept_by_mtrr(vcpu);
 					}
 				}
 				break;
@@ -1283,60 +1428,44 @@ void static noir_hvcode fastcall nvc_vt_ept_violation_handler(noir_gpr_state_p g
 	bool advance=true;
 	u64 gpa,gip;
 	ia32_ept_violation_qualification info;
-	noir_vt_vmread(vmexit_qualification,(ulong_ptr*)&info);
-	noir_vt_vmread64(guest_physical_address,&gpa);
+	info.value=(ulong_ptr)noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_qualification);
+	gpa=noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_gpa);
 	noir_vt_vmread(guest_rip,&gip);
+	if(info.write)
+	{
+		// Pages protected by Hardware-Enforced CI are read-only in EPT.
+		void* gva;
+		const u32 ci_action=noir_ci_verify_on_write_fault(gpa,&gva);
+		if(ci_action!=noir_ci_fault_not_protected)
+		{
+			if(ci_action==noir_ci_fault_corrupted)
+				nvd_printf("CI detected corruption in Page 0x%p on write fault! GPA=0x%llX, rip=0x%llX\n",gva,gpa,gip);
+			else if(ci_action==noir_ci_fault_restored)
+				nvd_printf("CI restored the corrupted Page 0x%p from its snapshot on write fault! GPA=0x%llX, rip=0x%llX\n",gva,gpa,gip);
+			else
+				nvd_printf("CI-event is intercepted! GPA=0x%llX, GVA=0x%p, rip=0x%llX\n",gpa,gva,gip);
+			// Discard the write by skipping the instruction.
+			noir_vt_advance_rip();
+			return;
+		}
+	}
 #if !defined(_hv_type1)
 	noir_ept_manager_p eptm=vcpu->ept_manager;
-	i32 lo=0,hi=noir_hook_pages_count;
 	bool is_stealth_hook=false;
-	noir_vt_vmread64(guest_physical_address,&gpa);
-	// We previously sorted the list.
-	// Use binary search to reduce time complexity.
-	while(hi>=lo)
+	// Hook pages are indexed by a hash table keyed on GPA pages.
+	const u32 index=nvc_ept_find_hook_page(vcpu->relative_hvm,gpa);
+	if(index!=maxu32)
 	{
-		i32 mid=(lo+hi)>>1;
-		noir_hook_page_p nhp=&eptm->hook_pages[mid];
-		if(gpa>=nhp->orig.phys+page_size)
-			lo=mid+1;
-		else if(gpa<nhp->orig.phys)
-			hi=mid-1;
-		else
+		// The violated page is found. Perform page-substitution
+		noir_hook_page_p nhp=&eptm->hook_pages[index];
+		ia32_ept_pte_p pte_p=(ia32_ept_pte_p)nhp->pte_descriptor;
+		// If the access is read or write, we should check if
+		// the instruction pointer is located in the same page
+		// to the data to be referenced.
+		const bool same_page=page_base(gip)==(ulong_ptr)nhp->orig.virt;
+		switch(nvc_ept_resolve_hook_violation(vcpu->ept_data_view!=null,(bool)info.execute,same_page))
 		{
-			// The violated page is found. Perform page-substitution
-			ia32_ept_pte_p pte_p=(ia32_ept_pte_p)nhp->pte_descriptor;
-			if(info.read || info.write)
-			{
-				// If the access is read or write, we should check if
-				// the instruction pointer is located in the same page
-				// to the data to be referenced.
-				ulong_ptr gip;
-				noir_vt_vmread(guest_rip,&gip);
-				if(page_base(gip)==(ulong_ptr)nhp->orig.virt)
-				{
-					ia32_vmx_priproc_controls proc_ctrl;
-					// They are in the same page. Grant all permissions
-					// and substitute the page to be original page.
-					pte_p->read=pte_p->write=pte_p->execute=1;
-					// Enable MTF at the same time.
-					noir_vt_vmread(primary_processor_based_vm_execution_controls,&proc_ctrl);
-					proc_ctrl.monitor_trap_flag=1;
-					noir_vt_vmwrite(primary_processor_based_vm_execution_controls,proc_ctrl.value);
-					// Indicate which hook page is pending to be stepped over.
-					eptm->pending_hook_index=mid;
-				}
-				else
-				{
-					// They are in different pages. We may grant the
-					// read/write permission but revoke execute permission
-					// and substitute the page to be original page.
-					pte_p->read=1;
-					pte_p->write=1;
-					pte_p->execute=0;
-				}
-				pte_p->page_offset=nhp->orig.phys>>page_shift;
-			}
-			else if(info.execute)
+			case noir_ept_hook_map_hook_page:
 			{
 				// If the access is execute, we grant
 				// execute permission but revoke read/write permission
@@ -1345,14 +1474,51 @@ void static noir_hvcode fastcall nvc_vt_ept_violation_handler(noir_gpr_state_p g
 				pte_p->write=0;
 				pte_p->execute=1;
 				pte_p->page_offset=nhp->hook.phys>>page_shift;
+				break;
+			}
+			case noir_ept_hook_map_orig_page:
+			{
+				// They are in different pages. We may grant the
+				// read/write permission but revoke execute permission
+				// and substitute the page to be original page.
+				pte_p->read=1;
+				pte_p->write=1;
+				pte_p->execute=0;
+				pte_p->page_offset=nhp->orig.phys>>page_shift;
+				break;
+			}
+			case noir_ept_hook_step_over:
+			{
+				ia32_vmx_priproc_controls proc_ctrl;
+				// They are in the same page. Grant all permissions
+				// and substitute the page to be original page.
+				pte_p->read=pte_p->write=pte_p->execute=1;
+				pte_p->page_offset=nhp->orig.phys>>page_shift;
+				// Enable MTF at the same time.
+				noir_vt_vmread(primary_processor_based_vm_execution_controls,&proc_ctrl);
+				proc_ctrl.monitor_trap_flag=1;
+				noir_vt_vmwrite(primary_processor_based_vm_execution_controls,proc_ctrl.value);
+				// Indicate which hook page is pending to be stepped over.
+				eptm->pending_hook_index=index;
+				break;
+			}
+			case noir_ept_hook_switch_to_hook_view:
+			{
+				// Both views have their own EP4TA. Switching the EPT pointer requires no invalidations.
+				noir_vt_vmwrite64(ept_pointer,eptm->eptp.phys.value);
+				break;
+			}
+			case noir_ept_hook_switch_to_data_view:
+			{
+				noir_vt_vmwrite64(ept_pointer,vcpu->ept_data_view->eptp.phys.value);
+				break;
 			}
-			is_stealth_hook=true;
-			advance=false;
-			// According to Intel SDM, an EPT Violation invalidates any guest-physical mappings (associated
-			// with the current EP4TA) that would be used to translate the GPA that caused EPT Violation.
-			// In other words, there is no need to invalidate the TLB via invept instruction.
-			break;
 		}
+		is_stealth_hook=true;
+		advance=false;
+		// According to Intel SDM, an EPT Violation invalidates any guest-physical mappings (associated
+		// with the current EP4TA) that would be used to translate the GPA that caused EPT Violation.
+		// In other words, there is no need to invalidate the TLB via invept instruction.
 	}
 	if(!is_stealth_hook && !info.execute)
 #endif
@@ -1436,7 +1602,7 @@ void static noir_hvcode fastcall nvc_vt_ept_misconfig_handler(noir_gpr_state_p g
 	ia32_addr_translator gpa;
 	noir_ept_pde_descriptor_p pde_p=vcpu->ept_manager->pde.head;
 	noir_ept_pte_descriptor_p pte_p=vcpu->ept_manager->pte.head;
-	noir_vt_vmread64(guest_physical_address,&gpa);
+	gpa.value=noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_gpa);
 	nvd_printf("EPT Misconfiguration is intercepted! GPA=0x%llX\n",gpa.value);
 	// Print the PDPTE, PDE and PTE for this page in order to debug.
 	nvd_printf("EPT PDPTE Entry: 0x%016llX\n",vcpu->ept_manager->pdpt.virt[(gpa.pml4e_offset<<page_shift_diff)|gpa.pdpte_offset].value);
@@ -1495,37 +1661,96 @@ void static noir_hvcode fastcall nvc_vt_xsetbv_handler(noir_gpr_state_p gpr_stat
 	}
 }
 
+#if defined(_hv_exit_trace)
+void static noir_hvcode nvc_vt_trace_exit(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,u32 processor,bool cvm_exit)
+{
+	noir_exit_trace_record_p record=nvc_begin_exit_trace(processor);
+	if(record)
+	{
+		record->vendor=noir_exit_trace_vendor_vmx;
+		record->flags=cvm_exit?noir_exit_trace_cvm_exit:0;
+		record->exit_code=vcpu->exit_cache.reason;
+		record->info[0]=noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_qualification);
+		record->info[1]=noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_gpa);
+		record->info[2]=noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_instruction_length);
+		record->info[3]=noir_vt_cached_vmread(vcpu,noir_vt_exit_cache_interruption_information);
+		noir_vt_vmread(guest_rip,&record->rip);
+		noir_vt_vmread(guest_rflags,&record->rflags);
+		noir_movsp(record->gpr,gpr_state,sizeof(void*)*2);
+		noir_vt_vmread(guest_rsp,&record->gpr[4]);
+		// VT-x does not fetch the instruction bytes. Read them from the host so that decoders can be replayed.
+		if(!cvm_exit)
+		{
+			u64 gcr3,gcr4,gcsb;
+			u8 ins_bytes[15];
+			u32 err=0;
+			size_t len=(size_t)record->info[2];
+			noir_vt_vmread(guest_cr3,&gcr3);
+			noir_vt_vmread(guest_cr4,&gcr4);
+			noir_vt_vmread(guest_cs_base,&gcsb);
+			// Instruction length is undefined for some VM-Exits. Read the maximum length of an instruction instead.
+			if(len==0 || len>sizeof(ins_bytes))len=sizeof(ins_bytes);
+			len=nvc_copy_host_virtual_memory64(gcr3,gcsb+record->rip,ins_bytes,len,false,noir_bt(&gcr4,ia32_cr4_la57),&err);
+			if(len)nvc_trace_exit_memory(record,gcsb+record->rip,ins_bytes,(u32)len);
+		}
+	}
+}
+#endif
+
 // It is important that this function uses fastcall convention.
 void noir_hvcode fastcall nvc_vt_exit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu)
 {
 	noir_vt_initial_stack_p loader_stack=(noir_vt_initial_stack_p)((ulong_ptr)vcpu->hv_stack+nvc_stack_size-sizeof(noir_vt_initial_stack));
-	u64 vmcs_phys;
+	noir_vt_custom_vcpu_p cvcpu=loader_stack->custom_vcpu;
 	u32 exit_reason;
 	noir_vt_vmread(vmexit_reason,&exit_reason);
 	exit_reason&=0xFFFF;
 	loader_stack->flags.initial_vmcs=false;
-	noir_vt_vmptrst(&vmcs_phys);
+	// Fields cached in the previous VM-Exit are stale.
+	vcpu->exit_cache.valid=0;
+	vcpu->exit_cache.reason=exit_reason;
+#if defined(_hv_exit_trace)
+	nvc_vt_trace_exit(gpr_state,vcpu,loader_stack->proc_id,cvcpu!=&nvc_vt_idle_cvcpu);
+#endif
+	// Profiler: Only a fraction of VM-Exits are timed in order to bound the overhead.
+	const bool sampled=(vcpu->exit_statistics.sequence++&noir_exit_profiler_sample_mask)==0;
+	const u64 profiler_tsc=sampled?noir_rdtsc():0;
 	// Confirm which vCPU is exiting so that the correct handler is to be invoked...
-	if(likely(vmcs_phys==vcpu->vmcs.phys))
+	// The loader stack tracks the current VMCS on world switches. There is no need to execute vmptrst.
+	if(likely(cvcpu==&nvc_vt_idle_cvcpu))
 	{
 		if(exit_reason<vmx_maximum_exit_reason)
+		{
 			vt_exit_handlers[exit_reason](gpr_state,vcpu);
+			nvc_record_exit_statistics(&vcpu->exit_statistics.reason[exit_reason],sampled,sampled?noir_rdtsc()-profiler_tsc:0);
+		}
 		else
 			nvc_vt_default_handler(gpr_state,vcpu);
 	}
-	else if(vmcs_phys==loader_stack->custom_vcpu->vmcs.phys)
+	else
 	{
-		noir_vt_custom_vcpu_p cvcpu=loader_stack->custom_vcpu;
+		const u64 profiler_time=noir_get_system_time();
+		// Profiler: Accumulate the Guest vCPU runtime.
+		nvc_cvm_profiler_enter(&cvcpu->header,profiler_time);
 		if(exit_reason<vmx_maximum_exit_reason)
 			vt_cvexit_handlers[exit_reason](gpr_state,vcpu,cvcpu);
 		else
 			nvc_vt_default_cvexit_handler(gpr_state,vcpu,cvcpu);
+		// The LAPIC timer and interrupts queued in the VPCB are delivered whenever the guest is resumed.
+		if(loader_stack->custom_vcpu==cvcpu)
+		{
+			nvc_vt_update_cvm_timer(cvcpu);
+			nvc_vt_deliver_queued_interrupts(cvcpu);
+		}
+		// Profiler: Classify the interception and accumulate the Hypervisor runtime.
+		nvc_cvm_profiler_classify(&cvcpu->header,loader_stack->custom_vcpu!=cvcpu);
+		nvc_cvm_profiler_leave(&cvcpu->header,profiler_time);
+		// Profiler: The latency includes the delivery of timer and queued interrupts.
+		if(exit_reason<vmx_maximum_exit_reason)
+			nvc_record_exit_statistics(&vcpu->exit_statistics.cvm_reason[exit_reason],sampled,sampled?noir_rdtsc()-profiler_tsc:0);
 	}
-	else
-	{
-		nv_dprintf("VM-Exit occured from an unexpected source! VMCS Physical Address=0x%llX, Exit Reason=%u\n",vmcs_phys,exit_reason);
-		noir_int3();
-	}
+#if defined(_vt_trace_injection)
+	// Define _vt_trace_injection to trace every event injection. This is expensive.
 	ia32_vmentry_interruption_information_field injection;
 	noir_vt_vmread(vmentry_interruption_information_field,&injection);
 	if(injection.valid)
@@ -1534,6 +1759,7 @@ void noir_hvcode fastcall nvc_vt_exit_handler(noir_gpr_state_p gpr_state,noir_vt
 		noir_vt_vmread(vmentry_exception_error_code,&err_code);
 		nvd_printf("Injecting Interrupt with Vector %u and Error-Code: 0x%X from VM-Exit Reason %u!\n",injection.vector,err_code,exit_reason);
 	}
+#endif
 	// Guest RIP is supposed to be advanced in specific handlers, not here.
 	// Do not execute vmresume here. It will be done as this function returns.
 }
@@ -1602,6 +1828,8 @@ void noir_hvcode fastcall nvc_vt_resume_failure(noir_gpr_state_p gpr_state,noir_
 		cvcpu->header.exit_context.intercept_code=cv_scheduler_bug;
 		// Switch to Host Context.
 		nvc_vt_switch_to_host_vcpu(gpr_state,vcpu);
+		// The VMCS failed to launch. Its state is not reliable anymore.
+		nvc_vt_clear_cvm_vmcs(cvcpu);
 	}
 }
 
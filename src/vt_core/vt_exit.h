@@ -19,8 +19,6 @@
 
 #include <nvdef.h>
 
-#define vmx_maximum_exit_reason		70
-
 typedef enum _vmx_vmexit_reason
 {
 	exception_nmi=0,
@@ -453,6 +451,9 @@ void static fastcall nvc_vt_vmcall_handler(noir_gpr_state_p gpr_state,noir_vt_vc
 void static fastcall nvc_vt_vmclear_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu);
 void static fastcall nvc_vt_vmptrld_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu);
 void static fastcall nvc_vt_vmptrst_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu);
+void static fastcall nvc_vt_vmentry_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu);
+void static fastcall nvc_vt_vmread_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu);
+void static fastcall nvc_vt_vmwrite_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu);
 void static fastcall nvc_vt_vmxoff_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu);
 void static fastcall nvc_vt_vmxon_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu);
 void static fastcall nvc_vt_cr_access_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu);
@@ -489,12 +490,12 @@ noir_hvdata noir_vt_exit_handler_routine vt_exit_handlers[vmx_maximum_exit_reaso
 	nvc_vt_default_handler,				// RSM Instruction
 	nvc_vt_vmcall_handler,				// VMCALL Instruction
 	nvc_vt_vmclear_handler,				// VMCLEAR Instruction
-	nvc_vt_default_handler,				// VMLAUNCH Instruction
+	nvc_vt_vmentry_handler,				// VMLAUNCH Instruction
 	nvc_vt_vmptrld_handler,				// VMPTRLD Instruction
 	nvc_vt_vmptrst_handler,				// VMPTRST Instruction
-	nvc_vt_default_handler,				// VMREAD Instruction
-	nvc_vt_default_handler,				// VMRESUME Instruction
-	nvc_vt_default_handler,				// VMWRITE Instruction
+	nvc_vt_vmread_handler,				// VMREAD Instruction
+	nvc_vt_vmentry_handler,				// VMRESUME Instruction
+	nvc_vt_vmwrite_handler,				// VMWRITE Instruction
 	nvc_vt_vmxoff_handler,				// VMXOFF Instruction
 	nvc_vt_vmxon_handler,				// VMXON Instruction
 	nvc_vt_cr_access_handler,			// Control-Register Access
@@ -571,6 +572,9 @@ void static fastcall nvc_vt_rdmsr_cvexit_handler(noir_gpr_state_p gpr_state,noir
 void static fastcall nvc_vt_wrmsr_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu);
 void static fastcall nvc_vt_invalid_guest_state_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu);
 void static fastcall nvc_vt_invalid_msr_loading_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu);
+void static fastcall nvc_vt_apic_access_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu);
+void static fastcall nvc_vt_apic_write_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu);
+void static fastcall nvc_vt_preemption_timer_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu);
 void static fastcall nvc_vt_ept_violation_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu);
 void static fastcall nvc_vt_ept_misconfig_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu);
 void static fastcall nvc_vt_invept_cvexit_handler(noir_gpr_state_p gpr_state,noir_vt_vcpu_p vcpu,noir_vt_custom_vcpu_p cvcpu);
@@ -623,7 +627,7 @@ noir_hvdata noir_vt_cvexit_handler_routine vt_cvexit_handlers[vmx_maximum_exit_r
 	nvc_vt_default_cvexit_handler,			// Machine-Check during VM-Entry
 	nvc_vt_default_cvexit_handler,			// Reserved (42)
 	nvc_vt_default_cvexit_handler,			// TPR Below Threshold
-	nvc_vt_default_cvexit_handler,			// APIC Access
+	nvc_vt_apic_access_cvexit_handler,		// APIC Access
 	nvc_vt_default_cvexit_handler,			// Virtualized EOI
 	nvc_vt_default_cvexit_handler,			// GDTR/IDTR Access
 	nvc_vt_default_cvexit_handler,			// LDTR/TR Access
@@ -631,11 +635,11 @@ noir_hvdata noir_vt_cvexit_handler_routine vt_cvexit_handlers[vmx_maximum_exit_r
 	nvc_vt_ept_misconfig_cvexit_handler,	// EPT Misconfiguration
 	nvc_vt_invept_cvexit_handler,			// INVEPT Instruction
 	nvc_vt_default_cvexit_handler,			// RDTSCP Instruction
-	nvc_vt_default_cvexit_handler,			// VMX-Preemption Timer Expiry
+	nvc_vt_preemption_timer_cvexit_handler,	// VMX-Preemption Timer Expiry
 	nvc_vt_invvpid_cvexit_handler,			// INVVPID Instruction
 	nvc_vt_default_cvexit_handler,			// WBINVD/WBNOINVD Instruction
 	nvc_vt_xsetbv_cvexit_handler,			// XSETBV Instruction
-	nvc_vt_default_cvexit_handler,			// APIC Write
+	nvc_vt_apic_write_cvexit_handler,		// APIC Write
 	nvc_vt_default_cvexit_handler,			// RDRAND Instruction
 	nvc_vt_default_cvexit_handler,			// INVPCID Instruction
 	nvc_vt_default_cvexit_handler,			// VMFUNC Instruction
@@ -692,6 +696,32 @@ void inline noir_hvcode noir_vt_advance_rip()
 	noir_vt_vmwrite(guest_rip,gip);
 }
 
+// Read a VM-Exit information field through the per-vCPU cache.
+// Each field is read by vmread at most once in a VM-Exit.
+u64 inline noir_hvcode noir_vt_cached_vmread(noir_vt_vcpu_p vcpu,u32 slot)
+{
+	if(!(vcpu->exit_cache.valid&(1<<slot)))
+	{
+		const u16 fields[noir_vt_exit_cache_slots]=
+		{
+			vmexit_qualification,guest_physical_address,guest_linear_address,
+			vmexit_instruction_length,vmexit_instruction_information,
+			vmexit_interruption_information,vmexit_interruption_error_code,
+			idt_vectoring_information
+		};
+		if(slot==noir_vt_exit_cache_gpa)
+			noir_vt_vmread64(guest_physical_address,&vcpu->exit_cache.value[slot]);
+		else
+		{
+			ulong_ptr value;
+			noir_vt_vmread(fields[slot],&value);
+			vcpu->exit_cache.value[slot]=value;
+		}
+		vcpu->exit_cache.valid|=1<<slot;
+	}
+	return vcpu->exit_cache.value[slot];
+}
+
 void inline noir_hvcode noir_vt_inject_event(u8 vector,u8 type,bool deliver,u32 length,u32 err_code)
 {
 	ia32_vmentry_interruption_information_field event_field;
@@ -38,6 +38,7 @@ void nvc_vt_iommu_enqueue_context_cache_invalidation(noir_dmar_iommu_bar_descrip
 	inval_d->context_cache.function_mask=function_mask;
 	// Enqueue.
 	tail.tail++;
+	if(tail.value==page_size)tail.value=0;
 	noir_mmio_write64((u64)bar->virt+mmio_offset_inval_queue_tail,tail.value);
 }
 
@@ -59,6 +60,7 @@ void nvc_vt_iommu_enqueue_iotlb_invalidation(noir_dmar_iommu_bar_descriptor_p ba
 	inval_d->iotlb.address=page_count(address);
 	// Enqueue.
 	tail.tail++;
+	if(tail.value==page_size)tail.value=0;
 	noir_mmio_write64((u64)bar->virt+mmio_offset_inval_queue_tail,tail.value);
 }
 
@@ -80,6 +82,7 @@ void nvc_vt_iommu_enqueue_device_tlb_invalidation(noir_dmar_iommu_bar_descriptor
 	inval_d->device_tlb.address=page_count(address);
 	// Enqueue.
 	tail.tail++;
+	if(tail.value==page_size)tail.value=0;
 	noir_mmio_write64((u64)bar->virt+mmio_offset_inval_queue_tail,tail.value);
 }
 
@@ -98,13 +101,13 @@ void nvc_vt_iommu_enqueue_intentry_cache_invalidation(noir_dmar_iommu_bar_descri
 	inval_d->intentry_cache.interrupt_index=interrupt_index;
 	// Enqueue.
 	tail.tail++;
+	if(tail.value==page_size)tail.value=0;
 	noir_mmio_write64((u64)bar->virt+mmio_offset_inval_queue_tail,tail.value);
 }
 
-void nvc_vt_iommu_wait_invalidation_queue(noir_dmar_iommu_bar_descriptor_p bar,bool interrupt,bool write_status,bool fence,bool drain_pagereq,u32 status_data,u64 status_address)
+void nvc_vt_iommu_enqueue_invalidation_wait(noir_dmar_iommu_bar_descriptor_p bar,bool interrupt,bool write_status,bool fence,bool drain_pagereq,u32 status_data,u64 status_address)
 {
 	// Get the tail.
-	intel_iommu_inval_queue_head_register head;
 	intel_iommu_inval_queue_tail_register tail={.value=noir_mmio_read64((u64)bar->virt+mmio_offset_inval_queue_tail)};
 	intel_iommu_queued_inval_legacy_descriptor_p inval_d;
 	if(tail.value==page_size)tail.value=0;
@@ -120,19 +123,39 @@ void nvc_vt_iommu_wait_invalidation_queue(noir_dmar_iommu_bar_descriptor_p bar,b
 	inval_d->inval_wait.status_address=status_address>>2;
 	// Enqueue.
 	tail.tail++;
+	if(tail.value==page_size)tail.value=0;
 	noir_mmio_write64((u64)bar->virt+mmio_offset_inval_queue_tail,tail.value);
-	// Wait for the hardware.
+}
+
+// Wait until the hardware consumes the queue up to the tail.
+noir_status static nvc_vt_iommu_poll_invalidation_queue(noir_dmar_iommu_bar_descriptor_p bar,intel_iommu_inval_queue_tail_register tail)
+{
+	intel_iommu_inval_queue_head_register head;
+	u32 polls=0;
 	do
 	{
 		noir_pause();
 		head.value=noir_mmio_read64((u64)bar->virt+mmio_offset_inval_queue_head);
-	}while(head.head!=tail.tail);
+	}while(head.head!=tail.tail && ++polls<noir_dmar_poll_limit);
+	if(head.head==tail.tail)return noir_success;
+	nv_dprintf("IOMMU at 0x%llX did not complete the Invalidation Queue! Head=0x%llX, Tail=0x%llX\n",bar->phys,head.value,tail.value);
+	return noir_hardware_error;
+}
+
+noir_status nvc_vt_iommu_wait_invalidation_queue(noir_dmar_iommu_bar_descriptor_p bar,bool interrupt,bool write_status,bool fence,bool drain_pagereq,u32 status_data,u64 status_address)
+{
+	intel_iommu_inval_queue_tail_register tail;
+	nvc_vt_iommu_enqueue_invalidation_wait(bar,interrupt,write_status,fence,drain_pagereq,status_data,status_address);
+	tail.value=noir_mmio_read64((u64)bar->virt+mmio_offset_inval_queue_tail);
+	// Wait for the hardware.
+	return nvc_vt_iommu_poll_invalidation_queue(bar,tail);
 }
 
-void nvc_vt_iommu_set_global_command(noir_dmar_iommu_bar_descriptor_p bar,u32 bit_position,bool value)
+noir_status nvc_vt_iommu_set_global_command(noir_dmar_iommu_bar_descriptor_p bar,u32 bit_position,bool value)
 {
 	u32v gcmd=noir_mmio_read32((u64)bar->virt+mmio_offset_global_status);
 	u32v gst;
+	u32 polls=0;
 	if(value)
 		noir_bts(&gcmd,bit_position);
 	else
@@ -142,12 +165,16 @@ void nvc_vt_iommu_set_global_command(noir_dmar_iommu_bar_descriptor_p bar,u32 bi
 	{
 		noir_pause();
 		gst=noir_mmio_read32((u64)bar->virt+mmio_offset_global_status);
-	}while(noir_bt(&gst,bit_position)!=value);
+	}while(noir_bt(&gst,bit_position)!=value && ++polls<noir_dmar_poll_limit);
+	if(noir_bt(&gst,bit_position)==value)return noir_success;
+	nv_dprintf("IOMMU at 0x%llX did not acknowledge Global Command bit %u!\n",bar->phys,bit_position);
+	return noir_hardware_error;
 }
 
-void nvc_vt_iommu_flush_context_cache(noir_dmar_iommu_bar_descriptor_p bar,u16 domain_id,u16 source_id,u8 function_mask,u8 request_granularity)
+noir_status nvc_vt_iommu_flush_context_cache(noir_dmar_iommu_bar_descriptor_p bar,u16 domain_id,u16 source_id,u8 function_mask,u8 request_granularity)
 {
 	intel_iommu_context_command_register ccmd;
+	u32 polls=0;
 	ccmd.value=0;
 	ccmd.domain_id=domain_id;
 	ccmd.source_id=source_id;
@@ -159,12 +186,16 @@ void nvc_vt_iommu_flush_context_cache(noir_dmar_iommu_bar_descriptor_p bar,u16 d
 	{
 		noir_pause();
 		ccmd.value=noir_mmio_read64((u64)bar->virt+mmio_offset_context_command);
-	}while(ccmd.inval_context_cache);
+	}while(ccmd.inval_context_cache && ++polls<noir_dmar_poll_limit);
+	if(ccmd.inval_context_cache==false)return noir_success;
+	nv_dprintf("IOMMU at 0x%llX did not complete the Context-Cache invalidation!\n",bar->phys);
+	return noir_hardware_error;
 }
 
-void nvc_vt_iommu_flush_iotlb(noir_dmar_iommu_bar_descriptor_p bar,u16 domain_id,bool drain_write,bool drain_read,u8 request_granularity,u64 address)
+noir_status nvc_vt_iommu_flush_iotlb(noir_dmar_iommu_bar_descriptor_p bar,u16 domain_id,bool drain_write,bool drain_read,u8 request_granularity,u64 address)
 {
 	intel_iommu_iotlb_inval_cmd_register icmd;
+	u32 polls=0;
 	icmd.value=0;
 	icmd.domain_id=domain_id;
 	icmd.drain_write=drain_write;
@@ -176,8 +207,213 @@ void nvc_vt_iommu_flush_iotlb(noir_dmar_iommu_bar_descriptor_p bar,u16 domain_id
 	do
 	{
 		noir_pause();
-		icmd.value=noir_mmio_read64((u64)bar->virt+bar->iotlb_reg_offset);
-	}while(icmd.inval_iotlb);
+		icmd.value=noir_mmio_read64((u64)bar->virt+bar->iotlb_reg_offset+mmio_offset_iotlb_inval_cmd);
+	}while(icmd.inval_iotlb && ++polls<noir_dmar_poll_limit);
+	if(icmd.inval_iotlb==false)return noir_success;
+	nv_dprintf("IOMMU at 0x%llX did not complete the IOTLB invalidation!\n",bar->phys);
+	return noir_hardware_error;
+}
+
+// NoirVisor's queue is shared by NoirVisor and the guest.
+void static nvc_vt_iommu_acquire_queue_lock(noir_dmar_iommu_bar_descriptor_p bar)
+{
+	while(noir_locked_cmpxchg(&bar->inval_queue.lock,1,0))noir_pause();
+}
+
+void static nvc_vt_iommu_release_queue_lock(noir_dmar_iommu_bar_descriptor_p bar)
+{
+	noir_locked_xchg(&bar->inval_queue.lock,0);
+}
+
+// Add a 4KiB page to the pending invalidations.
+// Buddy ranges are merged into an aligned range of twice the size, as long as all IOMMUs accept the address mask.
+void nvc_vt_iommu_queue_page_invalidation(noir_dmar_manager_p dmar_manager,u64 gpa)
+{
+	noir_dmar_inval_batch_p batch=&dmar_manager->inval_batch;
+	noir_dmar_inval_range range;
+	u8 mask_limit=0x3F;
+	bool merged;
+	range.address=page_4kb_base(gpa);
+	range.address_mask=0;
+	batch->submitted_pages++;
+	if(batch->overflow)return;
+	for(u64 i=0;i<dmar_manager->iommu_count;i++)
+		if(dmar_manager->bars[i].max_address_mask<mask_limit)
+			mask_limit=dmar_manager->bars[i].max_address_mask;
+	do
+	{
+		const u64 range_size=page_4kb_mult((u64)1<<range.address_mask);
+		merged=false;
+		for(u32 i=0;i<batch->count;i++)
+		{
+			noir_dmar_inval_range_p cur=&batch->ranges[i];
+			const u64 cur_size=page_4kb_mult((u64)1<<cur->address_mask);
+			if(cur->address_mask>=range.address_mask && range.address>=cur->address && range.address<cur->address+cur_size)
+				return;		// Already covered.
+			if(cur->address_mask<range.address_mask && cur->address>=range.address && cur->address<range.address+range_size)
+			{
+				// The new range covers this one. Remove it.
+				batch->ranges[i--]=batch->ranges[--batch->count];
+				continue;
+			}
+			if(cur->address_mask==range.address_mask && range.address_mask<mask_limit && (cur->address^range.address)==range_size)
+			{
+				// Merge with the buddy range.
+				range.address&=~range_size;
+				range.address_mask++;
+				batch->ranges[i]=batch->ranges[--batch->count];
+				merged=true;
+				break;
+			}
+		}
+	}while(merged);
+	if(batch->count<noir_dmar_inval_batch_limit)
+		batch->ranges[batch->count++]=range;
+	else
+		batch->overflow=true;
+}
+
+// Submit all pending invalidations to all IOMMUs, followed by one wait descriptor per IOMMU.
+// Every IOMMU is given its descriptors before NoirVisor waits for any of them.
+noir_status nvc_vt_iommu_commit_invalidations(noir_dmar_manager_p dmar_manager)
+{
+	noir_dmar_inval_batch_p batch=&dmar_manager->inval_batch;
+	noir_status st=noir_success;
+	if(batch->count==0 && batch->overflow==false)return noir_success;
+	for(u64 i=0;i<dmar_manager->iommu_count;i++)
+	{
+		noir_dmar_iommu_bar_descriptor_p bar=&dmar_manager->bars[i];
+		nvc_vt_iommu_acquire_queue_lock(bar);
+		if(batch->overflow || bar->page_selective==false)
+			nvc_vt_iommu_enqueue_iotlb_invalidation(bar,intel_iommu_iotlb_inval_domain,true,true,1,0,false,0);
+		else
+			for(u32 j=0;j<batch->count;j++)
+				nvc_vt_iommu_enqueue_iotlb_invalidation(bar,intel_iommu_iotlb_inval_page,true,true,1,batch->ranges[j].address_mask,false,batch->ranges[j].address);
+		bar->inval_queue.wait_status=0;
+		nvc_vt_iommu_enqueue_invalidation_wait(bar,false,true,true,false,1,bar->inval_queue.wait_status_phys);
+	}
+	for(u64 i=0;i<dmar_manager->iommu_count;i++)
+	{
+		u32 polls=0;
+		while(dmar_manager->bars[i].inval_queue.wait_status==0 && polls++<noir_dmar_poll_limit)
+			noir_pause();
+		if(dmar_manager->bars[i].inval_queue.wait_status==0)
+		{
+			nv_dprintf("IOMMU at 0x%llX did not complete the invalidations!\n",dmar_manager->bars[i].phys);
+			st=noir_hardware_error;
+		}
+		nvc_vt_iommu_release_queue_lock(&dmar_manager->bars[i]);
+	}
+	// Without batching, each range would require a wait for each IOMMU.
+	if(batch->overflow==false)batch->saved_waits+=(batch->count-1)*dmar_manager->iommu_count;
+	batch->submitted_batches++;
+	batch->count=0;
+	batch->overflow=false;
+	return st;
+}
+
+// Forward the pending descriptors in the guest's queue to NoirVisor's queue.
+// Descriptors are forwarded as-is because the DMA-Remapping is Identity-Map.
+// The caller must hold the queue lock.
+void static nvc_vt_iommu_sync_guest_queue(noir_dmar_iommu_bar_descriptor_p bar)
+{
+	intel_iommu_inval_queue_address_register iqa={.value=bar->inval_queue.guest.address};
+	const u64 queue_size=page_mult((u64)1<<iqa.queue_size);
+	if(bar->inval_queue.guest.view==null)
+	{
+		nvd_printf("The guest's Invalidation Queue (0x%llX) is not mapped! Descriptors are dropped!\n",page_mult(iqa.base));
+		bar->inval_queue.guest.head=bar->inval_queue.guest.tail;
+		return;
+	}
+	while(bar->inval_queue.guest.head!=bar->inval_queue.guest.tail)
+	{
+		intel_iommu_inval_queue_tail_register tail={.value=noir_mmio_read64((u64)bar->virt+mmio_offset_inval_queue_tail)};
+		intel_iommu_inval_queue_head_register head;
+		intel_iommu_fault_status_register fsts;
+		const u64 hv_start=tail.value;
+		u64 cur=bar->inval_queue.guest.head;
+		u32 polls=0;
+		// Leave one slot vacant in NoirVisor's queue. Otherwise, the tail would catch up the head.
+		for(u32 i=0;i<(page_size>>4)-1 && cur!=bar->inval_queue.guest.tail;i++)
+		{
+			intel_iommu_queued_inval_legacy_descriptor_p src=(intel_iommu_queued_inval_legacy_descriptor_p)((ulong_ptr)bar->inval_queue.guest.view+cur);
+			intel_iommu_queued_inval_legacy_descriptor_p dst=(intel_iommu_queued_inval_legacy_descriptor_p)((ulong_ptr)bar->inval_queue.hv_queue.virt+tail.value);
+			*dst=*src;
+			cur=(cur+sizeof(intel_iommu_queued_inval_legacy_descriptor))&(queue_size-1);
+			tail.value=(tail.value+sizeof(intel_iommu_queued_inval_legacy_descriptor))&(page_size-1);
+		}
+		noir_mmio_write64((u64)bar->virt+mmio_offset_inval_queue_tail,tail.value);
+		// Wait for the hardware. It stops at the faulting descriptor if the guest submitted an invalid one.
+		do
+		{
+			noir_pause();
+			head.value=noir_mmio_read64((u64)bar->virt+mmio_offset_inval_queue_head);
+			fsts.value=noir_mmio_read32((u64)bar->virt+mmio_offset_fault_status);
+		}while(head.value!=tail.value && fsts.inval_queue_error==false && ++polls<noir_dmar_poll_limit);
+		if(head.value!=tail.value && fsts.inval_queue_error==false)
+		{
+			// The hardware is stuck. Leave the guest's head so that the guest sees its descriptors pending.
+			nv_dprintf("IOMMU at 0x%llX did not complete the guest's invalidations!\n",bar->phys);
+			break;
+		}
+		if(head.value!=tail.value)
+		{
+			// Report the faulting descriptor at the same position in the guest's queue.
+			bar->inval_queue.guest.head=(bar->inval_queue.guest.head+((head.value-hv_start)&(page_size-1)))&(queue_size-1);
+			bar->inval_queue.guest.error=true;
+			break;
+		}
+		bar->inval_queue.guest.head=cur;
+	}
+}
+
+void static nvc_vt_iommu_set_guest_queue_address(noir_dmar_iommu_bar_descriptor_p bar,u64 value)
+{
+	intel_iommu_inval_queue_address_register iqa={.value=value};
+	const u64 queue_size=page_mult((u64)1<<iqa.queue_size);
+	bar->inval_queue.guest.address=value;
+	if(page_mult(iqa.base)==bar->inval_queue.guest.queue.phys && queue_size<=bar->inval_queue.guest.size)
+		bar->inval_queue.guest.view=bar->inval_queue.guest.queue.virt;
+	else
+		bar->inval_queue.guest.view=noir_find_virt_by_phys(page_mult(iqa.base));
+}
+
+// Invalidation Queue Registers are virtualized because NoirVisor owns the Invalidation Queue.
+u64 static nvc_vt_iommu_virtualize_inval_queue_register(noir_dmar_iommu_bar_descriptor_p bar,bool direction,u64 offset,u64 size,u64 value)
+{
+	const u64 shift=(offset&7)<<3;
+	const u64 mask=size==8?maxu64:(((u64)1<<(size<<3))-1);
+	u64 result=0;
+	nvc_vt_iommu_acquire_queue_lock(bar);
+	switch(offset&~7)
+	{
+		case mmio_offset_inval_queue_head:
+		{
+			// Invalidation Queue Head Register is read-only.
+			result=bar->inval_queue.guest.head;
+			break;
+		}
+		case mmio_offset_inval_queue_tail:
+		{
+			if(direction)
+			{
+				result=(bar->inval_queue.guest.tail&~(mask<<shift))|((value&mask)<<shift);
+				bar->inval_queue.guest.tail=result&0x7FFF0;
+				if(bar->inval_queue.guest.error==false)
+					nvc_vt_iommu_sync_guest_queue(bar);
+			}
+			result=bar->inval_queue.guest.tail;
+			break;
+		}
+		case mmio_offset_inval_queue_address:
+		{
+			if(direction)nvc_vt_iommu_set_guest_queue_address(bar,(bar->inval_queue.guest.address&~(mask<<shift))|((value&mask)<<shift));
+			result=bar->inval_queue.guest.address;
+			break;
+		}
+	}
+	nvc_vt_iommu_release_queue_lock(bar);
+	return (result>>shift)&mask;
 }
 
 // This handler routine will play the significant role of nested Intel VT-d.
@@ -186,9 +422,91 @@ void nvc_vt_iommu_region_rw_handler(bool direction,u64 address,u64 size,u64p val
 	noir_dmar_iommu_bar_descriptor_p bar=context;
 	const u64 offset=address-bar->phys;
 	const u64 addr=(u64)bar->virt+offset;
-	// FIXME: Current implementation is simply pass-through. We should virtualize IOMMU accesses.
-	nvd_printf("Intercepted IOMMU Access (%s)! Address=0x%llX (Offset=0x%llX), Access-Size=%llu\n",direction?"Write":"Read",address,offset,size);
-	if(direction)
+	if(offset>=mmio_offset_inval_queue_head && offset<mmio_offset_inval_queue_address+8 && size<=8)
+	{
+		u64 data=0;
+		if(direction)
+		{
+			switch(size)
+			{
+			case 1:
+				data=*(u8p)value;
+				break;
+			case 2:
+				data=*(u16p)value;
+				break;
+			case 4:
+				data=*(u32p)value;
+				break;
+			case 8:
+				data=*(u64p)value;
+				break;
+			}
+			nvc_vt_iommu_virtualize_inval_queue_register(bar,true,offset,size,data);
+		}
+		else
+		{
+			data=nvc_vt_iommu_virtualize_inval_queue_register(bar,false,offset,size,0);
+			switch(size)
+			{
+			case 1:
+				*(u8p)value=(u8)data;
+				break;
+			case 2:
+				*(u16p)value=(u16)data;
+				break;
+			case 4:
+				*(u32p)value=(u32)data;
+				break;
+			case 8:
+				*(u64p)value=data;
+				break;
+			}
+		}
+	}
+	else if(offset==mmio_offset_global_command && size==4 && direction)
+	{
+		// The Invalidation Queue must remain enabled for NoirVisor.
+		u32 cmd=*(u32p)value;
+		const bool enabled=noir_bt(&cmd,intel_iommu_global_queue_invalidation_enable);
+		nvc_vt_iommu_acquire_queue_lock(bar);
+		if(enabled!=bar->inval_queue.guest.enabled)
+		{
+			// The Invalidation Queue Head is reset if the guest toggles the queue.
+			bar->inval_queue.guest.enabled=enabled;
+			bar->inval_queue.guest.head=bar->inval_queue.guest.tail=0;
+			bar->inval_queue.guest.error=false;
+		}
+		nvc_vt_iommu_release_queue_lock(bar);
+		noir_bts(&cmd,intel_iommu_global_queue_invalidation_enable);
+		noir_mmio_write32(addr,cmd);
+	}
+	else if(offset==mmio_offset_global_status && size==4 && direction==false)
+	{
+		u32 gsts=noir_mmio_read32(addr);
+		if(bar->inval_queue.guest.enabled)
+			noir_bts(&gsts,intel_iommu_global_queue_invalidation_enable);
+		else
+			noir_btr(&gsts,intel_iommu_global_queue_invalidation_enable);
+		*(u32p)value=gsts;
+	}
+	else if(offset==mmio_offset_fault_status && size==4 && direction)
+	{
+		intel_iommu_fault_status_register fsts={.value=*(u32p)value};
+		nvc_vt_iommu_acquire_queue_lock(bar);
+		if(fsts.inval_queue_error && bar->inval_queue.guest.error)
+		{
+			// The guest has fixed the faulting descriptor. Discard the stale descriptors and forward again.
+			noir_mmio_write64((u64)bar->virt+mmio_offset_inval_queue_tail,noir_mmio_read64((u64)bar->virt+mmio_offset_inval_queue_head));
+			noir_mmio_write32(addr,fsts.value);
+			bar->inval_queue.guest.error=false;
+			nvc_vt_iommu_sync_guest_queue(bar);
+		}
+		else
+			noir_mmio_write32(addr,fsts.value);
+		nvc_vt_iommu_release_queue_lock(bar);
+	}
+	else if(direction)
 	{
 		// Emulate Write to IOMMU...
 		switch(size)
@@ -318,40 +636,61 @@ void nvc_vt_iommu_cleanup()
 	}
 }
 
+i32 static cdecl nvc_vt_iommu_compare_index_nodes(const void* a,const void* b)
+{
+	const noir_dmar_index_node_p na=(noir_dmar_index_node_p)a,nb=(noir_dmar_index_node_p)b;
+	if(na->gpa_start<nb->gpa_start)
+		return -1;
+	else if(na->gpa_start>nb->gpa_start)
+		return 1;
+	return 0;
+}
+
+i32 static cdecl nvc_vt_iommu_bst_search_index(avl_node_p node,const void* item)
+{
+	noir_dmar_index_node_p index=(noir_dmar_index_node_p)node;
+	u64 gpa_start=*(u64p)item;
+	if(gpa_start<index->gpa_start)
+		return -1;
+	else if(gpa_start>index->gpa_start)
+		return 1;
+	return 0;
+}
+
+void static nvc_vt_iommu_insert_index(noir_dmar_index_node_p *root,noir_dmar_index_node_p index)
+{
+	index->avl.left=index->avl.right=null;
+	index->avl.height=1;
+	*root=(noir_dmar_index_node_p)noir_insert_avl_node((avl_node_p)*root,(avl_node_p)index,nvc_vt_iommu_compare_index_nodes);
+}
+
+// Descriptors are searched by the base GPA of the range they cover, so the lookup is O(log n).
 noir_dmar_pml4e_descriptor_p nvc_vt_iommu_search_pml4e_descriptor(noir_dmar_manager_p dmar_manager,u64 gpa)
 {
+	u64 gpa_start=page_256tb_base(gpa);
 	if(dmar_manager->minimum_features.using_agaw<=intel_iommu_context_agaw_48_bit)
 		return null;
-	for(noir_dmar_pml4e_descriptor_p cur=dmar_manager->pml4.head;cur;cur=cur->next)
-		if(gpa>=cur->gpa_start && gpa<cur->gpa_start+page_256tb_size)
-			return cur;
-	return null;
+	return (noir_dmar_pml4e_descriptor_p)noir_search_avl_node((avl_node_p)dmar_manager->pml4.root,&gpa_start,nvc_vt_iommu_bst_search_index);
 }
 
 noir_dmar_pdpte_descriptor_p nvc_vt_iommu_search_pdpte_descriptor(noir_dmar_manager_p dmar_manager,u64 gpa)
 {
+	u64 gpa_start=page_512gb_base(gpa);
 	if(dmar_manager->minimum_features.using_agaw<=intel_iommu_context_agaw_39_bit)
 		return null;
-	for(noir_dmar_pdpte_descriptor_p cur=dmar_manager->pdpte.head;cur;cur=cur->next)
-		if(gpa>=cur->gpa_start && gpa<cur->gpa_start+page_512gb_size)
-			return cur;
-	return null;
+	return (noir_dmar_pdpte_descriptor_p)noir_search_avl_node((avl_node_p)dmar_manager->pdpte.root,&gpa_start,nvc_vt_iommu_bst_search_index);
 }
 
 noir_dmar_pde_descriptor_p nvc_vt_iommu_search_pde_descriptor(noir_dmar_manager_p dmar_manager,u64 gpa)
 {
-	for(noir_dmar_pde_descriptor_p cur=dmar_manager->pde.head;cur;cur=cur->next)
-		if(gpa>=cur->gpa_start && gpa<cur->gpa_start+page_1gb_size)
-			return cur;
-	return null;
+	u64 gpa_start=page_1gb_base(gpa);
+	return (noir_dmar_pde_descriptor_p)noir_search_avl_node((avl_node_p)dmar_manager->pde.root,&gpa_start,nvc_vt_iommu_bst_search_index);
 }
 
 noir_dmar_pte_descriptor_p nvc_vt_iommu_search_pte_descriptor(noir_dmar_manager_p dmar_manager,u64 gpa)
 {
-	for(noir_dmar_pte_descriptor_p cur=dmar_manager->pte.head;cur;cur=cur->next)
-		if(gpa>=cur->gpa_start && gpa<cur->gpa_start+page_2mb_size)
-			return cur;
-	return null;
+	u64 gpa_start=page_2mb_base(gpa);
+	return (noir_dmar_pte_descriptor_p)noir_search_avl_node((avl_node_p)dmar_manager->pte.root,&gpa_start,nvc_vt_iommu_bst_search_index);
 }
 
 // This will create a PML4E table that covers 256TiB range.
@@ -376,20 +715,21 @@ noir_status nvc_vt_iommu_create_512gb_page_map(noir_dmar_manager_p dmar_manager,
 		pml4e_p=noir_alloc_nonpg_memory(sizeof(noir_dmar_pml4e_descriptor));
 		if(pml4e_p)
 		{
-			pml4e_p->virt=noir_alloc_contd_memory(sizeof(page_size));
+			pml4e_p->virt=noir_alloc_contd_memory(page_size);
 			if(pml4e_p->virt==null)
 				noir_free_nonpg_memory(pml4e_p);
 			else
 			{
 				// Setup PML4E descriptor.
 				pml4e_p->phys=noir_get_physical_address(pml4e_p->virt);
-				pml4e_p->gpa_start=page_256tb_base(gpa);
-				// Append to linked-list.
+				pml4e_p->index.gpa_start=page_256tb_base(gpa);
+				// Append to linked-list and index.
 				if(dmar_manager->pml4.head)
 					dmar_manager->pml4.tail->next=pml4e_p;
 				else
 					dmar_manager->pml4.head=pml4e_p;
 				dmar_manager->pml4.tail=pml4e_p;
+				nvc_vt_iommu_insert_index(&dmar_manager->pml4.root,&pml4e_p->index);
 				// Setup upper-level mapping.
 				if(dmar_manager->minimum_features.using_agaw==intel_iommu_context_agaw_57_bit)
 				{
@@ -417,22 +757,12 @@ noir_status nvc_vt_iommu_create_512gb_page_map(noir_dmar_manager_p dmar_manager,
 
 // This will create a PDPTE table that covers 512GiB range.
 // This also splits upper PML4E structures, if applicable.
-noir_status nvc_vt_iommu_create_1gb_page_map(noir_dmar_manager_p dmar_manager,u64 gpa,bool huge,noir_dmar_pdpte_descriptor_p *descriptor)
+noir_status nvc_vt_iommu_create_1gb_page_map(noir_dmar_manager_p dmar_manager,u64 gpa,noir_dmar_pdpte_descriptor_p *descriptor)
 {
 	noir_status st=noir_insufficient_resources;
 	// Note that PDPTE can be top-level of paging structure.
 	if(dmar_manager->minimum_features.using_agaw==intel_iommu_context_agaw_39_bit)
 	{
-		if(huge)
-		{
-			intel_iommu_stage2_huge_pdpte_p pdpte_p=dmar_manager->pdpte.huge;
-			// Set-up Identity-Mapping if this PDPTE is created to map huge pages.
-			for(u32 i=0;i<page_table_entries64;i++)
-			{
-				pdpte_p[i].read=pdpte_p[i].write=pdpte_p[i].execute=pdpte_p[i].huge_page=true;
-				pdpte_p[i].page_ptr=page_1gb_count(gpa)+i;
-			}
-		}
 		*descriptor=null;
 		st=noir_success;
 	}
@@ -459,22 +789,14 @@ noir_status nvc_vt_iommu_create_1gb_page_map(noir_dmar_manager_p dmar_manager,u6
 				{
 					// Setup PDPTE descriptor.
 					pdpte_p->phys=noir_get_physical_address(pdpte_p->virt);
-					pdpte_p->gpa_start=page_512gb_base(gpa);
-					// Append to linked-list.
+					pdpte_p->index.gpa_start=page_512gb_base(gpa);
+					// Append to linked-list and index.
 					if(dmar_manager->pdpte.head)
 						dmar_manager->pdpte.tail->next=pdpte_p;
 					else
 						dmar_manager->pdpte.head=pdpte_p;
 					dmar_manager->pdpte.tail=pdpte_p;
-					if(huge)
-					{
-						// Set-up Identity-Mapping if this PDPTE is created to map huge pages.
-						for(u32 i=0;i<page_table_entries64;i++)
-						{
-							pdpte_p->huge[i].read=pdpte_p->huge[i].write=pdpte_p->huge[i].execute=pdpte_p->huge[i].huge_page=true;
-							pdpte_p->huge[i].page_ptr=page_1gb_count(pdpte_p->gpa_start)+i;
-						}
-					}
+					nvc_vt_iommu_insert_index(&dmar_manager->pdpte.root,&pdpte_p->index);
 					// Set-up upper-level mapping.
 					if(dmar_manager->minimum_features.using_agaw==intel_iommu_context_agaw_48_bit)
 					{
@@ -509,8 +831,8 @@ noir_status nvc_vt_iommu_create_1gb_page_map(noir_dmar_manager_p dmar_manager,u6
 }
 
 // This will create a PDE table that covers 1GiB range.
-// This also splits upper PDPTE structures.
-noir_status nvc_vt_iommu_create_2mb_page_map(noir_dmar_manager_p dmar_manager,u64 gpa,bool large,noir_dmar_pde_descriptor_p *descriptor)
+// If the range is mapped by a huge page, the huge page is split into large pages.
+noir_status nvc_vt_iommu_create_2mb_page_map(noir_dmar_manager_p dmar_manager,u64 gpa,noir_dmar_pde_descriptor_p *descriptor)
 {
 	noir_status st=noir_insufficient_resources;
 	noir_dmar_pde_descriptor_p pde_p=nvc_vt_iommu_search_pde_descriptor(dmar_manager,gpa);
@@ -529,51 +851,43 @@ noir_status nvc_vt_iommu_create_2mb_page_map(noir_dmar_manager_p dmar_manager,u6
 		{
 			// Locate the PDPTE descriptor to update PDPTE.
 			noir_dmar_pdpte_descriptor_p pdpte_p;
-			st=nvc_vt_iommu_create_1gb_page_map(dmar_manager,gpa,true,&pdpte_p);
+			st=nvc_vt_iommu_create_1gb_page_map(dmar_manager,gpa,&pdpte_p);
 			if(st==noir_success)
 			{
+				// PDPTE is the top-level if no descriptors can be found.
+				intel_iommu_stage2_huge_pdpte_p huge_p=pdpte_p?pdpte_p->huge:dmar_manager->pdpte.huge;
+				intel_iommu_stage2_pdpte_p upper_p;
+				ia32_addr_translator gat;
+				gat.value=gpa;
+				huge_p+=gat.pdpte_offset;
+				upper_p=(intel_iommu_stage2_pdpte_p)huge_p;
 				// Setup PDE descriptor.
 				pde_p->phys=noir_get_physical_address(pde_p->virt);
-				pde_p->gpa_start=page_1gb_base(gpa);
-				// Append to linked-list.
+				pde_p->index.gpa_start=page_1gb_base(gpa);
+				// Append to linked-list and index.
 				if(dmar_manager->pde.head)
 					dmar_manager->pde.tail->next=pde_p;
 				else
 					dmar_manager->pde.head=pde_p;
 				dmar_manager->pde.tail=pde_p;
-				if(large)
+				nvc_vt_iommu_insert_index(&dmar_manager->pde.root,&pde_p->index);
+				if(huge_p->huge_page)
 				{
-					// Set-up Identity-Mapping if this PDE is created to map large pages.
+					// Split the huge page. Large pages inherit the permissions.
 					for(u32 i=0;i<page_table_entries64;i++)
 					{
-						pde_p->large[i].read=pde_p->large[i].write=pde_p->large[i].execute=pde_p->large[i].large_page=true;
-						pde_p->large[i].page_ptr=page_2mb_count(pde_p->gpa_start)+i;
+						pde_p->large[i].read=huge_p->read;
+						pde_p->large[i].write=huge_p->write;
+						pde_p->large[i].execute=huge_p->execute;
+						pde_p->large[i].large_page=true;
+						pde_p->large[i].page_ptr=page_2mb_count(pde_p->index.gpa_start)+i;
 					}
 				}
 				// Set-up upper-level mapping.
-				if(dmar_manager->minimum_features.using_agaw==intel_iommu_context_agaw_39_bit)
-				{
-					// PDPTE is the top-level. No descriptors can be found.
-					intel_iommu_stage2_pdpte_p pdpte_p=dmar_manager->pdpte.virt;	// Note that this is a shadowed variable.
-					ia32_addr_translator gat;
-					gat.value=gpa;
-					pdpte_p[gat.pdpte_offset].read=pdpte_p[gat.pdpte_offset].write=pdpte_p[gat.pdpte_offset].execute=true;
-					pdpte_p[gat.pdpte_offset].huge_page=false;
-					pdpte_p[gat.pdpte_offset].pde_ptr=page_count(pde_p->phys);
-					*descriptor=pde_p;
-					st=noir_success;
-				}
-				else
-				{
-					// PDPTE is not the top-level. Find the descriptor.
-					ia32_addr_translator gat;
-					gat.value=gpa;
-					pdpte_p->virt[gat.pdpte_offset].read=pdpte_p->virt[gat.pdpte_offset].write=pdpte_p->virt[gat.pdpte_offset].execute=true;
-					pdpte_p->virt[gat.pdpte_offset].huge_page=false;
-					pdpte_p->virt[gat.pdpte_offset].pde_ptr=page_count(pde_p->phys);
-					*descriptor=pde_p;
-					st=noir_success;
-				}
+				upper_p->value=0;
+				upper_p->read=upper_p->write=upper_p->execute=true;
+				upper_p->pde_ptr=page_count(pde_p->phys);
+				*descriptor=pde_p;
 			}
 			else
 			{
@@ -586,7 +900,7 @@ noir_status nvc_vt_iommu_create_2mb_page_map(noir_dmar_manager_p dmar_manager,u6
 }
 
 // This will create a PTE table that covers 2MiB range.
-// This also splits upper PDE structures.
+// If the range is mapped by a large page, the large page is split into 4KiB pages.
 noir_status nvc_vt_iommu_create_4kb_page_map(noir_dmar_manager_p dmar_manager,u64 gpa,noir_dmar_pte_descriptor_p *descriptor)
 {
 	noir_status st=noir_insufficient_resources;
@@ -606,29 +920,37 @@ noir_status nvc_vt_iommu_create_4kb_page_map(noir_dmar_manager_p dmar_manager,u6
 		{
 			// Locate the PDE descriptor to update PDE.
 			noir_dmar_pde_descriptor_p pde_p;
-			st=nvc_vt_iommu_create_2mb_page_map(dmar_manager,gpa,true,&pde_p);
+			st=nvc_vt_iommu_create_2mb_page_map(dmar_manager,gpa,&pde_p);
 			if(st==noir_success)
 			{
+				ia32_addr_translator gat;
+				intel_iommu_stage2_large_pde_p large_p;
+				gat.value=gpa;
+				large_p=&pde_p->large[gat.pde_offset];
 				// Setup PTE descriptor.
 				pte_p->phys=noir_get_physical_address(pte_p->virt);
-				pte_p->gpa_start=page_2mb_base(gpa);
-				// Append to linked-list.
+				pte_p->index.gpa_start=page_2mb_base(gpa);
+				// Append to linked-list and index.
 				if(dmar_manager->pte.head)
 					dmar_manager->pte.tail->next=pte_p;
 				else
 					dmar_manager->pte.head=pte_p;
 				dmar_manager->pte.tail=pte_p;
-				// Set-up Identity-Mapping.
-				for(u32 i=0;i<page_table_entries64;i++)
+				nvc_vt_iommu_insert_index(&dmar_manager->pte.root,&pte_p->index);
+				if(large_p->large_page)
 				{
-					pte_p->virt[i].read=pte_p->virt[i].write=pte_p->virt[i].execute=true;
-					pte_p->virt[i].page_ptr=page_4kb_count(pte_p->gpa_start)+i;
+					// Split the large page. 4KiB pages inherit the permissions.
+					for(u32 i=0;i<page_table_entries64;i++)
+					{
+						pte_p->virt[i].read=large_p->read;
+						pte_p->virt[i].write=large_p->write;
+						pte_p->virt[i].execute=large_p->execute;
+						pte_p->virt[i].page_ptr=page_4kb_count(pte_p->index.gpa_start)+i;
+					}
 				}
 				// Set-up upper-level mapping.
-				ia32_addr_translator gat;
-				gat.value=gpa;
+				pde_p->virt[gat.pde_offset].value=0;
 				pde_p->virt[gat.pde_offset].read=pde_p->virt[gat.pde_offset].write=pde_p->virt[gat.pde_offset].execute=true;
-				pde_p->virt[gat.pde_offset].large_page=false;
 				pde_p->virt[gat.pde_offset].pte_ptr=page_count(pte_p->phys);
 				*descriptor=pte_p;
 			}
@@ -653,18 +975,9 @@ noir_status nvc_vt_iommu_update_pte(noir_dmar_manager_p dmar_manager,u64 gpa,u64
 		pte_p->virt[gat.pte_offset].write=w;
 		pte_p->virt[gat.pte_offset].execute=x;
 		pte_p->virt[gat.pte_offset].page_ptr=page_count(hpa);
-	}
-	return st;
-}
-
-noir_status nvc_vt_iommu_initialize_ci(noir_dmar_manager_p dmar_manager)
-{
-	noir_status st=noir_success;
-	for(u32 i=0;i<noir_ci->pages;i++)
-	{
-		u64 phys=noir_ci->page_ci[i].phys;
-		st=nvc_vt_iommu_update_pte(dmar_manager,phys,phys,false,false,false);
-		if(st!=noir_success)break;
+		// Caller is supposed to commit the invalidations after all updates.
+		if(dmar_manager->minimum_features.active)
+			nvc_vt_iommu_queue_page_invalidation(dmar_manager,gpa);
 	}
 	return st;
 }
@@ -705,44 +1018,248 @@ noir_status nvc_vt_iommu_register_mmio_region(noir_dmar_manager_p dmar_manager)
   not build the identity map in the same way as Intel EPT/AMD-V NPT. For
   example, VMware's IOMMU does not support 2MiB pages. The memory consumption
   could be ridiculously high if we try to cover the entire memory space.
-  Hence, we just need to cover the physical RAM instead.
+  Devices may access MMIO and firmware-reserved ranges (e.g: RMRRs) as well.
+  64-bit BARs are usually placed above the top of RAM, up to the highest
+  physical address. Hence:
+  If 1GiB pages are supported, the whole physical address space is covered.
+  If only 2MiB pages are supported, the lower 512GiB (or the RAM, if higher)
+  are covered, as is in NPT. Each GiB costs a 4KiB page table.
+  Otherwise, the physical RAM and the lowest 4GiB are covered.
 */
-void nvc_vt_iommu_add_ram_region(u64 start,u64 length,void* context)
+// The physical address space is limited by both the processor and the IOMMU.
+u64 static nvc_vt_iommu_address_limit(noir_dmar_manager_p dmar_manager)
 {
-	noir_dmar_manager_p dmarm=(noir_dmar_manager_p)context;
-	// Determine the increment based on largest supported page size.
-	const u64 increment=dmarm->minimum_features.huge_page?page_1gb_size:dmarm->minimum_features.large_page?page_2mb_size:page_4kb_size;
-	for(u64 i=0;i<length;i+=increment)
+	u32 a,width;
+	noir_cpuid(ia32_cpuid_ext_pcap_prm_eid,0,&a,null,null,null);
+	width=30+9*dmar_manager->minimum_features.using_agaw;
+	// Leaf 0x80000008 may be unavailable, in which case the width is reported as zero.
+	if((a&0xff) && (a&0xff)<width)width=a&0xff;
+	return (u64)1<<width;
+}
+
+void static nvc_vt_iommu_count_ram_region(u64 start,u64 length,void* context)
+{
+	noir_dmar_layout_planner_p planner=(noir_dmar_layout_planner_p)context;
+	planner->limit++;
+}
+
+void static nvc_vt_iommu_add_ram_region(u64 start,u64 length,void* context)
+{
+	noir_dmar_layout_planner_p planner=(noir_dmar_layout_planner_p)context;
+	// Memory ranges are enumerated twice. Do not overflow in case the ranges changed.
+	if(planner->count<planner->limit)
 	{
-		noir_status st;
-		switch(increment)
+		planner->ranges[planner->count].start=start;
+		planner->ranges[planner->count].end=start+length;
+		planner->count++;
+	}
+}
+
+i32 static cdecl nvc_vt_iommu_compare_ram_ranges(const void* a,const void* b)
+{
+	const noir_dmar_ram_range_p ra=(noir_dmar_ram_range_p)a,rb=(noir_dmar_ram_range_p)b;
+	if(ra->start<rb->start)
+		return -1;
+	else if(ra->start>rb->start)
+		return 1;
+	return 0;
+}
+
+i32 static cdecl nvc_vt_iommu_compare_pages(const void* a,const void* b)
+{
+	const u64 pa=*(u64p)a,pb=*(u64p)b;
+	if(pa<pb)
+		return -1;
+	else if(pa>pb)
+		return 1;
+	return 0;
+}
+
+noir_status static nvc_vt_iommu_map_identity_leaf(noir_dmar_manager_p dmar_manager,u64 gpa,u64 size)
+{
+	noir_status st=noir_invalid_parameter;
+	ia32_addr_translator gat;
+	gat.value=gpa;
+	switch(size)
+	{
+		case page_1gb_size:
 		{
-			case page_4kb_size:
+			noir_dmar_pdpte_descriptor_p pdpte_p;
+			st=nvc_vt_iommu_create_1gb_page_map(dmar_manager,gpa,&pdpte_p);
+			if(st==noir_success)
 			{
-				noir_dmar_pte_descriptor_p pte_p;
-				st=nvc_vt_iommu_create_4kb_page_map(dmarm,start+i,&pte_p);
-				break;
+				intel_iommu_stage2_huge_pdpte_p huge_p=pdpte_p?pdpte_p->huge:dmar_manager->pdpte.huge;
+				huge_p[gat.pdpte_offset].read=huge_p[gat.pdpte_offset].write=huge_p[gat.pdpte_offset].execute=huge_p[gat.pdpte_offset].huge_page=true;
+				huge_p[gat.pdpte_offset].page_ptr=page_1gb_count(gpa);
 			}
-			case page_2mb_size:
+			break;
+		}
+		case page_2mb_size:
+		{
+			noir_dmar_pde_descriptor_p pde_p;
+			st=nvc_vt_iommu_create_2mb_page_map(dmar_manager,gpa,&pde_p);
+			if(st==noir_success)
 			{
-				noir_dmar_pde_descriptor_p pde_p;
-				st=nvc_vt_iommu_create_2mb_page_map(dmarm,start+i,true,&pde_p);
-				break;
+				pde_p->large[gat.pde_offset].read=pde_p->large[gat.pde_offset].write=pde_p->large[gat.pde_offset].execute=pde_p->large[gat.pde_offset].large_page=true;
+				pde_p->large[gat.pde_offset].page_ptr=page_2mb_count(gpa);
 			}
-			case page_1gb_size:
+			break;
+		}
+		case page_4kb_size:
+		{
+			noir_dmar_pte_descriptor_p pte_p;
+			st=nvc_vt_iommu_create_4kb_page_map(dmar_manager,gpa,&pte_p);
+			if(st==noir_success)
 			{
-				noir_dmar_pdpte_descriptor_p pdpte_p;
-				st=nvc_vt_iommu_create_1gb_page_map(dmarm,start+i,true,&pdpte_p);
-				break;
+				pte_p->virt[gat.pte_offset].read=pte_p->virt[gat.pte_offset].write=pte_p->virt[gat.pte_offset].execute=true;
+				pte_p->virt[gat.pte_offset].page_ptr=page_4kb_count(gpa);
 			}
+			break;
+		}
+	}
+	return st;
+}
+
+/*
+  Planning the Identity Map:
+
+  The layout is computed before any table is built. RAM ranges are sorted
+  and merged, and the pages protected by Code-Integrity are subtracted.
+  Each aligned chunk is then mapped with the largest page that the IOMMU
+  hardware supports and that contains no protected page. Chunks are emitted
+  in ascending order, so no page is mapped and split afterwards.
+
+  Protected pages are left non-present, which denies all DMA accesses.
+*/
+noir_status nvc_vt_iommu_build_identity_map(noir_dmar_manager_p dmar_manager)
+{
+	noir_status st=noir_insufficient_resources;
+	noir_dmar_layout_planner planner={0};
+	// Pass I: Collect the RAM ranges. Reserve one more range for the lowest 4GiB.
+	noir_enum_physical_memory_ranges(nvc_vt_iommu_count_ram_region,&planner);
+	planner.ranges=noir_alloc_nonpg_memory(++planner.limit*sizeof(noir_dmar_ram_range));
+	if(planner.ranges==null)goto cleanup;
+	// The lowest 4GiB contains MMIO and firmware-reserved ranges.
+	planner.ranges[0].start=0;
+	planner.ranges[0].end=0x100000000;
+	planner.count=1;
+	noir_enum_physical_memory_ranges(nvc_vt_iommu_add_ram_region,&planner);
+	// Pass II: Sort and merge the RAM ranges.
+	noir_qsort(planner.ranges,planner.count,sizeof(noir_dmar_ram_range),nvc_vt_iommu_compare_ram_ranges);
+	if(planner.count)
+	{
+		u32 merged=0;
+		for(u32 i=1;i<planner.count;i++)
+		{
+			if(planner.ranges[i].start<=planner.ranges[merged].end)
+			{
+				if(planner.ranges[i].end>planner.ranges[merged].end)
+					planner.ranges[merged].end=planner.ranges[i].end;
+			}
+			else
+				planner.ranges[++merged]=planner.ranges[i];
+		}
+		planner.count=merged+1;
+	}
+	// If large pages are supported, cover the holes and the MMIO above the top of RAM as well.
+	if(dmar_manager->minimum_features.huge_page || dmar_manager->minimum_features.large_page)
+	{
+		const u64 ram_top=bytes_span_1gb_pages(planner.ranges[planner.count-1].end);
+		u64 limit=nvc_vt_iommu_address_limit(dmar_manager);
+		if(dmar_manager->minimum_features.huge_page==false && limit>page_512gb_size)limit=page_512gb_size;
+		planner.ranges[0].end=ram_top>limit?ram_top:limit;
+		planner.count=1;
+	}
+	// Pass III: Collect the protected pages in ascending order.
+	if(noir_ci)
+	{
+		planner.protected_pages=noir_alloc_nonpg_memory(noir_ci->pages*sizeof(u64));
+		if(planner.protected_pages==null && noir_ci->pages)goto cleanup;
+		for(u32 i=0;i<noir_ci->pages;i++)
+			planner.protected_pages[i]=page_4kb_base(noir_ci->page_ci[i].phys);
+		planner.protected_count=noir_ci->pages;
+		noir_qsort(planner.protected_pages,planner.protected_count,sizeof(u64),nvc_vt_iommu_compare_pages);
+	}
+	// Pass IV: Emit the leaves in ascending order.
+	st=noir_success;
+	for(u32 i=0,j=0;i<planner.count && st==noir_success;i++)
+	{
+		const u64 end=page_4kb_base(planner.ranges[i].end);
+		u64 gpa=page_4kb_base(planner.ranges[i].start+page_4kb_size-1);
+		while(gpa<end && st==noir_success)
+		{
+			u64 size=page_4kb_size;
+			// Skip the protected pages below this chunk. Check if this chunk has protected pages.
+			while(j<planner.protected_count && planner.protected_pages[j]<gpa)j++;
+			if(dmar_manager->minimum_features.huge_page && page_1gb_offset(gpa)==0 && gpa+page_1gb_size<=end)
+				if(j>=planner.protected_count || planner.protected_pages[j]>=gpa+page_1gb_size)
+					size=page_1gb_size;
+			if(size==page_4kb_size && dmar_manager->minimum_features.large_page && page_2mb_offset(gpa)==0 && gpa+page_2mb_size<=end)
+				if(j>=planner.protected_count || planner.protected_pages[j]>=gpa+page_2mb_size)
+					size=page_2mb_size;
+			if(size==page_4kb_size && j<planner.protected_count && planner.protected_pages[j]==gpa)
+				planner.leaves.excluded++;
+			else
+			{
+				st=nvc_vt_iommu_map_identity_leaf(dmar_manager,gpa,size);
+				if(size==page_1gb_size)
+					planner.leaves.huge++;
+				else if(size==page_2mb_size)
+					planner.leaves.large++;
+				else
+					planner.leaves.small++;
+			}
+			gpa+=size;
 		}
 	}
+	nv_dprintf("IOMMU Identity Map: %u ranges, %llu 1GiB pages, %llu 2MiB pages, %llu 4KiB pages, %llu protected pages excluded.\n",planner.count,planner.leaves.huge,planner.leaves.large,planner.leaves.small,planner.leaves.excluded);
+cleanup:
+	if(planner.ranges)noir_free_nonpg_memory(planner.ranges);
+	if(planner.protected_pages)noir_free_nonpg_memory(planner.protected_pages);
+	return st;
 }
 
 // IOMMU Initialization follows a three-pass procedure.
 // First pass will enumerate all IOMMU hardware and check their features.
 // Second pass will setup optimized page tables.
 // Third pass will activate DMA Remapping on all IOMMU Hardware.
+// DMA must not reach the structures that NoirVisor relies on to remap DMA.
+// Page tables created by splitting the large pages are appended to the lists, so they are protected as well.
+noir_status static nvc_vt_iommu_protect_hypervisor(noir_dmar_manager_p dmar_manager)
+{
+	noir_status st=nvc_vt_iommu_update_pte(dmar_manager,dmar_manager->root.phys,dmar_manager->root.phys,false,false,false),inval_st;
+	for(u32 i=0;i<256 && st==noir_success;i++)
+		st=nvc_vt_iommu_update_pte(dmar_manager,dmar_manager->context.phys+page_mult(i),dmar_manager->context.phys+page_mult(i),false,false,false);
+	for(u64 i=0;i<dmar_manager->iommu_count && st==noir_success;i++)
+		st=nvc_vt_iommu_update_pte(dmar_manager,dmar_manager->bars[i].inval_queue.hv_queue.phys,dmar_manager->bars[i].inval_queue.hv_queue.phys,false,false,false);
+	// Paging structures of the upper levels.
+	if(dmar_manager->minimum_features.using_agaw==intel_iommu_context_agaw_57_bit)
+	{
+		if(st==noir_success)st=nvc_vt_iommu_update_pte(dmar_manager,dmar_manager->pml5.phys,dmar_manager->pml5.phys,false,false,false);
+		for(noir_dmar_pml4e_descriptor_p cur=dmar_manager->pml4.head;cur && st==noir_success;cur=cur->next)
+			st=nvc_vt_iommu_update_pte(dmar_manager,cur->phys,cur->phys,false,false,false);
+	}
+	else if(dmar_manager->minimum_features.using_agaw==intel_iommu_context_agaw_48_bit)
+		if(st==noir_success)st=nvc_vt_iommu_update_pte(dmar_manager,dmar_manager->pml4.phys,dmar_manager->pml4.phys,false,false,false);
+	if(dmar_manager->minimum_features.using_agaw==intel_iommu_context_agaw_39_bit)
+	{
+		if(st==noir_success)st=nvc_vt_iommu_update_pte(dmar_manager,dmar_manager->pdpte.phys,dmar_manager->pdpte.phys,false,false,false);
+	}
+	else
+	{
+		for(noir_dmar_pdpte_descriptor_p cur=dmar_manager->pdpte.head;cur && st==noir_success;cur=cur->next)
+			st=nvc_vt_iommu_update_pte(dmar_manager,cur->phys,cur->phys,false,false,false);
+	}
+	// Paging structures of the lower levels.
+	for(noir_dmar_pde_descriptor_p cur=dmar_manager->pde.head;cur && st==noir_success;cur=cur->next)
+		st=nvc_vt_iommu_update_pte(dmar_manager,cur->phys,cur->phys,false,false,false);
+	for(noir_dmar_pte_descriptor_p cur=dmar_manager->pte.head;cur && st==noir_success;cur=cur->next)
+		st=nvc_vt_iommu_update_pte(dmar_manager,cur->phys,cur->phys,false,false,false);
+	// Submit the invalidations even if not all structures are protected.
+	inval_st=nvc_vt_iommu_commit_invalidations(dmar_manager);
+	return st==noir_success?inval_st:st;
+}
+
 noir_status nvc_vt_iommu_initialize()
 {
 	// Pass I: Enumerate all DMAR Hardware and check if all features are supported.
@@ -887,11 +1404,9 @@ noir_status nvc_vt_iommu_initialize()
 				goto alloc_failure;
 			dmarm->minimum_features.using_agaw=intel_iommu_context_agaw_39_bit;
 		}
-		// Then, enumerate the memory ranges in order to build the page table.
-		noir_enum_physical_memory_ranges(nvc_vt_iommu_add_ram_region,dmarm);
-		// Code-Integrity.
-		nvc_vt_iommu_initialize_ci(dmarm);
-		st=noir_success;
+		// Then, plan the layout from the memory ranges and Code-Integrity in order to build the page table.
+		st=nvc_vt_iommu_build_identity_map(dmarm);
+		if(st!=noir_success)goto alloc_failure;
 	}
 	else
 	{
@@ -937,6 +1452,9 @@ noir_status nvc_vt_iommu_initialize()
 						cap.value=noir_mmio_read64((u64)dmarm->bars[i].virt+mmio_offset_capability);
 						ext_cap.value=noir_mmio_read64((u64)dmarm->bars[i].virt+mmio_offset_extended_capability);
 						dmarm->bars[i].iotlb_reg_offset=ext_cap.iotlb_offset<<4;
+						dmarm->bars[i].page_selective=(bool)cap.page_selective_inval;
+						dmarm->bars[i].max_address_mask=(u8)cap.maximum_address_mask;
+						dmarm->bars[i].inval_queue.wait_status_phys=noir_get_physical_address((void*)&dmarm->bars[i].inval_queue.wait_status);
 						dmarm->bars[i].fault_rec_offset=cap.fault_record_offset<<4;
 						nv_dprintf("IOMMU Fault-Record Register: 0x%llX\n",dmarm->bars[i].phys+dmarm->bars[i].fault_rec_offset);
 						i++;
@@ -946,7 +1464,14 @@ noir_status nvc_vt_iommu_initialize()
 			}
 			st=nvc_acpi_search_table('RAMD',(acpi_common_description_header_p)dmar_table,(acpi_common_description_header_p*)&dmar_table);
 		}
-		nvc_vt_iommu_activate();
+		st=nvc_vt_iommu_activate();
+		if(st!=noir_success)
+		{
+			nv_dprintf("Failed to activate Intel VT-d! Status=0x%X\n",st);
+			return st;
+		}
+		st=nvc_vt_iommu_protect_hypervisor(dmarm);
+		if(st!=noir_success)nv_dprintf("Failed to protect NoirVisor from DMA! Status=0x%X\n",st);
 		// Eventually, register the IOMMU MMIO Regions.
 		st=nvc_vt_iommu_register_mmio_region(dmarm);
 		nv_dprintf("Intel VT-d MMIO-Region Registration Status=0x%X\n",st);
@@ -958,9 +1483,10 @@ alloc_failure:
 	return noir_insufficient_resources;
 }
 
-void nvc_vt_iommu_activate()
+noir_status nvc_vt_iommu_activate()
 {
 	noir_dmar_manager_p dmarm=hvm_p->relative_hvm->dmar_manager;
+	noir_status st=noir_success;
 	if(dmarm)
 	{
 		intel_iommu_root_table_address_register root_ptr;
@@ -968,9 +1494,11 @@ void nvc_vt_iommu_activate()
 		root_ptr.translation_table_mode=intel_iommu_translation_table_mode_legacy;
 		root_ptr.root_table_ptr=page_count(dmarm->root.phys);
 		// Setup all IOMMUs.
-		for(u64 i=0;i<dmarm->iommu_count;i++)
+		for(u64 i=0;i<dmarm->iommu_count && st==noir_success;i++)
 		{
+			intel_iommu_inval_queue_address_register iqa;
 			intel_iommu_msi_ctrl_register fault_msi_ctrl;
+			u32 gsts;
 			nv_dprintf("Working with IOMMU at 0x%llX...\n",dmarm->bars[i].phys);
 			// Do not inadvertently disable anything that was enabled by the platform (OS, firmware, etc.).
 #if !defined(_hv_type1)
@@ -983,8 +1511,28 @@ void nvc_vt_iommu_activate()
 				dmarm->bars[i].fault_vector=fault_msi_data.vector;
 				nv_dprintf("The host has already set up IOMMU Fault-Notification! Interrupt Vector=0x%02X\n",fault_msi_data.vector);
 			}
+			// Take over the Invalidation Queue set by the platform. Wait for the descriptors that have been submitted.
+			gsts=noir_mmio_read32((u64)dmarm->bars[i].virt+mmio_offset_global_status);
+			if(noir_bt(&gsts,intel_iommu_global_queue_invalidation_enable))
+			{
+				intel_iommu_inval_queue_tail_register tail={.value=noir_mmio_read64((u64)dmarm->bars[i].virt+mmio_offset_inval_queue_tail)};
+				st=nvc_vt_iommu_poll_invalidation_queue(&dmarm->bars[i],tail);
+				if(st!=noir_success)break;
+				dmarm->bars[i].inval_queue.guest.head=dmarm->bars[i].inval_queue.guest.tail=tail.value;
+				dmarm->bars[i].inval_queue.guest.enabled=true;
+			}
 			// Disable the Invalidation Queue.
-			nvc_vt_iommu_set_global_command(&dmarm->bars[i],intel_iommu_global_queue_invalidation_enable,false);
+			st=nvc_vt_iommu_set_global_command(&dmarm->bars[i],intel_iommu_global_queue_invalidation_enable,false);
+			if(st!=noir_success)break;
+			// Shadow the Invalidation Queue set by the platform.
+			iqa.value=noir_mmio_read64((u64)dmarm->bars[i].virt+mmio_offset_inval_queue_address);
+			if(iqa.base)
+			{
+				dmarm->bars[i].inval_queue.guest.queue.phys=page_mult(iqa.base);
+				dmarm->bars[i].inval_queue.guest.size=page_mult((u64)1<<iqa.queue_size);
+				dmarm->bars[i].inval_queue.guest.queue.virt=noir_map_physical_memory(dmarm->bars[i].inval_queue.guest.queue.phys,dmarm->bars[i].inval_queue.guest.size);
+			}
+			nvc_vt_iommu_set_guest_queue_address(&dmarm->bars[i],iqa.value);
 			// Save the Root-Table Pointer set by the platform (OS, firmware, etc.)
 			// Windows is IOMMU-aware, and sets all contexts to "Pass-Through" mode, even if you disabled Kernel DMA Protection.
 			dmarm->bars[i].prev_root_ptr=noir_mmio_read64((u64)dmarm->bars[i].virt+mmio_offset_root_table_ptr);
@@ -993,25 +1541,34 @@ void nvc_vt_iommu_activate()
 			nv_dprintf("Setting Root-Table Pointer...\n");
 			noir_mmio_write64((u64)dmarm->bars[i].virt+mmio_offset_root_table_ptr,root_ptr.value);
 			// Inform the IOMMU unit that Root-Table Pointer is updated...
-			nvc_vt_iommu_set_global_command(&dmarm->bars[i],intel_iommu_global_set_root_ptr,true);
+			st=nvc_vt_iommu_set_global_command(&dmarm->bars[i],intel_iommu_global_set_root_ptr,true);
+			if(st!=noir_success)break;
 			noir_int3();
 			// Invalidate Context-Cache.
 			nv_dprintf("Invalidating Context-Cache...\n");
-			nvc_vt_iommu_flush_context_cache(&dmarm->bars[i],0,0,0,intel_iommu_context_inval_global);
+			st=nvc_vt_iommu_flush_context_cache(&dmarm->bars[i],0,0,0,intel_iommu_context_inval_global);
+			if(st!=noir_success)break;
 			// Invalidate I/O TLB. Drain all R/W Requests by the way.
 			nv_dprintf("Invalidating I/O TLB...\n");
-			nvc_vt_iommu_flush_iotlb(&dmarm->bars[i],0,true,true,intel_iommu_iotlb_inval_global,0);
-			// (Re)Enable the Invalidation Queue.
+			st=nvc_vt_iommu_flush_iotlb(&dmarm->bars[i],0,true,true,intel_iommu_iotlb_inval_global,0);
+			if(st!=noir_success)break;
+			// (Re)Enable the Invalidation Queue. NoirVisor submits invalidations to its own queue.
+			iqa.value=0;
+			iqa.base=page_count(dmarm->bars[i].inval_queue.hv_queue.phys);
+			noir_mmio_write64((u64)dmarm->bars[i].virt+mmio_offset_inval_queue_address,iqa.value);
 			noir_mmio_write64((u64)dmarm->bars[i].virt+mmio_offset_inval_queue_tail,0);
-			nvc_vt_iommu_set_global_command(&dmarm->bars[i],intel_iommu_global_queue_invalidation_enable,true);
+			st=nvc_vt_iommu_set_global_command(&dmarm->bars[i],intel_iommu_global_queue_invalidation_enable,true);
+			if(st!=noir_success)break;
 			// Enable DMA-Remapping.
 			nv_dprintf("Enabling Translation...\n");
-			nvc_vt_iommu_set_global_command(&dmarm->bars[i],intel_iommu_global_translation_enable,true);
+			st=nvc_vt_iommu_set_global_command(&dmarm->bars[i],intel_iommu_global_translation_enable,true);
+			if(st!=noir_success)break;
 			// Completed!
 			dmarm->minimum_features.active=true;
 			nv_dprintf("Completed Configuration for IOMMU at 0x%p!\n",dmarm->bars[i].phys);
 		}
 	}
+	return st;
 }
 
 void nvc_vt_iommu_finalize()
@@ -1035,9 +1592,27 @@ void nvc_vt_iommu_finalize()
 			// Invalidate I/O TLB. Drain all R/W Requests by the way.
 			nv_dprintf("Invalidating I/O TLB...\n");
 			nvc_vt_iommu_flush_iotlb(&dmarm->bars[i],0,true,true,intel_iommu_iotlb_inval_global,0);
-			// (Re)Enable the Invalidation Queue.
+			// Return the Invalidation Queue to the platform.
+			noir_mmio_write64((u64)dmarm->bars[i].virt+mmio_offset_inval_queue_address,dmarm->bars[i].inval_queue.guest.address);
 			noir_mmio_write64((u64)dmarm->bars[i].virt+mmio_offset_inval_queue_tail,0);
-			nvc_vt_iommu_set_global_command(&dmarm->bars[i],intel_iommu_global_queue_invalidation_enable,true);
+			if(dmarm->bars[i].inval_queue.guest.enabled)
+			{
+				const intel_iommu_inval_queue_tail_register tail={.value=dmarm->bars[i].inval_queue.guest.tail};
+				nvc_vt_iommu_set_global_command(&dmarm->bars[i],intel_iommu_global_queue_invalidation_enable,true);
+				// The hardware restarts from the beginning of the queue, whereas the guest expects its tail.
+				// All descriptors before the tail have been completed. Replace them with no-op waits.
+				if(dmarm->bars[i].inval_queue.guest.view)
+				{
+					for(u64 j=0;j<tail.value;j+=sizeof(intel_iommu_queued_inval_legacy_descriptor))
+					{
+						intel_iommu_queued_inval_legacy_descriptor_p inval_d=(intel_iommu_queued_inval_legacy_descriptor_p)((ulong_ptr)dmarm->bars[i].inval_queue.guest.view+j);
+						inval_d->inval_wait.lo=inval_d->inval_wait.hi=0;
+						inval_d->inval_wait.type_lo=intel_iommu_queued_inval_type_inval_wait;
+					}
+					noir_mmio_write64((u64)dmarm->bars[i].virt+mmio_offset_inval_queue_tail,tail.value);
+					nvc_vt_iommu_poll_invalidation_queue(&dmarm->bars[i],tail);
+				}
+			}
 			// Reset DMA-Remapping.
 			nv_dprintf("Resetting Translation...\n");
 			nvc_vt_iommu_set_global_command(&dmarm->bars[i],intel_iommu_global_translation_enable,true);
@@ -15,16 +15,25 @@
 #include <nvdef.h>
 #include "vt_iommudef.h"
 
+// Descriptors of each level are indexed by AVL-Tree, keyed by the base GPA they cover.
+// The index node must be at the top of every descriptor.
+typedef struct _noir_dmar_index_node
+{
+	avl_node avl;
+	u64 gpa_start;
+}noir_dmar_index_node,*noir_dmar_index_node_p;
+
 typedef struct _noir_dmar_pml4e_descriptor
 {
+	noir_dmar_index_node index;
 	struct _noir_dmar_pml4e_descriptor* next;
 	intel_iommu_stage2_pml4e_p virt;
 	u64 phys;
-	u64 gpa_start;
 }noir_dmar_pml4e_descriptor,*noir_dmar_pml4e_descriptor_p;
 
 typedef struct _noir_dmar_pdpte_descriptor
 {
+	noir_dmar_index_node index;
 	struct _noir_dmar_pdpte_descriptor* next;
 	union
 	{
@@ -32,11 +41,11 @@ typedef struct _noir_dmar_pdpte_descriptor
 		intel_iommu_stage2_pdpte_p virt;
 	};
 	u64 phys;
-	u64 gpa_start;
 }noir_dmar_pdpte_descriptor,*noir_dmar_pdpte_descriptor_p;
 
 typedef struct _noir_dmar_pde_descriptor
 {
+	noir_dmar_index_node index;
 	struct _noir_dmar_pde_descriptor* next;
 	union
 	{
@@ -44,15 +53,14 @@ typedef struct _noir_dmar_pde_descriptor
 		intel_iommu_stage2_pde_p virt;
 	};
 	u64 phys;
-	u64 gpa_start;
 }noir_dmar_pde_descriptor,*noir_dmar_pde_descriptor_p;
 
 typedef struct _noir_dmar_pte_descriptor
 {
+	noir_dmar_index_node index;
 	struct _noir_dmar_pte_descriptor* next;
 	intel_iommu_stage2_pte_p virt;
 	u64 phys;
-	u64 gpa_start;
 }noir_dmar_pte_descriptor,*noir_dmar_pte_descriptor_p;
 
 typedef struct _noir_dmar_iommu_bar_descriptor
@@ -64,14 +72,21 @@ typedef struct _noir_dmar_iommu_bar_descriptor
 	struct
 	{
 		memory_descriptor hv_queue;
+		// The guest's queue is shadowed. Its descriptors are forwarded into NoirVisor's queue.
 		struct
 		{
-			memory_descriptor queue;
-			u64 size;
+			memory_descriptor queue;	// Mapped while NoirVisor takes over the queue.
+			void* view;					// Current queue specified by the guest.
+			u64 size;					// Size of the mapping.
+			u64 address;				// Value of IQA Register seen by the guest.
 			u64 head;
 			u64 tail;
+			bool enabled;
+			bool error;
 		}guest;
-		u32 wait_status;
+		u64 wait_status_phys;
+		u32v wait_status;
+		u32v lock;
 	}inval_queue;
 	// Records the state before NoirVisor uses IOMMU.
 	union
@@ -83,11 +98,62 @@ typedef struct _noir_dmar_iommu_bar_descriptor
 		};
 	}prev_state;
 	u8 fault_vector;
+	// Page-Selective Invalidation capabilities.
+	u8 max_address_mask;
+	bool page_selective;
 	u64 prev_root_ptr;
 	u64 iotlb_reg_offset;
 	u64 fault_rec_offset;
 }noir_dmar_iommu_bar_descriptor,*noir_dmar_iommu_bar_descriptor_p;
 
+typedef struct _noir_dmar_ram_range
+{
+	u64 start;
+	u64 end;
+}noir_dmar_ram_range,*noir_dmar_ram_range_p;
+
+// The layout of Identity-Map is planned before building the page tables.
+typedef struct _noir_dmar_layout_planner
+{
+	noir_dmar_ram_range_p ranges;
+	u32 count;
+	u32 limit;
+	u64p protected_pages;
+	u32 protected_count;
+	struct
+	{
+		u64 huge;
+		u64 large;
+		u64 small;
+		u64 excluded;
+	}leaves;
+}noir_dmar_layout_planner,*noir_dmar_layout_planner_p;
+
+// Number of polls before NoirVisor gives up waiting for an IOMMU. Each poll is a pause and an MMIO read.
+#define noir_dmar_poll_limit			0x100000
+
+// Page-Selective IOTLB invalidations are accumulated and submitted in batch.
+// Each pending range covers 2^address_mask pages and is naturally aligned.
+#define noir_dmar_inval_batch_limit		32
+
+typedef struct _noir_dmar_inval_range
+{
+	u64 address;
+	u8 address_mask;
+}noir_dmar_inval_range,*noir_dmar_inval_range_p;
+
+typedef struct _noir_dmar_inval_batch
+{
+	u32 count;
+	// If too many ranges are pending, the whole domain is invalidated.
+	bool overflow;
+	noir_dmar_inval_range ranges[noir_dmar_inval_batch_limit];
+	// Statistics
+	u64 submitted_pages;
+	u64 submitted_batches;
+	u64 saved_waits;
+}noir_dmar_inval_batch,*noir_dmar_inval_batch_p;
+
 // Note: Main DMAR Manager also affects NoirVisor CVM.
 // This is different from EPT Manager.
 typedef struct _noir_dmar_manager
@@ -115,6 +181,7 @@ typedef struct _noir_dmar_manager
 		{
 			noir_dmar_pml4e_descriptor_p head;
 			noir_dmar_pml4e_descriptor_p tail;
+			noir_dmar_index_node_p root;
 		};
 		struct
 		{
@@ -128,6 +195,7 @@ typedef struct _noir_dmar_manager
 		{
 			noir_dmar_pdpte_descriptor_p head;
 			noir_dmar_pdpte_descriptor_p tail;
+			noir_dmar_index_node_p root;
 		};
 		struct
 		{
@@ -143,12 +211,15 @@ typedef struct _noir_dmar_manager
 	{
 		noir_dmar_pde_descriptor_p head;
 		noir_dmar_pde_descriptor_p tail;
+		noir_dmar_index_node_p root;
 	}pde;
 	struct
 	{
 		noir_dmar_pte_descriptor_p head;
 		noir_dmar_pte_descriptor_p tail;
+		noir_dmar_index_node_p root;
 	}pte;
+	noir_dmar_inval_batch inval_batch;
 	// Lower bits list the features supported by all IOMMU Hardwares.
 	// Higher bits list the what NoirVisor has enabled.
 	union
@@ -175,11 +246,17 @@ void nvc_vt_iommu_enqueue_context_cache_invalidation(noir_dmar_iommu_bar_descrip
 void nvc_vt_iommu_enqueue_iotlb_invalidation(noir_dmar_iommu_bar_descriptor_p bar,u8 granularity,bool drain_write,bool drain_read,u16 domain_id,u8 address_mask,bool inval_hint,u64 address);
 void nvc_vt_iommu_enqueue_device_tlb_invalidation(noir_dmar_iommu_bar_descriptor_p bar,u16 pfsid,u8 mip,u16 source_id,bool size,u64 address);
 void nvc_vt_iommu_enqueue_intentry_cache_invalidation(noir_dmar_iommu_bar_descriptor_p bar,bool granularity,u8 index_mask,u16 interrupt_index);
-void nvc_vt_iommu_wait_invalidation_queue(noir_dmar_iommu_bar_descriptor_p bar,bool interrupt,bool write_status,bool fence,bool drain_pagereq,u32 status_data,u64 status_address);
-void nvc_vt_iommu_set_global_command(noir_dmar_iommu_bar_descriptor_p bar,u32 bit_position,bool value);
-void nvc_vt_iommu_flush_context_cache(noir_dmar_iommu_bar_descriptor_p bar,u16 domain_id,u16 source_id,u8 function_mask,u8 request_granularity);
-void nvc_vt_iommu_flush_iotlb(noir_dmar_iommu_bar_descriptor_p bar,u16 domain_id,bool drain_write,bool drain_read,u8 request_granularity,u64 address);
+void nvc_vt_iommu_enqueue_invalidation_wait(noir_dmar_iommu_bar_descriptor_p bar,bool interrupt,bool write_status,bool fence,bool drain_pagereq,u32 status_data,u64 status_address);
+noir_status nvc_vt_iommu_wait_invalidation_queue(noir_dmar_iommu_bar_descriptor_p bar,bool interrupt,bool write_status,bool fence,bool drain_pagereq,u32 status_data,u64 status_address);
+noir_status nvc_vt_iommu_set_global_command(noir_dmar_iommu_bar_descriptor_p bar,u32 bit_position,bool value);
+noir_status nvc_vt_iommu_flush_context_cache(noir_dmar_iommu_bar_descriptor_p bar,u16 domain_id,u16 source_id,u8 function_mask,u8 request_granularity);
+noir_status nvc_vt_iommu_flush_iotlb(noir_dmar_iommu_bar_descriptor_p bar,u16 domain_id,bool drain_write,bool drain_read,u8 request_granularity,u64 address);
 
+void nvc_vt_iommu_queue_page_invalidation(noir_dmar_manager_p dmar_manager,u64 gpa);
+noir_status nvc_vt_iommu_commit_invalidations(noir_dmar_manager_p dmar_manager);
+noir_status nvc_vt_iommu_update_pte(noir_dmar_manager_p dmar_manager,u64 gpa,u64 hpa,bool r,bool w,bool x);
+noir_status nvc_vt_iommu_build_identity_map(noir_dmar_manager_p dmar_manager);
 noir_status nvc_vt_iommu_initialize();
-void nvc_vt_iommu_activate();
-void nvc_vt_iommu_finalize();
\ No newline at end of file
+noir_status nvc_vt_iommu_activate();
+void nvc_vt_iommu_finalize();
+void nvc_vt_iommu_cleanup();
\ No newline at end of file
@@ -128,11 +128,14 @@ void static nvc_vt_cleanup(noir_hypervisor_p hvm)
 					noir_free_contd_memory(vcpu->msr_auto.virt,page_size);
 				if(vcpu->nested_vcpu.vmcs_t.virt)
 					noir_free_contd_memory(vcpu->nested_vcpu.vmcs_t.virt,page_size);
+				if(vcpu->nested_vcpu.vmcs_s.virt)
+					noir_free_contd_memory(vcpu->nested_vcpu.vmcs_s.virt,page_size);
 				if(vcpu->hv_stack)
-					noir_free_nonpg_memory(vcpu->hv_stack);
+					noir_free_contd_memory(vcpu->hv_stack,nvc_stack_size);
 				if(vcpu->cvm_state.xsave_area)
 					noir_free_contd_memory(vcpu->cvm_state.xsave_area,page_size);
 				nvc_ept_cleanup(vcpu->ept_manager);
+				nvc_ept_cleanup(vcpu->ept_data_view);
 			}
 			noir_free_nonpg_memory(hvm->virtual_cpu);
 		}
@@ -141,6 +144,9 @@ void static nvc_vt_cleanup(noir_hypervisor_p hvm)
 			if(rhvm->msr_bitmap.virt)noir_free_contd_memory(rhvm->msr_bitmap.virt,page_size);
 			if(rhvm->io_bitmap_a.virt)noir_free_contd_memory(rhvm->io_bitmap_a.virt,page_size);
 			if(rhvm->io_bitmap_b.virt)noir_free_contd_memory(rhvm->io_bitmap_b.virt,page_size);
+			if(rhvm->shadow_vmcs.vmread_bitmap.virt)noir_free_contd_memory(rhvm->shadow_vmcs.vmread_bitmap.virt,page_size);
+			if(rhvm->shadow_vmcs.vmwrite_bitmap.virt)noir_free_contd_memory(rhvm->shadow_vmcs.vmwrite_bitmap.virt,page_size);
+			if(rhvm->hook_lookup.table)noir_free_nonpg_memory(rhvm->hook_lookup.table);
 		}
 		if(hvm->host_memmap.hcr3.virt)
 			noir_free_contd_memory(hvm->host_memmap.hcr3.virt,page_size);
@@ -249,6 +255,9 @@ void static nvc_vt_setup_msr_auto_list(noir_vt_vcpu_p vcpu,noir_processor_state_
 	cvexit_load[noir_vt_cvm_msr_auto_sfmask].data=state_p->sfmask;
 	cvexit_load[noir_vt_cvm_msr_auto_gsswap].index=ia32_kernel_gs_base;
 	cvexit_load[noir_vt_cvm_msr_auto_gsswap].data=state_p->gsswap;
+	// TSC_AUX differs between processors.
+	cvexit_load[noir_vt_cvm_msr_auto_tsc_aux].index=ia32_tsc_aux;
+	cvexit_load[noir_vt_cvm_msr_auto_tsc_aux].data=noir_rdmsr(ia32_tsc_aux);
 }
 
 void static nvc_vt_setup_io_hook(noir_hypervisor_p hvm)
@@ -352,6 +361,20 @@ void static nvc_vt_setup_virtual_msr(noir_vt_vcpu_p vcpu)
 #endif
 }
 
+void static nvc_vt_setup_apic_id(noir_vt_vcpu_p vcpu)
+{
+	const u64 apic_base=noir_rdmsr(ia32_apic_base);
+	// The format of Notification Destination depends on the mode of local APIC.
+	if(noir_bt64(&apic_base,ia32_apic_extd))
+		vcpu->pi_destination=(u32)noir_rdmsr(ia32_x2apic_id);
+	else
+	{
+		u32 xid;
+		noir_cpuid(ia32_cpuid_std_proc_feature,0,null,&xid,null,null);
+		vcpu->pi_destination=(xid>>24)<<8;
+	}
+}
+
 u8 static nvc_vt_enable(u64* vmxon_phys)
 {
 	u64 cr0=noir_readcr0();
@@ -546,6 +569,7 @@ void static nvc_vt_setup_host_state_area(noir_vt_vcpu_p vcpu,noir_processor_stat
 	// Setup stack for Exit Handler.
 	noir_vt_initial_stack_p stack=(noir_vt_initial_stack_p)((ulong_ptr)vcpu->hv_stack+nvc_stack_size-sizeof(noir_vt_initial_stack));
 	stack->vcpu=vcpu;
+	stack->custom_vcpu=&nvc_vt_idle_cvcpu;
 	stack->proc_id=noir_get_current_processor();
 	// Host State Area - Descriptor Tables
 	nvc_vt_setup_host_descriptor_tables(vcpu,state);
@@ -711,6 +735,23 @@ void static nvc_vt_setup_memory_virtualization(noir_vt_vcpu_p vcpu)
 		noir_vt_vmwrite64(ept_pointer,vcpu->ept_manager->eptp.phys.value);
 }
 
+void static nvc_vt_setup_vmcs_shadowing_p(noir_vt_vcpu_p vcpu)
+{
+	if((vcpu->enabled_feature & noir_vt_vmcs_shadowing) && vcpu->nested_vcpu.vmcs_s.virt)
+	{
+		ia32_vmx_2ndproc_controls proc_ctrl2;
+		ulong_ptr controls;
+		noir_vt_vmread(secondary_processor_based_vm_execution_controls,&controls);
+		proc_ctrl2.value=(u32)controls;
+		proc_ctrl2.vmcs_shadowing=1;
+		noir_vt_vmwrite(secondary_processor_based_vm_execution_controls,proc_ctrl2.value);
+		noir_vt_vmwrite64(vmread_bitmap_address,vcpu->relative_hvm->shadow_vmcs.vmread_bitmap.phys);
+		noir_vt_vmwrite64(vmwrite_bitmap_address,vcpu->relative_hvm->shadow_vmcs.vmwrite_bitmap.phys);
+		// The shadow VMCS is linked when nested hypervisor loads a current VMCS.
+		noir_vt_vmclear(&vcpu->nested_vcpu.vmcs_s.phys);
+	}
+}
+
 void static nvc_vt_setup_available_features(noir_vt_vcpu_p vcpu)
 {
 	ia32_vmx_2ndproc_ctrl_msr proc2_cap;
@@ -783,7 +824,9 @@ u8 nvc_vt_subvert_processor_i(noir_vt_vcpu_p vcpu,void* reserved,ulong_ptr gsp)
 	nvc_vt_setup_msr_auto_list(vcpu,&state);
 	nvc_vt_setup_msr_hook_p(vcpu);
 	nvc_vt_setup_io_hook_p(vcpu);
+	nvc_vt_setup_vmcs_shadowing_p(vcpu);
 	nvc_vt_setup_virtual_msr(vcpu);
+	nvc_vt_setup_apic_id(vcpu);
 	vcpu->status=noir_virt_on;
 	// Everything are done, perform subversion.
 	nv_dprintf("Launching vCPU...\n");
@@ -858,11 +901,6 @@ void static nvc_vt_subvert_processor(noir_vt_vcpu_p vcpu)
 void static nvc_vt_subvert_processor_thunk(void* context,u32 processor_id)
 {
 	noir_vt_vcpu_p vcpu=(noir_vt_vcpu_p)context;
-	ia32_vmx_basic_msr vt_basic;
-	vt_basic.value=noir_rdmsr(ia32_vmx_basic);
-	*(u32*)vcpu[processor_id].vmxon.virt=(u32)vt_basic.revision_id;
-	*(u32*)vcpu[processor_id].vmcs.virt=(u32)vt_basic.revision_id;
-	*(u32*)vcpu[processor_id].nested_vcpu.vmcs_t.virt=(u32)vt_basic.revision_id;
 	nvd_printf("Processor %d entered subversion routine!\n",processor_id);
 	nvc_vt_subvert_processor(&vcpu[processor_id]);
 }
@@ -917,61 +955,98 @@ bool nvc_vt_build_host_page_table(noir_hypervisor_p hvm_p)
   routine, it is executed in DPC-Level (KeInsertQueueDpc) or IPI-Level (KeIpiGenericCall), where
   memory allocations are significantly restricted (DPC-Level) or even prohibited (IPI-Level).
 */
+// Per-processor structures are allocated on the processor that owns them.
+// Therefore, local allocations come from the NUMA node of the processor.
+bool static nvc_vt_alloc_vcpu(noir_hypervisor_p hvm,noir_vt_vcpu_p vcpu,u32 index)
+{
+	ia32_vmx_basic_msr vt_basic;
+	vcpu->vmcs.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
+	if(vcpu->vmcs.virt==null)return false;
+	vcpu->vmcs.phys=noir_get_physical_address(vcpu->vmcs.virt);
+	vcpu->vmxon.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
+	if(vcpu->vmxon.virt==null)return false;
+	vcpu->vmxon.phys=noir_get_physical_address(vcpu->vmxon.virt);
+	vcpu->msr_auto.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
+	if(vcpu->msr_auto.virt==null)return false;
+	vcpu->msr_auto.phys=noir_get_physical_address(vcpu->msr_auto.virt);
+	vcpu->nested_vcpu.vmcs_t.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
+	if(vcpu->nested_vcpu.vmcs_t.virt==null)return false;
+	vcpu->nested_vcpu.vmcs_t.phys=noir_get_physical_address(vcpu->nested_vcpu.vmcs_t.virt);
+	// Write the revision identifiers here, so that subversion only has to enter VMX.
+	vt_basic.value=noir_rdmsr(ia32_vmx_basic);
+	*(u32*)vcpu->vmxon.virt=(u32)vt_basic.revision_id;
+	*(u32*)vcpu->vmcs.virt=(u32)vt_basic.revision_id;
+	*(u32*)vcpu->nested_vcpu.vmcs_t.virt=(u32)vt_basic.revision_id;
+	if(hvm->relative_hvm->shadow_vmcs.vmread_bitmap.virt)
+	{
+		vcpu->nested_vcpu.vmcs_s.virt=noir_alloc_contd_memory_with_locality(noir_memory_local,page_size);
+		if(vcpu->nested_vcpu.vmcs_s.virt==null)return false;
+		vcpu->nested_vcpu.vmcs_s.phys=noir_get_physical_address(vcpu->nested_vcpu.vmcs_s.virt);
+		// Bit 31 indicates this is a shadow VMCS.
+		*(u32*)vcpu->nested_vcpu.vmcs_s.virt=(u32)vt_basic.revision_id|0x80000000;
+	}
+	vcpu->hv_stack=noir_alloc_contd_memory_with_locality(noir_memory_local,nvc_stack_size);
+	if(vcpu->hv_stack==null)return false;
+	vcpu->ept_manager=(void*)nvc_ept_build_identity_map(noir_ept_view_hook);
+	if(vcpu->ept_manager==null)return false;
+	if(hvm->options.stealth_hook_dual_view)
+	{
+		vcpu->ept_data_view=(void*)nvc_ept_build_identity_map(noir_ept_view_data);
+		if(vcpu->ept_data_view==null)return false;
+	}
+	vcpu->cvm_state.xsave_area=noir_alloc_contd_memory_with_locality(noir_memory_local,hvm->xfeat.supported_size_max);
+	if(vcpu->cvm_state.xsave_area==null)return false;
+	if(hvm->options.stealth_msr_hook)
+	{
+		if(hvm->options.kva_shadow_presence)
+			vcpu->enabled_feature|=noir_vt_kva_shadow_presence;
+		vcpu->enabled_feature|=noir_vt_syscall_hook;
+	}
+	vcpu->relative_hvm=(noir_vt_hvm_p)hvm->reserved;
+	vcpu->mshvcpu.root_vcpu=(void*)vcpu;
+	vcpu->mshvcpu.vp_index=index;
+	return true;
+}
+
+void static nvc_vt_alloc_vcpu_thunk(void* context,u32 processor_id)
+{
+	if(nvc_vt_alloc_vcpu(hvm_p,&hvm_p->virtual_cpu[processor_id],processor_id)==false)
+	{
+		nv_dprintf("Failed to allocate structures for processor %u!\n",processor_id);
+		noir_locked_inc((u32v*)context);
+	}
+}
+
+// Each vCPU protects the hypervisor in its own EPT. All vCPUs must be allocated at this moment.
+void static nvc_vt_protect_vcpu_thunk(void* context,u32 processor_id)
+{
+	noir_ept_manager_p eptm=hvm_p->virtual_cpu[processor_id].ept_manager;
+	noir_ept_manager_p eptmd=hvm_p->virtual_cpu[processor_id].ept_data_view;
+	if(nvc_ept_protect_hypervisor(hvm_p,eptm)==false || nvc_ept_setup_mmio_hooks(eptm)==false)
+	{
+		nv_dprintf("Failed to protect hypervisor for processor %u!\n",processor_id);
+		noir_locked_inc((u32v*)context);
+	}
+	else if(eptmd && (nvc_ept_protect_hypervisor(hvm_p,eptmd)==false || nvc_ept_setup_mmio_hooks(eptmd)==false))
+	{
+		nv_dprintf("Failed to protect hypervisor in the data view for processor %u!\n",processor_id);
+		noir_locked_inc((u32v*)context);
+	}
+}
+
 noir_status nvc_vt_subvert_system(noir_hypervisor_p hvm)
 {
+	u64 phase_time[5];
+	phase_time[0]=noir_get_system_time();
 	// Query Extended State Enumeration - Useful for xsetbv handler, CVM scheduler, etc.
 	noir_cpuid(ia32_cpuid_std_pestate_enum,0,&hvm_p->xfeat.support_mask.low,&hvm_p->xfeat.enabled_size_max,&hvm_p->xfeat.supported_size_max,&hvm_p->xfeat.support_mask.high);
 	hvm->cpu_count=noir_get_processor_count();
 	hvm->relative_hvm=(noir_vt_hvm_p)hvm->reserved;
 	hvm->virtual_cpu=noir_alloc_nonpg_memory(hvm->cpu_count*sizeof(noir_vt_vcpu));
-	if(hvm->virtual_cpu)
-	{
-		for(u32 i=0;i<hvm->cpu_count;i++)
-		{
-			noir_vt_vcpu_p vcpu=&hvm->virtual_cpu[i];
-			vcpu->vmcs.virt=noir_alloc_contd_memory(page_size);
-			if(vcpu->vmcs.virt)
-				vcpu->vmcs.phys=noir_get_physical_address(vcpu->vmcs.virt);
-			else
-				goto alloc_failure;
-			vcpu->vmxon.virt=noir_alloc_contd_memory(page_size);
-			if(vcpu->vmxon.virt)
-				vcpu->vmxon.phys=noir_get_physical_address(vcpu->vmxon.virt);
-			else
-				goto alloc_failure;
-			vcpu->msr_auto.virt=noir_alloc_contd_memory(page_size);
-			if(vcpu->msr_auto.virt)
-				vcpu->msr_auto.phys=noir_get_physical_address(vcpu->msr_auto.virt);
-			else
-				goto alloc_failure;
-			vcpu->nested_vcpu.vmcs_t.virt=noir_alloc_contd_memory(page_size);
-			if(vcpu->nested_vcpu.vmcs_t.virt)
-				vcpu->nested_vcpu.vmcs_t.phys=noir_get_physical_address(vcpu->nested_vcpu.vmcs_t.virt);
-			else
-				goto alloc_failure;
-			vcpu->hv_stack=noir_alloc_nonpg_memory(nvc_stack_size);
-			if(vcpu->hv_stack==null)
-				goto alloc_failure;
-			vcpu->ept_manager=(void*)nvc_ept_build_identity_map();
-			if(vcpu->ept_manager==null)
-				goto alloc_failure;
-			vcpu->cvm_state.xsave_area=noir_alloc_contd_memory(hvm->xfeat.supported_size_max);
-			if(vcpu->cvm_state.xsave_area==null)
-				goto alloc_failure;
-			if(hvm_p->options.stealth_msr_hook)
-			{
-				if(hvm_p->options.kva_shadow_presence)
-				{
-					nv_dprintf("KVA Shadow is present in the system!\n");
-					vcpu->enabled_feature|=noir_vt_kva_shadow_presence;
-				}
-				vcpu->enabled_feature|=noir_vt_syscall_hook;
-			}
-			vcpu->relative_hvm=(noir_vt_hvm_p)hvm->reserved;
-			vcpu->mshvcpu.root_vcpu=(void*)vcpu;
-			vcpu->mshvcpu.vp_index=i;
-		}
-	}
+	if(hvm->virtual_cpu==null)goto alloc_failure;
+	if(hvm->options.stealth_msr_hook && hvm->options.kva_shadow_presence)
+		nv_dprintf("KVA Shadow is present in the system!\n");
+	// Phase I: Build structures shared by all processors.
 	hvm->relative_hvm->msr_bitmap.virt=noir_alloc_contd_memory(page_size);
 	if(hvm->relative_hvm->msr_bitmap.virt)
 		hvm->relative_hvm->msr_bitmap.phys=noir_get_physical_address(hvm->relative_hvm->msr_bitmap.virt);
@@ -985,6 +1060,31 @@ noir_status nvc_vt_subvert_system(noir_hypervisor_p hvm)
 		hvm->relative_hvm->io_bitmap_a.phys=noir_get_physical_address(hvm->relative_hvm->io_bitmap_a.virt);
 		hvm->relative_hvm->io_bitmap_b.phys=noir_get_physical_address(hvm->relative_hvm->io_bitmap_b.virt);
 	}
+	if(hvm->options.nested_virtualization)
+	{
+		nvc_vt_build_nested_vmcs_field_table();
+		// VMCS shadowing allows the nested hypervisor to access common fields without VM-Exit.
+		if(nvc_is_vmcs_shadowing_supported())
+		{
+			hvm->relative_hvm->shadow_vmcs.vmread_bitmap.virt=noir_alloc_contd_memory(page_size);
+			hvm->relative_hvm->shadow_vmcs.vmwrite_bitmap.virt=noir_alloc_contd_memory(page_size);
+			if(hvm->relative_hvm->shadow_vmcs.vmread_bitmap.virt==null || hvm->relative_hvm->shadow_vmcs.vmwrite_bitmap.virt==null)goto alloc_failure;
+			hvm->relative_hvm->shadow_vmcs.vmread_bitmap.phys=noir_get_physical_address(hvm->relative_hvm->shadow_vmcs.vmread_bitmap.virt);
+			hvm->relative_hvm->shadow_vmcs.vmwrite_bitmap.phys=noir_get_physical_address(hvm->relative_hvm->shadow_vmcs.vmwrite_bitmap.virt);
+			nvc_vt_build_shadow_vmcs_bitmaps(hvm->relative_hvm);
+		}
+	}
+	// Dual EPT views are meaningless without Stealth Inline Hook.
+	if(!hvm->options.stealth_inline_hook)hvm->options.stealth_hook_dual_view=false;
+#if !defined(_hv_type1)
+	if(hvm->options.stealth_inline_hook)
+	{
+		// Hook pages are looked up on EPT violations with a hash table keyed on GPA pages.
+		if(nvc_ept_build_hook_lookup(hvm->relative_hvm)==false)goto alloc_failure;
+		if(hvm->options.stealth_hook_dual_view)
+			nv_dprintf("Stealth Inline Hook switches between dual EPT views!\n");
+	}
+#endif
 	hvm->options.tlfs_passthrough=noir_is_under_hvm();
 	if(hvm->options.tlfs_passthrough && hvm->options.cpuid_hv_presence)
 		nv_dprintf("Note: Hypervisor is detected! The cpuid presence will be in pass-through mode!\n");
@@ -998,7 +1098,6 @@ noir_status nvc_vt_subvert_system(noir_hypervisor_p hvm)
 	nvc_vt_set_mshv_handler(hvm->options.tlfs_passthrough?false:hvm_p->options.cpuid_hv_presence);
 	hvm->relative_hvm->hvm_cpuid_leaf_max=nvc_mshv_build_cpuid_handlers();
 	if(hvm->relative_hvm->hvm_cpuid_leaf_max==0)goto alloc_failure;
-	if(hvm->virtual_cpu==null)goto alloc_failure;
 	// Build Host CR3 in order to operate physical addresses directly.
 	if(nvc_vt_build_host_page_table(hvm_p))
 		nv_dprintf("Hypervisor's paging structure is initialized successfully!\n");
@@ -1008,12 +1107,12 @@ noir_status nvc_vt_subvert_system(noir_hypervisor_p hvm)
 		nvc_vt_iommu_initialize();
 	nvc_vt_setup_msr_hook(hvm);
 	nvc_vt_setup_io_hook(hvm);
-	for(u32 i=0;i<hvm->cpu_count;i++)
-	{
-		if(nvc_ept_protect_hypervisor(hvm,hvm->virtual_cpu[i].ept_manager)==false)
-			goto alloc_failure;
-		if(nvc_ept_setup_mmio_hooks(hvm->virtual_cpu[i].ept_manager)==false)goto alloc_failure;
-	}
+	phase_time[1]=noir_get_system_time();
+	// Phase II: Allocate per-processor structures, including the EPT identity map, on each processor.
+	if(nvc_setup_per_processor(nvc_vt_alloc_vcpu_thunk))goto alloc_failure;
+	phase_time[2]=noir_get_system_time();
+	// Phase III: Protect the hypervisor in every EPT.
+	if(nvc_setup_per_processor(nvc_vt_protect_vcpu_thunk))goto alloc_failure;
 #if !defined(_hv_type1)
 	if(nvc_vtc_initialize_cvm_module()!=noir_success)goto alloc_failure;
 	// Initialize VPID Pool for Customizable VMs.
@@ -1034,8 +1133,13 @@ noir_status nvc_vt_subvert_system(noir_hypervisor_p hvm)
 	if(hvm->tlb_tagging.vpid_pool_lock==null)goto alloc_failure;
 	hvm->tlb_tagging.start=2;
 #endif
+	phase_time[3]=noir_get_system_time();
+	// Phase IV: Subvert all processors. Nothing is allocated from now on.
 	nv_dprintf("All allocations are done, start subversion!\n");
 	noir_generic_call(nvc_vt_subvert_processor_thunk,hvm->virtual_cpu);
+	phase_time[4]=noir_get_system_time();
+	// The system time is in unit of 100ns.
+	nv_dprintf("Subversion phases of %u processors (us): Shared=%llu, Allocation=%llu, Protection=%llu, Subversion=%llu\n",hvm->cpu_count,(phase_time[1]-phase_time[0])/10,(phase_time[2]-phase_time[1])/10,(phase_time[3]-phase_time[2])/10,(phase_time[4]-phase_time[3])/10);
 	return noir_success;
 alloc_failure:
 	nv_dprintf("Allocation failure!\n");
@@ -1062,11 +1166,55 @@ void static nvc_vt_restore_processor_thunk(void* context,u32 processor_id)
 	nvc_vt_restore_processor(&vcpu[processor_id]);
 }
 
+void static nvc_vt_summarize_exit_statistics(noir_exit_statistics_p total,noir_exit_statistics_p stats)
+{
+	total->count+=stats->count;
+	total->sampled_count+=stats->sampled_count;
+	total->sampled_time+=stats->sampled_time;
+	if(stats->max_time>total->max_time)total->max_time=stats->max_time;
+}
+
+void static nvc_vt_report_exit_statistics(noir_hypervisor_p hvm)
+{
+	noir_vt_vcpu_p vcpu=(noir_vt_vcpu_p)hvm->virtual_cpu;
+	for(u32 i=0;i<vmx_maximum_exit_reason;i++)
+	{
+		noir_exit_statistics host={0},cvm={0};
+		// Summarize the statistics of all processors.
+		for(u32 j=0;j<hvm->cpu_count;j++)
+		{
+			nvc_vt_summarize_exit_statistics(&host,&vcpu[j].exit_statistics.reason[i]);
+			nvc_vt_summarize_exit_statistics(&cvm,&vcpu[j].exit_statistics.cvm_reason[i]);
+		}
+		if(host.count)
+		{
+			const u64 average=host.sampled_count?host.sampled_time/host.sampled_count:0;
+			nv_dprintf("VM-Exit Reason %u: Count=%llu, Sampled=%llu, Average Latency=%llu ticks, Maximum Latency=%llu ticks\n",i,host.count,host.sampled_count,average,host.max_time);
+		}
+		if(cvm.count)
+		{
+			const u64 average=cvm.sampled_count?cvm.sampled_time/cvm.sampled_count:0;
+			nv_dprintf("CVM VM-Exit Reason %u: Count=%llu, Sampled=%llu, Average Latency=%llu ticks, Maximum Latency=%llu ticks\n",i,cvm.count,cvm.sampled_count,average,cvm.max_time);
+		}
+	}
+}
+
+noir_status nvc_vt_query_exit_statistics(u32 processor,void* buffer,u32 buffer_size)
+{
+	noir_vt_vcpu_p vcpu=(noir_vt_vcpu_p)hvm_p->virtual_cpu;
+	if(vcpu==null)return noir_hypervision_absent;
+	if(buffer_size<sizeof(noir_vt_exit_statistics))return noir_buffer_too_small;
+	// The snapshot might be torn if the processor is counting a VM-Exit at this moment.
+	noir_copy_memory(buffer,&vcpu[processor].exit_statistics,sizeof(noir_vt_exit_statistics));
+	return noir_success;
+}
+
 void nvc_vt_restore_system(noir_hypervisor_p hvm)
 {
 	if(hvm->virtual_cpu)
 	{
 		noir_generic_call(nvc_vt_restore_processor_thunk,hvm->virtual_cpu);
+		nvc_vt_report_exit_statistics(hvm);
 		if(hvm->options.enable_iommu)
 			nvc_vt_iommu_finalize();
 		nvc_vt_cleanup(hvm);
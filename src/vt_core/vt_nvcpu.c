@@ -148,113 +148,173 @@ void noir_vt_vmfail_valid()
 	noir_vt_vmwrite(guest_rflags,gflags);
 }
 
-bool noir_vt_nested_vmread(void* vmcs,u32 encoding,ulong_ptr* data)
+// Build the field table of the software VMCS from the layout.
+// The field table translates an encoding into offset and size without decoding the encoding at runtime.
+void nvc_vt_build_nested_vmcs_field_table()
 {
-	ia32_vmx_vmcs_encoding translator;
-	u8 w,t;
-	translator.value=encoding;
-	w=(u8)translator.width;
-	t=(u8)translator.type;
-	if(translator.field<noir_vt_vmcs_limit[w][t])
+	for(u32 w=0;w<4;w++)
 	{
-		u16 offset=noir_vt_vmcs_redirection[w][t];
-		offset+=noir_vt_vmcs_field_size[w]*translator.field;
-		switch(w)
+		for(u32 t=0;t<4;t++)
 		{
-			case 0:
-			{
-				if(translator.hi)goto invalid_field;
-				*(u16*)data=*(u16*)((ulong_ptr)vmcs+offset);
-				break;
-			}
-			case 1:
+			for(u32 f=0;f<noir_vt_vmcs_limit[w][t];f++)
 			{
-#if defined(_amd64)
-				if(translator.hi)
-					*(u32*)data=*(u32*)((u64)vmcs+offset+4);
-				else
-					*data=*(u64*)((u64)vmcs+offset);
-#else
-				offset+=translator.hi<<2;
-				*data=*(u32*)((u32)vmcs+offset);
-#endif
-				break;
-			}
-			case 2:
-			{
-				if(translator.hi)goto invalid_field;
-				*(u32*)data=*(u32*)((ulong_ptr)vmcs+offset);
-				break;
-			}
-			case 3:
-			{
-				if(translator.hi)goto invalid_field;
-				*data=*(ulong_ptr*)((ulong_ptr)vmcs+offset);
-				break;
+				const u32 index=(w<<8)|(t<<6)|(f<<1);
+				const u16 offset=noir_vt_vmcs_redirection[w][t]+noir_vt_vmcs_field_size[w]*f;
+				noir_vt_vmcs_field_table[index].offset=offset;
+				noir_vt_vmcs_field_table[index].size=noir_vt_vmcs_field_size[w];
+				if(w==1)
+				{
+					// 64-Bit fields can be accessed in full or in high 32 bits.
+					noir_vt_vmcs_field_table[index].size=sizeof(ulong_ptr);
+					noir_vt_vmcs_field_table[index|1].offset=offset+4;
+					noir_vt_vmcs_field_table[index|1].size=4;
+				}
 			}
 		}
+	}
+}
+
+// Returns null if the encoding does not specify an implemented field.
+noir_vt_nested_vmcs_field_p static noir_hvcode nvc_vt_get_nested_vmcs_field(u32 encoding)
+{
+	ia32_vmx_vmcs_encoding translator;
+	noir_vt_nested_vmcs_field_p field;
+	translator.value=encoding;
+	if(translator.reserved1 || translator.reserved2 || translator.field>=0x20)return null;
+	field=&noir_vt_vmcs_field_table[(translator.width<<8)|(translator.type<<6)|(translator.field<<1)|translator.hi];
+	return field->size?field:null;
+}
+
+// The software VMCS occupies a whole page, so accessing a qword at any field does not go beyond the page.
+ulong_ptr static noir_hvcode nvc_vt_read_nested_vmcs_field(void* vmcs,noir_vt_nested_vmcs_field_p field)
+{
+	const u64 mask=noir_vt_vmcs_field_mask(field->size);
+	return (ulong_ptr)(*(u64p)((ulong_ptr)vmcs+field->offset)&mask);
+}
+
+void static noir_hvcode nvc_vt_write_nested_vmcs_field(void* vmcs,noir_vt_nested_vmcs_field_p field,ulong_ptr data)
+{
+	const u64 mask=noir_vt_vmcs_field_mask(field->size);
+	u64p p=(u64p)((ulong_ptr)vmcs+field->offset);
+	*p=(*p&~mask)|((u64)data&mask);
+}
+
+bool noir_vt_nested_vmread(void* vmcs,u32 encoding,ulong_ptr* data)
+{
+	noir_vt_nested_vmcs_field_p field=nvc_vt_get_nested_vmcs_field(encoding);
+	if(field)
+	{
+		*data=nvc_vt_read_nested_vmcs_field(vmcs,field);
 		noir_vt_vmsuccess();
 		return true;
 	}
-invalid_field:
 	noir_vt_vmfail_valid();
-	noir_vt_nested_vmwrite(vmcs,vm_instruction_error,vmrw_unsupported_field);
+	nvc_vt_write_nested_vmcs_field(vmcs,nvc_vt_get_nested_vmcs_field(vm_instruction_error),vmrw_unsupported_field);
 	return false;
 }
 
 bool noir_vt_nested_vmwrite(void* vmcs,u32 encoding,ulong_ptr data)
 {
-	ia32_vmx_vmcs_encoding translator;
-	u8 w,t;
-	translator.value=encoding;
-	w=(u8)translator.width;
-	t=(u8)translator.type;
-	if(translator.field<noir_vt_vmcs_limit[w][t])
+	noir_vt_nested_vmcs_field_p field=nvc_vt_get_nested_vmcs_field(encoding);
+	if(field)
+	{
+		nvc_vt_write_nested_vmcs_field(vmcs,field,data);
+		noir_vt_vmsuccess();
+		return true;
+	}
+	noir_vt_vmfail_valid();
+	nvc_vt_write_nested_vmcs_field(vmcs,nvc_vt_get_nested_vmcs_field(vm_instruction_error),vmrw_unsupported_field);
+	return false;
+}
+
+/*
+  VMCS Shadowing...
+
+  The nested hypervisor accesses the shadow VMCS without VM-Exit for fields cleared in the vmread/vmwrite bitmaps.
+  The shadow VMCS is loaded from the software VMCS when the nested hypervisor loads a current VMCS.
+  Fields written by the nested hypervisor are synchronized back to the software VMCS lazily, i.e.:
+  when the software VMCS is consumed by nested VM-Entry, or when it is no longer current.
+*/
+
+void nvc_vt_build_shadow_vmcs_bitmaps(noir_vt_hvm_p rhvm)
+{
+	ia32_vmx_misc_msr misc_msr;
+	misc_msr.value=noir_rdmsr(ia32_vmx_misc);
+	rhvm->shadow_vmcs.readonly_fields=misc_msr.allow_any_writing_to_vmcs;
+	// Intercept all fields by default.
+	noir_stosb(rhvm->shadow_vmcs.vmread_bitmap.virt,0xff,page_size);
+	noir_stosb(rhvm->shadow_vmcs.vmwrite_bitmap.virt,0xff,page_size);
+	for(u32 i=0;i<sizeof(noir_vt_shadowed_rw_fields)/sizeof(u32);i++)
 	{
-		u16 offset=noir_vt_vmcs_redirection[w][t];
-		offset+=noir_vt_vmcs_field_size[w]*translator.field;
-		switch(w)
+		if(nvc_vt_get_nested_vmcs_field(noir_vt_shadowed_rw_fields[i]))
 		{
-			case 0:
-			{
-				if(translator.hi)goto invalid_field;
-				*(u16*)((ulong_ptr)vmcs+offset)=(u16)data;
-				break;
-			}
-			case 1:
-			{
-#if defined(_amd64)
-				if(translator.hi)
-					*(u32*)((u64)vmcs+offset+4)=(u32)data;
-				else
-					*(u64*)((u64)vmcs+offset)=data;
-#else
-				offset+=translator.hi<<2;
-				*(u32*)((u32)vmcs+offset)=data;
-#endif
-				break;
-			}
-			case 2:
+			noir_reset_bitmap(rhvm->shadow_vmcs.vmread_bitmap.virt,noir_vt_shadowed_rw_fields[i]);
+			noir_reset_bitmap(rhvm->shadow_vmcs.vmwrite_bitmap.virt,noir_vt_shadowed_rw_fields[i]);
+		}
+	}
+	// Read-only fields are never written by nested hypervisor without VM-Exit.
+	if(rhvm->shadow_vmcs.readonly_fields)
+		for(u32 i=0;i<sizeof(noir_vt_shadowed_ro_fields)/sizeof(u32);i++)
+			if(nvc_vt_get_nested_vmcs_field(noir_vt_shadowed_ro_fields[i]))
+				noir_reset_bitmap(rhvm->shadow_vmcs.vmread_bitmap.virt,noir_vt_shadowed_ro_fields[i]);
+}
+
+// Load the shadow VMCS from the current software VMCS and enable it.
+void noir_hvcode nvc_vt_load_shadow_vmcs(noir_vt_vcpu_p vcpu)
+{
+	noir_vt_nested_vcpu_p nested_vcpu=&vcpu->nested_vcpu;
+	if(nested_vcpu->vmcs_s.virt && nested_vcpu->vmcs_c.virt)
+	{
+		noir_vt_nested_vmcs_field_p field;
+		noir_vt_vmptrld(&nested_vcpu->vmcs_s.phys);
+		for(u32 i=0;i<sizeof(noir_vt_shadowed_rw_fields)/sizeof(u32);i++)
+		{
+			field=nvc_vt_get_nested_vmcs_field(noir_vt_shadowed_rw_fields[i]);
+			if(field)noir_vt_vmwrite(noir_vt_shadowed_rw_fields[i],nvc_vt_read_nested_vmcs_field(nested_vcpu->vmcs_c.virt,field));
+		}
+		if(vcpu->relative_hvm->shadow_vmcs.readonly_fields)
+		{
+			for(u32 i=0;i<sizeof(noir_vt_shadowed_ro_fields)/sizeof(u32);i++)
 			{
-				if(translator.hi)goto invalid_field;
-				*(u32*)((ulong_ptr)vmcs+offset)=(u32)data;
-				break;
+				field=nvc_vt_get_nested_vmcs_field(noir_vt_shadowed_ro_fields[i]);
+				if(field)noir_vt_vmwrite(noir_vt_shadowed_ro_fields[i],nvc_vt_read_nested_vmcs_field(nested_vcpu->vmcs_c.virt,field));
 			}
-			case 3:
+		}
+		noir_vt_vmptrld(&vcpu->vmcs.phys);
+		noir_vt_vmwrite64(vmcs_link_pointer,nested_vcpu->vmcs_s.phys);
+	}
+}
+
+// Write fields modified by the nested hypervisor back to the current software VMCS.
+void noir_hvcode nvc_vt_sync_shadow_vmcs(noir_vt_vcpu_p vcpu)
+{
+	noir_vt_nested_vcpu_p nested_vcpu=&vcpu->nested_vcpu;
+	if(nested_vcpu->vmcs_s.virt && nested_vcpu->vmcs_c.virt)
+	{
+		noir_vt_vmptrld(&nested_vcpu->vmcs_s.phys);
+		for(u32 i=0;i<sizeof(noir_vt_shadowed_rw_fields)/sizeof(u32);i++)
+		{
+			noir_vt_nested_vmcs_field_p field=nvc_vt_get_nested_vmcs_field(noir_vt_shadowed_rw_fields[i]);
+			if(field)
 			{
-				if(translator.hi)goto invalid_field;
-				*(ulong_ptr*)((ulong_ptr)vmcs+offset)=data;
-				break;
+				ulong_ptr data;
+				noir_vt_vmread(noir_vt_shadowed_rw_fields[i],&data);
+				nvc_vt_write_nested_vmcs_field(nested_vcpu->vmcs_c.virt,field,data);
 			}
 		}
-		noir_vt_vmsuccess();
-		return true;
+		noir_vt_vmptrld(&vcpu->vmcs.phys);
+	}
+}
+
+// Synchronize and disable the shadow VMCS before the software VMCS is no longer current.
+// Nested hypervisor would receive VMfailInvalid on vmread/vmwrite without VM-Exit afterwards.
+void noir_hvcode nvc_vt_unload_shadow_vmcs(noir_vt_vcpu_p vcpu)
+{
+	if(vcpu->nested_vcpu.vmcs_s.virt)
+	{
+		nvc_vt_sync_shadow_vmcs(vcpu);
+		noir_vt_vmwrite64(vmcs_link_pointer,maxu64);
 	}
-invalid_field:
-	noir_vt_vmfail_valid();
-	// This won't cause a dead recursive call.
-	noir_vt_nested_vmwrite(vmcs,vm_instruction_error,vmrw_unsupported_field);
-	return false;
 }
 
 void noir_vt_vmfail(noir_vt_nested_vcpu_p nested_vcpu,u32 message)
@@ -433,7 +433,7 @@ typedef struct _noir_mshv_enlightened_vmcs
 
 /*
   VMCS Field has following encodings;
-  31					14	12	12	10			1	0
+  31					15	13	12	10			1	0
   +---------------------+---+---+---+-----------+---+
   | Reserved			| W | R | T | Field		| H	|
   +---------------------+---+---+---+-----------+---+
@@ -448,15 +448,27 @@ typedef union _ia32_vmx_vmcs_encoding
 	struct
 	{
 		u32 hi:1;
-		u32 field:10;
+		u32 field:9;
 		u32 type:2;
 		u32 reserved1:1;
 		u32 width:2;
-		u32 reserved2:18;
+		u32 reserved2:17;
 	};
 	u32 value;
 }ia32_vmx_vmcs_encoding,*ia32_vmx_vmcs_encoding_p;
 
+// Field of the software VMCS. A field of zero size is not implemented.
+typedef struct _noir_vt_nested_vmcs_field
+{
+	u16 offset;
+	u8 size;
+	u8 reserved;
+}noir_vt_nested_vmcs_field,*noir_vt_nested_vmcs_field_p;
+
+// Index to the field table consists of width, type, field and high-access bits.
+#define noir_vt_vmcs_field_table_size	0x400
+#define noir_vt_vmcs_field_mask(s)		(maxu64>>(64-((s)<<3)))
+
 #if defined(_vt_nvcpu)
 const u16 noir_vt_vmcs_redirection[4][4]=
 {
@@ -477,6 +489,42 @@ const u8 noir_vt_vmcs_limit[4][4]=
 };
 
 noir_hvdata const u8 noir_vt_vmcs_field_size[4]={2,8,4,sizeof(void*)};
+
+noir_hvdata noir_vt_nested_vmcs_field noir_vt_vmcs_field_table[noir_vt_vmcs_field_table_size];
+
+// Fields accessed by nested hypervisor without VM-Exit if VMCS shadowing is enabled.
+// Fields not implemented in the software VMCS are skipped.
+noir_hvdata const u32 noir_vt_shadowed_rw_fields[]=
+{
+	// Guest Segment Selectors
+	guest_es_selector,guest_cs_selector,guest_ss_selector,guest_ds_selector,
+	guest_fs_selector,guest_gs_selector,guest_ldtr_selector,guest_tr_selector,
+	// Guest Segment Limits
+	guest_es_limit,guest_cs_limit,guest_ss_limit,guest_ds_limit,guest_fs_limit,
+	guest_gs_limit,guest_ldtr_limit,guest_tr_limit,guest_gdtr_limit,guest_idtr_limit,
+	// Guest Segment Access Rights
+	guest_es_access_rights,guest_cs_access_rights,guest_ss_access_rights,guest_ds_access_rights,
+	guest_fs_access_rights,guest_gs_access_rights,guest_ldtr_access_rights,guest_tr_access_rights,
+	// Guest Segment Bases
+	guest_es_base,guest_cs_base,guest_ss_base,guest_ds_base,guest_fs_base,
+	guest_gs_base,guest_ldtr_base,guest_tr_base,guest_gdtr_base,guest_idtr_base,
+	// Guest Registers
+	guest_cr0,guest_cr3,guest_cr4,guest_dr7,guest_rsp,guest_rip,guest_rflags,
+	guest_interruptibility_state,guest_activity_state,guest_pending_debug_exceptions,
+	// Event Injection
+	vmentry_interruption_information_field,vmentry_exception_error_code,vmentry_instruction_length,
+	// Control Register Shadows
+	cr0_read_shadow,cr4_read_shadow
+};
+
+// Read-only fields can be shadowed only if vmwrite to read-only fields is allowed.
+noir_hvdata const u32 noir_vt_shadowed_ro_fields[]=
+{
+	vmexit_reason,vmexit_qualification,vmexit_instruction_length,vmexit_instruction_information,
+	vmexit_interruption_information,vmexit_interruption_error_code,
+	idt_vectoring_information,idt_vectoring_error_code,
+	guest_linear_address,guest_physical_address
+};
 #endif
 
 // This structure should have 256 bytes at maximum
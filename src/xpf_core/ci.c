@@ -22,16 +22,55 @@
 #include <ci.h>
 
 // Use CRC32 Castagnoli Algorithm.
-u32 static stdcall noir_crc32_page_std(void* page)
+// Slicing-by-8 consumes eight bytes per iteration with independent table lookups.
+// The checksum is seeded with zero so that the result is identical to the
+// crc32 instruction. This kernel does not touch XMM registers, so it is also
+// used to verify pages in the VM-Exit handler where guest XMM state is live.
+u32 static stdcall noir_crc32_page_slice8(void* page)
 {
-	u8* buf=(u8*)page;
-	u32 crc=0xffffffff;
-	for(u32 i=0;i<page_size;i++)
+	u32* buf=(u32*)page;
+	u32 crc=0;
+	for(u32 i=0;i<page_size>>2;i+=2)
 	{
-		u8 crc_index=(u8)(crc^(buf[i]&0xff));
-        crc=crc32c_table[crc_index]^(crc>>8);
-    }
-    return crc;
+		u32 lo=buf[i]^crc,hi=buf[i+1];
+		crc=crc32c_slice_table[7][lo&0xff]^crc32c_slice_table[6][(lo>>8)&0xff];
+		crc^=crc32c_slice_table[5][(lo>>16)&0xff]^crc32c_slice_table[4][lo>>24];
+		crc^=crc32c_slice_table[3][hi&0xff]^crc32c_slice_table[2][(hi>>8)&0xff];
+		crc^=crc32c_slice_table[1][(hi>>16)&0xff]^crc32c_slice_table[0][hi>>24];
+	}
+	return crc;
+}
+
+// Derive the slicing tables from the byte-at-a-time table.
+void static noir_crc32_build_slice_table()
+{
+	for(u32 i=0;i<256;i++)
+	{
+		u32 crc=crc32c_table[i];
+		crc32c_slice_table[0][i]=crc;
+		for(u32 j=1;j<8;j++)
+		{
+			crc=crc32c_table[crc&0xff]^(crc>>8);
+			crc32c_slice_table[j][i]=crc;
+		}
+	}
+}
+
+// Select the fastest CRC32C kernel supported by the processor.
+// Pages must be checksummed by the same kernel throughout the lifetime of CI.
+void static noir_crc32_select_kernel()
+{
+	noir_crc32_build_slice_table();
+	if(noir_check_sse42())
+	{
+		// Three-way interleaved kernel requires PCLMULQDQ to combine the streams.
+		if(noir_check_pclmulqdq())
+			noir_crc32_page=noir_crc32_page_sse_x3;
+		else
+			noir_crc32_page=noir_crc32_page_sse;
+	}
+	else
+		noir_crc32_page=noir_crc32_page_slice8;
 }
 
 // This function checks the basic SLAT capability.
@@ -88,23 +127,78 @@ svm_check:
 	return false;
 }
 
-bool noir_hvcode fastcall noir_ci_is_ci_phys_page(u64 phys,void** virt)
+noir_ci_page_p static noir_hvcode fastcall noir_ci_search_phys_page(u64 phys)
 {
 	u32 lo=0,hi=noir_ci->pages;
-	while(lo<=hi)
+	// Pages are sorted by physical address on activation.
+	while(lo<hi)
 	{
 		u32 mid=(lo+hi)>>1;
 		if(phys<noir_ci->page_ci[mid].phys)
-			hi=mid-1;
+			hi=mid;
 		else if(phys>=noir_ci->page_ci[mid].phys+page_size)
 			lo=mid+1;
 		else
+			return &noir_ci->page_ci[mid];
+	}
+	return null;
+}
+
+bool noir_hvcode fastcall noir_ci_is_ci_phys_page(u64 phys,void** virt)
+{
+	noir_ci_page_p page=noir_ci?noir_ci_search_phys_page(phys):null;
+	if(page)
+	{
+		if(virt)*virt=(void*)((ulong_ptr)page->virt+page_offset(phys));
+		return true;
+	}
+	return false;
+}
+
+// Restore the page from its snapshot through a writable view of the page.
+// The snapshot is verified first, because it is not protected by SLAT.
+bool static noir_hvcode fastcall noir_ci_restore_page(noir_ci_page_p page,void* view)
+{
+	// Do not use the selected kernel here: it may clobber guest XMM registers.
+	if(page->snapshot==null || noir_crc32_page_slice8(page->snapshot)!=page->crc)return false;
+	noir_movsq(view,page->snapshot,page_size>>3);
+	noir_locked_inc(&noir_ci->restorations);
+	return true;
+}
+
+/*
+  Pages protected by Hardware-Enforced CI are mapped read-only in SLAT.
+  Hence the write that caused the fault never reaches the page. It is
+  discarded by the caller advancing the instruction pointer, which
+  restores the page to its protected state.
+  The page is verified on such faults, so that corruption from paths
+  outside of SLAT (e.g.: DMA or aliased mappings) is detected promptly,
+  rather than waiting for the background audit to reach the page.
+  A corrupted page is restored from its snapshot. This function is only
+  called by VM-Exit handlers, where the host CR3 identity-maps the lowest
+  512GiB of physical memory as writable.
+*/
+u32 noir_hvcode fastcall noir_ci_verify_on_write_fault(u64 phys,void** virt)
+{
+	noir_ci_page_p page=noir_ci?noir_ci_search_phys_page(phys):null;
+	if(page)
+	{
+		if(virt)*virt=(void*)((ulong_ptr)page->virt+page_offset(phys));
+		noir_locked_inc(&page->write_faults);
+		noir_locked_inc(&noir_ci->write_faults);
+		// Mutable pages are legitimately written by NoirVisor. Their checksums are meaningless.
+		if(!page->options.immutable)return noir_ci_fault_discarded;
+		// Do not use the selected kernel here: it may clobber guest XMM registers.
+		if(noir_crc32_page_slice8(page->virt)!=page->crc)
 		{
-			if(virt)*virt=(void*)((ulong_ptr)noir_ci->page_ci[mid].virt+page_offset(phys));
-			return true;
+			noir_locked_inc(&noir_ci->corruptions);
+			if(page->phys<page_512gb_size && noir_ci_restore_page(page,(void*)page->phys))
+				return noir_ci_fault_restored;
+			return noir_ci_fault_corrupted;
 		}
+		return noir_ci_fault_discarded;
 	}
-	return false;
+	return noir_ci_fault_not_protected;
 }
 
 #if !defined(_hv_type1)
@@ -123,11 +217,25 @@ u32 static noir_hvcode stdcall noir_ci_enforcement_worker(void* context)
 		// Perform Enforcement.
 		u32 crc=noir_crc32_page(page);
 		if(crc!=ncie->page_ci[i].crc)
-			nvci_panicf("CI detected corruption in Page 0x%p!\n",page);
+		{
+			// Restore the page through a new mapping. If the page is write-protected in SLAT,
+			// the write faults and the VM-Exit handler restores the page instead.
+			void* view=noir_map_physical_memory(ncie->page_ci[i].phys,page_size);
+			if(view)
+			{
+				noir_ci_restore_page(&ncie->page_ci[i],view);
+				noir_unmap_physical_memory(view,page_size);
+			}
+			if(noir_crc32_page(page)==ncie->page_ci[i].crc)
+				nvci_panicf("CI detected corruption in Page 0x%p! The page is restored from its snapshot.\n",page);
+			else
+				nvci_panicf("CI detected corruption in Page 0x%p!\n",page);
+		}
 		else
 			nvci_tracef("Page 0x%p scanned. CRC32C=0x%08X - No Anomaly.\n",page,crc);
-		// Clock.
-		noir_sleep(ci_enforcement_delay);
+		// Clock. Write-protected pages are verified on write faults.
+		// Scanning them is merely an audit so that it is less frequent.
+		noir_sleep(ncie->page_ci[i].options.hard_ci?ci_audit_delay:ci_enforcement_delay);
 skip_page:
 		// Advance the CI page.
 		if(noir_ci_selected_page==ncie->pages)noir_ci_selected_page=0;
@@ -149,6 +257,15 @@ i32 static cdecl noir_ci_sorting_comparator(const void* a,const void*b)
 	return 0;
 }
 
+void static noir_ci_free_snapshots()
+{
+	for(u32 i=0;i<noir_ci->pages;i++)
+	{
+		if(noir_ci->page_ci[i].snapshot)noir_free_nonpg_memory(noir_ci->page_ci[i].snapshot);
+		noir_ci->page_ci[i].snapshot=null;
+	}
+}
+
 bool noir_add_section_to_ci(void* base,u32 size,bool enable_scan)
 {
 	const u32 page_num=bytes_to_pages(size);
@@ -162,6 +279,24 @@ bool noir_add_section_to_ci(void* base,u32 size,bool enable_scan)
 		noir_ci->page_ci[i].options.value=0;
 		noir_ci->page_ci[i].options.soft_ci=enable_scan?noir_ci->options.soft_ci:false;
 		noir_ci->page_ci[i].options.hard_ci=noir_ci->options.hard_ci;
+		noir_ci->page_ci[i].options.immutable=enable_scan;
+		noir_ci->page_ci[i].write_faults=0;
+		// Immutable pages are restored from their snapshots if they are corrupted.
+		noir_ci->page_ci[i].snapshot=enable_scan?noir_alloc_nonpg_memory(page_size):null;
+		if(enable_scan)
+		{
+			if(noir_ci->page_ci[i].snapshot==null)
+			{
+				// Do not leave the pages of this section half-initialized.
+				for(u32 j=noir_ci->pages;j<i;j++)
+				{
+					noir_free_nonpg_memory(noir_ci->page_ci[j].snapshot);
+					noir_ci->page_ci[j].snapshot=null;
+				}
+				return false;
+			}
+			noir_copy_memory(noir_ci->page_ci[i].snapshot,noir_ci->page_ci[i].virt,page_size);
+		}
 	}
 	noir_ci->pages+=page_num;
 	return true;
@@ -183,6 +318,7 @@ bool noir_activate_ci()
 			goto activation;
 		else
 		{
+			noir_ci_free_snapshots();
 			noir_free_contd_memory(noir_ci,page_size);
 			return false;
 		}
@@ -203,17 +339,14 @@ bool noir_initialize_ci(bool soft_ci,bool hard_ci)
 	// If both are disabled, fail the Code Integrity initialization.
 	if(use_hard || soft_ci)
 	{
-		// Check supportability of SSE4.2.
-		if(noir_check_sse42())
-			noir_crc32_page=noir_crc32_page_sse;
-		else
-			noir_crc32_page=noir_crc32_page_std;
+		// CRC32C kernel must be selected before any section is added to CI.
+		noir_crc32_select_kernel();
 		noir_ci=noir_alloc_contd_memory(page_size);
 		if(noir_ci)
 		{
 			noir_ci->limit=(page_size-sizeof(noir_ci_context))/sizeof(noir_ci_page);
 			noir_ci->options.soft_ci=soft_ci;
-			noir_ci->options.hard_ci=hard_ci;
+			noir_ci->options.hard_ci=use_hard;
 			// Add CI page to protection. Do not enable scanner. Otherwise CI will always report corruption.
 			if(noir_add_section_to_ci(noir_ci,page_size,false))
 				return true;
@@ -237,6 +370,7 @@ void noir_finalize_ci()
 		noir_join_thread(noir_ci->ci_thread);
 #endif
 		// Finalization.
+		noir_ci_free_snapshots();
 		noir_free_contd_memory(noir_ci,page_size);
 		noir_ci=null;
 	}
@@ -0,0 +1,65 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file is the Halt-Polling policy for Customizable VMs.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /xpf_core/cvhalt.c
+*/
+
+#include <nvdef.h>
+#include <nvbdk.h>
+#include <nvstatus.h>
+#include <cvm_hvm.h>
+
+/*
+  Functions in this file operate on the halt-polling structure only. Time is
+  measured in TSC ticks and is passed by the caller. They do not call any
+  intrinsics or access the hypervisor structures, so that they can be built
+  into a user-mode simulator with synthetic arrival traces as is.
+
+  The window adapts to the time that the vCPU stayed halted:
+  - If the vCPU is woken up within the window, the window is kept.
+  - If the vCPU is woken up after the window, but within the maximum, the window grows.
+  - If the vCPU stays halted longer than the maximum, polling is wasted. The window shrinks.
+  A window shrunk below the initial window is reset to zero, so that idle vCPUs do not poll.
+*/
+
+u64 static noir_hvcode nvc_cvm_halt_poll_initial_window(noir_cvm_halt_poll_p poll)
+{
+	return poll->window_max>>noir_cvm_halt_poll_initial_shift;
+}
+
+void noir_hvcode nvc_cvm_halt_poll_set_max_window(noir_cvm_halt_poll_p poll,u64 window_max)
+{
+	poll->window_max=window_max;
+	if(poll->window>window_max)poll->window=window_max;
+}
+
+void noir_hvcode nvc_cvm_halt_poll_grow(noir_cvm_halt_poll_p poll)
+{
+	const u64 initial=nvc_cvm_halt_poll_initial_window(poll);
+	poll->window=poll->window<initial?initial:poll->window<<1;
+	if(poll->window>poll->window_max)poll->window=poll->window_max;
+}
+
+void noir_hvcode nvc_cvm_halt_poll_shrink(noir_cvm_halt_poll_p poll)
+{
+	poll->window>>=1;
+	if(poll->window<nvc_cvm_halt_poll_initial_window(poll))poll->window=0;
+}
+
+// Adjust the window according to the TSC ticks that the vCPU stayed halted.
+void noir_hvcode nvc_cvm_halt_poll_update(noir_cvm_halt_poll_p poll,u64 halted_ticks)
+{
+	if(halted_ticks<=poll->window)return;
+	if(halted_ticks>poll->window_max)
+		nvc_cvm_halt_poll_shrink(poll);
+	else
+		nvc_cvm_halt_poll_grow(poll);
+}
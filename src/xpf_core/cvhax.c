@@ -17,6 +17,7 @@
 #include <nvstatus.h>
 #include <noirhvm.h>
 #include <nv_intrin.h>
+#include <amd64.h>
 
 noir_status nvc_hax_get_version_info(void* buffer,u32 size,u32p return_size)
 {
@@ -39,6 +40,7 @@ noir_status nvc_hax_get_capability(void* buffer,u32 size,u32p return_size)
 	{
 		cap_info->status=noir_hax_cap_status_working;
 		cap_info->info=noir_hax_cap_ept;
+		cap_info->info|=noir_hax_cap_fastmmio;
 		cap_info->info|=noir_hax_cap_ug;
 		cap_info->info|=noir_hax_cap_64bit_ramblock;
 		cap_info->info|=noir_hax_cap_64bit_setram;
@@ -84,6 +86,8 @@ noir_status nvc_hax_set_tunnel(noir_cvm_virtual_cpu_p vcpu,void* tunnel,void* io
 	vcpu->tunnel=tunnel;
 	vcpu->iobuff=iobuff;
 	vcpu->vcpu_options.use_tunnel=true;
+	// Fast MMIO requires the decoded memory access instruction.
+	vcpu->vcpu_options.decode_memory_access_instruction=true;
 	vcpu->vcpu_options.tunnel_format=noir_cvm_tunnel_format_haxm;
 	return noir_success;
 }
@@ -230,88 +234,29 @@ noir_status nvc_hax_set_fpu_state(noir_cvm_virtual_cpu_p vcpu,void* buffer,u32 s
 noir_status nvc_hax_set_msrs(noir_cvm_virtual_cpu_p vcpu,void* buffer,u32 size,u32p return_size)
 {
 	noir_status st=noir_buffer_too_small;
-	if(sizeof(noir_hax_msr_data)<=size)
+	if(return_size)*return_size=0;
+	if(field_offset(noir_hax_msr_data,entries)<=size)
 	{
 		st=noir_hypervision_absent;
 		if(hvm_p)
 		{
 			noir_hax_msr_data_p msr_info=(noir_hax_msr_data_p)buffer;
-			if(msr_info->nr_msr>=hax_max_msr_array)
+			const u32 required_size=(u32)(field_offset(noir_hax_msr_data,entries)+msr_info->nr_msr*sizeof(noir_hax_vmx_msr));
+			if(msr_info->nr_msr>noir_cvm_msr_transfer_limit)
 				st=noir_invalid_parameter;
+			else if(required_size>size)
+				st=noir_buffer_too_small;
 			else
 			{
-				for(u16 i=0;i<msr_info->nr_msr;i++)
+				msr_info->done=(u16)nvc_edit_vcpu_msr_list(vcpu,(noir_cvm_msr_entry_p)msr_info->entries,msr_info->nr_msr);
+				if(msr_info->done<msr_info->nr_msr)
 				{
-					switch(msr_info->entries[i].entry)
-					{
-						case hax_msr_tsc:
-						{
-							vcpu->tsc_offset=msr_info->entries[i].value-noir_rdtsc();
-							vcpu->state_cache.ts_valid=false;
-							break;
-						}
-						case hax_msr_sysenter_cs:
-						{
-							vcpu->msrs.sysenter_cs=msr_info->entries[i].value;
-							vcpu->state_cache.se_valid=false;
-							break;
-						}
-						case hax_msr_sysenter_esp:
-						{
-							vcpu->msrs.sysenter_esp=msr_info->entries[i].value;
-							vcpu->state_cache.se_valid=false;
-							break;
-						}
-						case hax_msr_sysenter_eip:
-						{
-							vcpu->msrs.sysenter_eip=msr_info->entries[i].value;
-							vcpu->state_cache.se_valid=false;
-							break;
-						}
-						case hax_msr_efer:
-						{
-							vcpu->msrs.efer=msr_info->entries[i].value;
-							vcpu->state_cache.ef_valid=false;
-							break;
-						}
-						case hax_msr_star:
-						{
-							vcpu->msrs.star=msr_info->entries[i].value;
-							vcpu->state_cache.sc_valid=false;
-							break;
-						}
-						case hax_msr_lstar:
-						{
-							vcpu->msrs.lstar=msr_info->entries[i].value;
-							vcpu->state_cache.sc_valid=false;
-							break;
-						}
-						case hax_msr_cstar:
-						{
-							vcpu->msrs.cstar=msr_info->entries[i].value;
-							vcpu->state_cache.sc_valid=false;
-							break;
-						}
-						case hax_msr_fmask:
-						{
-							vcpu->msrs.sfmask=msr_info->entries[i].value;
-							vcpu->state_cache.sc_valid=false;
-							break;
-						}
-						case hax_msr_kernel_gs_base:
-						{
-							vcpu->msrs.gsswap=msr_info->entries[i].value;
-							vcpu->state_cache.fg_valid=false;
-							break;
-						}
-						default:
-						{
-							nv_dprintf("[HAXM] Setting unknown MSR (0x%llX)!",msr_info->entries[i].entry);
-							return noir_invalid_parameter;
-						}
-					}
+					nv_dprintf("[HAXM] Setting unknown MSR (0x%llX)!\n",msr_info->entries[msr_info->done].entry);
+					st=noir_invalid_parameter;
 				}
-				st=noir_success;
+				else
+					st=noir_success;
+				if(return_size)*return_size=required_size;
 			}
 		}
 	}
@@ -321,85 +266,158 @@ noir_status nvc_hax_set_msrs(noir_cvm_virtual_cpu_p vcpu,void* buffer,u32 size,u
 noir_status nvc_hax_get_msrs(noir_cvm_virtual_cpu_p vcpu,void* buffer,u32 size,u32p return_size)
 {
 	noir_status st=noir_buffer_too_small;
-	if(sizeof(noir_hax_msr_data)<=size)
+	if(return_size)*return_size=0;
+	if(field_offset(noir_hax_msr_data,entries)<=size)
 	{
 		st=noir_hypervision_absent;
 		if(hvm_p)
 		{
 			noir_hax_msr_data_p msr_info=(noir_hax_msr_data_p)buffer;
-			if(msr_info->nr_msr>=hax_max_msr_array)
+			const u32 required_size=(u32)(field_offset(noir_hax_msr_data,entries)+msr_info->nr_msr*sizeof(noir_hax_vmx_msr));
+			if(msr_info->nr_msr>noir_cvm_msr_transfer_limit)
 				st=noir_invalid_parameter;
+			else if(required_size>size)
+				st=noir_buffer_too_small;
 			else
 			{
 				nvc_synchronize_vcpu_state(vcpu);
-				for(u16 i=0;i<msr_info->nr_msr;i++)
+				msr_info->done=(u16)nvc_view_vcpu_msr_list(vcpu,(noir_cvm_msr_entry_p)msr_info->entries,msr_info->nr_msr);
+				if(msr_info->done<msr_info->nr_msr)
 				{
-					switch(msr_info->entries[i].entry)
-					{
-						case hax_msr_tsc:
-						{
-							msr_info->entries[i].value=vcpu->tsc_offset+noir_rdtsc();
-							break;
-						}
-						case hax_msr_sysenter_cs:
-						{
-							msr_info->entries[i].value=vcpu->msrs.sysenter_cs;
-							break;
-						}
-						case hax_msr_sysenter_esp:
-						{
-							msr_info->entries[i].value=vcpu->msrs.sysenter_esp;
-							break;
-						}
-						case hax_msr_sysenter_eip:
-						{
-							msr_info->entries[i].value=vcpu->msrs.sysenter_eip;
-							break;
-						}
-						case hax_msr_efer:
-						{
-							msr_info->entries[i].value=vcpu->msrs.efer;
-							break;
-						}
-						case hax_msr_star:
-						{
-							msr_info->entries[i].value=vcpu->msrs.star;
-							break;
-						}
-						case hax_msr_lstar:
-						{
-							msr_info->entries[i].value=vcpu->msrs.lstar;
-							break;
-						}
-						case hax_msr_cstar:
-						{
-							msr_info->entries[i].value=vcpu->msrs.cstar;
-							break;
-						}
-						case hax_msr_fmask:
-						{
-							msr_info->entries[i].value=vcpu->msrs.sfmask;
-							break;
-						}
-						case hax_msr_kernel_gs_base:
-						{
-							msr_info->entries[i].value=vcpu->msrs.gsswap;
-							break;
-						}
-						default:
-						{
-							nv_dprintf("[HAXM] Getting unknown MSR (0x%llX)!",msr_info->entries[i].entry);
-							return noir_invalid_parameter;
-						}
-					}
+					nv_dprintf("[HAXM] Getting unknown MSR (0x%llX)!\n",msr_info->entries[msr_info->done].entry);
+					st=noir_invalid_parameter;
 				}
-				st=noir_success;
+				else
+					st=noir_success;
+				if(return_size)*return_size=required_size;
 			}
 		}
 	}
 	return st;
 }
 
+// Writing to the 32-bit form of a register clears the high 32 bits. Narrower writes merge into the register.
+u64 static nvc_hax_merge_register(u64 old_value,u64 new_value,u32 size)
+{
+	switch(size)
+	{
+		case 1:return (old_value&~(u64)0xff)|(new_value&0xff);
+		case 2:return (old_value&~(u64)0xffff)|(new_value&0xffff);
+		case 4:return new_value&maxu32;
+	}
+	return new_value;
+}
+
+// Transfer as many elements of the string I/O as the I/O buffer can hold,
+// so that "rep ins/outs" does not cost one VM-Exit per element.
+// Update the registers as if the elements in the I/O Buffer are transferred.
+// Returns true if no more elements are left, in that the instruction is completed.
+bool static nvc_hax_advance_string_io(noir_cvm_virtual_cpu_p vcpu,noir_hax_tunnel_p htun)
+{
+	noir_cvm_io_context_p io=&vcpu->exit_context.io;
+	const u32 width=io->access.address_width;
+	const u64 width_mask=width>=8?maxu64:((u64)1<<(width<<3))-1;
+	const u64 count=htun->io.count;
+	const u64 length=count*htun->io.size;
+	if(htun->io.direction)
+		vcpu->gpr.rdi=nvc_hax_merge_register(io->rdi,htun->io.df?io->rdi-length:io->rdi+length,width);
+	else
+		vcpu->gpr.rsi=nvc_hax_merge_register(io->rsi,htun->io.df?io->rsi-length:io->rsi+length,width);
+	if(io->access.repeat)vcpu->gpr.rcx=nvc_hax_merge_register(io->rcx,io->rcx-count,width);
+	vcpu->state_cache.gprvalid=false;
+	return io->access.repeat?(io->rcx&width_mask)==count:true;
+}
+
+bool static nvc_hax_translate_string_io(noir_cvm_virtual_cpu_p vcpu,noir_hax_tunnel_p htun,bool *complete)
+{
+	noir_cvm_io_context_p io=&vcpu->exit_context.io;
+	const u32 width=io->access.address_width;
+	const u64 width_mask=width>=8?maxu64:((u64)1<<(width<<3))-1;
+	const u64 index=htun->io.direction?io->rdi:io->rsi;
+	u64 count=io->access.repeat?io->rcx&width_mask:1;
+	u64 length,offset;
+	htun->io.count=0;
+	// Nothing to be transferred if the repetition count is zero. The instruction is completed at once.
+	*complete=true;
+	if(count==0)return true;
+	// Guest memory can be written by SVM-Core only. Do not let the VMM input the data that cannot be delivered.
+	if(htun->io.direction && hvm_p->selected_core!=use_svm_core)return false;
+	if(count>page_size/htun->io.size)count=page_size/htun->io.size;
+	length=count*htun->io.size;
+	htun->io.df=(u8)noir_bt((u32p)&vcpu->rflags,amd64_rflags_df);
+	htun->io.count=(u16)count;
+	// I/O Buffer is laid out in ascending order, regardless of the direction flag.
+	offset=htun->io.df?index-length+htun->io.size:index;
+	htun->io.gva=io->segment.base+(offset&width_mask);
+	// For ins instruction, the registers are updated when the I/O Buffer is copied to guest on resumption.
+	*complete=false;
+	if(htun->io.direction)return true;
+	// For outs instruction, output buffer must be copied to I/O Buffer.
+	if(nvc_operate_guest_memory(vcpu,htun->io.gva,vcpu->iobuff,(u32)length,false,true)!=noir_success)return false;
+	*complete=nvc_hax_advance_string_io(vcpu,htun);
+	return true;
+}
+
+bool static nvc_hax_translate_fast_mmio(noir_cvm_virtual_cpu_p vcpu,noir_hax_tunnel_p htun)
+{
+	noir_cvm_memory_access_context_p mem=&vcpu->exit_context.memory_access;
+	noir_hax_fastmmio_p fast_mmio=(noir_hax_fastmmio_p)vcpu->iobuff;
+	const u64p gpr_array=(u64p)&vcpu->gpr;
+	// Only decoded mov instructions are translated into Fast MMIO.
+	if(!mem->flags.decoded || mem->access.execute)return false;
+	if(mem->flags.instruction_code!=noir_cvm_instruction_code_mov)return false;
+	if(mem->flags.operand_code>=sizeof(noir_gpr_state)/sizeof(u64))return false;
+	fast_mmio->gpa=mem->gpa;
+	fast_mmio->size=(u8)mem->flags.operand_size;
+	fast_mmio->direction=(u8)mem->access.write;
+	fast_mmio->reg_index=(u16)mem->flags.operand_code;
+	fast_mmio->pad=0;
+	// Control registers are not fetched on every VM-Exit. QEMU does not consume them.
+	fast_mmio->cr0=fast_mmio->cr2=fast_mmio->cr3=fast_mmio->cr4=0;
+	switch(mem->flags.operand_class)
+	{
+		case noir_cvm_operand_class_gpr:
+		{
+			if(mem->access.write)fast_mmio->value=gpr_array[mem->flags.operand_code];
+			break;
+		}
+		case noir_cvm_operand_class_gpr8hi:
+		{
+			if(mem->access.write)fast_mmio->value=gpr_array[mem->flags.operand_code]>>8;
+			break;
+		}
+		case noir_cvm_operand_class_immediate:
+		{
+			// Immediate operand can only be the source.
+			if(!mem->access.write)return false;
+			fast_mmio->value=mem->operand.imm.u;
+			break;
+		}
+		default:
+		{
+			return false;
+		}
+	}
+	htun->exit_status=hax_exit_fast_mmio;
+	return true;
+}
+
+// MMIO reads are completed when the vCPU is resumed.
+void static nvc_hax_complete_fast_mmio(noir_cvm_virtual_cpu_p vcpu)
+{
+	noir_cvm_memory_access_context_p mem=&vcpu->exit_context.memory_access;
+	noir_hax_fastmmio_p fast_mmio=(noir_hax_fastmmio_p)vcpu->iobuff;
+	u64p gpr=&((u64p)&vcpu->gpr)[mem->flags.operand_code];
+	if(vcpu->exit_context.intercept_code==cv_memory_access && !mem->access.write)
+	{
+		if(mem->flags.operand_class==noir_cvm_operand_class_gpr8hi)
+			*gpr=(*gpr&~(u64)0xff00)|((fast_mmio->value&0xff)<<8);
+		else
+			*gpr=nvc_hax_merge_register(*gpr,fast_mmio->value,(u32)mem->flags.operand_size);
+		vcpu->state_cache.gprvalid=false;
+	}
+}
+
 noir_status nvc_hax_run_vcpu(noir_cvm_virtual_cpu_p vcpu)
 {
 	noir_status st;
@@ -409,21 +427,31 @@ noir_status nvc_hax_run_vcpu(noir_cvm_virtual_cpu_p vcpu)
 		// Input operation has post-processing procedures...
 		if(htun->io.flags.string)
 		{
-			// FIXME: For ins instructions, I/O buffer must be copied to input buffer.
-			;
+			// For ins instructions, I/O buffer must be copied to input buffer.
+			const u32 length=htun->io.count*htun->io.size;
+			if(length>page_size || (length && nvc_operate_guest_memory(vcpu,htun->io.gva,vcpu->iobuff,length,true,true)!=noir_success))
+			{
+				// The input is not delivered. Leave the registers unchanged so that the instruction is not retired.
+				htun->exit_status=hax_exit_state_change;
+				return noir_success;
+			}
+			// Intel HAXM automatically advance rip.
+			if(nvc_hax_advance_string_io(vcpu,htun))
+				nvc_edit_vcpu_registers(vcpu,noir_cvm_instruction_pointer,&vcpu->exit_context.next_rip,sizeof(u64));
 		}
 		else
 		{
-			// For out instructions, I/O buffer must be copied to register.
-			noir_copy_memory(&vcpu->gpr.rax,vcpu->iobuff,htun->io.size);
+			// For in instructions, I/O buffer must be copied to register.
+			vcpu->gpr.rax=nvc_hax_merge_register(vcpu->gpr.rax,*(u64p)vcpu->iobuff,htun->io.size);
+			vcpu->state_cache.gprvalid=false;
 		}
 	}
+	else if(htun->exit_status==hax_exit_fast_mmio)
+		nvc_hax_complete_fast_mmio(vcpu);
 	st=nvc_run_vcpu(vcpu,null);
 	while(st==noir_success)
 	{
 		bool resumption=false;
-		// NoirVisor CVM VM-Exit happened.
-		nv_dprintf("CVM VM-Exit in Haxm! Intercept Code=0x%X\n",vcpu->exit_context.intercept_code);
 		// Translate CVM Exit Context into HAXM Tunnel.
 		switch(vcpu->exit_context.intercept_code)
 		{
@@ -433,14 +461,24 @@ noir_status nvc_hax_run_vcpu(noir_cvm_virtual_cpu_p vcpu)
 				// For invalid states and shutdown conditions,
 				// Intel HAXM interprets them as state changes.
 				htun->exit_status=hax_exit_state_change;
-				noir_int3();
 				break;
 			}
 			case cv_memory_access:
 			{
 				// Memory Access Interceptions can be either Fast MMIO or Page Fault.
-				htun->exit_status=hax_exit_page_fault;
-				noir_int3();
+				if(nvc_hax_translate_fast_mmio(vcpu,htun))
+				{
+					// Intel HAXM automatically advance rip.
+					nvc_edit_vcpu_registers(vcpu,noir_cvm_instruction_pointer,&vcpu->exit_context.next_rip,sizeof(u64));
+				}
+				else
+				{
+					htun->exit_status=hax_exit_page_fault;
+					htun->pagefault.gpa=vcpu->exit_context.memory_access.gpa;
+					htun->pagefault.flags.acc_r=!vcpu->exit_context.memory_access.access.write;
+					htun->pagefault.flags.acc_w=vcpu->exit_context.memory_access.access.write;
+					htun->pagefault.flags.acc_x=vcpu->exit_context.memory_access.access.execute;
+				}
 				break;
 			}
 			case cv_hlt_instruction:
@@ -453,34 +491,24 @@ noir_status nvc_hax_run_vcpu(noir_cvm_virtual_cpu_p vcpu)
 			}
 			case cv_io_instruction:
 			{
+				bool complete=true;
 				htun->exit_status=hax_exit_io;
 				htun->io.direction=(u8)vcpu->exit_context.io.access.io_type;
 				htun->io.port=vcpu->exit_context.io.port;
 				htun->io.size=(u8)vcpu->exit_context.io.access.operand_size;
 				htun->io.flags.string=(u8)vcpu->exit_context.io.access.string;
+				htun->io.df=0;
 				htun->io.count=1;
-				nv_dprintf("PIO on Port=0x%04X! Size=%u, (%s, %s)\n",htun->io.port,htun->io.size,htun->io.direction?"in":"out",htun->io.flags.string?"string":"value");
 				if(htun->io.flags.string)
 				{
-					u64 mask_a=(u64)-1;
-					u64 mask_b=0;
-					if(htun->io.direction)	// The ins instruction uses rdi.
-						htun->io.gva=vcpu->exit_context.io.rdi;
-					else					// The outs instruction uses rsi.
-						htun->io.gva=vcpu->exit_context.io.rsi;
-					// Append the base address.
-					htun->io.gva+=vcpu->exit_context.io.segment.base;
-					// Truncate the linear address by the width.
-					noir_copy_memory(&mask_b,&mask_a,vcpu->exit_context.io.access.address_width);
-					htun->io.gva&=mask_b;
-					if(!htun->io.direction)
+					if(!nvc_hax_translate_string_io(vcpu,htun,&complete))
 					{
-						u16 size=htun->io.size;
-						// FIXME: For outs instruction. Output buffer must be copied to I/O Buffer.
-						if(vcpu->exit_context.io.access.repeat)size*=(u16)vcpu->exit_context.io.rcx;
+						// The guest memory of the string is inaccessible.
+						htun->exit_status=hax_exit_state_change;
+						break;
 					}
-					nv_dprintf("String I/O is unsupported!\n");
-					noir_int3();
+					// Nothing to be transferred if the repetition count is zero.
+					if(htun->io.count==0)resumption=true;
 				}
 				else if(!htun->io.direction)
 				{
@@ -489,7 +517,7 @@ noir_status nvc_hax_run_vcpu(noir_cvm_virtual_cpu_p vcpu)
 				}
 				// For in instruction, there is post processing mechanism.
 				// Intel HAXM automatically advance rip.
-				nvc_edit_vcpu_registers(vcpu,noir_cvm_instruction_pointer,&vcpu->exit_context.next_rip,sizeof(u64));
+				if(complete)nvc_edit_vcpu_registers(vcpu,noir_cvm_instruction_pointer,&vcpu->exit_context.next_rip,sizeof(u64));
 				break;
 			}
 			case cv_scheduler_exit:
@@ -0,0 +1,84 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file is the consumer of VPCB Submission Queue for Customizable VMs.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /xpf_core/cvqueue.c
+*/
+
+#include <nvdef.h>
+#include <nvbdk.h>
+#include <nvstatus.h>
+#include <cvm_hvm.h>
+
+/*
+  Functions in this file operate on the submission queue only. They do not
+  call any intrinsics or access the hypervisor structures, so that they can
+  be built into a user-mode producer/consumer simulator as is.
+
+  The queue is a single-producer single-consumer ring in shared memory:
+  - User Hypervisor writes the entry, then increments the tail.
+  - NoirVisor copies the entry at the head, then increments the head.
+  Stores are not reordered with other stores in x86, so no fences are required.
+  The queue is writable by user mode. Entries are copied before validation,
+  and the queue is considered empty if the indices are inconsistent.
+*/
+
+noir_cvm_vpcb_queue_p noir_hvcode nvc_cvm_get_vpcb_queue(noir_cvm_virtual_cpu_p vcpu)
+{
+	if(vcpu->vcpu_options.use_tunnel && vcpu->vcpu_options.tunnel_format==noir_cvm_tunnel_format_nvc && vcpu->tunnel)
+		return &((noir_cvm_vcpu_control_block_p)vcpu->tunnel)->queue;
+	return null;
+}
+
+// Copy the entry at the head of the queue. Returns false if the queue is empty.
+bool noir_hvcode nvc_cvm_vpcb_queue_peek(noir_cvm_vpcb_queue_p queue,noir_cvm_vpcb_queue_entry_p entry)
+{
+	const u32 head=queue->head;
+	const u32 pending=queue->tail-head;
+	if(pending==0 || pending>noir_cvm_vpcb_queue_length)return false;
+	*entry=queue->entries[head&(noir_cvm_vpcb_queue_length-1)];
+	return true;
+}
+
+void noir_hvcode nvc_cvm_vpcb_queue_pop(noir_cvm_vpcb_queue_p queue)
+{
+	queue->head++;
+}
+
+// The interrupt is not popped. The caller pops it after posting the interrupt.
+bool noir_hvcode nvc_cvm_vpcb_queue_peek_interrupt(noir_cvm_vpcb_queue_p queue,u8p vector)
+{
+	noir_cvm_vpcb_queue_entry entry;
+	if(!nvc_cvm_vpcb_queue_peek(queue,&entry))return false;
+	if(entry.type!=noir_cvm_vpcb_entry_interrupt)return false;
+	// Vectors 0-15 are reserved. They are never delivered through the APIC.
+	if(entry.interrupt.vector<16 || entry.interrupt.vector>0xFF)return false;
+	*vector=(u8)entry.interrupt.vector;
+	return true;
+}
+
+// Complete a non-string port I/O with the entry at the head of the queue. Returns true if the access is completed.
+bool noir_hvcode nvc_cvm_vpcb_queue_complete_io(noir_cvm_vpcb_queue_p queue,u16 port,u32 size,bool in,u64p rax)
+{
+	noir_cvm_vpcb_queue_entry entry;
+	u64 mask;
+	if(!nvc_cvm_vpcb_queue_peek(queue,&entry))return false;
+	if(entry.type!=(in?noir_cvm_vpcb_entry_io_in:noir_cvm_vpcb_entry_io_out))return false;
+	if(entry.io.port!=port || entry.io.size!=size)return false;
+	if(size!=1 && size!=2 && size!=4)return false;
+	// A 32-bit operand clears the upper half of rax.
+	mask=size==4?maxu64:((u64)1<<(size<<3))-1;
+	if(in)
+		*rax=(*rax&~mask)|(entry.io.value&mask);
+	else
+		queue->entries[queue->head&(noir_cvm_vpcb_queue_length-1)].io.value=(u32)(*rax&mask);
+	nvc_cvm_vpcb_queue_pop(queue);
+	return true;
+}
@@ -0,0 +1,228 @@
+/*
+  NoirVisor - Hardware-Accelerated Hypervisor solution
+
+  Copyright 2018-2024, Zero Tang. All rights reserved.
+
+  This file is the Local APIC Timer model for Customizable VMs.
+
+  This program is distributed in the hope that it will be useful, but
+  without any warranty (no matter implied warranty or merchantability
+  or fitness for a particular purpose, etc.).
+
+  File Location: /xpf_core/cvtimer.c
+*/
+
+#include <nvdef.h>
+#include <nvbdk.h>
+#include <nvstatus.h>
+#include <ia32.h>
+#include <cvm_hvm.h>
+
+/*
+  Functions in this file operate on the timer structure only. The current
+  time is passed by the caller in guest TSC ticks. They do not call any
+  intrinsics or access the hypervisor structures, so that they can be built
+  into a user-mode simulator with virtual time as is.
+
+  One-shot and periodic modes count down from the initial count at the rate
+  of TSC/(tsc_ratio*divisor). The deadline is computed on writes to the
+  initial count, so the timer does not have to tick.
+  Switching to or from TSC-deadline mode disarms the timer.
+  Changes to the divide configuration take effect on the next initial count.
+*/
+
+u32 static noir_hvcode nvc_cvm_lapic_timer_divisor(u32 divide_config)
+{
+	// Divide Configuration Bits 0,1,3 encode the divisor. 111b stands for 1.
+	const u32 dv=(divide_config&3)|((divide_config&8)>>1);
+	return 1<<((dv+1)&7);
+}
+
+u64 static noir_hvcode nvc_cvm_lapic_timer_count_to_ticks(noir_cvm_lapic_timer_p timer,u32 count)
+{
+	return (u64)count*nvc_cvm_lapic_timer_divisor(timer->divide_config)*timer->tsc_ratio;
+}
+
+void noir_hvcode nvc_cvm_lapic_timer_write_lvt(noir_cvm_lapic_timer_p timer,u32 value)
+{
+	const u32 old_mode=noir_cvm_lapic_timer_mode(timer->lvt);
+	const u32 new_mode=noir_cvm_lapic_timer_mode(value);
+	timer->lvt=value;
+	if(old_mode!=new_mode)
+	{
+		if(old_mode==noir_cvm_lapic_timer_tsc_deadline || new_mode==noir_cvm_lapic_timer_tsc_deadline)
+		{
+			timer->deadline=0;
+			timer->period=0;
+			timer->initial_count=0;
+		}
+		else if(timer->deadline)
+		{
+			// Switching between one-shot and periodic does not restart the count.
+			timer->period=new_mode==noir_cvm_lapic_timer_periodic?nvc_cvm_lapic_timer_count_to_ticks(timer,timer->initial_count):0;
+		}
+	}
+}
+
+void noir_hvcode nvc_cvm_lapic_timer_write_initial_count(noir_cvm_lapic_timer_p timer,u32 value,u64 now)
+{
+	const u32 mode=noir_cvm_lapic_timer_mode(timer->lvt);
+	u64 ticks;
+	// Writes to the initial count are ignored in TSC-deadline mode.
+	if(mode==noir_cvm_lapic_timer_tsc_deadline)return;
+	timer->initial_count=value;
+	ticks=nvc_cvm_lapic_timer_count_to_ticks(timer,value);
+	// Writing zero stops the timer.
+	if(ticks==0)
+	{
+		timer->deadline=0;
+		timer->period=0;
+	}
+	else
+	{
+		timer->deadline=now+ticks;
+		timer->period=mode==noir_cvm_lapic_timer_periodic?ticks:0;
+	}
+}
+
+void noir_hvcode nvc_cvm_lapic_timer_write_divide_config(noir_cvm_lapic_timer_p timer,u32 value)
+{
+	timer->divide_config=value&0xB;
+}
+
+void noir_hvcode nvc_cvm_lapic_timer_write_deadline(noir_cvm_lapic_timer_p timer,u64 value)
+{
+	// Writes to IA32_TSC_DEADLINE are ignored unless the timer is in TSC-deadline mode.
+	// Writing zero disarms the timer.
+	if(noir_cvm_lapic_timer_mode(timer->lvt)==noir_cvm_lapic_timer_tsc_deadline)
+	{
+		timer->deadline=value;
+		timer->period=0;
+	}
+}
+
+u64 noir_hvcode nvc_cvm_lapic_timer_read_deadline(noir_cvm_lapic_timer_p timer)
+{
+	if(noir_cvm_lapic_timer_mode(timer->lvt)==noir_cvm_lapic_timer_tsc_deadline)return timer->deadline;
+	return 0;
+}
+
+u32 noir_hvcode nvc_cvm_lapic_timer_read_current_count(noir_cvm_lapic_timer_p timer,u64 now)
+{
+	const u64 tick=nvc_cvm_lapic_timer_count_to_ticks(timer,1);
+	u64 remaining;
+	if(noir_cvm_lapic_timer_mode(timer->lvt)==noir_cvm_lapic_timer_tsc_deadline || timer->deadline==0 || tick==0)return 0;
+	if(now<timer->deadline)
+		remaining=timer->deadline-now;
+	else if(timer->period)
+		remaining=timer->period-(now-timer->deadline)%timer->period;
+	else
+		return 0;
+	// Round up so that the count reaches zero only on expiration.
+	return (u32)((remaining+tick-1)/tick);
+}
+
+// Returns the guest TSC ticks until the next expiration. Returns maxu64 if the timer is disarmed.
+u64 noir_hvcode nvc_cvm_lapic_timer_remaining(noir_cvm_lapic_timer_p timer,u64 now)
+{
+	if(timer->deadline==0)return maxu64;
+	return now<timer->deadline?timer->deadline-now:0;
+}
+
+// Record the host TSC when the host timer to be armed for the next expiration fires.
+// Returns the ticks until then, or maxu64 if the timer is disarmed and the host timer must be canceled.
+u64 noir_hvcode nvc_cvm_lapic_timer_arm(noir_cvm_lapic_timer_p timer,u64 now,u64 tsc_offset)
+{
+	const u64 remaining=nvc_cvm_lapic_timer_remaining(timer,now+tsc_offset);
+	timer->armed=remaining==maxu64?0:now+remaining;
+	return remaining;
+}
+
+// Returns true if the next expiration is earlier than the armed host timer, or if the armed host timer has fired.
+bool noir_hvcode nvc_cvm_lapic_timer_unarmed(noir_cvm_lapic_timer_p timer,u64 now,u64 tsc_offset)
+{
+	const u64 remaining=nvc_cvm_lapic_timer_remaining(timer,now+tsc_offset);
+	if(remaining==maxu64)return false;
+	return timer->armed<=now || timer->armed>now+remaining;
+}
+
+// Returns true if the timer interrupt is supposed to be injected.
+bool noir_hvcode nvc_cvm_lapic_timer_expire(noir_cvm_lapic_timer_p timer,u64 now,u8p vector)
+{
+	if(timer->deadline==0 || now<timer->deadline)return false;
+	timer->expirations++;
+	timer->latency+=now-timer->deadline;
+	if(timer->period)
+	{
+		// Missed periods are coalesced. The IRR can hold only one request per vector.
+		const u64 missed=(now-timer->deadline)/timer->period;
+		timer->deadline+=(missed+1)*timer->period;
+	}
+	else
+		timer->deadline=0;
+	*vector=(u8)timer->lvt;
+	// A masked timer still counts, but the interrupt is not delivered.
+	return !noir_cvm_lapic_timer_masked(timer->lvt);
+}
+
+// Emulate accesses to timer registers in the xAPIC page. Returns false if the offset is not a timer register.
+bool noir_hvcode nvc_cvm_lapic_timer_write_register(noir_cvm_lapic_timer_p timer,u32 offset,u32 value,u64 now)
+{
+	switch(offset)
+	{
+		case ia32_apic_timer_lvt:
+			nvc_cvm_lapic_timer_write_lvt(timer,value);
+			return true;
+		case ia32_apic_timer_init_count:
+			nvc_cvm_lapic_timer_write_initial_count(timer,value,now);
+			return true;
+		case ia32_apic_timer_div_conf:
+			nvc_cvm_lapic_timer_write_divide_config(timer,value);
+			return true;
+	}
+	return false;
+}
+
+// Emulate the MSR accesses. Returns false if the MSR does not belong to the timer.
+bool noir_hvcode nvc_cvm_lapic_timer_rdmsr(noir_cvm_lapic_timer_p timer,u32 index,u64 now,u64p value)
+{
+	switch(index)
+	{
+		case ia32_tsc_deadline:
+			*value=nvc_cvm_lapic_timer_read_deadline(timer);
+			return true;
+		case ia32_x2apic_timer_lvt:
+			*value=timer->lvt;
+			return true;
+		case ia32_x2apic_timer_init_count:
+			*value=timer->initial_count;
+			return true;
+		case ia32_x2apic_timer_cur_count:
+			*value=nvc_cvm_lapic_timer_read_current_count(timer,now);
+			return true;
+		case ia32_x2apic_timer_div_conf:
+			*value=timer->divide_config;
+			return true;
+	}
+	return false;
+}
+
+bool noir_hvcode nvc_cvm_lapic_timer_wrmsr(noir_cvm_lapic_timer_p timer,u32 index,u64 value,u64 now)
+{
+	switch(index)
+	{
+		case ia32_tsc_deadline:
+			nvc_cvm_lapic_timer_write_deadline(timer,value);
+			return true;
+		case ia32_x2apic_timer_lvt:
+			nvc_cvm_lapic_timer_write_lvt(timer,(u32)value);
+			return true;
+		case ia32_x2apic_timer_init_count:
+			nvc_cvm_lapic_timer_write_initial_count(timer,(u32)value,now);
+			return true;
+		case ia32_x2apic_timer_div_conf:
+			nvc_cvm_lapic_timer_write_divide_config(timer,(u32)value);
+			return true;
+	}
+	return false;
+}
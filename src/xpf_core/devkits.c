@@ -85,8 +85,9 @@ avl_node_p static noir_rotr_avl_node(avl_node_p y)
 	avl_node_p x=y->left,t2=x->right;
 	x->right=y;
 	y->left=t2;
-	noir_reset_avl_height(x);
+	// Node y is now the child of x. Update y's height first.
 	noir_reset_avl_height(y);
+	noir_reset_avl_height(x);
 	return x;
 }
 
@@ -104,24 +105,79 @@ avl_node_p noir_insert_avl_node(avl_node_p parent,avl_node_p node,noir_sorting_c
 		parent->right=noir_insert_avl_node(parent->right,node,compare_fn);
 	noir_reset_avl_height(parent);
 	// Retrieve balance factor to determine how to rotate.
+	// Note that the balance factor is right-height minus left-height.
 	i64 bf=noir_get_avl_balance_factor(parent);
-	if(bf>1 && compare_result<0)			// Left-Left Case.
-		return noir_rotl_avl_node(parent);
-	else if(bf<-1 && compare_result>0)		// Right-Right Case.
-		return noir_rotr_avl_node(parent);
-	else if(bf>1 && compare_result>0)		// Left-Right Case.
+	if(bf<-1)
 	{
+		if(compare_fn(node,parent->left)<0)		// Left-Left Case.
+			return noir_rotr_avl_node(parent);
+		// Left-Right Case.
 		parent->left=noir_rotl_avl_node(parent->left);
 		return noir_rotr_avl_node(parent);
 	}
-	else if(bf<-1 && compare_result<0)		// Right-Left Case.
+	else if(bf>1)
 	{
+		if(compare_fn(node,parent->right)>=0)	// Right-Right Case.
+			return noir_rotl_avl_node(parent);
+		// Right-Left Case.
 		parent->right=noir_rotr_avl_node(parent->right);
 		return noir_rotl_avl_node(parent);
 	}
 	return parent;
 }
 
+// In AVL-Tree, return value of removal is supposed to replace the parent.
+// The node to be removed must be in the tree and keys are assumed to be unique.
+avl_node_p noir_remove_avl_node(avl_node_p parent,avl_node_p node,noir_sorting_comparator compare_fn)
+{
+	if(parent==null)
+		return null;
+	if(parent==node)
+	{
+		if(node->left==null || node->right==null)
+		{
+			// At most one child. The child subtree is already balanced.
+			avl_node_p child=node->left?node->left:node->right;
+			node->left=node->right=null;
+			node->height=1;
+			return child;
+		}
+		else
+		{
+			// Two children. Replace the node with its in-order successor.
+			avl_node_p successor=node->right;
+			while(successor->left)successor=successor->left;
+			successor->right=noir_remove_avl_node(node->right,successor,compare_fn);
+			successor->left=node->left;
+			node->left=node->right=null;
+			node->height=1;
+			parent=successor;
+		}
+	}
+	else if(compare_fn(node,parent)<0)
+		parent->left=noir_remove_avl_node(parent->left,node,compare_fn);
+	else
+		parent->right=noir_remove_avl_node(parent->right,node,compare_fn);
+	noir_reset_avl_height(parent);
+	// Retrieve balance factor to determine how to rotate.
+	i64 bf=noir_get_avl_balance_factor(parent);
+	if(bf<-1)
+	{
+		// Left-Right Case.
+		if(noir_get_avl_balance_factor(parent->left)>0)
+			parent->left=noir_rotl_avl_node(parent->left);
+		return noir_rotr_avl_node(parent);
+	}
+	else if(bf>1)
+	{
+		// Right-Left Case.
+		if(noir_get_avl_balance_factor(parent->right)<0)
+			parent->right=noir_rotr_avl_node(parent->right);
+		return noir_rotl_avl_node(parent);
+	}
+	return parent;
+}
+
 avl_node_p noir_search_avl_node(avl_node_p root,const void* item,noir_bst_search_comparator compare_fn)
 {
 	avl_node_p cur=root;
@@ -296,6 +352,19 @@ i64 i64_max(const u64 n,...)
 	return m;
 }
 
+// Select the NUMA node according to the allocation policy.
+u32 noir_select_numa_node(noir_memory_locality locality)
+{
+	if(locality==noir_memory_local)
+		return noir_get_current_numa_node();
+	return noir_numa_node_any;
+}
+
+void* noir_alloc_contd_memory_with_locality(noir_memory_locality locality,size_t length)
+{
+	return noir_alloc_contd_memory_for_numa(noir_select_numa_node(locality),length);
+}
+
 // Use the third-party static library for internal debugger.
 int rpl_vsnprintf(char *str,size_t size,const char *format,va_list args);
 
@@ -125,7 +125,29 @@ bool noir_is_under_hvm()
 	return noir_bt(&c,31);
 }
 
+// Run the worker on every processor so that per-processor structures are built in parallel.
+// The worker increments the counter passed as context if it fails. Return value is the number of failures.
+u32 nvc_setup_per_processor(noir_broadcast_worker worker)
+{
+	u32v failures=0;
+#if defined(_hv_type1)
+	// Firmware services are not multi-processor safe. Set up processors one by one.
+	for(u32 i=0;i<hvm_p->cpu_count;i++)
+		worker((void*)&failures,i);
+#else
+	noir_generic_call(worker,(void*)&failures);
+#endif
+	return failures;
+}
+
 #if !defined(_hv_type1)
+u64 nvc_tsc_ticks_per_100ns()
+{
+	const u64 elapsed=noir_get_interrupt_time()-hvm_p->tsc_calibration.time;
+	if(elapsed==0)return 0;
+	return (noir_rdtsc()-hvm_p->tsc_calibration.tsc)/elapsed;
+}
+
 noir_status nvc_set_guest_vcpu_options(noir_cvm_virtual_cpu_p vcpu,noir_cvm_vcpu_option_type option_type,u32 data)
 {
 	noir_status st=noir_hypervision_absent;
@@ -154,6 +176,22 @@ noir_status nvc_set_guest_vcpu_options(noir_cvm_virtual_cpu_p vcpu,noir_cvm_vcpu
 				vcpu->msr_interceptions.value=data;
 				break;
 			}
+			case noir_cvm_vcpu_affinity_hint:
+			{
+				vcpu->affinity_hint=data;
+				break;
+			}
+			case noir_cvm_lapic_timer_ratio:
+			{
+				vcpu->lapic_timer.tsc_ratio=data;
+				break;
+			}
+			case noir_cvm_halt_poll_window:
+			{
+				// The maximum polling window is specified in microseconds.
+				nvc_cvm_halt_poll_set_max_window(&vcpu->halt_poll,(u64)data*nvc_tsc_ticks_per_100ns()*10);
+				break;
+			}
 			default:
 			{
 				valid=false;
@@ -189,12 +227,147 @@ void nvc_synchronize_vcpu_state(noir_cvm_virtual_cpu_p vcpu)
 		noir_vt_vmcall(noir_cvm_dump_vcpu_vmcb,(ulong_ptr)vcpu);
 }
 
+// Dump the state groups from VMCB/VMCS only if they are stale in the vCPU structure.
+void static nvc_synchronize_vcpu_state_groups(noir_cvm_virtual_cpu_p vcpu,u32 groups)
+{
+	const u32 stale_groups=noir_cvm_stale_state_groups(vcpu,groups);
+	if(stale_groups)
+	{
+		vcpu->synchronizing_groups=stale_groups;
+		nvc_synchronize_vcpu_state(vcpu);
+	}
+}
+
+noir_status nvc_operate_guest_memory(noir_cvm_virtual_cpu_p vcpu,u64 guest_address,void* buffer,u32 size,bool write,bool use_va)
+{
+	noir_cvm_gmem_op_context context;
+	// Guest memory is translated by nested paging walker, which is so far implemented by SVM-Core only.
+	if(hvm_p->selected_core!=use_svm_core || noir_translate_custom_gpa==null)return noir_not_implemented;
+	context.vcpu=vcpu;
+	context.guest_address=guest_address;
+	context.hva=buffer;
+	context.size=size;
+	context.write_op=write;
+	context.use_va=use_va;
+	context.reserved=0;
+	context.status=noir_unsuccessful;
+	noir_svm_vmmcall(noir_cvm_guest_memory_operation,(ulong_ptr)&context);
+	return context.status;
+}
+
+#define nvc_msr_field(f)		(u32)field_offset(noir_cvm_virtual_cpu,f)
+
+// This table must be sorted by MSR index. Lookups are done by binary search.
+noir_cvm_msr_accessor static noir_cvm_msr_accessor_table[]=
+{
+	{amd64_tsc,nvc_msr_field(tsc_offset),noir_cvm_state_cache_ts_valid,noir_cvm_msr_tsc_relative},
+	{amd64_apic_base,nvc_msr_field(msrs.apic.value),noir_cvm_state_cache_ap_valid,0},
+	{amd64_sysenter_cs,nvc_msr_field(msrs.sysenter_cs),noir_cvm_state_cache_se_valid,0},
+	{amd64_sysenter_esp,nvc_msr_field(msrs.sysenter_esp),noir_cvm_state_cache_se_valid,0},
+	{amd64_sysenter_eip,nvc_msr_field(msrs.sysenter_eip),noir_cvm_state_cache_se_valid,0},
+	{amd64_pat,nvc_msr_field(msrs.pat),noir_cvm_state_cache_pa_valid,0},
+	// Only MTRRdefType is emulated. Variable and fixed-range MTRRs are not supported.
+	{amd64_mtrr_def_type,nvc_msr_field(msrs.mtrr.def_type),0,0},
+	{amd64_efer,nvc_msr_field(msrs.efer),noir_cvm_state_cache_ef_valid,0},
+	{amd64_star,nvc_msr_field(msrs.star),noir_cvm_state_cache_sc_valid,0},
+	{amd64_lstar,nvc_msr_field(msrs.lstar),noir_cvm_state_cache_sc_valid,0},
+	{amd64_cstar,nvc_msr_field(msrs.cstar),noir_cvm_state_cache_sc_valid,0},
+	{amd64_sfmask,nvc_msr_field(msrs.sfmask),noir_cvm_state_cache_sc_valid,0},
+	{amd64_kernel_gs_base,nvc_msr_field(msrs.gsswap),noir_cvm_state_cache_fg_valid,0},
+	{amd64_tsc_aux,nvc_msr_field(msrs.tsc_aux),noir_cvm_state_cache_ta_valid,0}
+};
+
+// MSR indices of MSR register names, starting from noir_cvm_register_tsc.
+// The ststar register is not an architectural MSR. Its index is left zero.
+u32 static noir_cvm_msr_name_index[noir_cvm_register_msr_max-noir_cvm_register_tsc]=
+{
+	amd64_tsc,
+	amd64_efer,
+	amd64_kernel_gs_base,
+	amd64_apic_base,
+	amd64_sysenter_cs,
+	amd64_sysenter_esp,
+	amd64_sysenter_eip,
+	amd64_pat,
+	amd64_star,
+	amd64_lstar,
+	amd64_cstar,
+	amd64_sfmask,
+	0,
+	amd64_tsc_aux
+};
+
+noir_cvm_msr_accessor_p static nvc_search_msr_accessor(u64 index)
+{
+	u32 lo=0,hi=sizeof(noir_cvm_msr_accessor_table)/sizeof(noir_cvm_msr_accessor);
+	while(lo<hi)
+	{
+		const u32 mid=(lo+hi)>>1;
+		if(noir_cvm_msr_accessor_table[mid].index==index)
+			return &noir_cvm_msr_accessor_table[mid];
+		else if(noir_cvm_msr_accessor_table[mid].index<index)
+			lo=mid+1;
+		else
+			hi=mid;
+	}
+	return null;
+}
+
+bool static nvc_edit_vcpu_msr(noir_cvm_virtual_cpu_p vcpu,u64 index,u64 value,u32p cache_mask)
+{
+	noir_cvm_msr_accessor_p accessor=nvc_search_msr_accessor(index);
+	if(accessor)
+	{
+		u64p field=(u64p)((ulong_ptr)vcpu+accessor->offset);
+		if(accessor->flags & noir_cvm_msr_tsc_relative)value-=noir_rdtsc();
+		*field=value;
+		*cache_mask|=accessor->cache_mask;
+		return true;
+	}
+	return false;
+}
+
+bool static nvc_view_vcpu_msr(noir_cvm_virtual_cpu_p vcpu,u64 index,u64p value)
+{
+	noir_cvm_msr_accessor_p accessor=nvc_search_msr_accessor(index);
+	if(accessor)
+	{
+		*value=*(u64p)((ulong_ptr)vcpu+accessor->offset);
+		if(accessor->flags & noir_cvm_msr_tsc_relative)*value+=noir_rdtsc();
+		return true;
+	}
+	return false;
+}
+
+// Returns the number of MSRs edited. Editing stops at the first unsupported MSR.
+// The state cache is invalidated only once, for the affected groups.
+u32 nvc_edit_vcpu_msr_list(noir_cvm_virtual_cpu_p vcpu,noir_cvm_msr_entry_p entries,u32 count)
+{
+	u32 cache_mask=0,i=0;
+	for(;i<count;i++)
+		if(!nvc_edit_vcpu_msr(vcpu,entries[i].index,entries[i].value,&cache_mask))
+			break;
+	vcpu->state_cache.value&=~cache_mask;
+	return i;
+}
+
+// Returns the number of MSRs viewed. Viewing stops at the first unsupported MSR.
+u32 nvc_view_vcpu_msr_list(noir_cvm_virtual_cpu_p vcpu,noir_cvm_msr_entry_p entries,u32 count)
+{
+	u32 i=0;
+	for(;i<count;i++)
+		if(!nvc_view_vcpu_msr(vcpu,entries[i].index,&entries[i].value))
+			break;
+	return i;
+}
+
 noir_status nvc_edit_vcpu_registers2(noir_cvm_virtual_cpu_p vcpu,noir_cvm_register_name_p register_names,u32 register_count,u32 register_size,void* buffer)
 {
 	noir_status st=noir_invalid_parameter;
+	u32 cache_mask=0,i=0;
 	// Each element of register array must be at least 8 bytes.
 	if(register_size<8)return st;
-	for(u32 i=0;i<register_count;i++)
+	for(;i<register_count;i++)
 	{
 		void* reg_buff=(void*)((ulong_ptr)buffer+i*register_size);
 		// General-Purpose Registers.
@@ -273,6 +446,7 @@ noir_status nvc_edit_vcpu_registers2(noir_cvm_virtual_cpu_p vcpu,noir_cvm_regist
 					break;
 				default:
 					nv_dprintf("Unimplemented control register (CR%u) is being edited!\n",register_names[i]-noir_cvm_register_cr0);
+					vcpu->state_cache.value&=~cache_mask;
 					return st;
 			}
 		}
@@ -296,64 +470,24 @@ noir_status nvc_edit_vcpu_registers2(noir_cvm_virtual_cpu_p vcpu,noir_cvm_regist
 			vcpu->xcrs.xcr0=*(u64p)reg_buff;
 		}
 		// Model-Specific Registers
-		else if(register_names[i]>=noir_cvm_register_tsc && register_names[i]<=noir_cvm_register_msr_max)
+		else if(register_names[i]>=noir_cvm_register_tsc && register_names[i]<noir_cvm_register_msr_max)
 		{
-			switch(register_names[i])
+			if(register_names[i]==noir_cvm_register_ststar)
 			{
-				case noir_cvm_register_tsc:
-					vcpu->tsc_offset=*(u64p)reg_buff-noir_rdtsc();
-					vcpu->state_cache.ts_valid=0;
-					break;
-				case noir_cvm_register_efer:
-					vcpu->msrs.efer=*(u64p)reg_buff;
-					vcpu->state_cache.ef_valid=0;
-					break;
-				case noir_cvm_register_kgs_base:
-					vcpu->msrs.gsswap=*(u64p)reg_buff;
-					vcpu->state_cache.fg_valid=0;
-					break;
-				case noir_cvm_register_apic_base:
-					vcpu->msrs.apic.value=*(u64p)reg_buff;
-					vcpu->state_cache.ap_valid=0;
-					break;
-				case noir_cvm_register_sysenter_cs:
-				case noir_cvm_register_sysenter_esp:
-				case noir_cvm_register_sysenter_eip:
-				{
-					u64p msr_array=&vcpu->msrs.sysenter_cs;
-					msr_array[register_names[i]-noir_cvm_register_sysenter_cs]=*(u64p)reg_buff;
-					vcpu->state_cache.se_valid=0;
-					break;
-				}
-				case noir_cvm_register_pat:
-					vcpu->msrs.pat=*(u64p)reg_buff;
-					vcpu->state_cache.pa_valid=0;
-					break;
-				case noir_cvm_register_star:
-				case noir_cvm_register_lstar:
-				case noir_cvm_register_cstar:
-				case noir_cvm_register_sfmask:
-				case noir_cvm_register_ststar:
-				{
-					u64p msr_array=&vcpu->msrs.star;
-					msr_array[register_names[i]-noir_cvm_register_star]=*(u64p)reg_buff;
-					vcpu->state_cache.sc_valid=0;
-					break;
-				}
-				default:
-				{
-					nv_dprintf("Unknown Model-Specific Register (Name: 0x%X) is being edited!\n",register_names[i]);
-					break;
-				}
+				vcpu->msrs.ststar=*(u64p)reg_buff;
+				cache_mask|=noir_cvm_state_cache_sc_valid;
 			}
+			else
+				nvc_edit_vcpu_msr(vcpu,noir_cvm_msr_name_index[register_names[i]-noir_cvm_register_tsc],*(u64p)reg_buff,&cache_mask);
 		}
 		else
 		{
 			nv_dprintf("Unknown register (Name: 0x%X) is being edited!\n",register_names[i]);
-			return st;
+			break;
 		}
 	}
-	return noir_success;
+	vcpu->state_cache.value&=~cache_mask;
+	return i==register_count?noir_success:st;
 }
 
 noir_status nvc_view_vcpu_registers2(noir_cvm_virtual_cpu_p vcpu,noir_cvm_register_name_p register_names,u32 register_count,u32 register_size,void* buffer)
@@ -427,49 +561,12 @@ noir_status nvc_view_vcpu_registers2(noir_cvm_virtual_cpu_p vcpu,noir_cvm_regist
 			*(u64p)reg_buff=vcpu->xcrs.xcr0;
 		}
 		// Model-Specific Registers
-		else if(register_names[i]>=noir_cvm_register_tsc && register_names[i]<=noir_cvm_register_msr_max)
+		else if(register_names[i]>=noir_cvm_register_tsc && register_names[i]<noir_cvm_register_msr_max)
 		{
-			switch(register_names[i])
-			{
-				case noir_cvm_register_tsc:
-					*(u64p)reg_buff=vcpu->tsc_offset+noir_rdtsc();
-					break;
-				case noir_cvm_register_efer:
-					*(u64p)reg_buff=vcpu->msrs.efer;
-					break;
-				case noir_cvm_register_kgs_base:
-					*(u64p)reg_buff=vcpu->msrs.gsswap;
-					break;
-				case noir_cvm_register_apic_base:
-					*(u64p)reg_buff=vcpu->msrs.apic.value;
-					break;
-				case noir_cvm_register_sysenter_cs:
-				case noir_cvm_register_sysenter_esp:
-				case noir_cvm_register_sysenter_eip:
-				{
-					u64p msr_array=&vcpu->msrs.sysenter_cs;
-					*(u64p)reg_buff=msr_array[register_names[i]-noir_cvm_register_sysenter_cs];
-					break;
-				}
-				case noir_cvm_register_pat:
-					*(u64p)reg_buff=vcpu->msrs.pat;
-					break;
-				case noir_cvm_register_star:
-				case noir_cvm_register_lstar:
-				case noir_cvm_register_cstar:
-				case noir_cvm_register_sfmask:
-				case noir_cvm_register_ststar:
-				{
-					u64p msr_array=&vcpu->msrs.star;
-					*(u64p)reg_buff=msr_array[register_names[i]-noir_cvm_register_star];
-					break;
-				}
-				default:
-				{
-					nv_dprintf("Unknown Model-Specific Register (Name: 0x%X) is being viewed!\n",register_names[i]);
-					break;
-				}
-			}
+			if(register_names[i]==noir_cvm_register_ststar)
+				*(u64p)reg_buff=vcpu->msrs.ststar;
+			else
+				nvc_view_vcpu_msr(vcpu,noir_cvm_msr_name_index[register_names[i]-noir_cvm_register_tsc],(u64p)reg_buff);
 		}
 		else
 		{
@@ -661,8 +758,8 @@ noir_status nvc_view_vcpu_registers(noir_cvm_virtual_cpu_p vcpu,noir_cvm_registe
 		st=noir_success;
 		switch(register_type)
 		{
-			// If the state is saved in VMCB, check if the state cache is invalid and synchronized.
-			// Perform synchronization if the state cache is both valid and unsynchronized.
+			// If the state is saved in VMCB, check if the state cache is valid and synchronized.
+			// Perform synchronization only for groups that are valid in VMCB but not yet dumped.
 			case noir_cvm_general_purpose_register:
 			{
 				noir_movsp(buffer,&vcpu->gpr,sizeof(void*)*2);
@@ -681,8 +778,7 @@ noir_status nvc_view_vcpu_registers(noir_cvm_virtual_cpu_p vcpu,noir_cvm_registe
 			case noir_cvm_control_register:
 			{
 				u64* cr_list=(u64*)buffer;
-				if(vcpu->state_cache.cr_valid && !vcpu->state_cache.synchronized)
-					nvc_synchronize_vcpu_state(vcpu);
+				nvc_synchronize_vcpu_state_groups(vcpu,noir_cvm_state_cache_cr_valid);
 				cr_list[0]=vcpu->crs.cr0;
 				cr_list[1]=vcpu->crs.cr3;
 				cr_list[2]=vcpu->crs.cr4;
@@ -690,8 +786,7 @@ noir_status nvc_view_vcpu_registers(noir_cvm_virtual_cpu_p vcpu,noir_cvm_registe
 			}
 			case noir_cvm_cr2_register:
 			{
-				if(vcpu->state_cache.cr2valid && !vcpu->state_cache.synchronized)
-					nvc_synchronize_vcpu_state(vcpu);
+				nvc_synchronize_vcpu_state_groups(vcpu,noir_cvm_state_cache_cr2valid);
 				*(u64*)buffer=vcpu->crs.cr2;
 				break;
 			}
@@ -702,16 +797,14 @@ noir_status nvc_view_vcpu_registers(noir_cvm_virtual_cpu_p vcpu,noir_cvm_registe
 			}
 			case noir_cvm_dr67_register:
 			{
-				if(vcpu->state_cache.dr_valid && !vcpu->state_cache.synchronized)
-					nvc_synchronize_vcpu_state(vcpu);
+				nvc_synchronize_vcpu_state_groups(vcpu,noir_cvm_state_cache_dr_valid);
 				noir_copy_memory(buffer,&vcpu->drs.dr6,sizeof(u64)*2);
 				break;
 			}
 			case noir_cvm_segment_register:
 			{
 				segment_register_p sr_list=(segment_register_p)buffer;
-				if(vcpu->state_cache.sr_valid && !vcpu->state_cache.synchronized)
-					nvc_synchronize_vcpu_state(vcpu);
+				nvc_synchronize_vcpu_state_groups(vcpu,noir_cvm_state_cache_sr_valid);
 				sr_list[0]=vcpu->seg.es;
 				sr_list[1]=vcpu->seg.cs;
 				sr_list[2]=vcpu->seg.ss;
@@ -721,8 +814,7 @@ noir_status nvc_view_vcpu_registers(noir_cvm_virtual_cpu_p vcpu,noir_cvm_registe
 			case noir_cvm_fgseg_register:
 			{
 				segment_register_p sr_list=(segment_register_p)buffer;
-				if(vcpu->state_cache.fg_valid && !vcpu->state_cache.synchronized)
-					nvc_synchronize_vcpu_state(vcpu);
+				nvc_synchronize_vcpu_state_groups(vcpu,noir_cvm_state_cache_fg_valid);
 				sr_list[0]=vcpu->seg.fs;
 				sr_list[1]=vcpu->seg.gs;
 				*(u64p)((ulong_ptr)buffer+32)=vcpu->msrs.gsswap;
@@ -731,8 +823,7 @@ noir_status nvc_view_vcpu_registers(noir_cvm_virtual_cpu_p vcpu,noir_cvm_registe
 			case noir_cvm_descriptor_table:
 			{
 				segment_register_p dt_list=(segment_register_p)buffer;
-				if(vcpu->state_cache.dt_valid && !vcpu->state_cache.synchronized)
-					nvc_synchronize_vcpu_state(vcpu);
+				nvc_synchronize_vcpu_state_groups(vcpu,noir_cvm_state_cache_dt_valid);
 				dt_list[0].limit=vcpu->seg.gdtr.limit;
 				dt_list[0].base=vcpu->seg.gdtr.base;
 				dt_list[1].limit=vcpu->seg.idtr.limit;
@@ -742,30 +833,26 @@ noir_status nvc_view_vcpu_registers(noir_cvm_virtual_cpu_p vcpu,noir_cvm_registe
 			case noir_cvm_ldtr_task_register:
 			{
 				segment_register_p sr_list=(segment_register_p)buffer;
-				if(vcpu->state_cache.lt_valid && !vcpu->state_cache.synchronized)
-					nvc_synchronize_vcpu_state(vcpu);
+				nvc_synchronize_vcpu_state_groups(vcpu,noir_cvm_state_cache_lt_valid);
 				sr_list[0]=vcpu->seg.tr;
 				sr_list[1]=vcpu->seg.ldtr;
 				break;
 			}
 			case noir_cvm_syscall_msr_register:
 			{
-				if(vcpu->state_cache.sc_valid && !vcpu->state_cache.synchronized)
-					nvc_synchronize_vcpu_state(vcpu);
+				nvc_synchronize_vcpu_state_groups(vcpu,noir_cvm_state_cache_sc_valid);
 				noir_copy_memory(buffer,&vcpu->msrs.star,sizeof(u64*)*4);
 				break;
 			}
 			case noir_cvm_sysenter_msr_register:
 			{
-				if(vcpu->state_cache.se_valid && !vcpu->state_cache.synchronized)
-					nvc_synchronize_vcpu_state(vcpu);
+				nvc_synchronize_vcpu_state_groups(vcpu,noir_cvm_state_cache_se_valid);
 				noir_copy_memory(buffer,&vcpu->msrs.sysenter_cs,sizeof(u64*)*3);
 				break;
 			}
 			case noir_cvm_cr8_register:
 			{
-				if(vcpu->state_cache.tp_valid && !vcpu->state_cache.synchronized)
-					nvc_synchronize_vcpu_state(vcpu);
+				nvc_synchronize_vcpu_state_groups(vcpu,noir_cvm_state_cache_tp_valid);
 				*(u64*)buffer=vcpu->crs.cr8;
 				break;
 			}
@@ -829,10 +916,212 @@ noir_status nvc_view_vcpu_registers(noir_cvm_virtual_cpu_p vcpu,noir_cvm_registe
 
 noir_status nvc_set_event_injection(noir_cvm_virtual_cpu_p vcpu,noir_cvm_event_injection injected_event)
 {
-	vcpu->injected_event=injected_event;
+	bool posted=false;
+	// With AVIC or posted interrupts, external interrupts are posted to the virtual APIC without a VM-Exit on the vCPU.
+	if(injected_event.attributes.valid && injected_event.attributes.type==0)
+	{
+		if(hvm_p->selected_core==use_svm_core)
+			posted=nvc_svmc_post_interrupt(vcpu,(u8)injected_event.attributes.vector);
+		else if(hvm_p->selected_core==use_vt_core)
+			posted=nvc_vtc_post_interrupt(vcpu,(u8)injected_event.attributes.vector);
+	}
+	if(!posted)vcpu->injected_event=injected_event;
+	// Wake up the vCPU if it is halted in NoirVisor. The interrupt is counted before the request.
+	noir_locked_inc(&vcpu->halt_poll.interrupts);
+	noir_locked_inc(&vcpu->halt_poll.requests);
+	noir_set_event(vcpu->halt_event);
+	return noir_success;
+}
+
+/*
+  Profiler of VM-Exits, shared by Intel VT-x and AMD-V cores.
+
+  The CVM profiler accumulates the guest runtime and the hypervisor time per
+  interception category. Both cores report identical fields in this way.
+  The scheduler category is selected on entry. Exit handlers may select a
+  more specific category.
+*/
+void noir_hvcode nvc_cvm_profiler_enter(noir_cvm_virtual_cpu_p vcpu,u64 exit_time)
+{
+	// Accumulate the Guest vCPU runtime.
+	vcpu->statistics.runtime+=exit_time-vcpu->statistics_internal.runtime_start;
+	vcpu->statistics_internal.selector=&vcpu->statistics.interceptions.scheduler;
+}
+
+void noir_hvcode nvc_cvm_profiler_leave(noir_cvm_virtual_cpu_p vcpu,u64 exit_time)
+{
+	const u64 current_time=noir_get_system_time();
+	// Accumulate the Hypervisor runtime.
+	vcpu->statistics_internal.selector->time+=current_time-exit_time;
+	vcpu->statistics_internal.selector->count++;
+	// If the guest is resumed, its runtime starts over from now.
+	vcpu->statistics_internal.runtime_start=current_time;
+}
+
+// Select the category according to the interception code delivered to the VMM.
+void noir_hvcode nvc_cvm_profiler_classify(noir_cvm_virtual_cpu_p vcpu,bool world_switched)
+{
+	noir_cvm_interception_counter_p selector=&vcpu->statistics.interceptions.emulation;
+	if(world_switched)
+	{
+		switch(vcpu->exit_context.intercept_code)
+		{
+			case cv_memory_access:
+			case cv_scheduler_npt_misconfig:
+				selector=&vcpu->statistics.interceptions.npf;
+				break;
+			case cv_rsm_instruction:
+				selector=&vcpu->statistics.interceptions.rsm;
+				break;
+			case cv_hlt_instruction:
+				selector=&vcpu->statistics.interceptions.halt;
+				break;
+			case cv_io_instruction:
+				selector=&vcpu->statistics.interceptions.io;
+				break;
+			case cv_cpuid_instruction:
+				selector=&vcpu->statistics.interceptions.cpuid;
+				break;
+			case cv_rdmsr_instruction:
+			case cv_wrmsr_instruction:
+				selector=&vcpu->statistics.interceptions.msr;
+				break;
+			case cv_cr_access:
+				selector=&vcpu->statistics.interceptions.cr;
+				break;
+			case cv_dr_access:
+				selector=&vcpu->statistics.interceptions.dr;
+				break;
+			case cv_hypercall:
+				selector=&vcpu->statistics.interceptions.hypercall;
+				break;
+			case cv_exception:
+				selector=&vcpu->statistics.interceptions.exception;
+				break;
+			case cv_apic_msr:
+			case cv_apic_access:
+			case cv_apic_ipi:
+				selector=&vcpu->statistics.interceptions.apic;
+				break;
+			default:
+				selector=&vcpu->statistics.interceptions.scheduler;
+				break;
+		}
+	}
+	vcpu->statistics_internal.selector=selector;
+}
+
+// Every VM-Exit is counted, whereas only sampled VM-Exits are timed.
+void noir_hvcode nvc_record_exit_statistics(noir_exit_statistics_p stats,bool sampled,u64 ticks)
+{
+	stats->count++;
+	if(sampled)
+	{
+		stats->sampled_count++;
+		stats->sampled_time+=ticks;
+		if(ticks>stats->max_time)stats->max_time=ticks;
+	}
+}
+
+// Allocate a record in the trace buffer of the processor. Returns null if tracing is inactive.
+noir_exit_trace_record_p noir_hvcode nvc_begin_exit_trace(u32 processor)
+{
+	if(hvm_p->exit_trace)
+	{
+		noir_exit_trace_buffer_p trace=hvm_p->exit_trace[processor];
+		// The trace buffer is owned by the processor. No lock is required.
+		noir_exit_trace_record_p record=&trace->records[trace->sequence++&(trace->capacity-1)];
+		noir_stosb(record,0,sizeof(noir_exit_trace_record));
+		record->tsc=noir_rdtsc();
+		return record;
+	}
+	return null;
+}
+
+void noir_hvcode nvc_trace_exit_memory(noir_exit_trace_record_p record,u64 address,void* buffer,u32 size)
+{
+	const u32 length=size<sizeof(record->memory)?size:sizeof(record->memory);
+	record->memory_address=address;
+	record->memory_size=(u8)length;
+	noir_movsb(record->memory,buffer,length);
+	record->flags|=noir_exit_trace_memory_valid;
+}
+
+void static nvc_release_exit_trace()
+{
+	if(hvm_p->exit_trace)
+	{
+		const u32 cpu_count=noir_get_processor_count();
+		for(u32 i=0;i<cpu_count;i++)
+			if(hvm_p->exit_trace[i])
+				noir_free_nonpg_memory(hvm_p->exit_trace[i]);
+		noir_free_nonpg_memory(hvm_p->exit_trace);
+		hvm_p->exit_trace=null;
+	}
+}
+
+noir_status static nvc_build_exit_trace()
+{
+#if defined(_hv_exit_trace)
+	const u32 cpu_count=noir_get_processor_count();
+	hvm_p->exit_trace=noir_alloc_nonpg_memory(sizeof(void*)*cpu_count);
+	if(hvm_p->exit_trace==null)return noir_insufficient_resources;
+	for(u32 i=0;i<cpu_count;i++)
+	{
+		noir_exit_trace_buffer_p trace=noir_alloc_nonpg_memory(noir_exit_trace_buffer_size);
+		if(trace==null)
+		{
+			nvc_release_exit_trace();
+			return noir_insufficient_resources;
+		}
+		trace->signature=noir_exit_trace_signature;
+		trace->version=noir_exit_trace_version;
+		trace->record_size=sizeof(noir_exit_trace_record);
+		trace->capacity=noir_exit_trace_capacity;
+		trace->processor=i;
+		hvm_p->exit_trace[i]=trace;
+	}
+	nv_dprintf("VM-Exit tracing is enabled with %u records per processor!\n",noir_exit_trace_capacity);
+#endif
 	return noir_success;
 }
 
+noir_status nvc_query_exit_trace(u32 processor,void* buffer,u32 buffer_size)
+{
+	noir_status st=noir_hypervision_absent;
+	if(hvm_p)
+	{
+		if(hvm_p->exit_trace==null)
+			st=noir_not_implemented;
+		else if(processor>=hvm_p->cpu_count)
+			st=noir_invalid_parameter;
+		else if(buffer_size<noir_exit_trace_buffer_size)
+			st=noir_buffer_too_small;
+		else
+		{
+			// The snapshot might be torn if the processor is writing a record at this moment.
+			noir_copy_memory(buffer,hvm_p->exit_trace[processor],noir_exit_trace_buffer_size);
+			st=noir_success;
+		}
+	}
+	return st;
+}
+
+noir_status nvc_query_exit_statistics(u32 processor,void* buffer,u32 buffer_size)
+{
+	noir_status st=noir_hypervision_absent;
+	if(hvm_p)
+	{
+		if(processor>=hvm_p->cpu_count)
+			st=noir_invalid_parameter;
+		else if(hvm_p->selected_core==use_vt_core)
+			st=nvc_vt_query_exit_statistics(processor,buffer,buffer_size);
+		else
+			st=noir_not_implemented;		// Host exits on AMD-V are not profiled.
+	}
+	return st;
+}
+
 noir_status nvc_query_vcpu_statistics(noir_cvm_virtual_cpu_p vcpu,void* buffer,u32 buffer_size)
 {
 	noir_status st=noir_hypervision_absent;
@@ -872,23 +1161,182 @@ invalid_state:
 	return false;
 }
 
+#define nvc_vpcb_field(f)	(u32)field_offset(noir_cvm_vpcb_register_file,f)
+
+// Location of each register group in the VPCB, indexed by register type.
+// Sizes are the buffer sizes accepted by the register view/edit functions.
+static noir_hvdata u32 noir_cvm_vpcb_register_layout[noir_cvm_maximum_register_type][2]=
+{
+	{nvc_vpcb_field(gpr),sizeof(noir_gpr_state)},
+	{nvc_vpcb_field(rflags),sizeof(u64)},
+	{nvc_vpcb_field(rip),sizeof(u64)},
+	{nvc_vpcb_field(cr),sizeof(u64)*3},
+	{nvc_vpcb_field(cr2),sizeof(u64)},
+	{nvc_vpcb_field(dr),sizeof(u64)*4},
+	{nvc_vpcb_field(dr67),sizeof(u64)*2},
+	{nvc_vpcb_field(sr),sizeof(segment_register)*4},
+	{nvc_vpcb_field(fgseg),sizeof(segment_register)*2+sizeof(u64)},		// Including gsswap.
+	{nvc_vpcb_field(dt),sizeof(segment_register)*2},
+	{nvc_vpcb_field(lt),sizeof(segment_register)*2},
+	{nvc_vpcb_field(syscall_msr),sizeof(u64)*4},
+	{nvc_vpcb_field(sysenter_msr),sizeof(u64)*3},
+	{nvc_vpcb_field(cr8),sizeof(u64)},
+	{nvc_vpcb_field(fxstate),sizeof(noir_fx_state)},
+	{0,0},																// Extended State is not in VPCB.
+	{nvc_vpcb_field(xcr0),sizeof(u64)},
+	{nvc_vpcb_field(efer),sizeof(u64)},
+	{nvc_vpcb_field(pat),sizeof(u64)},
+	{nvc_vpcb_field(lbr),sizeof(u64)*5},
+	{nvc_vpcb_field(tsc),sizeof(u64)},
+	{nvc_vpcb_field(ghcb),sizeof(u64)},
+	{nvc_vpcb_field(apic_bar),sizeof(u64)}
+};
+
+static void nvc_load_vpcb_registers(noir_cvm_virtual_cpu_p vcpu,noir_cvm_vcpu_control_block_p vpcb)
+{
+	u32 dirty=(u32)(vpcb->dirty&~noir_cvm_vpcb_invalid_groups),type;
+	// Load the groups edited by User Hypervisor. Edits invalidate the state cache as usual.
+	for(;noir_bsf(&type,dirty);dirty&=dirty-1)
+	{
+		void* buffer=(void*)((ulong_ptr)&vpcb->registers+noir_cvm_vpcb_register_layout[type][0]);
+		nvc_edit_vcpu_registers(vcpu,type,buffer,noir_cvm_vpcb_register_layout[type][1]);
+	}
+	vpcb->dirty=0;
+}
+
+static void nvc_publish_vpcb_registers(noir_cvm_virtual_cpu_p vcpu,noir_cvm_vcpu_control_block_p vpcb)
+{
+	u32 groups=(u32)((vpcb->request|noir_cvm_vpcb_default_groups)&~noir_cvm_vpcb_invalid_groups),type;
+	u64 valid=0;
+	noir_copy_memory(&vpcb->exit_context,&vcpu->exit_context,sizeof(noir_cvm_exit_context));
+	// The first group requiring a synchronization will dump the whole state.
+	for(;noir_bsf(&type,groups);groups&=groups-1)
+	{
+		void* buffer=(void*)((ulong_ptr)&vpcb->registers+noir_cvm_vpcb_register_layout[type][0]);
+		if(nvc_view_vcpu_registers(vcpu,type,buffer,noir_cvm_vpcb_register_layout[type][1])==noir_success)
+			valid|=noir_cvm_vpcb_group(type);
+	}
+	vpcb->valid=valid;
+}
+
+// Wait until the LAPIC timer wakes up the halted vCPU, or until an event is posted to the vCPU.
+void static nvc_wait_halted_vcpu(noir_cvm_virtual_cpu_p vcpu,u32 requests)
+{
+	const u64 ticks=nvc_tsc_ticks_per_100ns();
+	u64 now=noir_rdtsc();
+	// The event is signaled by every request, even if the vCPU is not halted. Clear the stale signal.
+	// Requests made before the clear are caught by the counter.
+	noir_reset_event(vcpu->halt_event);
+	if(vcpu->halt_poll.requests!=requests)return;
+	while(now<vcpu->lapic_timer.wakeup)
+	{
+		if(noir_wait_event(vcpu->halt_event,ticks?(vcpu->lapic_timer.wakeup-now)/ticks:0))break;
+		now=noir_rdtsc();
+	}
+}
+
+// Poll for wakeup requests posted to the halted vCPU. Returns true if the vCPU is woken up within the window.
+bool static nvc_poll_halted_vcpu(noir_cvm_virtual_cpu_p vcpu,u32 requests)
+{
+	const u64 start=noir_rdtsc();
+	u64 now=start;
+	bool woken=false;
+	while(now-start<vcpu->halt_poll.window)
+	{
+		if(vcpu->halt_poll.requests!=requests)
+		{
+			woken=true;
+			break;
+		}
+		noir_pause();
+		now=noir_rdtsc();
+	}
+	vcpu->statistics.halt_poll.attempts++;
+	vcpu->statistics.halt_poll.successes+=woken;
+	vcpu->statistics.halt_poll.time+=now-start;
+	return woken;
+}
+
+// Returns true if the halted vCPU is woken up by NoirVisor. Otherwise, the halt is delivered to the VMM.
+bool static nvc_halt_vcpu(noir_cvm_virtual_cpu_p vcpu,u32 requests,u32 interrupts)
+{
+	const u64 start=noir_rdtsc(),wakeup=vcpu->lapic_timer.wakeup;
+	bool woken=false;
+	if(vcpu->halt_poll.halted)
+	{
+		if(vcpu->halt_poll.window)woken=nvc_poll_halted_vcpu(vcpu,requests);
+		if(!woken && wakeup)
+		{
+			nvc_wait_halted_vcpu(vcpu,requests);
+			woken=true;
+		}
+	}
+	vcpu->halt_poll.halted=false;
+	vcpu->lapic_timer.wakeup=0;
+	if(woken)
+	{
+		const u64 now=noir_rdtsc();
+		// The hlt instruction is retired by NoirVisor only if an interrupt or the LAPIC timer woke up the vCPU.
+		// A rescission leaves rip on the hlt instruction, so the guest halts again when the VMM resumes it.
+		if(vcpu->halt_poll.interrupts!=interrupts || (wakeup && now>=wakeup))
+		{
+			vcpu->rip=vcpu->exit_context.next_rip;
+			vcpu->state_cache.gprvalid=0;
+			nvc_cvm_halt_poll_update(&vcpu->halt_poll,now-start);
+		}
+	}
+	else if(vcpu->halt_poll.window_max)
+	{
+		// The window is adapted when the VMM runs the vCPU again.
+		vcpu->halt_poll.halt_start=start;
+	}
+	return woken;
+}
+
 noir_status nvc_run_vcpu(noir_cvm_virtual_cpu_p vcpu,void* exit_context)
 {
 	noir_status st=noir_hypervision_absent;
 	if(hvm_p)
 	{
+		bool valid_state;
+		// The tunnel must not be swapped while the vCPU is scheduled.
+		if(noir_locked_cmpxchg(&vcpu->scheduled,1,0))return noir_vcpu_busy;
+		// Without a tunnel, the Exit-Context must be delivered through the caller's buffer.
+		if(!vcpu->vcpu_options.use_tunnel && exit_context==null)
+		{
+			vcpu->scheduled=0;
+			return noir_buffer_too_small;
+		}
+		// Registers edited through VPCB must be loaded before the state is validated.
+		if(vcpu->vcpu_options.use_tunnel && vcpu->vcpu_options.tunnel_format==noir_cvm_tunnel_format_nvc && vcpu->tunnel)
+			nvc_load_vpcb_registers(vcpu,vcpu->tunnel);
 		// Some processor state is not checked and loaded by Intel VT-x/AMD-V. (e.g: x87 FPU State)
 		// Check their consistency manually.
-		bool valid_state=nvc_validate_vcpu_state(vcpu);
+		valid_state=nvc_validate_vcpu_state(vcpu);
+		// The halt delivered to the VMM is over. Adapt the polling window to its duration.
+		if(vcpu->halt_poll.halt_start)
+		{
+			nvc_cvm_halt_poll_update(&vcpu->halt_poll,noir_rdtsc()-vcpu->halt_poll.halt_start);
+			vcpu->halt_poll.halt_start=0;
+		}
 		st=noir_success;
-		if(valid_state)
+		while(valid_state)
 		{
+			// Requests posted after this point wake up the vCPU halted in this iteration.
+			const u32 interrupts=vcpu->halt_poll.interrupts;
+			const u32 requests=vcpu->halt_poll.requests;
 			if(hvm_p->selected_core==use_svm_core)
 				st=nvc_svmc_run_vcpu(vcpu);
 			else if(hvm_p->selected_core==use_vt_core)
 				st=nvc_vtc_run_vcpu(vcpu);
 			else
 				st=noir_unknown_processor;
+			if(st!=noir_success)break;
+			// The host timer is re-armed by the next iteration.
+			if(vcpu->exit_context.intercept_code==cv_scheduler_timer_rearm)continue;
+			// The halted vCPU may be woken up by polling or by its LAPIC timer without returning to the VMM.
+			if(vcpu->exit_context.intercept_code!=cv_hlt_instruction)break;
+			if(!nvc_halt_vcpu(vcpu,requests,interrupts))break;
 		}
 		if(st==noir_success)
 		{
@@ -902,13 +1350,13 @@ noir_status nvc_run_vcpu(noir_cvm_virtual_cpu_p vcpu,void* exit_context)
 					case noir_cvm_tunnel_format_nvc:
 					{
 						// The NoirVisor's Virtual-Processor Control Block format.
-						noir_cvm_vcpu_control_block_p vpcb=vcpu->tunnel;
-						vpcb->intercept_code=vcpu->exit_context.intercept_code;
+						nvc_publish_vpcb_registers(vcpu,vcpu->tunnel);
 						break;
 					}
 				}
 			}
 		}
+		vcpu->scheduled=0;
 	}
 	return st;
 }
@@ -925,6 +1373,9 @@ noir_status nvc_rescind_vcpu(noir_cvm_virtual_cpu_p vcpu)
 			st=nvc_svmc_rescind_vcpu(vcpu);
 		else
 			st=noir_unknown_processor;
+		// Wake up the vCPU if it is halted in NoirVisor.
+		noir_locked_inc(&vcpu->halt_poll.requests);
+		noir_set_event(vcpu->halt_event);
 	}
 	return st;
 }
@@ -960,6 +1411,8 @@ noir_status nvc_release_vcpu(noir_cvm_virtual_cpu_p vcpu)
 		st=noir_success;
 		if(vcpu->ref_count)
 			nv_dprintf("Deleting vCPU 0x%p with uncleared reference (%u)!",vcpu,vcpu->ref_count);
+		noir_finalize_event(vcpu->halt_event);
+		noir_finalize_timer(vcpu->host_timer);
 		if(hvm_p->selected_core==use_vt_core)
 			nvc_vtc_release_vcpu(vcpu);
 		else if(hvm_p->selected_core==use_svm_core)
@@ -984,10 +1437,22 @@ noir_status nvc_create_vcpu(noir_cvm_virtual_machine_p vm,noir_cvm_virtual_cpu_p
 			st=noir_unknown_processor;
 		if(st==noir_success)
 		{
-			(*vcpu)->ref_count=1;
-			// Initialize some registers...
-			(*vcpu)->xcrs.xcr0=1;			// HAXM does not know XCR0.
-			(*vcpu)->msrs.mtrr.def_type=6;	// Let WB to be default.
+			// The event wakes up the vCPU halted in NoirVisor.
+			(*vcpu)->halt_event=noir_initialize_event();
+			// AMD-V has no preemption timer. The host timer interrupts the vCPU when its LAPIC timer expires.
+			if(hvm_p->selected_core==use_svm_core)(*vcpu)->host_timer=noir_initialize_timer();
+			if((*vcpu)->halt_event==null || (hvm_p->selected_core==use_svm_core && (*vcpu)->host_timer==null))
+			{
+				nvc_release_vcpu(*vcpu);
+				st=noir_insufficient_resources;
+			}
+			else
+			{
+				(*vcpu)->ref_count=1;
+				// Initialize some registers...
+				(*vcpu)->xcrs.xcr0=1;			// HAXM does not know XCR0.
+				(*vcpu)->msrs.mtrr.def_type=6;	// Let WB to be default.
+			}
 		}
 	}
 	return st;
@@ -1143,6 +1608,57 @@ alloc_failure:
 	return st;
 }
 
+noir_status nvc_set_vcpu_control_block(noir_cvm_virtual_machine_p vm,noir_cvm_virtual_cpu_p vcpu,void* vpcb)
+{
+	noir_status st=noir_insufficient_resources;
+	const u32 pages=bytes_to_pages(sizeof(noir_cvm_vcpu_control_block));
+	void** locker_slot;
+	u64 phys[bytes_to_pages(sizeof(noir_cvm_vcpu_control_block))];
+	if(page_offset((ulong_ptr)vpcb))return noir_invalid_parameter;
+	// Locker slots are allocated without atomic operations. Acquire the lock exclusively.
+	noir_acquire_reslock_exclusive(vm->vcpu_list_lock);
+	locker_slot=nvc_alloc_locker_slot(vm);
+	if(locker_slot)
+	{
+		// Lock the User Hypervisor's pages so that they can be accessed regardless of the process context.
+		*locker_slot=noir_lock_pages(vpcb,page_4kb_mult(pages),phys);
+		if(*locker_slot)
+		{
+			noir_cvm_vcpu_control_block_p kernel_vpcb=noir_get_locked_system_address(*locker_slot);
+			if(kernel_vpcb)
+			{
+				noir_stosb(kernel_vpcb,0,sizeof(noir_cvm_vcpu_control_block));
+				kernel_vpcb->size=sizeof(noir_cvm_vcpu_control_block);
+				// Refuse to swap the VPCB while the vCPU is scheduled. The hypervisor may be accessing the previous one.
+				if(noir_locked_cmpxchg(&vcpu->scheduled,1,0))
+					st=noir_vcpu_busy;
+				else
+				{
+					void** prev_locker=vcpu->tunnel_locker;
+					// Switch to the new VPCB before the previous one is released.
+					vcpu->tunnel_locker=locker_slot;
+					st=nvc_set_tunnel(vcpu,kernel_vpcb);
+					vcpu->scheduled=0;
+					if(prev_locker)
+					{
+						noir_unlock_pages(*prev_locker);
+						nvc_free_locker_slot(prev_locker);
+					}
+				}
+			}
+			if(st!=noir_success)
+			{
+				noir_unlock_pages(*locker_slot);
+				nvc_free_locker_slot(locker_slot);
+			}
+		}
+		else
+			nvc_free_locker_slot(locker_slot);
+	}
+	noir_release_reslock(vm->vcpu_list_lock);
+	return st;
+}
+
 noir_status nvc_query_gpa_accessing_bitmap(noir_cvm_virtual_machine_p virtual_machine,u64 gpa_start,u32 page_count,void* bitmap,u32 bitmap_size)
 {
 	noir_status st=noir_hypervision_absent;
@@ -1214,14 +1730,14 @@ noir_status nvc_create_vm_ex(noir_cvm_virtual_machine_p* vm,u32 process_id,noir_
 	{
 		if(hvm_p->selected_core==use_vt_core)
 		{
-			if(properties.value)
+			if(properties.value & ~nvc_vtc_get_supported_vm_properties())
 				st=noir_not_implemented;
 			else
 				st=nvc_vtc_create_vm(vm);
 		}
 		else if(hvm_p->selected_core==use_svm_core)
 		{
-			if(properties.value)
+			if(properties.value & ~nvc_svmc_get_supported_vm_properties())
 				st=noir_not_implemented;
 			else
 				st=nvc_svmc_create_vm(vm);
@@ -1624,7 +2140,6 @@ bool static nvc_translate_guest_virtual_address_routine64(u64 np_base,u64 pt,u32
 					const u64 offset_mask=(1<<(shift_diff+page_4kb_shift))-1;
 					const u64 base=(table[index].base>>shift_diff)<<(shift_diff+page_4kb_shift);
 					*gpa=base+(gva&offset_mask);
-					nvd_printf("[GVA Translate] GVA 0x%016llX is translated into GPA 0x%016llX at level %u in Long-Mode!\n",gva,*gpa,level);
 					return true;
 				}
 				else
@@ -1638,7 +2153,6 @@ bool static nvc_translate_guest_virtual_address_routine64(u64 np_base,u64 pt,u32
 				// Final Level
 				const u64 base=page_4kb_mult(table[index].base);
 				*gpa=base+page_offset(gva);
-				nvd_printf("[GVA Translate] GVA 0x%016llX is translated into GPA 0x%016llX in Long-Mode!\n",gva,*gpa);
 				return true;
 			}
 		}
@@ -1716,10 +2230,9 @@ size_t nvc_copy_guest_virtual_memory(noir_cvm_virtual_cpu_p vcpu,u64 gva,void* b
 	u64 copy_size=0,copied_size=0,real_size=0;
 	for(u64 cur_va=gva;cur_va<end_va;cur_va+=copy_size)
 	{
-		const u64 end_len=page_size-page_offset(gva);
+		const u64 end_len=page_size-page_offset(cur_va);
 		const u64 rem_len=end_va-cur_va;
 		copy_size=end_len<rem_len?end_len:rem_len;
-		nvd_printf("[Copy] Copying %u bytes at VA 0x%016llX!\n",copy_size,cur_va);
 		real_size+=nvc_copy_guest_virtual_memory_in_page(vcpu,cur_va,(void*)((ulong_ptr)buffer+copied_size),copy_size,write,error_code);
 		copied_size+=copy_size;
 		// Let hypervisor know which address caused page fault!
@@ -1728,6 +2241,45 @@ size_t nvc_copy_guest_virtual_memory(noir_cvm_virtual_cpu_p vcpu,u64 gva,void* b
 	return real_size;
 }
 
+// This routine must be called in host mode, where guest memory can be dereferenced by identity map.
+void noir_hvcode nvc_operate_guest_memory_hvrt(noir_cvm_gmem_op_context_p context)
+{
+	u32 error_code=0;
+	if(context->use_va)
+	{
+		const size_t copied=nvc_copy_guest_virtual_memory(context->vcpu,context->guest_address,context->hva,(size_t)context->size,(bool)context->write_op,&error_code);
+		context->status=copied==context->size?noir_success:noir_guest_page_absent;
+	}
+	else
+	{
+		const u64 np_base=noir_get_custom_vcpu_np_base(context->vcpu);
+		const u64 end_gpa=context->guest_address+context->size;
+		u32 flags=noir_cvm_map_va_read_bit;
+		u64 copy_size=0;
+		u8p buffer=(u8p)context->hva;
+		if(context->write_op)flags|=noir_cvm_map_va_write_bit;
+		context->status=noir_success;
+		for(u64 cur_gpa=context->guest_address;cur_gpa<end_gpa;cur_gpa+=copy_size)
+		{
+			const u64 end_len=page_size-page_offset(cur_gpa);
+			const u64 rem_len=end_gpa-cur_gpa;
+			noir_page_fault_error_code np_err;
+			u64 hpa;
+			copy_size=end_len<rem_len?end_len:rem_len;
+			if(!noir_translate_custom_gpa(np_base,4,cur_gpa,flags,&hpa,&np_err))
+			{
+				context->status=noir_guest_page_absent;
+				break;
+			}
+			if(context->write_op)
+				noir_movsb((u8p)hpa,buffer,copy_size);
+			else
+				noir_movsb(buffer,(u8p)hpa,copy_size);
+			buffer+=copy_size;
+		}
+	}
+}
+
 // Caveat: this routine currently does not consider shadow-stack and protection-key.
 // Use this routine only when Identity-Mapping is enabled.
 // Use recursive logic to reduce code size.
@@ -1959,10 +2511,22 @@ void nvc_call_rw_mmio_region(bool direction,u64 address,u64 size,u64p value)
 
 noir_status nvc_build_hypervisor()
 {
+	noir_status st=noir_unsuccessful;
 	noir_get_vendor_string(hvm_p->vendor_string);
 	hvm_p->cpu_manuf=nvc_confirm_cpu_manufacturer(hvm_p->vendor_string);
 	hvm_p->options.value=noir_query_enabled_features_in_system();
+	hvm_p->nested_cache_capacity=noir_query_nested_cache_capacity();
+	if(hvm_p->nested_cache_capacity==0)
+		hvm_p->nested_cache_capacity=noir_nested_cache_capacity_default;
+	else if(hvm_p->nested_cache_capacity<noir_nested_cache_capacity_minimum)
+		hvm_p->nested_cache_capacity=noir_nested_cache_capacity_minimum;
+	else if(hvm_p->nested_cache_capacity>noir_nested_cache_capacity_maximum)
+		hvm_p->nested_cache_capacity=noir_nested_cache_capacity_maximum;
 	nvc_store_image_info(&hvm_p->hv_image.base,&hvm_p->hv_image.size);
+	hvm_p->tsc_calibration.time=noir_get_interrupt_time();
+	hvm_p->tsc_calibration.tsc=noir_rdtsc();
+	st=nvc_build_exit_trace();
+	if(st!=noir_success)return st;
 	nv_dprintf("Note: If you are using GDB over QEMU/KVM, you may set a hardware breakpoint at 0x%p! (e.g.: hb *0x%p)\n",noir_hbreak,noir_hbreak);
 	switch(hvm_p->cpu_manuf)
 	{
@@ -1984,34 +2548,39 @@ noir_status nvc_build_hypervisor()
 				nv_dprintf("You are using unknown manufacturer's processor!\n");
 			else
 				nv_dprintf("Your processor is manufactured by rare known vendor that NoirVisor currently failed to support!\n");
-			return noir_unknown_processor;
+			st=noir_unknown_processor;
+			break;
 		}
 vmx_subversion:
 		hvm_p->selected_core=use_vt_core;
 		if(nvc_is_vt_supported())
 		{
 			nv_dprintf("Starting subversion with VMX Engine!\n");
-			return nvc_vt_subvert_system(hvm_p);
+			st=nvc_vt_subvert_system(hvm_p);
 		}
 		else
 		{
 			nv_dprintf("Your processor does not support Intel VT-x!\n");
-			return noir_vmx_not_supported;
+			st=noir_vmx_not_supported;
 		}
+		break;
 svm_subversion:
 		hvm_p->selected_core=use_svm_core;
 		if(nvc_is_svm_supported())
 		{
 			nv_dprintf("Starting subversion with SVM Engine!\n");
-			return nvc_svm_subvert_system(hvm_p);
+			st=nvc_svm_subvert_system(hvm_p);
 		}
 		else
 		{
 			nv_dprintf("Your processor does not support AMD-V!\n");
-			return noir_svm_not_supported;
+			st=noir_svm_not_supported;
 		}
+		break;
 	}
-	return noir_unsuccessful;
+	// Trace buffers are released at teardown. Release them here if subversion failed.
+	if(st!=noir_success)nvc_release_exit_trace();
+	return st;
 }
 
 void nvc_teardown_hypervisor()
@@ -2042,6 +2611,7 @@ svm_restoration:
 		nvc_svm_restore_system(hvm_p);
 		goto end_restoration;
 end_restoration:
+		nvc_release_exit_trace();
 		nv_dprintf("Restoration Complete...\n");
 	}
 }
\ No newline at end of file
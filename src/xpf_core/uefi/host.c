@@ -136,6 +136,12 @@ void* noir_alloc_contd_memory(IN UINTN Length)
 	return p;
 }
 
+// UEFI does not describe NUMA nodes to drivers. Simply allocate from anywhere.
+void* noir_alloc_contd_memory_for_numa(IN UINT32 NumaNode,IN UINTN Length)
+{
+	return noir_alloc_contd_memory(Length);
+}
+
 void* noir_alloc_2mb_page()
 {
 	void* p=AllocateAlignedRuntimePages(0x200,0x200000);
@@ -326,6 +332,11 @@ UINT32 noir_get_current_processor()
 	return 0;
 }
 
+UINT32 noir_get_current_numa_node()
+{
+	return 0;
+}
+
 UINT32 noir_get_processor_count()
 {
 	if(MpServices)
@@ -397,6 +408,12 @@ UINT64 noir_get_system_time()
 	return 0;
 }
 
+UINT64 noir_get_interrupt_time()
+{
+	// HPET is never adjusted. The system time is the interrupt time as well.
+	return noir_get_system_time();
+}
+
 void NoirDisplayProcessorState()
 {
 	NOIR_PROCESSOR_STATE State;
@@ -71,6 +71,14 @@ UINT64 noir_query_enabled_features_in_system()
 	return Features;
 }
 
+UINT32 noir_query_nested_cache_capacity()
+{
+	UINT32 Type;
+	UINT32 Capacity=0;		// Zero selects the default capacity.
+	NoirGetConfigurationRecord("NestedCacheCapacity",&Type,&Capacity,sizeof(UINT32),NULL);
+	return Capacity;
+}
+
 void nvc_store_image_info(OUT VOID** Base,OUT UINT32* Size)
 {
 	if(Base)*Base=NvImageBase;
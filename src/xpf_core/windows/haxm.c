@@ -35,7 +35,7 @@ void NoirHaxDestroyVirtualProcessorTunnel(IN PHAX_VP_OBJECT HaxVp)
 		if(HaxVp->KernelIoBuff)MmUnmapLockedPages(HaxVp->KernelIoBuff,HaxVp->IoBuffMdl);
 		if(HaxVp->UserIoBuff)MmUnmapLockedPages(HaxVp->UserIoBuff,HaxVp->IoBuffMdl);
 		MmFreePagesFromMdl(HaxVp->IoBuffMdl);
-		HaxVp->KernelIoBuff=HaxVp->UserIoBuff=HaxVp->TunnelMdl=NULL;
+		HaxVp->KernelIoBuff=HaxVp->UserIoBuff=HaxVp->IoBuffMdl=NULL;
 	}
 }
 
@@ -53,9 +53,9 @@ NTSTATUS NoirHaxSetupVirtualProcessorTunnel(IN PHAX_VP_OBJECT HaxVp,IN OUT PHAX_
 	else
 	{
 		HaxVp->KernelTunnel=MmMapLockedPagesSpecifyCache(HaxVp->TunnelMdl,KernelMode,MmCached,NULL,FALSE,HighPagePriority);
-		HaxVp->KernelIoBuff=MmMapLockedPagesSpecifyCache(HaxVp->TunnelMdl,KernelMode,MmCached,NULL,FALSE,HighPagePriority);
+		HaxVp->KernelIoBuff=MmMapLockedPagesSpecifyCache(HaxVp->IoBuffMdl,KernelMode,MmCached,NULL,FALSE,HighPagePriority);
 		HaxVp->UserTunnel=MmMapLockedPagesSpecifyCache(HaxVp->TunnelMdl,UserMode,MmCached,NULL,FALSE,HighPagePriority);
-		HaxVp->UserIoBuff=MmMapLockedPagesSpecifyCache(HaxVp->TunnelMdl,UserMode,MmCached,NULL,FALSE,HighPagePriority);
+		HaxVp->UserIoBuff=MmMapLockedPagesSpecifyCache(HaxVp->IoBuffMdl,UserMode,MmCached,NULL,FALSE,HighPagePriority);
 		if(HaxVp->KernelTunnel==NULL || HaxVp->KernelIoBuff==NULL || HaxVp->UserTunnel==NULL || HaxVp->UserIoBuff==NULL)
 			NoirHaxDestroyVirtualProcessorTunnel(HaxVp);
 		else
@@ -376,6 +376,18 @@ NOIR_STATUS NoirSetVirtualProcessorOptions(IN CVM_HANDLE VirtualMachine,IN ULONG
 	return st;
 }
 
+NOIR_STATUS NoirSetVirtualProcessorControlBlock(IN CVM_HANDLE VirtualMachine,IN ULONG32 VpIndex,IN PVOID ControlBlock)
+{
+	NOIR_STATUS st=NOIR_UNSUCCESSFUL;
+	PVOID VM=NoirReferenceVirtualMachineByHandle(VirtualMachine);
+	if(VM)
+	{
+		PVOID VP=nvc_reference_vcpu(VM,VpIndex);
+		st=VP==NULL?NOIR_VCPU_NOT_EXIST:nvc_set_vcpu_control_block(VM,VP,ControlBlock);
+	}
+	return st;
+}
+
 NOIR_STATUS NoirRunVirtualProcessor(IN CVM_HANDLE VirtualMachine,IN ULONG32 VpIndex,OUT PVOID ExitContext)
 {
 	NOIR_STATUS st=NOIR_UNSUCCESSFUL;
@@ -258,6 +258,21 @@ ULONG32 noir_get_current_processor()
 	return KeGetCurrentProcessorNumber();
 }
 
+UCHAR noir_raise_irql_to_dispatch()
+{
+	return KeRaiseIrqlToDpcLevel();
+}
+
+void noir_lower_irql(IN UCHAR Irql)
+{
+	KeLowerIrql(Irql);
+}
+
+ULONG32 noir_get_current_numa_node()
+{
+	return KeGetCurrentNodeNumber();
+}
+
 void static NoirDpcRT(IN PKDPC Dpc,IN PVOID DeferedContext OPTIONAL,IN PVOID SystemArgument1 OPTIONAL,IN PVOID SystemArgument2 OPTIONAL)
 {
 	noir_broadcast_worker worker=(noir_broadcast_worker)SystemArgument1;
@@ -290,6 +305,28 @@ void noir_generic_call(noir_broadcast_worker worker,void* context)
 	}
 }
 
+void noir_targeted_call(noir_broadcast_worker worker,void* context,ULONG32 ProcessorNumber)
+{
+	// The DPC and the counter are on the stack. The stack remains resident because this function spins.
+	KDPC Dpc;
+	LONG32 volatile OperatingNumber=1;
+#if !defined(_WINNT5)
+	PROCESSOR_NUMBER ProcNum;
+#endif
+	KeInitializeDpc(&Dpc,NoirDpcRT,context);
+#if defined(_WINNT5)
+	KeSetTargetProcessorDpc(&Dpc,(CCHAR)ProcessorNumber);
+#else
+	KeGetProcessorNumberFromIndex(ProcessorNumber,&ProcNum);
+	KeSetTargetProcessorDpcEx(&Dpc,&ProcNum);
+#endif
+	KeSetImportanceDpc(&Dpc,HighImportance);
+	KeInsertQueueDpc(&Dpc,(PVOID)worker,(PVOID)&OperatingNumber);
+	// Only the targeted processor is awaited.
+	while(InterlockedCompareExchange(&OperatingNumber,0,0))
+		_mm_pause();
+}
+
 NTSTATUS NoirCopyAcpiTableRootFromRegistry(OUT PVOID *Rsdt,OUT PSIZE_T Length)
 {
 	NTSTATUS st=STATUS_INSUFFICIENT_RESOURCES;
@@ -474,6 +511,12 @@ void noir_get_locked_range(PMDL Mdl,void** virt,PULONG bytes)
 	*bytes=MmGetMdlByteCount(Mdl);
 }
 
+PVOID noir_get_locked_system_address(PMDL Mdl)
+{
+	// The system mapping is released along with the MDL on unlocking.
+	return MmGetSystemAddressForMdlSafe(Mdl,HighPagePriority|MdlMappingNoExecute);
+}
+
 void noir_unlock_pages(PMDL Mdl)
 {
 	MmUnlockPages(Mdl);
@@ -607,18 +650,23 @@ void noir_free_2mb_page(void* virtual_address)
 	MmFreeContiguousMemorySpecifyCache(virtual_address,0x200000,MmCached);
 }
 
-/*
 // NoirVisor should be aware of large-scale systems with NUMA.
-void* noir_alloc_contd_memory_for_numa(ULONG32 numa_node,ULONG64 alignment,size_t length)
+// The memory is released by noir_free_contd_memory.
+void* noir_alloc_contd_memory_for_numa(ULONG32 numa_node,size_t length)
 {
 	PHYSICAL_ADDRESS L={0};
-	PHYSICAL_ADDRESS H={0xFFFFFFFFFFFFFFFFui64};
-	PHYSICAL_ADDRESS B={alignment};
-	PVOID p=MmAllocateContiguousMemorySpecifyCacheNode(length,L,H,B,MmCached,numa_node);
-	if(p)RtlZeroMemory(p,length);
+	PHYSICAL_ADDRESS H={0xFFFFFFFFFFFFFFFF};
+	PHYSICAL_ADDRESS B={0};
+	PVOID p;
+	if(numa_node==NOIR_NUMA_NODE_ANY)numa_node=MM_ANY_NODE_OK;
+	p=MmAllocateContiguousMemorySpecifyCacheNode(length,L,H,B,MmCached,numa_node);
+	if(p)
+	{
+		RtlZeroMemory(p,length);
+		InterlockedIncrement(&NoirAllocatedContiguousMemoryCount);
+	}
 	return p;
 }
-*/
 
 void noir_enum_physical_memory_ranges(IN NOIR_PHYSICAL_MEMORY_RANGE_CALLBACK CallbackRoutine,IN OUT PVOID Context)
 {
@@ -717,6 +765,12 @@ ULONG64 noir_get_system_time()
 	return Time.QuadPart;
 }
 
+// Unlike the system time, the interrupt time is not adjusted. It is suitable to measure intervals.
+ULONG64 noir_get_interrupt_time()
+{
+	return KeQueryInterruptTime();
+}
+
 // Essential Multi-Threading Facility.
 HANDLE noir_create_thread(IN PKSTART_ROUTINE StartRoutine,IN PVOID Context)
 {
@@ -830,6 +884,121 @@ void noir_release_pushlock_shared(IN PEX_PUSH_LOCK PushLock)
 	KeLeaveCriticalRegion();
 }
 
+// Event
+PKEVENT noir_initialize_event()
+{
+	PKEVENT Event=NoirAllocateNonPagedMemory(sizeof(KEVENT));
+	if(Event)KeInitializeEvent(Event,SynchronizationEvent,FALSE);
+	return Event;
+}
+
+void noir_finalize_event(IN PKEVENT Event)
+{
+	if(Event)NoirFreeNonPagedMemory(Event);
+}
+
+void noir_set_event(IN PKEVENT Event)
+{
+	KeSetEvent(Event,IO_NO_INCREMENT,FALSE);
+}
+
+void noir_reset_event(IN PKEVENT Event)
+{
+	KeClearEvent(Event);
+}
+
+BOOLEAN noir_wait_event(IN PKEVENT Event,IN ULONG64 Timeout)
+{
+	// The timeout is in units of 100ns. Negative value indicates the relative time.
+	LARGE_INTEGER Time;
+	Time.QuadPart=-(LONG64)Timeout;
+	return KeWaitForSingleObject(Event,Executive,KernelMode,FALSE,&Time)==STATUS_SUCCESS;
+}
+
+// Timer
+// The expiration of the timer interrupts the processor that armed it.
+typedef struct _NOIR_TIMER
+{
+	KTIMER Timer;
+	KDPC Dpc;
+}NOIR_TIMER,*PNOIR_TIMER;
+
+void static NoirTimerDpcRT(IN PKDPC Dpc,IN PVOID DeferedContext OPTIONAL,IN PVOID SystemArgument1 OPTIONAL,IN PVOID SystemArgument2 OPTIONAL)
+{
+	// The interrupt that delivers this DPC is what the timer is armed for. Nothing else to do.
+}
+
+PNOIR_TIMER noir_initialize_timer()
+{
+	PNOIR_TIMER Timer=NoirAllocateNonPagedMemory(sizeof(NOIR_TIMER));
+	if(Timer)
+	{
+		KeInitializeTimer(&Timer->Timer);
+		KeInitializeDpc(&Timer->Dpc,NoirTimerDpcRT,NULL);
+		// High importance requests an interrupt on the target processor at once.
+		KeSetImportanceDpc(&Timer->Dpc,HighImportance);
+	}
+	return Timer;
+}
+
+void noir_finalize_timer(IN PNOIR_TIMER Timer)
+{
+	if(Timer)
+	{
+		KeCancelTimer(&Timer->Timer);
+		KeRemoveQueueDpc(&Timer->Dpc);
+		KeFlushQueuedDpcs();
+		NoirFreeNonPagedMemory(Timer);
+	}
+}
+
+void noir_set_timer(IN PNOIR_TIMER Timer,IN ULONG64 DueTime)
+{
+	// The due time is in units of 100ns. Negative value indicates the relative time.
+	LARGE_INTEGER Time;
+#if !defined(_WINNT5)
+	PROCESSOR_NUMBER ProcNum;
+#endif
+	Time.QuadPart=-(LONG64)DueTime;
+	KeCancelTimer(&Timer->Timer);
+	KeRemoveQueueDpc(&Timer->Dpc);
+	// The timer is supposed to interrupt the current processor, which might not be in the first processor group.
+#if defined(_WINNT5)
+	KeSetTargetProcessorDpc(&Timer->Dpc,(CCHAR)KeGetCurrentProcessorNumber());
+#else
+	KeGetCurrentProcessorNumberEx(&ProcNum);
+	KeSetTargetProcessorDpcEx(&Timer->Dpc,&ProcNum);
+#endif
+	KeSetTimer(&Timer->Timer,Time,&Timer->Dpc);
+}
+
+void noir_cancel_timer(IN PNOIR_TIMER Timer)
+{
+	KeCancelTimer(&Timer->Timer);
+}
+
+// Interrupt
+// Vectors used by the hypervisor may still arrive at the host. Acknowledge them with a do-nothing handler.
+BOOLEAN static NoirNoopInterruptRT(IN PKINTERRUPT Interrupt,IN PVOID ServiceContext)
+{
+	// Returning TRUE tells the kernel that the interrupt is serviced so that the EOI is signaled.
+	return TRUE;
+}
+
+PKINTERRUPT noir_connect_noop_interrupt(IN UCHAR Vector)
+{
+	PKINTERRUPT Interrupt=NULL;
+	// On x64, the IRQL of an interrupt is determined by the upper four bits of its vector.
+	const KIRQL Irql=(KIRQL)(Vector>>4);
+	NTSTATUS st=IoConnectInterrupt(&Interrupt,NoirNoopInterruptRT,NULL,NULL,Vector,Irql,Irql,Latched,TRUE,KeQueryActiveProcessors(),FALSE);
+	return NT_SUCCESS(st)?Interrupt:NULL;
+}
+
+void noir_disconnect_interrupt(IN PKINTERRUPT Interrupt)
+{
+	if(Interrupt)IoDisconnectInterrupt(Interrupt);
+}
+
 // Standard I/O
 void noir_qsort(IN PVOID base,IN ULONG num,IN ULONG width,IN noir_sorting_comparator comparator)
 {
@@ -17,6 +17,7 @@
 
 #define NOIR_DEBUG_LOG_RECORD_LIMIT		160
 #define NOIR_DEBUG_PRINT_DELAY			2000
+#define NOIR_NUMA_NODE_ANY				0xFFFFFFFF
 
 typedef void (*NOIR_PHYSICAL_MEMORY_RANGE_CALLBACK)
 (
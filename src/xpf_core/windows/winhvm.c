@@ -296,6 +296,7 @@ NTSTATUS NoirQueryEnabledFeaturesInSystem(OUT PULONG64 Features)
 	ULONG32 HideFromProcessorTrace=0;		// Do not hide from Intel Processor Trace at default.
 	ULONG32 SecureVirtualization=0;			// Disable Secure Virtualization at default.
 	ULONG32 EnableIommu=0;					// Disable IOMMU at default.
+	ULONG32 StealthHookDualView=0;			// Substitute EPT entries for Stealth Inline Hook at default.
 	BOOLEAN KvaShadowPresence=NoirDetectKvaShadow();
 	// Initialize.
 	NTSTATUS st=STATUS_INSUFFICIENT_RESOURCES;
@@ -339,6 +340,10 @@ NTSTATUS NoirQueryEnabledFeaturesInSystem(OUT PULONG64 Features)
 			RtlInitUnicodeString(&uniKvName,L"EnableIommu");
 			st=ZwQueryValueKey(hKey,&uniKvName,KeyValuePartialInformation,KvPartInf,PAGE_SIZE,&RetLen);
 			if(NT_SUCCESS(st))EnableIommu=*(PULONG32)KvPartInf->Data;
+			// Detect if Stealth Inline Hook switches between dual views.
+			RtlInitUnicodeString(&uniKvName,L"StealthHookDualView");
+			st=ZwQueryValueKey(hKey,&uniKvName,KeyValuePartialInformation,KvPartInf,PAGE_SIZE,&RetLen);
+			if(NT_SUCCESS(st))StealthHookDualView=*(PULONG32)KvPartInf->Data;
 			// Close the registry key handle.
 			ZwClose(hKey);
 		}
@@ -352,6 +357,7 @@ NTSTATUS NoirQueryEnabledFeaturesInSystem(OUT PULONG64 Features)
 	NoirDebugPrint("Hiding from Intel Processor Trace is %s!\n",HideFromProcessorTrace?"enabled":"disabled");
 	NoirDebugPrint("Secure Virtualization is %s!\n",SecureVirtualization?"enabled":"disabled");
 	NoirDebugPrint("IOMMU is %s!\n",EnableIommu?"enabled":"disabled");
+	NoirDebugPrint("Dual-View Stealth Hook is %s!\n",StealthHookDualView?"enabled":"disabled");
 	// Summarize.
 	*Features|=(CpuidPresence!=0)<<NOIR_HVM_FEATURE_CPUID_PRESENCE_BIT;
 	*Features|=(StealthMsrHook!=0)<<NOIR_HVM_FEATURE_STEALTH_MSR_HOOK_BIT;
@@ -361,9 +367,35 @@ NTSTATUS NoirQueryEnabledFeaturesInSystem(OUT PULONG64 Features)
 	*Features|=(HideFromProcessorTrace!=0)<<NOIR_HVM_FEATURE_HIDE_FROM_IPT_BIT;
 	*Features|=(SecureVirtualization!=0)<<NOIR_HVM_FEATURE_SECURE_VIRTUALIZATION_BIT;
 	*Features|=(EnableIommu!=0)<<NOIR_HVM_FEATURE_ENABLE_IOMMU_BIT;
+	*Features|=(StealthHookDualView!=0)<<NOIR_HVM_FEATURE_STEALTH_HOOK_DUAL_VIEW_BIT;
 	return st;
 }
 
+ULONG32 noir_query_nested_cache_capacity()
+{
+	ULONG32 Capacity=0;		// Zero selects the default capacity.
+	PKEY_VALUE_PARTIAL_INFORMATION KvPartInf=NoirAllocatePagedMemory(PAGE_SIZE);
+	if(KvPartInf)
+	{
+		HANDLE hKey=NULL;
+		UNICODE_STRING uniKeyName=RTL_CONSTANT_STRING(L"\\Registry\\Machine\\Software\\Zero-Tang\\NoirVisor");
+		OBJECT_ATTRIBUTES oa;
+		NTSTATUS st;
+		InitializeObjectAttributes(&oa,&uniKeyName,OBJ_CASE_INSENSITIVE|OBJ_KERNEL_HANDLE,NULL,NULL);
+		st=ZwOpenKey(&hKey,GENERIC_READ,&oa);
+		if(NT_SUCCESS(st))
+		{
+			UNICODE_STRING uniKvName=RTL_CONSTANT_STRING(L"NestedCacheCapacity");
+			ULONG RetLen;
+			st=ZwQueryValueKey(hKey,&uniKvName,KeyValuePartialInformation,KvPartInf,PAGE_SIZE,&RetLen);
+			if(NT_SUCCESS(st))Capacity=*(PULONG32)KvPartInf->Data;
+			ZwClose(hKey);
+		}
+		NoirFreePagedMemory(KvPartInf);
+	}
+	return Capacity;
+}
+
 ULONG64 noir_query_enabled_features_in_system()
 {
 	ULONG64 Features=0;
@@ -466,6 +498,16 @@ BOOLEAN NoirIsVirtualizationEnabled()
 	return noir_is_virtualization_enabled();
 }
 
+ULONG NoirQueryExitTrace(IN ULONG32 ProcessorNumber,OUT PVOID Buffer,IN ULONG32 BufferSize)
+{
+	return nvc_query_exit_trace(ProcessorNumber,Buffer,BufferSize);
+}
+
+ULONG NoirQueryExitStatistics(IN ULONG32 ProcessorNumber,OUT PVOID Buffer,IN ULONG32 BufferSize)
+{
+	return nvc_query_exit_statistics(ProcessorNumber,Buffer,BufferSize);
+}
+
 void NoirSaveImageInfo(IN PDRIVER_OBJECT DriverObject)
 {
 	if(DriverObject)
@@ -34,6 +34,7 @@
 #define NOIR_HVM_FEATURE_HIDE_FROM_IPT			0x80
 #define NOIR_HVM_FEATURE_SECURE_VIRTUALIZATION	0x100
 #define NOIR_HVM_FEATURE_ENABLE_IOMMU			0x200
+#define NOIR_HVM_FEATURE_STEALTH_HOOK_DUAL_VIEW	0x400
 
 #define NOIR_HVM_FEATURE_STEALTH_MSR_HOOK_BIT		0
 #define NOIR_HVM_FEATURE_STEALTH_INLINE_HOOK_BIT	1
@@ -44,6 +45,7 @@
 #define NOIR_HVM_FEATURE_HIDE_FROM_IPT_BIT			7
 #define NOIR_HVM_FEATURE_SECURE_VIRTUALIZATION_BIT	8
 #define NOIR_HVM_FEATURE_ENABLE_IOMMU_BIT			9
+#define NOIR_HVM_FEATURE_STEALTH_HOOK_DUAL_VIEW_BIT	10
 
 typedef union _HV_MSR_PROPRIETARY_GUEST_OS_ID
 {
@@ -143,6 +145,8 @@ void noir_get_vendor_string(char* vendor_string);
 void noir_get_processor_name(char* processor_name);
 ULONG noir_get_virtualization_supportability();
 BOOLEAN noir_is_virtualization_enabled();
+ULONG nvc_query_exit_trace(IN ULONG32 processor,OUT PVOID buffer,IN ULONG32 buffer_size);
+ULONG nvc_query_exit_statistics(IN ULONG32 processor,OUT PVOID buffer,IN ULONG32 buffer_size);
 BOOLEAN noir_initialize_ci(BOOLEAN soft_ci,BOOLEAN hard_ci);
 BOOLEAN noir_add_section_to_ci(PVOID base,ULONG32 size,BOOLEAN enable_scan);
 BOOLEAN noir_activate_ci();